@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../socket/socket.h"
+#include "IEEE1451_5_lib.h"
+
+/* 编译命令：这里是 linux 下，socket.h 里的 WIN_OR_LINUX 要注释掉
+    gcc -O2 1451_shm_local_test.c ../socket/socket.c ./IEEE1451_5_lib.c -I ../socket -I ./ -o 1451_shm_local_test
+   运行：先起 NCAP，再起 TIM
+    ./1451_shm_local_test ncap
+    ./1451_shm_local_test tim
+*/
+
+/* NCAP 和 TIM 在同一个板子上（比如 i.mx8mm 上的两个进程）时不走 TCP 回环，走共享内存环；
+    1451 这边只是 ctx 的 send / sendv / recv 换了，别的都一样；
+    内核网络栈不在路径上，NCAP 这边测出来的来回时间基本就是编解码和两边处理的开销 */
+
+#define SHM_LOCAL_PATH          "/tmp/1451_shm.sock"
+#define SHM_LOCAL_ROUNDS        100000          /* NCAP 测多少次 Query_TEDS 来回 */
+#define SHM_LOCAL_DATA_SET_SIZE (1024 * 1024)   /* TIM 绑在 TC_1 上的数据集，NCAP 拉回来测吞吐 */
+
+static struct linux_shm_link_struct shm_link;
+static struct MES_ctx_struct shm_ctx;
+static struct MES_stream_struct rx_stream;
+static uint8_t data_set[SHM_LOCAL_DATA_SET_SIZE];
+
+/* IEEE 1451 Message 数据发送 / 接收接口 API，都走共享内存环 */
+static unsigned int shm_send(void* user_data, unsigned char * data, unsigned int len)
+{
+    return linux_shm_link_send(user_data, data, len) < 0 ? 0 : len;
+}
+
+static unsigned int shm_sendv(void* user_data, const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    struct iovec vec[MES_TXQ_IOV_MAX];
+    unsigned int total = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < iovcnt && i < MES_TXQ_IOV_MAX; i++)
+    {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+        total += iov[i].len;
+    }
+    return linux_shm_link_sendv(user_data, vec, i) < 0 ? 0 : total;
+}
+
+static unsigned int shm_recv(void* user_data, unsigned char * data, unsigned int len)
+{
+    int recv_num = linux_shm_link_recv(user_data, data, len, -1);
+
+    return recv_num < 0 ? 0 : (unsigned int)recv_num;
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* 我是 TIM：发 TIM_initiated，之后收到的 Message 都自动回复 */
+static int run_tim(void)
+{
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    unsigned int recv_num = 0;
+    uint32_t served = 0;
+    uint32_t i = 0;
+
+    if(linux_shm_link_join(&shm_link, SHM_LOCAL_PATH) < 0)
+    {
+        return -1;
+    }
+    MES_ctx_init(&shm_ctx, shm_send, &shm_link);
+    shm_ctx.sendv = shm_sendv;
+    shm_ctx.recv = shm_recv;
+
+    for(i = 0; i < SHM_LOCAL_DATA_SET_SIZE; i++)
+    {
+        data_set[i] = (uint8_t)(i * 131 >> 3);
+    }
+    TC_data_set_bind(TC_1, data_set, SHM_LOCAL_DATA_SET_SIZE);
+
+    Message_TIM_initiated_pack_up_ctx(&shm_ctx);
+    Message_pack_up_And_send_ctx(&shm_ctx);
+
+    /* 共享内存环和 TCP 一样是字节流，照旧用分帧的接收缓存 */
+    while(1)
+    {
+        write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+        recv_num = shm_recv(&shm_link, write_ptr, space);
+        if(recv_num == 0)
+        {
+            break;
+        }
+        MES_stream_commit(&rx_stream, recv_num);
+        served += MES_stream_serve_ctx(&shm_ctx, &rx_stream);
+    }
+
+    printf("TIM served %u Message, doorbells %lu waits %lu\n", served, shm_link.doorbell_count, shm_link.wait_count);
+    linux_shm_link_close(&shm_link);
+    return 0;
+}
+
+/* 我是 NCAP：等 TIM_initiated，测 Query_TEDS 来回和拉数据集的吞吐 */
+static int run_ncap(void)
+{
+    struct Message_view_struct message_view;
+    struct ReplyMessage_view_struct reply_view;
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    unsigned int recv_num = 0;
+    uint32_t i = 0, pulled = 0, bad = 0;
+    double start = 0, end = 0;
+    static uint8_t dest[SHM_LOCAL_DATA_SET_SIZE];
+
+    printf("wait TIM on %s\n", SHM_LOCAL_PATH);
+    if(linux_shm_link_offer(&shm_link, SHM_LOCAL_PATH) < 0)
+    {
+        return -1;
+    }
+    MES_ctx_init(&shm_ctx, shm_send, &shm_link);
+    shm_ctx.sendv = shm_sendv;
+    shm_ctx.recv = shm_recv;
+
+    while(MES_stream_next_Message(&rx_stream, &message_view) != MES_DECODE_OK)
+    {
+        write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+        recv_num = shm_recv(&shm_link, write_ptr, space);
+        if(recv_num == 0)
+        {
+            linux_shm_link_close(&shm_link);
+            return -1;
+        }
+        MES_stream_commit(&rx_stream, recv_num);
+    }
+    MES_ctx_negotiate(&shm_ctx, &rx_stream, &message_view);
+    printf("TIM %d initiated, caps:%#x\n", message_view.Dest_TIM_and_TC_Num[TIM_enum], shm_ctx.peer_caps);
+
+    start = now_us();
+    for(i = 0; i < SHM_LOCAL_ROUNDS; i++)
+    {
+        Message_CommonCmd_Query_TEDS_pack_up_ctx(&shm_ctx, message_view.Dest_TIM_and_TC_Num[TIM_enum], TC_1, TC_TEDS_ACCESS_CODE);
+        Message_pack_up_And_send_ctx(&shm_ctx);
+        if(!MES_stream_wait_ReplyMessage_ctx(&shm_ctx, &rx_stream, &reply_view) || !reply_view.Flag)
+        {
+            bad++;
+            break;
+        }
+    }
+    end = now_us();
+    printf("Query_TEDS round trip: %u rounds, avg %.2f us\n", i, (end - start) / (i ? i : 1));
+
+    start = now_us();
+    pulled = TC_data_set_pull_ctx(&shm_ctx, &rx_stream, message_view.Dest_TIM_and_TC_Num[TIM_enum], TC_1,
+        dest, SHM_LOCAL_DATA_SET_SIZE, MAX_TC_data_segment_SIZE, 8);
+    end = now_us();
+    for(i = 0; i < pulled; i++)
+    {
+        bad += dest[i] != (uint8_t)(i * 131 >> 3);
+    }
+    printf("data set pull: %u bytes in %.0f us (%.0f MB/s), bad %u\n", pulled, end - start, pulled / (end - start), bad);
+    printf("NCAP doorbells %lu waits %lu\n", shm_link.doorbell_count, shm_link.wait_count);
+
+    linux_shm_link_close(&shm_link);
+    return bad == 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    TEDS_init();
+    Message_init();
+    MES_stream_init(&rx_stream);
+
+    if(argc > 1 && strcmp(argv[1], "tim") == 0)
+    {
+        return run_tim();
+    }
+    return run_ncap();
+}
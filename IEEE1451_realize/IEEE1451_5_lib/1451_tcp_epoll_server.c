@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../socket/socket.h"
+#include "IEEE1451_5_lib.h"
+
+/* 编译命令：这里是 linux 下，socket.h 里的 WIN_OR_LINUX 要注释掉
+    gcc 1451_tcp_epoll_server.c ../socket/socket.c ./IEEE1451_5_lib.c -I ../socket -I ./ -o 1451_tcp_epoll_server
+*/
+
+/* 我是 NCAP 程序，一个线程同时服务多个 TIM */
+
+/* 这里是 LINUX 版本程序，用 socket.c 里的 epoll 事件循环，内核支持的话收发走 io_uring */
+
+/* 每个 TIM 连接一份：自己的 ctx（发 Message 的缓存和编解码）和分帧的接收缓存，
+    事件循环收到的数据直接写进 rx_stream，切出完整的帧再交给 1451 解析；
+    一个 TIM 发了半帧就不发了只是它的 rx_stream 里留着半帧，不影响别的 TIM */
+struct NCAP_TIM_conn_struct
+{
+    struct linux_socket_conn_struct* conn;
+    struct MES_ctx_struct ctx;
+    struct MES_stream_struct rx_stream;
+    uint8_t TIM;            /* TIM_initiated 里带的 TIM 号 */
+    uint8_t initiated;      /* 收到 TIM_initiated 了，之后收的都是 ReplyMessage */
+    uint64_t stream_bytes;  /* 采样环推上来的数据 */
+
+    /* 数据报上传：TIM 握手带 MES_CAP_DATAGRAM 的先发 Datagram_mode，它的回复是握手后的第一个 */
+    uint8_t dgram_asked;
+    uint8_t dgram_on;
+    uint16_t dgram_session;
+    uint64_t dgram_bytes;
+    struct MES_dgram_rx_struct dgram_rx;
+};
+
+/* 连接表和事件循环的连接表一一对应，用 conn->index 索引；
+    分帧的接收缓存每个 64KB、数据报重排窗口每个约 360KB，只有用到的页才占内存，连接多时可以把 MES_STREAM_BUFFER_SIZE、MES_DGRAM_WINDOW 改小 */
+static struct NCAP_TIM_conn_struct TIM_conn[LINUX_SOCKET_CONN_MAX];
+static struct linux_socket_epoll_struct ncap_loop;
+
+/* 所有 TIM 的数据报都发到这一个 UDP 端口，按头里的 TIM 号找连接 */
+#define NCAP_UDP_PORT   (TEST_SERVER_PORT + 1)
+static int ncap_udp = -1;
+static uint16_t ncap_dgram_session = 0;
+static struct NCAP_TIM_conn_struct* TIM_dgram[TIM_MAX];
+
+/* 会话跟 TIM 走，不跟连接走：TIM 断线重连带着会话号来，认出来就不重新上线，从收到的位置接着收 */
+static struct MES_session_struct TIM_session[TIM_MAX];
+
+/* 上线时让 TIM 的这个通道用 BufferHalfFull 推采样 */
+#define NCAP_STREAM_TC  TC_1
+#if LINUX_SOCKET_USE_IO_URING
+static struct linux_socket_uring_struct ncap_uring;
+#endif
+
+/* IEEE 1451 Message 数据发送接口 API，每个连接的 ctx 各用各的，发不完的由事件循环存着等 socket 可写 */
+static unsigned int TIM_conn_send(void* user_data, unsigned char * data, unsigned int len)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+
+    return linux_socket_conn_send(tim->conn, data, len) < 0 ? 0 : len;
+}
+
+static unsigned int TIM_conn_sendv(void* user_data, const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+    struct iovec vec[MES_TXQ_IOV_MAX];
+    unsigned int total = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < iovcnt && i < MES_TXQ_IOV_MAX; i++)
+    {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+        total += iov[i].len;
+    }
+    return linux_socket_conn_sendv(tim->conn, vec, i) < 0 ? 0 : total;
+}
+
+static uint32_t NCAP_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint32_t NCAP_session_token(void)
+{
+    uint32_t token = 0;
+
+    while(token == 0)
+    {
+        token = ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ NCAP_now_ms();
+    }
+    return token;
+}
+
+/* 推上来的一段采样：位置接不上的说明断线时丢了（TIM 环里已经没有了），记下收到哪里重连时用 */
+static void TIM_stream_data(struct NCAP_TIM_conn_struct* tim, uint8_t TC, uint32_t Offset, uint32_t length)
+{
+    struct MES_session_struct* session = NULL;
+
+    tim->stream_bytes += length;
+    if(tim->TIM >= TIM_MAX || TC >= TC_MAX)
+    {
+        return;
+    }
+    session = &TIM_session[tim->TIM];
+
+    if(session->acked_valid[TC] && session->acked_Offset[TC] != Offset)
+    {
+        printf("TIM %d TC %d stream jump: expect %u got %u\n", tim->TIM, TC, session->acked_Offset[TC], Offset);
+    }
+    MES_session_ack(session, TC, Offset + length);
+}
+
+/* TCP 上推的采样，Flag 带 MES_REPLY_FLAG_PUSH */
+static void TIM_on_push(void* user_data, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length)
+{
+    TIM_stream_data(user_data, TC, Offset, length);
+}
+
+/* 按序号重排好的采样，Offset 跳变说明中间有丢了没补上的 */
+static void TIM_dgram_deliver(void* user_data, uint8_t TC, uint32_t Offset, uint32_t timestamp_ms, const uint8_t* data, uint16_t length)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+
+    tim->dgram_bytes += length;
+    TIM_stream_data(tim, TC, Offset, length);
+}
+
+/* 把 UDP socket 里攒的数据报都收了，再给开了数据报的连接发 NACK、放弃太旧的 */
+static void NCAP_dgram_drain(void)
+{
+    static uint8_t datagram[MES_DGRAM_HEADER_SIZE + MES_DGRAM_PAYLOAD_MAX];
+    struct NCAP_TIM_conn_struct* tim = NULL;
+    uint32_t now_ms = NCAP_now_ms();
+    ssize_t len = 0;
+    unsigned int i = 0;
+
+    while((len = recv(ncap_udp, datagram, sizeof(datagram), 0)) > 0)
+    {
+        if(len < MES_DGRAM_HEADER_SIZE || datagram[2] >= TIM_MAX || (tim = TIM_dgram[datagram[2]]) == NULL)
+        {
+            continue;
+        }
+        MES_dgram_rx_input(&tim->dgram_rx, datagram, (uint32_t)len, now_ms);
+    }
+
+    for(i = 0; i < TIM_MAX; i++)
+    {
+        if(TIM_dgram[i] != NULL)
+        {
+            MES_dgram_rx_poll(&TIM_dgram[i]->dgram_rx, now_ms);
+        }
+    }
+}
+
+static void* TIM_on_open(struct linux_socket_conn_struct* conn, const struct sockaddr_in* caddr)
+{
+    struct NCAP_TIM_conn_struct* tim = &TIM_conn[conn->index];
+    char client_ip_addr_str[20] = {'\0'};
+
+    tim->conn = conn;
+    tim->TIM = 0;
+    tim->initiated = 0;
+    tim->stream_bytes = 0;
+    tim->dgram_asked = 0;
+    tim->dgram_on = 0;
+    tim->dgram_bytes = 0;
+    MES_ctx_init(&tim->ctx, TIM_conn_send, tim);
+    tim->ctx.sendv = TIM_conn_sendv;
+    MES_ctx_attach_push(&tim->ctx, TIM_on_push, tim);
+    MES_stream_init(&tim->rx_stream);
+
+    inet_ntop(AF_INET, &(caddr->sin_addr), client_ip_addr_str, sizeof(client_ip_addr_str));
+    printf("TIM connected, conn:%u ip:%s port:%d, %u TIMs online\n",
+        conn->index, client_ip_addr_str, ntohs(caddr->sin_port), ncap_loop.conn_count);
+
+    return tim;
+}
+
+static unsigned char* TIM_rx_space(void* user_data, unsigned int* space)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+
+    return MES_stream_write_ptr(&tim->rx_stream, space);
+}
+
+/* 收到数据：切出所有完整的帧，先等 TIM_initiated，握手后走上线流程（或者恢复会话），之后收回复 */
+static int TIM_on_recv(void* user_data, unsigned int len)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+    struct Message_view_struct message_view;
+    struct ReplyMessage_view_struct reply_view;
+    enum MES_decode_result_enum result = MES_DECODE_OK;
+
+    MES_stream_commit(&tim->rx_stream, len);
+
+    while(result == MES_DECODE_OK)
+    {
+        if(!tim->initiated)
+        {
+            result = MES_stream_next_Message(&tim->rx_stream, &message_view);
+            if(result != MES_DECODE_OK)
+            {
+                break;
+            }
+            if(message_view.Command_class != XdcrIdle || message_view.Command_function != TIM_ALL_TC_initiated)
+            {
+                continue;   /* 还没握手的 TIM 发别的不理 */
+            }
+
+            /* TIM_initiated 里带握手信息，大小端和 NCAP 不同的 TIM 这个连接以后收发都自动转 */
+            MES_ctx_negotiate(&tim->ctx, &tim->rx_stream, &message_view);
+            tim->TIM = message_view.Dest_TIM_and_TC_Num[TIM_enum];
+            tim->initiated = 1;
+            printf("TIM %d initiated, conn:%u caps:%#x max segment:%u\n",
+                tim->TIM, tim->conn->index, tim->ctx.peer_caps, tim->ctx.peer_max_segment_size);
+
+            /* 采样走 UDP：每个连接一个会话号，旧连接残留的数据报会被丢掉 */
+            if((tim->ctx.peer_caps & MES_CAP_DATAGRAM) && ncap_udp >= 0 && tim->TIM < TIM_MAX && TIM_dgram[tim->TIM] == NULL)
+            {
+                tim->dgram_session = ++ncap_dgram_session;
+                Message_CommonCmd_Datagram_mode_pack_up_ctx(&tim->ctx, tim->TIM, 1, tim->dgram_session, NCAP_UDP_PORT, MES_DGRAM_PAYLOAD_MAX);
+                Message_pack_up_And_send_ctx(&tim->ctx);
+                tim->dgram_asked = 1;
+            }
+
+            if(tim->TIM < TIM_MAX && MES_session_match(&TIM_session[tim->TIM], &tim->ctx, tim->TIM))
+            {
+                /* 认出来了：TEDS 和上传模式都没变，一个来回就接着收 */
+                Message_CommonCmd_Session_resume_pack_up_ctx(&tim->ctx, tim->TIM, &TIM_session[tim->TIM]);
+                Message_pack_up_And_send_ctx(&tim->ctx);
+                printf("TIM %d session resumed, TC %d from %u\n", tim->TIM, NCAP_STREAM_TC, TIM_session[tim->TIM].acked_Offset[NCAP_STREAM_TC]);
+                continue;
+            }
+
+            /* 上线流程：读 PHY TEDS，设上传模式，最后给它会话号 */
+            Message_CommonCmd_Query_TEDS_pack_up_ctx(&tim->ctx, tim->TIM, TC_MAX, PHY_TEDS_ACCESS_CODE);
+            Message_pack_up_And_send_ctx(&tim->ctx);
+            Message_XdcrIdle_Set_Data_Transmission_mode_pack_up_ctx(&tim->ctx, tim->TIM, NCAP_STREAM_TC, BufferHalfFull);
+            Message_pack_up_And_send_ctx(&tim->ctx);
+            if(tim->TIM < TIM_MAX && (tim->ctx.peer_caps & MES_CAP_SESSION_RESUME))
+            {
+                MES_session_new(&TIM_session[tim->TIM], tim->TIM, NCAP_session_token());
+                Message_CommonCmd_Session_resume_pack_up_ctx(&tim->ctx, tim->TIM, &TIM_session[tim->TIM]);
+                Message_pack_up_And_send_ctx(&tim->ctx);
+            }
+        }else{
+            result = MES_stream_next_ReplyMessage(&tim->rx_stream, &reply_view);
+            if(result != MES_DECODE_OK)
+            {
+                break;
+            }
+            if(MES_ctx_take_push(&tim->ctx, &reply_view))
+            {
+                continue;   /* 推的采样或 Datagram_NACK 的回复，不是等的那个 */
+            }
+            if(tim->dgram_asked)
+            {
+                tim->dgram_asked = 0;
+                if(reply_view.Flag && TIM_dgram[tim->TIM] == NULL)
+                {
+                    MES_dgram_rx_init(&tim->dgram_rx, &tim->ctx, tim->TIM, tim->dgram_session, TIM_dgram_deliver, tim);
+                    TIM_dgram[tim->TIM] = tim;
+                    tim->dgram_on = 1;
+                }
+                printf("TIM %d datagram upload %s\n", tim->TIM, tim->dgram_on ? "on" : "refused, use TCP");
+                continue;
+            }
+            printf("TIM %d ReplyMessage recv, Flag:%d dependent_Length:%d\n",
+                tim->TIM, reply_view.Flag, reply_view.dependent_Length);
+        }
+    }
+
+    /* 坏帧之后流已经失去同步，断开让 TIM 重连 */
+    return tim->rx_stream.Broken || result == MES_DECODE_TOO_LONG ? -1 : 0;
+}
+
+static void TIM_on_close(void* user_data)
+{
+    struct NCAP_TIM_conn_struct* tim = user_data;
+
+    printf("TIM %d disconnected, conn:%u, stream bytes %llu\n", tim->TIM, tim->conn->index, (unsigned long long)tim->stream_bytes);
+    if(tim->dgram_on)
+    {
+        printf("TIM %d datagram: bytes %llu recv %u reordered %u duplicate %u repaired %u lost %u nack %u bad %u\n",
+            tim->TIM, (unsigned long long)tim->dgram_bytes, tim->dgram_rx.received_count, tim->dgram_rx.reordered_count,
+            tim->dgram_rx.duplicate_count, tim->dgram_rx.repaired_count, tim->dgram_rx.lost_count,
+            tim->dgram_rx.nack_count, tim->dgram_rx.bad_count);
+        TIM_dgram[tim->TIM] = NULL;
+        tim->dgram_on = 0;
+    }
+    tim->conn = NULL;
+}
+
+static const struct linux_socket_epoll_handler_struct TIM_handler = {
+    .on_open = TIM_on_open,
+    .rx_space = TIM_rx_space,
+    .on_recv = TIM_on_recv,
+    .on_close = TIM_on_close,
+};
+
+int main()
+{
+    char sys[2][50] = {" ---------- start! ---------- ", \
+                       " ----------  end! ----------- "};
+    int socket_ncap = 0;
+
+    printf("\n%s\n",sys[0]);
+
+    Message_init();
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
+    /* NCAP 的 TCP 初始化，监听队列给大一些，很多 TIM 会同时上电 */
+    socket_ncap = linux_socket_TCP_server_init(
+        1,
+        TEST_SERVER_ADDR_STR,
+        TEST_SERVER_PORT,
+        SOMAXCONN
+    );
+    if(socket_ncap < 0)
+    {
+        return -1;
+    }
+
+    if(linux_socket_epoll_init(&ncap_loop, socket_ncap, &TIM_handler) < 0)
+    {
+        close(socket_ncap);
+        return -1;
+    }
+
+#if LINUX_SOCKET_USE_IO_URING
+    /* 多次接收 + 缓存环 + 批量提交，一轮只一次系统调用；老内核不支持就还是 epoll，下面都不用改 */
+    if(linux_socket_uring_attach(&ncap_loop, &ncap_uring) < 0)
+    {
+        printf("io_uring not available, use epoll\n");
+    }
+#endif
+
+    /* 采样数据报的 UDP 端口，开不了的话 TIM 都还是走 TCP */
+    ncap_udp = linux_socket_UDP_init(1, TEST_SERVER_ADDR_STR, NCAP_UDP_PORT);
+
+    /* 所有 TIM 都在这一个循环里服务，哪个 TIM 慢都只影响它自己；
+        有 UDP 时最多等 10ms，每轮把数据报收完再看要不要请重发 */
+    while(1)
+    {
+        if(linux_socket_epoll_poll(&ncap_loop, ncap_udp >= 0 ? 10 : -1) < 0)
+        {
+            perror("server epoll_wait error");
+            break;
+        }
+        if(ncap_udp >= 0)
+        {
+            NCAP_dgram_drain();
+        }
+    }
+
+    printf("\n%s\n",sys[1]);
+    close(socket_ncap);
+
+    return 0;
+}
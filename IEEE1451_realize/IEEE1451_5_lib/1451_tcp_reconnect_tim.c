@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "../socket/socket.h"
+#include "IEEE1451_5_lib.h"
+
+/* 编译命令：这里是 linux 下，socket.h 里的 WIN_OR_LINUX 要注释掉
+    gcc 1451_tcp_reconnect_tim.c ../socket/socket.c ./IEEE1451_5_lib.c -I ../socket -I ./ -o 1451_tcp_reconnect_tim
+   运行：NCAP 用 1451_tcp_epoll_server，TIM 带 NCAP 的 ip
+    ./1451_tcp_reconnect_tim 127.0.0.1
+*/
+
+/* 我是 TIM 程序，断线自动重连：
+    ctx 和采样环都在重连之间保留，重连后 TIM_initiated 带着 NCAP 上次给的会话号，
+    NCAP 认出来就回一个 Session_resume，TIM 从 NCAP 收到的位置接着推，上传模式不用重新设；
+    NCAP 重启了不认识会话号的就照常走上线流程 */
+
+#define TIM_CONNECT_TIMEOUT_MS  1000
+#define TIM_BACKOFF_BASE_MS     100
+#define TIM_BACKOFF_MAX_MS      5000
+#define TIM_LOOP_MS             10              /* 一轮采一次样、推一次环 */
+#define TIM_RING_HALF_SIZE      1024
+#define TIM_SAMPLES_PER_LOOP    256
+
+static int socket_tim = -1;
+static struct MES_ctx_struct tim_ctx;
+static struct MES_stream_struct rx_stream;
+static uint8_t ring_load[2 * TIM_RING_HALF_SIZE];
+
+/* IEEE 1451 Message 数据发送接口 API */
+static unsigned int tim_send(void* user_data, unsigned char * data, unsigned int len)
+{
+    return send(socket_tim, data, len, MSG_NOSIGNAL) < 0 ? 0 : len;
+}
+
+static unsigned int tim_sendv(void* user_data, const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    struct iovec vec[MES_TXQ_IOV_MAX];
+    unsigned int total = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < iovcnt && i < MES_TXQ_IOV_MAX; i++)
+    {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+        total += iov[i].len;
+    }
+    return linux_socket_TCP_sendv(socket_tim, vec, i) < 0 ? 0 : total;
+}
+
+/* 模拟采集：每轮推一些锯齿波进 TC_1 的环 */
+static void TIM_sample(void)
+{
+    static uint32_t phase = 0;
+    uint8_t samples[TIM_SAMPLES_PER_LOOP];
+    uint32_t i = 0;
+
+    for(i = 0; i < TIM_SAMPLES_PER_LOOP; i++)
+    {
+        samples[i] = (uint8_t)(phase++);
+    }
+    TC_sample_ring_push(TC_1, samples, TIM_SAMPLES_PER_LOOP);
+}
+
+/* 一次连接的生命周期：握手，之后收命令 / 推采样，直到断线；
+    NCAP 回了命令并且会话恢复了（或者重新上线了）才算连好，退避清零 */
+static void TIM_session_run(struct linux_socket_backoff_struct* backoff)
+{
+    struct pollfd pfd;
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    uint8_t established = 0;
+    int recv_num = 0;
+
+    MES_stream_init(&rx_stream);
+    Message_TIM_initiated_pack_up_ctx(&tim_ctx);
+    Message_pack_up_And_send_ctx(&tim_ctx);
+
+    pfd.fd = socket_tim;
+    pfd.events = POLLIN;
+    while(1)
+    {
+        if(poll(&pfd, 1, TIM_LOOP_MS) > 0)
+        {
+            write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+            recv_num = recv(socket_tim, write_ptr, space, 0);
+            if(recv_num <= 0)
+            {
+                return;
+            }
+            MES_stream_commit(&rx_stream, recv_num);
+            if(MES_stream_serve_ctx(&tim_ctx, &rx_stream) > 0 && !tim_ctx.session_pending && !established)
+            {
+                established = 1;
+                linux_socket_backoff_reset(backoff);
+            }
+        }
+
+        TIM_sample();
+        /* 会话还没恢复时这里什么都不发，采样先攒在环里 */
+        TC_sample_ring_ship_ctx(&tim_ctx, TC_1);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    struct linux_socket_backoff_struct backoff;
+    const char* ncap_ip = argc > 1 ? argv[1] : TEST_CLIENT_AIM_SOC_ADDR_STR;
+
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    TEDS_init();
+    Message_init();
+
+    MES_ctx_init(&tim_ctx, tim_send, NULL);
+    tim_ctx.sendv = tim_sendv;
+    TC_sample_ring_init(TC_1, ring_load, TIM_RING_HALF_SIZE, NULL, NULL);
+    linux_socket_backoff_init(&backoff, TIM_BACKOFF_BASE_MS, TIM_BACKOFF_MAX_MS);
+
+    while(1)
+    {
+        socket_tim = linux_socket_TCP_reconnect(ncap_ip, TEST_CLIENT_AIM_PORT, TIM_CONNECT_TIMEOUT_MS, &backoff);
+        printf("NCAP %s connected, session %u\n", ncap_ip, tim_ctx.session_token);
+
+        TIM_session_run(&backoff);
+
+        close(socket_tim);
+        printf("NCAP lost, TC_1 shipped to %u, overrun %u\n", TC_sample_ring[TC_1].ship_pos, TC_sample_ring[TC_1].overrun_bytes);
+    }
+    return 0;
+}
@@ -22,6 +22,29 @@ unsigned int mes_1451_send_g(unsigned char * data, unsigned int len)
     return send(socket_tim, data, len, 0);
 }
 
+/* IEEE 1451 Message 向量数据发送接口 API，发送队列批量发送时用，iovcnt 不超过 MES_TXQ_IOV_MAX */
+unsigned int mes_1451_sendv_g(const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    WSABUF bufs[MES_TXQ_IOV_MAX];
+    unsigned int i = 0;
+    int sent = 0;
+
+    for(i = 0;i < iovcnt;i++)
+    {
+        bufs[i].buf = (char*)iov[i].base;
+        bufs[i].len = iov[i].len;
+    }
+    /* 出错返回的 SOCKET_ERROR（-1）转成 unsigned 就成了发送成功，这里当 0 个字节 */
+    sent = win_socket_TCP_sendv(socket_tim, bufs, iovcnt);
+    return sent == SOCKET_ERROR ? 0 : (unsigned int)sent;
+}
+
+/* 分帧的接收缓存，64KB，放静态区 */
+static struct MES_stream_struct rx_stream;
+
+/* 回复缓存，NCAP 反复读 TEDS 时直接发存好的帧，放静态区 */
+static struct MES_reply_cache_struct reply_cache;
+
 int main()
 {
     char sys[2][50] = {" ---------- start! ---------- ", \
@@ -30,12 +53,18 @@ int main()
     printf("\n%s\n",sys[0]);
 
     unsigned int recv_num = 0;
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    struct Message_view_struct message_view;
 
     mes_1451_send = mes_1451_send_g;
+    mes_1451_sendv = mes_1451_sendv_g;
 
     TIM_status = Idle;
     TEDS_init();
     Message_init();
+    MES_stream_init(&rx_stream);
+    MES_ctx_attach_reply_cache(&MES_ctx_default, &reply_cache);
 
     /* 各种外设初始化 */
 
@@ -61,33 +90,38 @@ int main()
         否则 只执行一次（与 1451_tcp_test_server.c 那个 NCAP 程序 对应），然后 死循环接收 Server 的 消息 */
     // while(1)
     // {
-        /* TIM 接收 Message 到 MES.Message_u->Message_load 这个数组，
-            然后 ReplyMessage_Server() 会自动解析 Message 并予以回复 ReplyMessage */
-        recv_num = recv(socket_tim, MES.Message_u->Message_load, 
-            sizeof(MES.Message_u->Message_load), 0);
+        /* TIM 接收 Message 直接放进分帧的接收缓存，TCP 一次 recv 可能收到多帧或半帧，
+            然后 MES_stream_serve_ctx() 会切出每一个完整的 Message，自动解析并予以回复 ReplyMessage */
+        write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+        recv_num = recv(socket_tim, write_ptr, space, 0);
 
-        if(recv_num > 0)
+        if(recv_num > 0 && recv_num != SOCKET_ERROR)
         {
-            Message_decode(&Message_temp,MES.Message_u->Message_load);
-
-            printf("TIM Message recv:        \
-                \n   Dest_TIM:%d                 \
-                \n   Dest_TC:%d                  \
-                \n   Command_class:%d            \
-                \n   Command_function:%d         \
-                \n   dependent_Length:%d\n",       \
-                Message_temp.Dest_TIM_and_TC_Num[TIM_enum], \
-                Message_temp.Dest_TIM_and_TC_Num[TC_enum], \
-                Message_temp.Command_class,         \
-                Message_temp.Command_function,      \
-                Message_temp.dependent_Length       \
-            );
+            MES_stream_commit(&rx_stream, recv_num);
+
+            /* 先只看一下头一帧，不取走 */
+            if(Message_decode_view(&message_view, &rx_stream.buffer[rx_stream.head], 
+                rx_stream.tail - rx_stream.head) == MES_DECODE_OK)
+            {
+                printf("TIM Message recv:        \
+                    \n   Dest_TIM:%d                 \
+                    \n   Dest_TC:%d                  \
+                    \n   Command_class:%d            \
+                    \n   Command_function:%d         \
+                    \n   dependent_Length:%d\n",       \
+                    message_view.Dest_TIM_and_TC_Num[TIM_enum], \
+                    message_view.Dest_TIM_and_TC_Num[TC_enum], \
+                    message_view.Command_class,         \
+                    message_view.Command_function,      \
+                    message_view.dependent_Length       \
+                );
+            }
+
+            printf("TIM served %u Message\n", MES_stream_serve_ctx(&MES_ctx_default, &rx_stream));
         }else
         {
             // break;
         }
-        
-        ReplyMessage_Server(MES.Message_u->Message_load);
     // }
 
     /* 接收 server 数据 并打印  */
@@ -22,6 +22,36 @@ unsigned int mes_1451_send_g(unsigned char * data, unsigned int len)
     return send(socket_tim, data, len, 0);
 }
 
+/* IEEE 1451 Message 向量数据发送接口 API，发送队列批量发送时用，iovcnt 不超过 MES_TXQ_IOV_MAX */
+unsigned int mes_1451_sendv_g(const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    WSABUF bufs[MES_TXQ_IOV_MAX];
+    unsigned int i = 0;
+    int sent = 0;
+
+    for(i = 0;i < iovcnt;i++)
+    {
+        bufs[i].buf = (char*)iov[i].base;
+        bufs[i].len = iov[i].len;
+    }
+    /* 出错返回的 SOCKET_ERROR（-1）转成 unsigned 就成了发送成功，这里当 0 个字节 */
+    sent = win_socket_TCP_sendv(socket_tim, bufs, iovcnt);
+    return sent == SOCKET_ERROR ? 0 : (unsigned int)sent;
+}
+
+/* IEEE 1451 Message 数据接收接口 API，TC_data_set_pull_ctx() 这类要等回复的 API 用 */
+unsigned int mes_1451_recv_g(unsigned char * data, unsigned int len)
+{
+    int recv_n = recv(socket_tim, data, len, 0);
+    return recv_n > 0 ? recv_n : 0;
+}
+
+/* 分帧的接收缓存，64KB，放静态区 */
+static struct MES_stream_struct rx_stream;
+
+/* 发送队列，16KB，放静态区 */
+static struct MES_txq_struct tx_queue;
+
 int main()
 {
     char sys[2][50] = {" ---------- start! ---------- ", \
@@ -30,12 +60,21 @@ int main()
     printf("\n%s\n",sys[0]);
 
     unsigned int recv_num = 0;
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    struct Message_view_struct message_view;
+    struct ReplyMessage_view_struct reply_view;
 
     mes_1451_send = mes_1451_send_g;
+    mes_1451_sendv = mes_1451_sendv_g;
+    mes_1451_recv = mes_1451_recv_g;
 
     // TIM_status = Idle;
     // TEDS_init();
     Message_init();
+    MES_stream_init(&rx_stream);
+    /* 默认 ctx 挂上发送队列，攒够 4KB 或者主动冲刷时一次发出去 */
+    MES_ctx_attach_txq(&MES_ctx_default, &tx_queue, 4096, 0, NULL);
 
     /* 各种外设初始化 */
 
@@ -66,11 +105,19 @@ int main()
     /* TIM 会发送 初始化完毕 的 Message */
 
     /* NCAP 阻塞等待接收 TIM 的初始化完毕 的 Message，
-        NCAP 接收 Message，接收的 数据 直接放入 MES.Message_u->Message_load 这个数组，
-        然后 Message_decode() 会解析 并填充到 Message_temp 结构体里面 */
-    recv_num = recv(socket_tim, MES.Message_u->Message_load, 
-        sizeof(MES.Message_u->Message_load), 0);
-    Message_decode(&Message_temp,MES.Message_u->Message_load);
+        NCAP 接收的数据直接放入分帧的接收缓存，TCP 一次 recv 可能收到多帧或半帧，
+        然后 MES_stream_next_Message() 会切出一个完整的 Message 并零拷贝解析到 message_view 里面 */
+    while(MES_stream_next_Message(&rx_stream, &message_view) == MES_DECODE_INCOMPLETE)
+    {
+        write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+        recv_num = recv(socket_tim, write_ptr, space, 0);
+        if(recv_num == 0 || recv_num == SOCKET_ERROR)
+        {
+            perror("server recv error");
+            exit(-1);
+        }
+        MES_stream_commit(&rx_stream, recv_num);
+    }
 
     printf("NCAP Message recv:        \
         \n   Dest_TIM:%d                 \
@@ -78,32 +125,45 @@ int main()
         \n   Command_class:%d            \
         \n   Command_function:%d         \
         \n   dependent_Length:%d\n",       \
-        Message_temp.Dest_TIM_and_TC_Num[TIM_enum], \
-        Message_temp.Dest_TIM_and_TC_Num[TC_enum], \
-        Message_temp.Command_class,         \
-        Message_temp.Command_function,      \
-        Message_temp.dependent_Length       \
+        message_view.Dest_TIM_and_TC_Num[TIM_enum], \
+        message_view.Dest_TIM_and_TC_Num[TC_enum], \
+        message_view.Command_class,         \
+        message_view.Command_function,      \
+        message_view.dependent_Length       \
     );
 
+    /* TIM_initiated 里带握手信息，大小端和 NCAP 不同的 TIM 这个连接以后收发都自动转 */
+    MES_ctx_negotiate(&MES_ctx_default, &rx_stream, &message_view);
+    printf("TIM caps:%#x max segment:%u swap:%d\n", 
+        MES_ctx_default.peer_caps, MES_ctx_default.peer_max_segment_size, MES_ctx_default.codec->swap);
+
     system("pause");
 
     /* NCAP 发送 Query_TEDS 的 Message */
     printf("NCAP send Query_TEDS Message\n");
     Message_CommonCmd_Query_TEDS_pack_up(TIM_3, TC_12, PHY_TEDS_ACCESS_CODE);
     Message_pack_up_And_send();
-
-    /* NCAP 阻塞等待接收 TIM 的 ReplyMessage，
-        NCAP 接收 ReplyMessage，接收的 数据 直接放入 MES.ReplyMessage_u->ReplyMessage_load 这个数组，
-        然后 ReplyMessage_decode() 会解析 并填充到 ReplyMessage_temp 结构体里面 */
-    recv_num = recv(socket_tim, MES.ReplyMessage_u->ReplyMessage_load, 
-        sizeof(MES.ReplyMessage_u->ReplyMessage_load), 0);
-    ReplyMessage_decode(&ReplyMessage_temp, MES.ReplyMessage_u->ReplyMessage_load);
+    MES_txq_flush_ctx(&MES_ctx_default);    /* 后面要等回复，这里主动冲刷 */
+
+    /* NCAP 阻塞等待接收 TIM 的 ReplyMessage，同样先放进分帧的接收缓存，
+        然后 MES_stream_next_ReplyMessage() 会切出一个完整的 ReplyMessage 并零拷贝解析到 reply_view 里面 */
+    while(MES_stream_next_ReplyMessage(&rx_stream, &reply_view) == MES_DECODE_INCOMPLETE)
+    {
+        write_ptr = MES_stream_write_ptr(&rx_stream, &space);
+        recv_num = recv(socket_tim, write_ptr, space, 0);
+        if(recv_num == 0 || recv_num == SOCKET_ERROR)
+        {
+            perror("server recv error");
+            exit(-1);
+        }
+        MES_stream_commit(&rx_stream, recv_num);
+    }
     
     printf("NCAP ReplyMessage recv:         \
         \n   Flag:%d                        \
         \n   dependent_Length:%d\n",        \
-        ReplyMessage_temp.Flag,             \
-        ReplyMessage_temp.dependent_Length  \
+        reply_view.Flag,             \
+        reply_view.dependent_Length  \
     );
 
     /* 向 client 发 输入的东西，用于测试 */
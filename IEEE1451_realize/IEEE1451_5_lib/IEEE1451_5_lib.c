@@ -39,10 +39,23 @@ Log:            日期        发布版本    作者   描述
 #include "IEEE1451_5_lib.h"
 #include <string.h>
 
+#if TEDS_PREBUILT
+    #include "TEDS_images.h"
+#endif
+
+/* TEDS 校验内核用的向量指令，按编译目标选（比如 -mavx2、-msse2，aarch64 默认有 NEON） */
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+#endif
+
 /* 
 流程：
     0、NCAP 发出 WiFi 热点， TIM 们上电开机后分别自动的连上 NCAP
-    0.5、TIM 给 NCAP 发送初始化完毕消息（Message_TIM_initiated）
+    0.5、TIM 给 NCAP 发送初始化完毕消息（Message_TIM_initiated），带字节序标记和能力位图，NCAP 用 MES_ctx_negotiate() 给这个连接选编解码
     1、NCAP 自动询问 TIM 的 TEDS（CommonCmd_Query_TEDS），TIM 自动做回应
     2、NCAP 再自动读 TIM 的 TEDS（CommonCmd_Read_TEDS），TIM 自动做回应
     3、以上步骤均无误后，NCAP 根据一个标志位判断自动启动 TIM 还是等待上级进一步操作
@@ -83,6 +96,8 @@ Log:            日期        发布版本    作者   描述
 
         NCAP 解析回复消息 API：填入接收到的回复消息字符串，接收回复消息解析，并讲结果存在 replyMessageReceived 结构体地址里
             void ReplyMessage_decode(struct ReplyMessage_struct* replyMessageReceived,uint8_t* received_rep_mes_load)
+        或者用零拷贝的版本，只检查头部和长度，结果 view 里的 dependent_load 直接指向接收缓存，不拷贝：
+            enum MES_decode_result_enum ReplyMessage_decode_view(struct ReplyMessage_view_struct* view, const uint8_t* received_rep_mes_load, uint32_t received_length)
 
     回复消息，这里一般是 TIM 调用的 API：
         TIM 首先主动发送初始化完毕消息：
@@ -91,11 +106,109 @@ Log:            日期        发布版本    作者   描述
 
         TIM 处理 接收消息 和 自动回复消息 API：填入接收到的消息字符串，会根据已经实现的消息解码字符串和自动回应
             void ReplyMessage_Server(uint8_t* received_mes_load)
+
+    读传感器通道数据集：
+        TIM 把采集好的数据集绑定到对应通道，ReplyMessage_Server() 收到读数据集命令后按 Offset 从中直接分段回复：
+            TC_data_set_bind(TC_1, audio_buffer, 60000);
+        NCAP 流水线拉取整个数据集（需要先填 mes_1451_recv 接收函数指针）：
+            TC_data_set_pull_ctx(&MES_ctx_default, &rx_stream, TIM_3, TC_1, dest, 60000, 4096, 8);
+
+    BufferHalfFull 上传模式：（TIM 用）
+        给通道挂环形缓存，采集线程只管推采样，写满半个缓存时 wake 回调通知网络线程发这一半：
+            TC_sample_ring_init(TC_1, ring_buffer, 16384, wake_net_thread, NULL);
+            TC_sample_ring_push(TC_1, samples, samples_length);     采集线程
+            TC_sample_ring_ship(TC_1);                              网络线程被唤醒后
+        NCAP 收到的是 Flag 带 MES_REPLY_FLAG_PUSH 的回复，带通道号，等命令回复时交给挂的处理函数：
+            MES_ctx_attach_push(&ctx_tim_3, on_samples, NULL);
+
+    Interval / Interval_1s 上传模式：（TIM 用）
+        初始化调度器，之后收到 Data_Transmission_mode 命令自动启停通道的定时器，到期调 upload 回调发数据：
+            TC_upload_sched_init(now_ms(), upload_TC_data, NULL);
+            TC_upload_sched_tick(now_ms());                         网络线程循环里
+
+    采样走 UDP 数据报：（两边都用，命令和回复还是走 TCP，每个连接各自协商）
+        TIM 给 ctx 挂数据报发送，NCAP 发 Datagram_mode 打开后 TC_sample_ring_ship() 自动走 UDP，Interval 的回调里用 MES_dgram_send_ctx()：
+            MES_ctx_attach_dgram_tx(&MES_ctx_default, &dgram_tx, udp_sendv, NULL, now_ms);                              TIM
+            Message_CommonCmd_Datagram_mode_pack_up_ctx(&ctx_tim_3, TIM_3, 1, session, udp_port, MES_DGRAM_PAYLOAD_MAX);   NCAP，回复 Flag 为 1 后
+            MES_dgram_rx_init(&dgram_rx, &ctx_tim_3, TIM_3, session, deliver, NULL);
+            MES_dgram_rx_input(&dgram_rx, datagram, length, now_ms());                                                  收到数据报
+            MES_dgram_rx_poll(&dgram_rx, now_ms());                                                                     定期，缺的发 Datagram_NACK
+
+    断线重连恢复会话：（两边都用，TIM 的 ReplyMessage_Server() 自动处理）
+        TIM 的 ctx 和采样环跨重连保留，重连后照常发 TIM_initiated（带上次的会话号），
+        NCAP 认出来就只回一个 Session_resume，不再读 TEDS、设上传模式，TIM 从 NCAP 收到的位置接着推：
+            if(MES_session_match(&session_tim_3, &ctx_tim_3, TIM_3))                                NCAP，握手后
+            else MES_session_new(&session_tim_3, TIM_3, token);                                     上线流程走完后
+            Message_CommonCmd_Session_resume_pack_up_ctx(&ctx_tim_3, TIM_3, &session_tim_3);
+            MES_session_ack(&session_tim_3, TC_1, Offset + length);                                 收到采样
+        TIM 连 NCAP 用 socket.c 的 linux_socket_TCP_reconnect()，带超时和随机退避，会话恢复（或重新上线）后再 linux_socket_backoff_reset()
+
+    回复缓存：（TIM 用）
+        每个连接的 ctx 挂一个，NCAP 上线读 TEDS、定期核对 TEDS 时同样的 Query_TEDS / Read_TEDS_segment 直接发存好的帧：
+            static struct MES_reply_cache_struct reply_cache;
+            MES_ctx_attach_reply_cache(&MES_ctx_default, &reply_cache);
+
+    NCAP 取 TEDS 走缓存：（NCAP 用，IEEE1451_5_lib.h 里 TEDS_CACHE_USE 改为 1）
+        Checksum 和缓存一样的只发一个 Query_TEDS，不再读 TEDS，缓存可以存文件跨重启：
+            TEDS_cache_load("teds_cache.bin");
+            load = TEDS_cache_fetch_ctx(&ctx_tim_3, &rx_stream, TIM_3, TC_1, TC_TEDS_ACCESS_CODE, &length);
+            TEDS_cache_save("teds_cache.bin");
+
+    TEDS 目录：（NCAP 用，同上要 TEDS_CACHE_USE 为 1）
+        TEDS 存进缓存时自动建索引，查单位为开尔文、SPeriod 小于 1ms 的 Sensor 通道：
+            struct TEDS_dir_query_struct query = { .match = TEDS_DIR_MATCH_ChanType | TEDS_DIR_MATCH_PhyUnits | TEDS_DIR_MATCH_SPeriod,
+                .ChanType = Sensor, .PhyUnits = kelvin_units, .SPeriod_min = 0, .SPeriod_max = 0.001f };
+            count = TEDS_dir_query(&query, result, 1024);       result 里是 TEDS_dir.channel[] 的下标
+
+    NCAP 改 TIM 的 TEDS：（NCAP 发，TIM 的 ReplyMessage_Server() 自动处理）
+        先分段写进 TIM 的影子，全部写完再 Update_TEDS，TIM 检查通过才整个换上，之前读的都是旧 TEDS：
+            Message_CommonCmd_Write_TEDS_segment_pack_up_ctx(&ctx_tim_3, TIM_3, TC_1, UTN_TEDS_ACCESS_CODE, TEDSOffset, data, length);
+            Message_CommonCmd_Update_TEDS_pack_up_ctx(&ctx_tim_3, TIM_3, TC_1, UTN_TEDS_ACCESS_CODE);
+        TIM 自己改也一样：TEDS_write_segment() 若干次后 TEDS_update()
+
+    每个通道自己的 TC TEDS：（TIM 挂，NCAP 按 Dest_TC 读写）
+        没挂的通道用共用的 TC TEDS，NCAP 用一个 Query_TC_TEDS_digest 拿所有通道的长度和 Checksum：
+            TC_TEDS_bind(TC_5, tc5_TEDS, tc5_TEDS_length);                                          TIM
+            Message_CommonCmd_Query_TC_TEDS_digest_pack_up_ctx(&ctx_tim_3, TIM_3);                  NCAP
+            count = TC_TEDS_digest_decode(&reply, digest, TC_MAX);
+
+    TEDS 持久存储：（Linux 上的 TIM 用）
+        TEDS_STORE_USE_MMAP 改为 1，NCAP 写的 TEDS 存在文件里，重启后一次 mmap 直接挂上，不用重新编译也不用再写：
+            TEDS_init();
+            TEDS_store_open("teds_store.bin");
+        TEDS_update_field() 改的 Adaptive 域先不落盘，隔一段时间和退出前存一次：
+            TEDS_store_flush();
+
+    TEDS 预先编译：（TIM 用）
+        在 TEDS_desc.txt 里写 TEDS，用 TEDS_gen 生成带 Length 和 Checksum 的 const 镜像，TEDS_PREBUILT 改为 1，TEDS_init() 不用再算：
+            gcc TEDS_gen.c -o TEDS_gen.exe
+            TEDS_gen.exe TEDS_desc.txt TEDS_images
+            gcc ... IEEE1451_5_lib.c TEDS_images.c
+
+    大小端不同的 TIM 和 NCAP：（两边都用）
+        NEED_SWITCH_LITTLE_BIG_END 改为 1，库内置命令的帧和读回来的 TEDS 按字段表自动转，
+        自己等回复的用带命令的版本，厂商自定义命令自己写字段表：
+            MES_stream_wait_ReplyMessage_as_ctx(&ctx_tim_3, &rx_stream, &reply, CommonCmd, Query_TC_TEDS_digest);
+            MES_swap_fields(dependent_load, dependent_Length, &my_schema);
+
+    多连接 / 多线程使用：（一般是 NCAP 同时服务多个 TIM）
+        上面的 API 都用的是一个默认的上下文（MES_ctx_default），同一时刻只能处理一路；
+        每个 API 都有 _ctx 后缀的版本，给每个连接例化一个 struct MES_ctx_struct，各自初始化，互不干扰，例子如下：
+            struct MES_ctx_struct ctx_tim_3;
+            MES_ctx_init(&ctx_tim_3, send_to_tim_3, (void*)&socket_tim_3);
+            Message_CommonCmd_Query_TEDS_pack_up_ctx(&ctx_tim_3, TIM_3, TC_12, PHY_TEDS_ACCESS_CODE);
+            Message_pack_up_And_send_ctx(&ctx_tim_3);
+        linux 上的 NCAP 用 socket.c 的 epoll 事件循环一个线程服务所有 TIM，每个连接一个 ctx 和一个分帧的接收缓存，
+        见 1451_tcp_epoll_server.c；内核支持 io_uring 时收发走 io_uring（linux_socket_uring_attach()），ctx 的 send 接口不用改
+        NCAP 和 TIM 在同一个板子上的两个进程时 ctx 的 send / sendv / recv 换成 socket.c 的共享内存环（linux_shm_link_xxx()），不走 TCP 回环
 */
 
 /* 调试 / 测试 / 样例 程序：
     见 1451_tcp_test_server.c
     与 1451_tcp_test_client.c
+    多 TIM 的 NCAP（linux）见 1451_tcp_epoll_server.c
+    同板子上的 NCAP 和 TIM 走共享内存（linux）见 1451_shm_local_test.c
+    断线自动重连的 TIM（linux）见 1451_tcp_reconnect_tim.c
 */
 
 
@@ -107,6 +220,12 @@ Log:            日期        发布版本    作者   描述
 /* 定义发送数据 函数指针，初始化时候应该填入 */
 unsigned int (*mes_1451_send)(unsigned char * data, unsigned int len);
 
+/* 定义向量发送数据函数指针，可选 */
+unsigned int (*mes_1451_sendv)(const struct MES_iovec_struct* iov, unsigned int iovcnt);
+
+/* 定义接收数据函数指针，可选 */
+unsigned int (*mes_1451_recv)(unsigned char * data, unsigned int len);
+
 /* TIM 自己的固定 IP */ /* 固定 IP 吧，省心，在下面设定 */
 uint8_t NCAP_IP[4] = {192,168,120,0};
 
@@ -125,9 +244,6 @@ enum TIM_enum Self_TIM = TIM_3;
 
 enum TIM_status_enum TIM_status = Initializing;
 
-uint8_t temp_load[200];
-uint32_t temp_load_valid_length = 0;
-
                                     /*************\
 *************************************  TEDS 部分  *****************************************************
                                     \*************/
@@ -236,6 +352,8 @@ struct TEDS_status_struct PHY_TEDS_status =
     .Open_7 = 1,
 };
 
+#if !TEDS_PREBUILT
+
 /* 开始装填 M_TEDS 结构体 */
 union Meta_TEDS_union M_TEDS_u = 
 {
@@ -329,7 +447,18 @@ union TransducerChannel_TEDS_union TC_TEDS_u =
     .TC_TEDS.MRange.Type = 17, .TC_TEDS.MRange.Length = 1,
     .TC_TEDS.MRange.Value = 0, /* 值为真表示具有多量程，否则不具有 */
     
-    /* 太多了 T_T 后面略 */
+    /* 太多了 T_T 后面略，值先都为 0，TLV 头还是要填上，不然 TEDS_decode() 认不出结构体布局 */
+    .TC_TEDS.Sample.Type = 18, .TC_TEDS.Sample.Length = 1,         .TC_TEDS.DataSet.Type = 19, .TC_TEDS.DataSet.Length = 1,
+    .TC_TEDS.UpdateT.Type = 20, .TC_TEDS.UpdateT.Length = 4,       .TC_TEDS.WSetupT.Type = 21, .TC_TEDS.WSetupT.Length = 4,
+    .TC_TEDS.RSetupT.Type = 22, .TC_TEDS.RSetupT.Length = 4,       .TC_TEDS.SPeriod.Type = 23, .TC_TEDS.SPeriod.Length = 4,
+    .TC_TEDS.WarmUpT.Type = 24, .TC_TEDS.WarmUpT.Length = 4,       .TC_TEDS.RDelayT.Type = 25, .TC_TEDS.RDelayT.Length = 4,
+    .TC_TEDS.TestTime.Type = 26, .TC_TEDS.TestTime.Length = 4,     .TC_TEDS.TimeSrc.Type = 27, .TC_TEDS.TimeSrc.Length = 1,
+    .TC_TEDS.InPropDl.Type = 28, .TC_TEDS.InPropDl.Length = 4,     .TC_TEDS.OutPropD.Type = 29, .TC_TEDS.OutPropD.Length = 4,
+    .TC_TEDS.TSError.Type = 30, .TC_TEDS.TSError.Length = 4,       .TC_TEDS.Sampling.Type = 31, .TC_TEDS.Sampling.Length = 1,
+    .TC_TEDS.DataXmit.Type = 32, .TC_TEDS.DataXmit.Length = 1,     .TC_TEDS.Buffered.Type = 33, .TC_TEDS.Buffered.Length = 1,
+    .TC_TEDS.EndOfSet.Type = 34, .TC_TEDS.EndOfSet.Length = 1,     .TC_TEDS.EdgeRpt.Type = 35, .TC_TEDS.EdgeRpt.Length = 1,
+    .TC_TEDS.ActHalt.Type = 36, .TC_TEDS.ActHalt.Length = 1,       .TC_TEDS.Directon.Type = 37, .TC_TEDS.Directon.Length = 4,
+    .TC_TEDS.DAngles.Type = 38, .TC_TEDS.DAngles.Length = 8,       .TC_TEDS.ESOption.Type = 39, .TC_TEDS.ESOption.Length = 1,
     
     // .Sample = , 略
     // .DataSet = , 略
@@ -448,10 +577,30 @@ union PHY_TEDS_union PHY_TEDS_u =
     .PHY_TEDS.MaxRetry.Value = 5, 
 };
 
+#endif  /* !TEDS_PREBUILT */
+
+/* TEDS 代数，任何 TEDS 镜像发布都加一，回复缓存用它判断存的帧是否过时 */
+static uint32_t TEDS_generation;
+
 /**************************** TEDS init，用户使用 ****************************/
 void TEDS_init(void)
 {
-    
+    uint8_t TC = 0;
+
+#if TEDS_PREBUILT
+    /* TEDS_gen 生成的镜像 Length 和 Checksum 都已经算好，这里只挂上，不做任何计算 */
+    TEDS.M_TEDS_u = (union Meta_TEDS_union*)TEDS_image_M_TEDS;
+    TEDS.M_TEDS_load_Length = TEDS_IMAGE_M_TEDS_LENGTH;
+
+    TEDS.TC_TEDS_u = (union TransducerChannel_TEDS_union*)TEDS_image_TC_TEDS;
+    TEDS.TC_TEDS_load_Length = TEDS_IMAGE_TC_TEDS_LENGTH;
+
+    TEDS.UTN_TEDS_u = (union User_Transducer_Name_TEDS_union*)TEDS_image_UTN_TEDS;
+    TEDS.UTN_TEDS_load_Length = TEDS_IMAGE_UTN_TEDS_LENGTH;
+
+    TEDS.PHY_TEDS_u = (union PHY_TEDS_union*)TEDS_image_PHY_TEDS;
+    TEDS.PHY_TEDS_load_Length = TEDS_IMAGE_PHY_TEDS_LENGTH;
+#else
     M_TEDS_u.M_TEDS.Length = sizeof(struct Meta_TEDS_struct) - 4;       /* 计算 TEDS 的数据区长度 */ /* 42，宇宙的终极答案，yyds */
                         /* 这个长度 只包括 TEDS 的 DATA BLOCK 和 CHECKSUM，不包括 占 4 byte 的 length */
     TEDS.M_TEDS_load_Length = M_TEDS_u.M_TEDS.Length + 4;               /* 计算 TEDS 总长度 */
@@ -472,6 +621,7 @@ void TEDS_init(void)
     TEDS.PHY_TEDS_load_Length = PHY_TEDS_u.PHY_TEDS.Length + 4;
     TEDS.PHY_TEDS_u = &PHY_TEDS_u;
     PHY_TEDS_u.PHY_TEDS.Checksum = TEDS_calc_Checksum(PHY_TEDS_ACCESS_CODE);
+#endif
 
 
     /* 开始装填 每个 TEDS 的全名字符串 */
@@ -490,6 +640,18 @@ void TEDS_init(void)
     TEDS.TC_TEDS_status = &TC_TEDS_status;
     TEDS.UTN_TEDS_status = &UTN_TEDS_status;
     TEDS.PHY_TEDS_status = &PHY_TEDS_status;
+
+    /* 每个通道先都用共用的 TC TEDS，属性和状态也照共用的来，之后用 TC_TEDS_bind() 挂通道自己的 */
+    for(TC = 0; TC < TC_MAX; TC++)
+    {
+        TC_TEDS_table[TC].load = NULL;
+        TC_TEDS_table[TC].whole_length = 0;
+        TC_TEDS_table[TC].Checksum = 0;
+        TC_TEDS_table[TC].attr = TC_TEDS_attr;
+        TC_TEDS_table[TC].status = TC_TEDS_status;
+    }
+
+    __atomic_add_fetch(&TEDS_generation, 1, __ATOMIC_RELEASE);
 }
 
 /* TEDS 打包函数
@@ -552,523 +714,5424 @@ void TEDS_pack_up(uint8_t* dest_loader,uint32_t* length,uint8_t access_code)
     
 }
 
-/* 
-    计算 TEDS 校验，
-    从 TED Length（最开头） 到 DATA BLOCK 的最后一个字节（本域类的上一个字节） 的加和，
-    再用 0xFFFF 减去该加和值。 
-*/
-uint16_t TEDS_calc_Checksum(uint8_t access_code)
+/**************************** TEDS 影子镜像 ****************************/
+/* 每个 TEDS 两块影子缓存，写 TEDS 先写影子，Update 时校验通过再原子地换 TEDS.xxx_TEDS_u 指针（类似 RCU），
+    读 TEDS（回复 Query / Read 段）的一直读当前指针指向的镜像，不加锁，写到一半也不受影响；
+    换下来的旧镜像下次写时当影子用，用之前等还在从它发送的回复发完（readers 为 0）；
+    槽 0 ~ 3 为四个 TEDS（其中 TC TEDS 为所有通道共用的那个），4 起为每个通道自己的 TC TEDS（TC_TEDS_table） */
+#define TEDS_SLOT_SHARED_MAX    4
+#define TEDS_SLOT_MAX           (TEDS_SLOT_SHARED_MAX + TC_MAX)
+
+struct TEDS_shadow_struct
 {
-    uint32_t i = 0;
-    uint8_t* load_ptr;
-    uint32_t length_except_checksum = 0;
-    uint16_t Checksum = 0;
+    uint32_t readers[2];    /* 正在从这块读 / 发送的个数 */
+    uint8_t index;          /* 当前影子是哪一块 */
+    uint8_t open;           /* 影子已经写了还没 Update */
+    uint8_t busy;           /* 写者互斥，写者之间不等待，拿不到直接返回失败 */
+    uint32_t link_id;       /* 打开影子的连接（ctx 的 link_id），本地 API 写的为 0 */
+    uint32_t covered;       /* 从 0 开始连续写过的字节数，大小端不同的 NCAP 要整个写完才能 Update */
+    uint8_t ram;            /* 影子在静态缓存里：没开持久存储，或者开了但是 TEDS_update_field() 改的（先不落盘） */
+    uint8_t dirty;          /* 发布的镜像比持久存储里的新，TEDS_store_flush() 时再存 */
+};
 
-    switch (access_code)
-    {
-        case M_TEDS_ACCESS_CODE:
-            
-            length_except_checksum = TEDS.M_TEDS_load_Length - 2;
-            
-            load_ptr = TEDS.M_TEDS_u->TEDS_load;
-            
-            break;
+static struct TEDS_shadow_struct TEDS_shadow[TEDS_SLOT_MAX];
 
-        case TC_TEDS_ACCESS_CODE:
-            
-            length_except_checksum = TEDS.TC_TEDS_load_Length - 2;
-            
-            load_ptr = TEDS.TC_TEDS_u->TEDS_load;
+/* 影子缓存本身，通道的 TC TEDS 一般不大，用小一点的缓存 */
+static uint8_t TEDS_shadow_load[TEDS_SLOT_SHARED_MAX][2][MAX_TEDS_IMAGE_SIZE];
+static uint8_t TC_TEDS_shadow_load[TC_MAX][2][TC_TEDS_SHADOW_SIZE];
 
-            break;
+#if TEDS_STORE_USE_MMAP
 
-        case UTN_TEDS_ACCESS_CODE:
-            
-            length_except_checksum = TEDS.UTN_TEDS_load_Length - 2;
-            
-            load_ptr = TEDS.UTN_TEDS_u->TEDS_load;
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-            break;
+/* 持久存储的文件布局：文件头、每个槽两块的提交头、每个槽两块的数据，数据块大小同上面的影子；
+    提交头的 seq 为 0 表示这块没有提交过的镜像，check 防头本身写坏，文件按本平台的字节序存 */
+#define TEDS_STORE_MAGIC    0x31535445  /* "ETS1" */
 
-        case PHY_TEDS_ACCESS_CODE:
-            
-            length_except_checksum = TEDS.PHY_TEDS_load_Length - 2;
-            
-            load_ptr = TEDS.PHY_TEDS_u->TEDS_load;
-            
-            break;
-        
-        default:
-            break;
-    }
+struct TEDS_store_header_struct
+{
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t shared_size;
+    uint32_t TC_size;
+};
 
-    for(i = 0;i < length_except_checksum;i++)
-    {
-        Checksum += *load_ptr++;
-    }
-    
-    Checksum = 0xFFFF - Checksum;
+struct TEDS_store_commit_struct
+{
+    uint32_t seq;
+    uint32_t whole_length;
+    uint32_t check;
+    uint32_t reserved;
+};
 
-    return Checksum;
-}
+#define TEDS_STORE_DATA_OFFSET  (sizeof(struct TEDS_store_header_struct) + TEDS_SLOT_MAX * 2 * sizeof(struct TEDS_store_commit_struct))
+#define TEDS_STORE_FILE_SIZE    (TEDS_STORE_DATA_OFFSET + TEDS_SLOT_SHARED_MAX * 2 * MAX_TEDS_IMAGE_SIZE + TC_MAX * 2 * TC_TEDS_SHADOW_SIZE)
 
-void TEDS_decode(uint8_t* TEDS_load);   /* TODO ，暂不实现 */
+/* 映射的起始地址，NULL 表示没有打开，影子用上面的静态缓存 */
+static uint8_t* TEDS_store_base;
 
-/*
-    带大小端区分的 memcpy，若 is_switch 为 真 则 src 大端转小端或者小端转大端 幅值给 dest，连续 size 的内存空间
-    用例：
-    memcpy_with_BitLittle_switch( (uint8_t*)(&(TEDS.M_TEDS.Length)), (uint8_t*)(&M_TEDS_Value.Length), sizeof(TEDS.M_TEDS.Length), LITTLE_BIG_END);  数据拷贝，根据大小端选择是否要转换
-    memcpy_with_BitLittle_switch( (uint8_t*)(&(TEDS.UTN_TEDS.Length)), (uint8_t*)(&UTN_TEDS_Value.Length), sizeof(TEDS.UTN_TEDS.Length), LITTLE_BIG_END);
-*/
-void memcpy_with_BitLittle_switch(uint8_t* dest, uint8_t* src, uint32_t size, uint8_t is_switch)
+static uint8_t* TEDS_store_bank(int8_t slot, uint8_t index)
 {
-    if(is_switch)
-    {
-        Big_Little_End_Switch(dest, src, size);
-    }else
+    uint32_t offset = TEDS_STORE_DATA_OFFSET;
+
+    if(slot < TEDS_SLOT_SHARED_MAX)
     {
-        memcpy(dest, src, size);
+        offset += (slot * 2 + index) * MAX_TEDS_IMAGE_SIZE;
+    }else{
+        offset += TEDS_SLOT_SHARED_MAX * 2 * MAX_TEDS_IMAGE_SIZE + ((slot - TEDS_SLOT_SHARED_MAX) * 2 + index) * TC_TEDS_SHADOW_SIZE;
     }
+    return TEDS_store_base + offset;
 }
 
-/* 大端 小端 转换，src 如果是大端，出来 dest 为小端，否则反之，
-    总之就是 src 数组 倒过来给 dest */
-void Big_Little_End_Switch(uint8_t* dest, uint8_t* src, uint32_t size)
+static struct TEDS_store_commit_struct* TEDS_store_commit_of(int8_t slot, uint8_t index)
 {
-    uint32_t i = 0;
-    for(i = 0;i < size;i++)
-    {
-        *dest++ = *(src + size - 1 - i);
-    }
+    return (struct TEDS_store_commit_struct*)(TEDS_store_base + sizeof(struct TEDS_store_header_struct)) + slot * 2 + index;
 }
 
+static uint32_t TEDS_store_check(uint32_t seq, uint32_t whole_length)
+{
+    return seq ^ whole_length ^ TEDS_STORE_MAGIC;
+}
 
-                                    /*************\
-************************************* Message 部分 *****************************************************
-                                    \*************/
+/* 同步落盘，msync 要求起始地址按页对齐 */
+static uint8_t TEDS_store_sync(const void* addr, uint32_t length)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
 
-struct MES_struct MES;
+    return msync((void*)start, (uintptr_t)addr + length - start, MS_SYNC) == 0;
+}
 
-/* 给 Message_u 和 ReplyMessage_u 填充默认值  */
-union Message_union Message_u = 
+/* 要往这块写之前先把它的提交头作废并落盘，写到一半断电重启后不会挑到它；落盘失败返回 0，这块不能写 */
+static uint8_t TEDS_store_begin(int8_t slot, uint8_t index)
 {
-    .Message.Dest_TIM_and_TC_Num[TIM_enum] = TIM_3,
-    .Message.Dest_TIM_and_TC_Num[TC_enum] = TC_12,
+    struct TEDS_store_commit_struct* commit = TEDS_store_commit_of(slot, index);
 
-    .Message.Command_class = CommonCmd,
-    .Message.Command_function = Query_TEDS,
-    .Message.dependent_Length = 1,
+    if(commit->seq != 0)
+    {
+        memset(commit, 0, sizeof(*commit));
+        return TEDS_store_sync(commit, sizeof(*commit));
+    }
 
-    .Message.dependent_load[0] = PHY_TEDS_ACCESS_CODE,
-};
+    return 1;
+}
 
-union ReplyMessage_union ReplyMessage_u = 
+/* 提交：数据先落盘，再写提交头（序号比另一块大）并落盘，两次 msync 之间断电这块还是作废的；
+    任何一次落盘失败返回 0，调用者不发布，数据没落盘的话提交头也不写 */
+static uint8_t TEDS_store_commit(int8_t slot, uint8_t index, uint32_t whole_length)
 {
-    .ReplyMessage.Flag = 0,
-    .ReplyMessage.dependent_Length = 1,
-    .ReplyMessage.dependent_load[0] = 0xAA,
-};
+    struct TEDS_store_commit_struct* commit = TEDS_store_commit_of(slot, index);
+    uint32_t seq = TEDS_store_commit_of(slot, !index)->seq + 1;
 
-/**************************** Message init，用户使用 ****************************/
-void Message_init(void)
-{
-    MES.Message_u = &Message_u;
-    MES.ReplyMessage_u = &ReplyMessage_u;
+    if(!TEDS_store_sync(TEDS_store_bank(slot, index), whole_length))
+    {
+        return 0;
+    }
+
+    commit->whole_length = whole_length;
+    commit->check = TEDS_store_check(seq, whole_length);
+    commit->seq = seq;
 
-    /* MES 的 Message_load_Length 和 ReplyMessage_load_Length 根据不同的情景在打包发送数据的时候再填 */
+    return TEDS_store_sync(commit, sizeof(*commit));
 }
 
-/**************************** 根据不同命令 填充 Message 结构体 的 API，用户使用 ****************************/
-/* 打包好的消息数据在 MES.Message_u->Message_load 里面，有效数据长度为 MES.Message_load_Length */
+#endif
 
-/* 发送 Message API，CommonCmd 的 Query_TEDS 命令*/
-void Message_CommonCmd_Query_TEDS_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS)
-{
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = CommonCmd;
-    MES.Message_u->Message.Command_function = Query_TEDS;
-    MES.Message_u->Message.dependent_Length = 1;    /* 本命令的附带参数固定长度 */
-    
-    MES.Message_u->Message.dependent_load[0] = which_TEDS;
+/* 读者引用的不是影子缓存（TEDS_init 的静态 TEDS、生成的只读镜像或用户挂的）时用这个，写者不会改那些内存 */
+static uint32_t TEDS_readers_dummy;
 
-    /* 固定信息长度 + 附带参数长度 */
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
-}
+struct TC_TEDS_entry_struct TC_TEDS_table[TC_MAX];
 
-void Message_CommonCmd_Read_TEDS_segment_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset)
+/* TC 为具体通道时 TC TEDS 用通道自己的槽，TC_MAX 或别的 TEDS 用共用的槽 */
+static int8_t TEDS_slot_of(uint8_t access_code, uint8_t TC)
 {
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = CommonCmd;
-    MES.Message_u->Message.Command_function = Read_TEDS_segment;
-    MES.Message_u->Message.dependent_Length = 5;
-    
-    MES.Message_u->Message.dependent_load[0] = which_TEDS;
-    memcpy(&(MES.Message_u->Message.dependent_load[1]), &TEDSOffset, sizeof(TEDSOffset));
-
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
+    switch (access_code)
+    {
+        case M_TEDS_ACCESS_CODE:    return 0;
+        case TC_TEDS_ACCESS_CODE:   return TC < TC_MAX ? TEDS_SLOT_SHARED_MAX + TC : 1;
+        case UTN_TEDS_ACCESS_CODE:  return 2;
+        case PHY_TEDS_ACCESS_CODE:  return 3;
+        default:                    return -1;
+    }
 }
 
-void Message_XdcrIdle_Set_Data_Transmission_mode_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC,enum Data_Transmission_mode_enum mode)
+static uint8_t* TEDS_shadow_ram_buffer(int8_t slot, uint8_t index)
 {
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = XdcrIdle;
-    MES.Message_u->Message.Command_function = Data_Transmission_mode;
-    MES.Message_u->Message.dependent_Length = 1;
-    
-    MES.Message_u->Message.dependent_load[0] = mode;
-
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
+    return slot < TEDS_SLOT_SHARED_MAX ? TEDS_shadow_load[slot][index] : TC_TEDS_shadow_load[slot - TEDS_SLOT_SHARED_MAX][index];
 }
 
-void Message_XdcrOperate_Read_TC_data_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset)
+/* 影子缓存：打开了持久存储就是映射里的块，没打开就是上面的静态缓存 */
+static uint8_t* TEDS_shadow_buffer(int8_t slot, uint8_t index)
 {
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = XdcrOperate;
-    MES.Message_u->Message.Command_function = Read_TransducerChannel_data_set_segment;
-    MES.Message_u->Message.dependent_Length = 4;
-    
-    memcpy(&(MES.Message_u->Message.dependent_load[0]), &Offset, sizeof(Offset));
-
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
+#if TEDS_STORE_USE_MMAP
+    if(TEDS_store_base != NULL)
+    {
+        return TEDS_store_bank(slot, index);
+    }
+#endif
+    return TEDS_shadow_ram_buffer(slot, index);
 }
 
-void Message_XdcrOperate_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC)
+/* 当前打开的影子 */
+static uint8_t* TEDS_shadow_current(int8_t slot)
 {
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = XdcrOperate;
-    MES.Message_u->Message.Command_function = Trigger_command;
-    MES.Message_u->Message.dependent_Length = 0;
-    
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
-}
+    struct TEDS_shadow_struct* shadow = &TEDS_shadow[slot];
 
-void Message_XdcrOperate_Abort_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC)
-{
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
-    MES.Message_u->Message.Command_class = XdcrOperate;
-    MES.Message_u->Message.Command_function = Abort_Trigger;
-    MES.Message_u->Message.dependent_Length = 0;
-    
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
+    return shadow->ram ? TEDS_shadow_ram_buffer(slot, shadow->index) : TEDS_shadow_buffer(slot, shadow->index);
 }
 
-void Message_TIM_initiated_pack_up(void)
+static uint32_t TEDS_shadow_size(int8_t slot)
 {
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] = Self_TIM; /* 我是谁 */
-    MES.Message_u->Message.Dest_TIM_and_TC_Num[TC_enum] = TC_MAX; /* 表示 ALL */
-    MES.Message_u->Message.Command_class = XdcrIdle;
-    MES.Message_u->Message.Command_function = TIM_ALL_TC_initiated;
-    MES.Message_u->Message.dependent_Length = 0;
-    
-    MES.Message_load_Length = 6 + MES.Message_u->Message.dependent_Length;
+    return slot < TEDS_SLOT_SHARED_MAX ? MAX_TEDS_IMAGE_SIZE : TC_TEDS_SHADOW_SIZE;
 }
 
-/* 剩余其他 Message 在这里 挨个实现 ... 相当繁琐了 */
-
-/**************************** 消息的 发送，用户使用 ****************************/
-/* 发送 Message，一般是 NCAP 用 */
-void Message_pack_up_And_send(void)
+/* 当前发布的镜像，acquire 读指针；通道没有自己的 TC TEDS 时就是共用的那个 */
+static uint8_t* TEDS_live_load(int8_t slot)
 {
-    /* 进行发送 */
-    /*
-        目标 TIM 的 IP 地址：   TIM_IP[ MES.Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] ][0 ~ 3]; 
-        调用 Message_xxx_pack_up() 即 填充 MES 结构体：
-            待发送数组：        MES.Message_u->Message_load
-            有效数据长度为：    MES.Message_load_Length
-        然后在 这里 发送数据。
-    */
-
-   mes_1451_send(MES.Message_u->Message_load, MES.Message_load_Length);
+    union Meta_TEDS_union* M_u = NULL;
+    union TransducerChannel_TEDS_union* TC_u = NULL;
+    union User_Transducer_Name_TEDS_union* UTN_u = NULL;
+    union PHY_TEDS_union* PHY_u = NULL;
+    uint8_t* load = NULL;
 
+    switch (slot)
+    {
+        case 0: M_u = __atomic_load_n(&TEDS.M_TEDS_u, __ATOMIC_ACQUIRE);        return M_u == NULL ? NULL : M_u->TEDS_load;
+        case 1: TC_u = __atomic_load_n(&TEDS.TC_TEDS_u, __ATOMIC_ACQUIRE);      return TC_u == NULL ? NULL : TC_u->TEDS_load;
+        case 2: UTN_u = __atomic_load_n(&TEDS.UTN_TEDS_u, __ATOMIC_ACQUIRE);    return UTN_u == NULL ? NULL : UTN_u->TEDS_load;
+        case 3: PHY_u = __atomic_load_n(&TEDS.PHY_TEDS_u, __ATOMIC_ACQUIRE);    return PHY_u == NULL ? NULL : PHY_u->TEDS_load;
+        default: break;
+    }
+    if(slot >= TEDS_SLOT_SHARED_MAX && slot < TEDS_SLOT_MAX)
+    {
+        load = __atomic_load_n(&TC_TEDS_table[slot - TEDS_SLOT_SHARED_MAX].load, __ATOMIC_ACQUIRE);
+        return load != NULL ? load : TEDS_live_load(1);
+    }
+    return NULL;
 }
 
-/* 临时用到 */
-struct Message_struct Message_temp = { 0 };
-struct ReplyMessage_struct ReplyMessage_temp = { 0 };
-
-/**************************** 解析接收到的 Message 的 API ****************************/
-/* 接收 信息 字节数组 received_mes_load 并 解析 然后 将 结果放在 messageReceived 地址的结构体里 */
-void Message_decode(struct Message_struct* messageReceived,uint8_t* received_mes_load)
+/* 发布新镜像，release 写指针，之后读者看到的都是写完的内容；
+    TEDS.xxx_load_Length 和通道表里的长度、Checksum 是给用户和摘要看的，库里读内容都从镜像自己的 Length 取，不会和指针对不上；
+    通道的 load 为 NULL 表示回到共用的 TC TEDS */
+static void TEDS_live_publish(int8_t slot, uint8_t* load, uint32_t whole_length)
 {
-    uint16_t i = 0;
-
-    memset(messageReceived, 0, sizeof(struct Message_struct));
-    
-    messageReceived->Dest_TIM_and_TC_Num[TIM_enum] = received_mes_load[0];
-    messageReceived->Dest_TIM_and_TC_Num[TC_enum] = received_mes_load[1];
-
-    messageReceived->Command_class = received_mes_load[2];
-    messageReceived->Command_function = received_mes_load[3];
-
-    /* 这一步填充 dependent_Length */
-    /* 根据 NEED_SWITCH_LITTLE_BIG_END 来判断本平台与 发送数据的 平台的 大小端是否一致，若一致则进行大小端转换，否则不转换 */
-    memcpy_with_BitLittle_switch((uint8_t*)(&(messageReceived->dependent_Length)),   \
-            (uint8_t*)(&(received_mes_load[4])), sizeof((messageReceived->dependent_Length)), NEED_SWITCH_LITTLE_BIG_END);
-    
-    /* 长度限幅 */
-    messageReceived->dependent_Length = messageReceived->dependent_Length > MAX_Message_dependent_SIZE ? \
-        messageReceived->dependent_Length = MAX_Message_dependent_SIZE : messageReceived->dependent_Length;
+    struct TC_TEDS_entry_struct* entry = NULL;
 
-    for(i = 0;i < messageReceived->dependent_Length;i++)
+    /* 联合体是 1 字节对齐的，指针直接指过去，后面按 TEDS_load 逐字节用 */
+    switch (slot)
     {
-        messageReceived->dependent_load[i] = received_mes_load[6 + i];
+        case 0: __atomic_store_n(&TEDS.M_TEDS_u, (union Meta_TEDS_union*)load, __ATOMIC_RELEASE);
+                TEDS.M_TEDS_load_Length = whole_length;     break;
+        case 1: __atomic_store_n(&TEDS.TC_TEDS_u, (union TransducerChannel_TEDS_union*)load, __ATOMIC_RELEASE);
+                TEDS.TC_TEDS_load_Length = whole_length;    break;
+        case 2: __atomic_store_n(&TEDS.UTN_TEDS_u, (union User_Transducer_Name_TEDS_union*)load, __ATOMIC_RELEASE);
+                TEDS.UTN_TEDS_load_Length = whole_length;   break;
+        case 3: __atomic_store_n(&TEDS.PHY_TEDS_u, (union PHY_TEDS_union*)load, __ATOMIC_RELEASE);
+                TEDS.PHY_TEDS_load_Length = whole_length;   break;
+        default: break;
+    }
+    if(slot >= TEDS_SLOT_SHARED_MAX && slot < TEDS_SLOT_MAX)
+    {
+        entry = &TC_TEDS_table[slot - TEDS_SLOT_SHARED_MAX];
+        entry->whole_length = load == NULL ? 0 : whole_length;
+        entry->Checksum = 0;
+        if(load != NULL)
+        {
+            memcpy(&entry->Checksum, &load[whole_length - 2], sizeof(entry->Checksum));
+        }
+        __atomic_store_n(&entry->load, load, __ATOMIC_RELEASE);
     }
-}
 
-/**************************** 根据相应 Message 填充 ReplyMessage 结构体 并打包数据的 API， 的 API ****************************/
-/* 打包好后的回复消息数据在 MES.ReplyMessage_u->ReplyMessage_load 里面，有效数据长度为 MES.ReplyMessage_load_Length */
+    /* 换完指针再加代数：看到新代数的一定看得到新镜像，回复缓存最多多编一次，不会把旧的当新的存 */
+    __atomic_add_fetch(&TEDS_generation, 1, __ATOMIC_RELEASE);
+}
 
-void ReplyMessage_CommonCmd_Query_TEDS_pack_up(uint8_t which_TEDS)
+/* 镜像的总长度（含 4 byte 的 Length 和 2 byte 的 Checksum），从镜像头部的 Length 算，不合法返回 0 */
+static uint32_t TEDS_image_length(const uint8_t* load)
 {
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 12;
-    
-    switch (which_TEDS)
-    {
-        case M_TEDS_ACCESS_CODE:
-            
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[0] = *((uint8_t*)(TEDS.M_TEDS_attr));
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[1] = *((uint8_t*)(TEDS.M_TEDS_status));
+    uint32_t Length = 0;
 
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[2]),&TEDS.M_TEDS_load_Length,sizeof(TEDS.M_TEDS_load_Length));
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[6]),&TEDS.M_TEDS_u->M_TEDS.Checksum,sizeof(TEDS.M_TEDS_u->M_TEDS.Checksum));
+    memcpy(&Length, load, sizeof(Length));
 
-            break;
+    return (Length < 2 || Length > MAX_TEDS_IMAGE_SIZE - 4) ? 0 : Length + 4;
+}
 
-        case TC_TEDS_ACCESS_CODE:
+/* 按 access code 和通道找到对应 TEDS 的整个数组和总长度，没有返回 NULL；只看一眼的用，要读内容的用下面的 acquire */
+static uint8_t* TEDS_image_get(uint8_t access_code, uint8_t TC, uint32_t* whole_length)
+{
+    uint8_t* load = TEDS_live_load(TEDS_slot_of(access_code, TC));
 
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[0] = *((uint8_t*)(TEDS.TC_TEDS_attr));
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[1] = *((uint8_t*)(TEDS.TC_TEDS_status));
+    if(load == NULL || (*whole_length = TEDS_image_length(load)) < 6)
+    {
+        return NULL;
+    }
 
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[2]),&TEDS.TC_TEDS_load_Length,sizeof(TEDS.TC_TEDS_load_Length));
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[6]),&TEDS.TC_TEDS_u->TC_TEDS.Checksum,sizeof(TEDS.TC_TEDS_u->TC_TEDS.Checksum));
-            
-            break;
-            
-        case UTN_TEDS_ACCESS_CODE:
+    return load;
+}
 
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[0] = *((uint8_t*)(TEDS.UTN_TEDS_attr));
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[1] = *((uint8_t*)(TEDS.UTN_TEDS_status));
+/* 镜像在哪个影子缓存里就用哪个的 readers，通道用的共用 TC TEDS 也可能在槽 1 的影子里；
+    映射里的块和静态缓存下标一样的共用一个 readers，写者只会多等，不会少等 */
+static uint32_t* TEDS_readers_of(int8_t slot, const uint8_t* load)
+{
+    uint8_t i = 0;
 
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[2]),&TEDS.UTN_TEDS_load_Length,sizeof(TEDS.UTN_TEDS_load_Length));
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[6]),&TEDS.UTN_TEDS_u->UTN_TEDS.Checksum,sizeof(TEDS.UTN_TEDS_u->UTN_TEDS.Checksum));
-            
-            break;
+    for(i = 0; i < 2; i++)
+    {
+        if(load == TEDS_shadow_buffer(slot, i) || load == TEDS_shadow_ram_buffer(slot, i))
+        {
+            return &TEDS_shadow[slot].readers[i];
+        }
+        if(slot >= TEDS_SLOT_SHARED_MAX && (load == TEDS_shadow_buffer(1, i) || load == TEDS_shadow_ram_buffer(1, i)))
+        {
+            return &TEDS_shadow[1].readers[i];
+        }
+    }
+    return &TEDS_readers_dummy;
+}
 
-        case PHY_TEDS_ACCESS_CODE:
+/* 读者用：拿当前镜像并挂一个引用，用完 TEDS_image_release()；
+    先加引用再确认指针没变，变了就退掉重来，这样写者看到 readers 为 0 后就不会再有读者进来 */
+static uint8_t* TEDS_image_acquire(uint8_t access_code, uint8_t TC, uint32_t* whole_length, uint32_t** ref)
+{
+    int8_t slot = TEDS_slot_of(access_code, TC);
+    uint8_t* load = NULL;
+    uint32_t* readers = NULL;
 
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[0] = *((uint8_t*)(TEDS.PHY_TEDS_attr));
-            MES.ReplyMessage_u->ReplyMessage.dependent_load[1] = *((uint8_t*)(TEDS.PHY_TEDS_status));
+    while(1)
+    {
+        load = TEDS_image_get(access_code, TC, whole_length);
+        if(load == NULL)
+        {
+            return NULL;
+        }
 
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[2]),&TEDS.PHY_TEDS_load_Length,sizeof(TEDS.PHY_TEDS_load_Length));
-            memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[6]),&TEDS.PHY_TEDS_u->PHY_TEDS.Checksum,sizeof(TEDS.PHY_TEDS_u->PHY_TEDS.Checksum));
+        readers = TEDS_readers_of(slot, load);
 
-            break;
-        default:
-            break;
+        __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+        if(TEDS_live_load(slot) == load)
+        {
+            *ref = readers;
+            return load;
+        }
+        __atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
     }
-
-    /* 最后四个字节为 max_TEDS_size */
-    temp_load_valid_length = (uint32_t)MAX_TEDS_LOAD_SIZE;
-    memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[8]),&temp_load_valid_length, 4);
-
-    /* 回复消息附带参数的长度 + Flag、dependent_Length 的变量长度 */
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
 }
 
-void ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(uint8_t which_TEDS, uint32_t TEDSOffset)
+static void TEDS_image_release(uint32_t* ref)
 {
-    /* 经过下面的函数，一个 完整 TEDS 数据存在 temp_load 中，TEDS 有效长度为 temp_load_valid_length */
-    TEDS_pack_up(temp_load, &temp_load_valid_length, which_TEDS);
-
-    /* 填充 回复命令 结构体 */
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = (uint16_t)temp_load_valid_length + 5; /* TEDS 长度 +  which_TEDS 和 TEDSOffset */
-   
-    MES.ReplyMessage_u->ReplyMessage.dependent_load[0] = which_TEDS;
-    memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[1]), &TEDSOffset, sizeof(TEDSOffset));
-    /* 拷贝 TEDS 数据 到 回复命令的 附带参数中 */
-    memcpy(&(MES.ReplyMessage_u->ReplyMessage.dependent_load[5]), &temp_load, temp_load_valid_length);
-
-    /* 回复消息附带参数的长度 + Flag、dependent_Length 的变量长度 */
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+    if(ref != NULL)
+    {
+        __atomic_sub_fetch(ref, 1, __ATOMIC_RELEASE);
+    }
 }
 
-void ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up(void)
+/* 写者用：打开影子，把当前镜像拷进去，之后在影子上改；
+    通道还没有自己的 TC TEDS 时拷的是共用的那个，Update 后通道就有自己的了；
+    deferred 为 1 时打开了持久存储也用静态缓存，发布时不落盘，TEDS_store_flush() 再存 */
+static uint8_t TEDS_shadow_open(int8_t slot, uint8_t deferred)
 {
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+    struct TEDS_shadow_struct* shadow = &TEDS_shadow[slot];
+    uint8_t* live = TEDS_live_load(slot);
+    uint32_t whole_length = 0;
 
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
-}
+    if(shadow->open)
+    {
+        return 1;
+    }
+    if(live == NULL || (whole_length = TEDS_image_length(live)) == 0 || whole_length > TEDS_shadow_size(slot))
+    {
+        return 0;
+    }
 
-/* 使用静态内存，而不是动态申请，为 1s 的数据开静态内存太大，所以这里暂不实现 */
+    /* 用不是当前发布的那块，还有回复在从它发（一般不会）就这次不写，返回失败让对方重试，不在这里死等 */
+    shadow->ram = 1;
+    shadow->index = live == TEDS_shadow_ram_buffer(slot, 0) || live == TEDS_shadow_buffer(slot, 0) ? 1 : 0;
+#if TEDS_STORE_USE_MMAP
+    if(TEDS_store_base != NULL && !deferred)
+    {
+        /* 发布的不在映射里（比如还没存的 TEDS_update_field()）就用序号小的那块，序号大的留着 */
+        shadow->ram = 0;
+        if(live == TEDS_store_bank(slot, 0) || live == TEDS_store_bank(slot, 1))
+        {
+            shadow->index = live == TEDS_store_bank(slot, 0) ? 1 : 0;
+        }else{
+            shadow->index = TEDS_store_commit_of(slot, 0)->seq <= TEDS_store_commit_of(slot, 1)->seq ? 0 : 1;
+        }
+    }
+#else
+    (void)deferred;
+#endif
+    if(__atomic_load_n(&shadow->readers[shadow->index], __ATOMIC_SEQ_CST) != 0)
+    {
+        return 0;
+    }
 
-void ReplyMessage_XdcrOperate_Read_TC_data_pack_up(void)
-{
-    MES.ReplyMessage_u->ReplyMessage.Flag = 0;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+#if TEDS_STORE_USE_MMAP
+    if(!shadow->ram && !TEDS_store_begin(slot, shadow->index))
+    {
+        return 0;
+    }
+#endif
+    memcpy(TEDS_shadow_current(slot), live, whole_length);
+    shadow->covered = 0;
+    shadow->open = 1;
 
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+    return 1;
 }
 
-void ReplyMessage_XdcrOperate_Trigger_pack_up(void)
+static uint8_t TEDS_writer_lock(int8_t slot)
 {
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 0;
-
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+    return slot >= 0 && !__atomic_test_and_set(&TEDS_shadow[slot].busy, __ATOMIC_ACQUIRE);
 }
 
-void ReplyMessage_XdcrOperate_Abort_Trigger_pack_up(void)
+static void TEDS_writer_unlock(int8_t slot)
 {
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 0;
-
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+    __atomic_clear(&TEDS_shadow[slot].busy, __ATOMIC_RELEASE);
 }
 
-void ReplyMessage_TIM_initiated_pack_up(void)
+/* 影子检查通过、发布之前调：打开了持久存储时先提交进文件，落盘失败返回 0，不发布；
+    影子在静态缓存里的只记一下还没存，没打开持久存储什么也不做 */
+static uint8_t TEDS_shadow_commit(int8_t slot, uint32_t whole_length)
 {
-    MES.ReplyMessage_u->ReplyMessage.Flag = 1;
-    MES.ReplyMessage_u->ReplyMessage.dependent_Length = 0;
-
-    MES.ReplyMessage_load_Length = MES.ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+#if TEDS_STORE_USE_MMAP
+    if(TEDS_store_base != NULL)
+    {
+        if(TEDS_shadow[slot].ram)
+        {
+            TEDS_shadow[slot].dirty = 1;
+            return 1;
+        }
+        if(!TEDS_store_commit(slot, TEDS_shadow[slot].index, whole_length))
+        {
+            return 0;
+        }
+        TEDS_shadow[slot].dirty = 0;
+    }
+#else
+    (void)slot;
+    (void)whole_length;
+#endif
+    return 1;
 }
 
-/**************************** 回复消息的 发送 ****************************/
-    /* 发送 ReplyMessage，一般是 TIM 用 */
-uint8_t ReplyMessage_send(uint8_t class, uint8_t command)
-{
-    /* 这里我自己再定义，回复消息的 dependent 的尾部再添加两个字节，
-        标识回复消息所对应命令名校的 class 和 command （但是 MES.ReplyMessage_u->ReplyMessage.dependent_Length 就不再动了）*/
-    MES.ReplyMessage_u->ReplyMessage.dependent_load[MES.ReplyMessage_u->ReplyMessage.dependent_Length] = class;
-    MES.ReplyMessage_u->ReplyMessage.dependent_load[MES.ReplyMessage_u->ReplyMessage.dependent_Length + 1] = command;
-
-    /* 进行发送 */
-    /*
-        目标 NCAP 的 IP 地址：  NCAP_IP[0 ~ 3]
-        调用 ReplyMessage_xxx_pack_up() 即填充 MES 结构体
-            待发送数组：        MES.ReplyMessage_u->ReplyMessage_load
-            有效数据长度为：    MES.ReplyMessage_load_Length
-        然后在这里 发送数据。
-    */
+/* 
+    计算 TEDS 校验，
+    从 TED Length（最开头） 到 DATA BLOCK 的最后一个字节（本域类的上一个字节） 的加和，
+    再用 0xFFFF 减去该加和值。 
+*/
+uint16_t TEDS_calc_Checksum(uint8_t access_code)
+{
+    uint8_t* load_ptr = NULL;
+    uint32_t whole_length = 0;
 
-    mes_1451_send(MES.ReplyMessage_u->ReplyMessage_load, MES.ReplyMessage_load_Length);
+    load_ptr = TEDS_image_get(access_code, TC_MAX, &whole_length);
+    if(load_ptr == NULL)
+    {
+        return 0xFFFF;
+    }
 
+    return 0xFFFF - (uint16_t)TEDS_checksum_sum(load_ptr, whole_length - 2);
 }
 
-/**************************** 解析接收到的 回复消息 的 API ****************************/
-/* 填入接收到的回复消息字符串，接收回复消息解析，并讲结果存在 replyMessageReceived 结构体地址里 */
-void ReplyMessage_decode(struct ReplyMessage_struct* replyMessageReceived,uint8_t* received_rep_mes_load)
+/* 校验内核：字节加和，向量版本一次加 16 / 32 个字节，尾巴用标量补 */
+uint32_t TEDS_checksum_sum(const uint8_t* load, uint32_t length)
 {
-    uint16_t i = 0;
+    uint32_t sum = 0;
+    uint32_t i = 0;
 
-    memset(replyMessageReceived, 0, sizeof(struct ReplyMessage_struct));
+#if defined(__AVX2__)
+    /* sad_epu8 和 0 做差的绝对值之和，即每 8 个字节加到一个 64 位里 */
+    __m256i acc_256 = _mm256_setzero_si256();
+    __m128i acc_128;
 
-    replyMessageReceived->Flag = received_rep_mes_load[0];
-    
-    /* 根据 NEED_SWITCH_LITTLE_BIG_END 来判断本平台与 发送数据的 平台的 大小端是否一致，若一致则进行大小端转换，否则不转换 */
-    memcpy_with_BitLittle_switch((uint8_t*)(&(replyMessageReceived->dependent_Length)),   \
-            (uint8_t*)(&(received_rep_mes_load[1])), sizeof((replyMessageReceived->dependent_Length)), NEED_SWITCH_LITTLE_BIG_END);
-    
-    /* 长度限幅 */
-    replyMessageReceived->dependent_Length = replyMessageReceived->dependent_Length > MAX_Message_dependent_SIZE ? \
-        replyMessageReceived->dependent_Length = MAX_Message_dependent_SIZE : replyMessageReceived->dependent_Length;
+    for(; i + 32 <= length; i += 32)
+    {
+        acc_256 = _mm256_add_epi64(acc_256, 
+            _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(load + i)), _mm256_setzero_si256()));
+    }
+    acc_128 = _mm_add_epi64(_mm256_castsi256_si128(acc_256), _mm256_extracti128_si256(acc_256, 1));
+    acc_128 = _mm_add_epi64(acc_128, _mm_unpackhi_epi64(acc_128, acc_128));
+    sum = (uint32_t)_mm_cvtsi128_si32(acc_128);
+#elif defined(__SSE2__)
+    __m128i acc_128 = _mm_setzero_si128();
 
-    for(i = 0;i < replyMessageReceived->dependent_Length;i++)
+    for(; i + 16 <= length; i += 16)
     {
-        replyMessageReceived->dependent_load[i] = received_rep_mes_load[3 + i];
+        acc_128 = _mm_add_epi64(acc_128, 
+            _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(load + i)), _mm_setzero_si128()));
+    }
+    acc_128 = _mm_add_epi64(acc_128, _mm_unpackhi_epi64(acc_128, acc_128));
+    sum = (uint32_t)_mm_cvtsi128_si32(acc_128);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    /* 相邻字节两两加成 16 位，再两两累加到 32 位里 */
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint32x2_t acc_half;
+
+    for(; i + 16 <= length; i += 16)
+    {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(load + i)));
     }
+    acc_half = vadd_u32(vget_low_u32(acc), vget_high_u32(acc));
+    sum = vget_lane_u32(vpadd_u32(acc_half, acc_half), 0);
+#endif
+
+    for(; i < length; i++)
+    {
+        sum += load[i];
+    }
+
+    return sum;
 }
 
-/**************************** ReplyMessage 服务程序，自动解析 Message 并回复，用户使用  ****************************/
-/* 填入接收到的消息字符串，会根据已经实现的消息解码字符串和自动回应 */
-void ReplyMessage_Server(uint8_t* received_mes_load)
+/* Checksum = 0xFFFF - 加和，一段字节由 old 变 new，加和变 sum(new) - sum(old)，Checksum 反向变，都是模 0x10000 */
+uint16_t TEDS_checksum_update(uint16_t Checksum, const uint8_t* old_bytes, const uint8_t* new_bytes, uint32_t length)
+{
+    return (uint16_t)(Checksum + TEDS_checksum_sum(old_bytes, length) - TEDS_checksum_sum(new_bytes, length));
+}
+
+/* 以下几个写 TEDS 的函数都按槽操作，公开的 API 在后面包一层 */
+static uint8_t TEDS_update_field_slot(int8_t slot, uint32_t offset, const void* value, uint32_t length)
 {
-    Message_decode(&Message_temp,received_mes_load);
+    uint8_t* load_ptr = NULL;
+    uint32_t whole_length = 0;
+    uint16_t Checksum = 0;
+    uint8_t ok = 0;
 
-    switch (Message_temp.Command_class)
+    if(!TEDS_writer_lock(slot))
     {
-        case CommonCmd:
+        return 0;
+    }
+
+    /* Adaptive 的域改得勤，持久存储打开时也先不落盘，TEDS_store_flush() 一起存 */
+    if(!TEDS_shadow[slot].open && TEDS_shadow_open(slot, 1))
+    {
+        load_ptr = TEDS_shadow_current(slot);
+        whole_length = TEDS_image_length(load_ptr);
+
+        if(offset >= 4 && offset <= whole_length - 2 && length <= whole_length - 2 - offset)
         {
-            switch (Message_temp.Command_function)
+            memcpy(&Checksum, &load_ptr[whole_length - 2], sizeof(Checksum));
+            Checksum = TEDS_checksum_update(Checksum, &load_ptr[offset], (const uint8_t*)value, length);
+
+            memcpy(&load_ptr[offset], value, length);
+            memcpy(&load_ptr[whole_length - 2], &Checksum, sizeof(Checksum));
+
+            if(TEDS_shadow_commit(slot, whole_length))
             {
-                case Query_TEDS:
-ReplyMessage_CommonCmd_Query_TEDS_pack_up(Message_temp.dependent_load[0]);
-                    break;
-                case Read_TEDS_segment:
-ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(Message_temp.dependent_load[0], *((uint32_t*)(&Message_temp.dependent_load[1])));
-                    break;
-                default:
-                    break;
+                TEDS_live_publish(slot, load_ptr, whole_length);
+                ok = 1;
             }
-            break;
         }
-        case XdcrIdle:
+        TEDS_shadow[slot].open = 0;
+    }
+
+    TEDS_writer_unlock(slot);
+
+    return ok;
+}
+
+static uint8_t TEDS_bind_slot(int8_t slot, uint8_t access_code, const uint8_t* load, uint32_t whole_length)
+{
+    struct TEDS_decoded_struct decoded;
+
+    if(load != NULL && (whole_length > MAX_TEDS_IMAGE_SIZE 
+        || TEDS_decode(&decoded, load, whole_length) != TEDS_DECODE_OK
+        || decoded.access_code != access_code || decoded.whole_length != whole_length))
+    {
+        return 0;
+    }
+
+    if(!TEDS_writer_lock(slot))
+    {
+        return 0;
+    }
+    TEDS_shadow[slot].open = 0;
+    TEDS_shadow[slot].dirty = 0;    /* 挂的是用户的内存，不存，之前还没存的也不存了 */
+    TEDS_live_publish(slot, (uint8_t*)load, whole_length);     /* 库不会改发布出去的镜像，见 TEDS_update_field() */
+    TEDS_writer_unlock(slot);
+
+    return 1;
+}
+
+/* link_id 为写的连接，和打开影子的不是同一个（上一个 NCAP 写了一半断了）就先丢掉旧影子重新打开 */
+static uint8_t TEDS_write_segment_slot(int8_t slot, uint32_t link_id, uint32_t TEDSOffset, const uint8_t* data, uint32_t length)
+{
+    uint8_t ok = 0;
+
+    if(slot < 0 || TEDSOffset > TEDS_shadow_size(slot) || length > TEDS_shadow_size(slot) - TEDSOffset)
+    {
+        return 0;
+    }
+    if(!TEDS_writer_lock(slot))
+    {
+        return 0;
+    }
+
+    if(TEDS_shadow[slot].open && TEDS_shadow[slot].link_id != link_id)
+    {
+        TEDS_shadow[slot].open = 0;
+    }
+    if(TEDS_shadow_open(slot, 0))
+    {
+        TEDS_shadow[slot].link_id = link_id;
+        memcpy(&TEDS_shadow_current(slot)[TEDSOffset], data, length);
+        if(TEDSOffset <= TEDS_shadow[slot].covered && TEDSOffset + length > TEDS_shadow[slot].covered)
+        {
+            TEDS_shadow[slot].covered = TEDSOffset + length;
+        }
+        ok = 1;
+    }
+
+    TEDS_writer_unlock(slot);
+
+    return ok;
+}
+
+/* foreign 为 1 表示影子是 NCAP 按它的大小端写的，先整个转成本平台的再检查；
+    影子开头是从本平台的镜像拷的，NCAP 没写到的字节转一遍就错了（按字节加的 Checksum 还查不出来），
+    所以这时影子必须从 0 开始连续写满整个 TEDS，没写满的丢掉 */
+static uint8_t TEDS_update_slot(int8_t slot, uint8_t access_code, uint8_t foreign)
+{
+    struct TEDS_decoded_struct decoded;
+    uint8_t* load_ptr = NULL;
+    uint32_t whole_length = 0;
+    uint8_t ok = 0;
+
+    if(!TEDS_writer_lock(slot))
+    {
+        return 0;
+    }
+
+    if(TEDS_shadow[slot].open)
+    {
+        load_ptr = TEDS_shadow_current(slot);
+        if(foreign)
         {
-            switch (Message_temp.Command_function)
+            memcpy(&whole_length, load_ptr, sizeof(whole_length));
+            whole_length = __builtin_bswap32(whole_length) + 4;
+            if(whole_length < 4 || whole_length > TEDS_shadow_size(slot) || TEDS_shadow[slot].covered < whole_length
+                || !TEDS_swap(load_ptr, whole_length))
             {
-                case Data_Transmission_mode:
-ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up();
-                    break;
-                case TIM_ALL_TC_initiated:
-ReplyMessage_TIM_initiated_pack_up();
-                    break;
-                
-                default:
-                    break;
+                whole_length = 0;
             }
-            break;
+        }else{
+            whole_length = TEDS_image_length(load_ptr);
         }
-        case XdcrOperate:
+
+        if(whole_length != 0 && whole_length <= TEDS_shadow_size(slot)
+            && TEDS_decode(&decoded, load_ptr, whole_length) == TEDS_DECODE_OK
+            && decoded.access_code == access_code && TEDS_shadow_commit(slot, whole_length))
+        {
+            TEDS_live_publish(slot, load_ptr, whole_length);
+            ok = 1;
+        }
+        TEDS_shadow[slot].open = 0;
+    }
+
+    TEDS_writer_unlock(slot);
+
+    return ok;
+}
+
+/* 丢掉写了一半的影子，当前镜像不变；别的线程正在写时返回 0 */
+static uint8_t TEDS_write_abort_slot(int8_t slot)
+{
+    if(!TEDS_writer_lock(slot))
+    {
+        return 0;
+    }
+    TEDS_shadow[slot].open = 0;
+    TEDS_writer_unlock(slot);
+
+    return 1;
+}
+
+/* 改 TEDS 里的一段值并增量更新 Checksum，在影子上改完再发布，正在发送的回复不受影响，Adaptive TEDS 高频改用这个；
+    offset 从 TEDS_load 开头算，不能碰到最开头的 Length 和最后的 Checksum，比如改 TC TEDS 的 UpdateT：
+        float UpdateT = 0.5f;
+        TEDS_update_field(TC_TEDS_ACCESS_CODE, offsetof(struct TransducerChannel_TEDS_struct, UpdateT.Value), &UpdateT, sizeof(UpdateT));
+    NCAP 正在写这个 TEDS（Write_TEDS_segment 了还没 Update_TEDS）或别的线程正在写时返回 0；
+    TC TEDS 改的是共用的那个，改某个通道自己的用 TC_TEDS_update_field() */
+uint8_t TEDS_update_field(uint8_t access_code, uint32_t offset, const void* value, uint32_t length)
+{
+    return TEDS_update_field_slot(TEDS_slot_of(access_code, TC_MAX), offset, value, length);
+}
+
+uint32_t TEDS_segment_size_limit = MAX_TC_data_segment_SIZE;
+
+/* TIM 用：挂变长 TEDS，先用 TEDS_decode() 检查一遍，access code 要和挂的位置一致 */
+uint8_t TEDS_image_bind(uint8_t access_code, const uint8_t* load, uint32_t whole_length)
+{
+    if(load == NULL)
+    {
+        return 0;
+    }
+    return TEDS_bind_slot(TEDS_slot_of(access_code, TC_MAX), access_code, load, whole_length);
+}
+
+/* 写 TEDS 段：写到影子里，第一次写时先把当前镜像拷进影子，
+    可以写到当前 TEDS 后面（TEDS 变长），但总长不超过 MAX_TEDS_IMAGE_SIZE，Length 和 Checksum 由写的一方填好 */
+uint8_t TEDS_write_segment(uint8_t access_code, uint32_t TEDSOffset, const uint8_t* data, uint32_t length)
+{
+    return TEDS_write_segment_slot(TEDS_slot_of(access_code, TC_MAX), 0, TEDSOffset, data, length);
+}
+
+/* 更新 TEDS：影子通过 TEDS_decode() 检查（Length、ID、Checksum）就发布，不通过则丢掉影子，当前镜像不变 */
+uint8_t TEDS_update(uint8_t access_code)
+{
+    return TEDS_update_slot(TEDS_slot_of(access_code, TC_MAX), access_code, 0);
+}
+
+/* 丢掉 TEDS_write_segment() / NCAP 的 Write_TEDS_segment 写了一半还没 Update 的影子，NCAP 写到一半断线时用 */
+uint8_t TEDS_write_abort(uint8_t access_code)
+{
+    int8_t slot = TEDS_slot_of(access_code, TC_MAX);
+
+    return slot >= 0 && TEDS_write_abort_slot(slot);
+}
+
+/* 通道自己的 TC TEDS，和上面的一样，只是换成 TC_TEDS_table[TC]；
+    TC_TEDS_bind() 的 load 为 NULL 时通道回到共用的 TC TEDS，没 bind 过的通道第一次写时从共用的拷一份来改 */
+uint8_t TC_TEDS_bind(uint8_t TC, const uint8_t* load, uint32_t whole_length)
+{
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    return TEDS_bind_slot(TEDS_slot_of(TC_TEDS_ACCESS_CODE, TC), TC_TEDS_ACCESS_CODE, load, whole_length);
+}
+
+uint8_t TC_TEDS_update_field(uint8_t TC, uint32_t offset, const void* value, uint32_t length)
+{
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    return TEDS_update_field_slot(TEDS_slot_of(TC_TEDS_ACCESS_CODE, TC), offset, value, length);
+}
+
+uint8_t TC_TEDS_write_segment(uint8_t TC, uint32_t TEDSOffset, const uint8_t* data, uint32_t length)
+{
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    return TEDS_write_segment_slot(TEDS_slot_of(TC_TEDS_ACCESS_CODE, TC), 0, TEDSOffset, data, length);
+}
+
+uint8_t TC_TEDS_update(uint8_t TC)
+{
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    return TEDS_update_slot(TEDS_slot_of(TC_TEDS_ACCESS_CODE, TC), TC_TEDS_ACCESS_CODE, 0);
+}
+
+uint8_t TC_TEDS_write_abort(uint8_t TC)
+{
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    return TEDS_write_abort_slot(TEDS_slot_of(TC_TEDS_ACCESS_CODE, TC));
+}
+
+#if TEDS_STORE_USE_MMAP
+/* TIM 用：打开持久存储，整个文件一次 mmap，之后影子就是映射里的块；
+    每个槽挑提交头合法、序号大的那块直接发布，提交时已经检查过，这里不再解析；
+    两块都没提交过的槽照旧用编译进来的 TEDS */
+uint8_t TEDS_store_open(const char* path)
+{
+    struct stat file_stat;
+    struct TEDS_store_header_struct* header = NULL;
+    struct TEDS_store_commit_struct* commit = NULL;
+    uint8_t* base = NULL;
+    int8_t slot = 0;
+    int8_t best = 0;
+    uint8_t i = 0;
+    int fd = -1;
+
+    if(TEDS_store_base != NULL)
+    {
+        return 0;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+    {
+        return 0;
+    }
+
+    /* 大小对不上的是别的配置（TC_MAX、影子大小）存的，清空重建 */
+    if(fstat(fd, &file_stat) != 0
+        || (file_stat.st_size != TEDS_STORE_FILE_SIZE && (ftruncate(fd, 0) != 0 || ftruncate(fd, TEDS_STORE_FILE_SIZE) != 0)))
+    {
+        close(fd);
+        return 0;
+    }
+
+    base = mmap(NULL, TEDS_STORE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);      /* 映射不依赖 fd */
+    if(base == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    header = (struct TEDS_store_header_struct*)base;
+    if(header->magic != TEDS_STORE_MAGIC || header->slot_count != TEDS_SLOT_MAX
+        || header->shared_size != MAX_TEDS_IMAGE_SIZE || header->TC_size != TC_TEDS_SHADOW_SIZE)
+    {
+        memset(base, 0, TEDS_STORE_DATA_OFFSET);
+        header->magic = TEDS_STORE_MAGIC;
+        header->slot_count = TEDS_SLOT_MAX;
+        header->shared_size = MAX_TEDS_IMAGE_SIZE;
+        header->TC_size = TC_TEDS_SHADOW_SIZE;
+        TEDS_store_sync(base, TEDS_STORE_DATA_OFFSET);
+    }
+
+    /* 换影子之前丢掉开着的，之前写了一半的不要了 */
+    for(slot = 0; slot < TEDS_SLOT_MAX; slot++)
+    {
+        TEDS_shadow[slot].open = 0;
+        TEDS_shadow[slot].dirty = 0;
+    }
+    TEDS_store_base = base;
+
+    for(slot = 0; slot < TEDS_SLOT_MAX; slot++)
+    {
+        best = -1;
+        for(i = 0; i < 2; i++)
         {
-            switch (Message_temp.Command_function)
+            commit = TEDS_store_commit_of(slot, i);
+            if(commit->seq != 0 && commit->check == TEDS_store_check(commit->seq, commit->whole_length)
+                && commit->whole_length <= TEDS_shadow_size(slot)
+                && TEDS_image_length(TEDS_store_bank(slot, i)) == commit->whole_length
+                && (best < 0 || commit->seq > TEDS_store_commit_of(slot, best)->seq))
             {
-                case Read_TransducerChannel_data_set_segment:
-ReplyMessage_XdcrOperate_Read_TC_data_pack_up();
-                    break;
-
-                case Trigger_command:
-ReplyMessage_XdcrOperate_Trigger_pack_up();
-                    break;
-                
-                case Abort_Trigger:
-ReplyMessage_XdcrOperate_Abort_Trigger_pack_up();
-                    break;
-
-                default:
-                    break;
+                best = i;
             }
-            break;
         }
-        case XdcrEither:
+
+        if(best >= 0 && TEDS_writer_lock(slot))
         {
-            break;
+            TEDS_live_publish(slot, TEDS_store_bank(slot, best), TEDS_store_commit_of(slot, best)->whole_length);
+            TEDS_writer_unlock(slot);
         }
-        case TIMsleep:
+    }
+
+    return 1;
+}
+
+/* 把 TEDS_update_field() 改了还没存的槽存进文件：当前镜像拷进映射里序号小的那块，提交后发布它；
+    正在被写的槽这次跳过；全部存好返回 1 */
+uint8_t TEDS_store_flush(void)
+{
+    int8_t slot = 0;
+    uint32_t whole_length = 0;
+    uint8_t ok = 1;
+
+    if(TEDS_store_base == NULL)
+    {
+        return 0;
+    }
+
+    for(slot = 0; slot < TEDS_SLOT_MAX; slot++)
+    {
+        if(!TEDS_shadow[slot].dirty)
         {
-            break;
+            continue;
         }
-        case TIMActive:
+        if(!TEDS_writer_lock(slot))
         {
-            break;
+            ok = 0;
+            continue;
+        }
+
+        if(!TEDS_shadow[slot].open && TEDS_shadow_open(slot, 0))
+        {
+            whole_length = TEDS_image_length(TEDS_shadow_current(slot));
+            if(TEDS_shadow_commit(slot, whole_length))
+            {
+                TEDS_live_publish(slot, TEDS_shadow_current(slot), whole_length);
+            }
+            TEDS_shadow[slot].open = 0;
         }
-        case AnyState:
+        ok &= !TEDS_shadow[slot].dirty;
+
+        TEDS_writer_unlock(slot);
+    }
+
+    return ok;
+}
+#endif
+
+/* 从 TEDS 里解析出来的值按 TEDS_generation 记下来：高 32 位为代数，低 32 位为值，
+    每发布一次镜像（或者 MES_reply_cache_invalidate()）代数变一次，之后第一次用时才重新解析，
+    不用每个 Read_TEDS_segment 回复、数据段回复都把整个 TEDS 连 Checksum 扫一遍；
+    代数要在解析之前取，解析当中换了镜像的话记下的是旧代数，下次还会重新解析 */
+static uint64_t TEDS_PHY_MaxSDU_memo;
+static uint64_t TEDS_TC_period_memo[TC_MAX];
+
+static uint8_t TEDS_memo_get(const uint64_t* memo, uint32_t generation, uint32_t* value)
+{
+    uint64_t memo_value = __atomic_load_n(memo, __ATOMIC_ACQUIRE);
+
+    if(memo_value == 0 || (uint32_t)(memo_value >> 32) != generation)
+    {
+        return 0;
+    }
+    *value = (uint32_t)memo_value;
+
+    return 1;
+}
+
+static void TEDS_memo_set(uint64_t* memo, uint32_t generation, uint32_t value)
+{
+    __atomic_store_n(memo, ((uint64_t)generation << 32) | value, __ATOMIC_RELEASE);
+}
+
+/* 当前 PHY TEDS 的 MaxSDU，没有或为 0 返回 0；TEDS 可能是挂的变长 TEDS，所以先解析再取 */
+static uint32_t TEDS_PHY_MaxSDU_decode(void)
+{
+    struct TEDS_decoded_struct decoded;
+    struct TEDS_TLV_view_struct tlv;
+    uint8_t* load_ptr = NULL;
+    uint32_t* ref = NULL;
+    uint32_t whole_length = 0;
+    uint16_t MaxSDU = 0;
+
+    load_ptr = TEDS_image_acquire(PHY_TEDS_ACCESS_CODE, TC_MAX, &whole_length, &ref);
+    if(load_ptr == NULL)
+    {
+        return 0;
+    }
+
+    if(TEDS_decode(&decoded, load_ptr, whole_length) == TEDS_DECODE_OK)
+    {
+        if(decoded.PHY_TEDS != NULL)
         {
-            break;
+            MaxSDU = decoded.PHY_TEDS->MaxSDU.Value;
+        }else if(TEDS_cursor_find(&decoded.cursor, 18, &tlv) && tlv.Length == sizeof(MaxSDU))
+        {
+            memcpy(&MaxSDU, tlv.Value, sizeof(MaxSDU));
+        }
+    }
+
+    TEDS_image_release(ref);
+
+    return MaxSDU;
+}
+
+static uint32_t TEDS_PHY_MaxSDU(void)
+{
+    uint32_t generation = __atomic_load_n(&TEDS_generation, __ATOMIC_ACQUIRE);
+    uint32_t MaxSDU = 0;
+
+    if(!TEDS_memo_get(&TEDS_PHY_MaxSDU_memo, generation, &MaxSDU))
+    {
+        MaxSDU = TEDS_PHY_MaxSDU_decode();
+        TEDS_memo_set(&TEDS_PHY_MaxSDU_memo, generation, MaxSDU);
+    }
+
+    return MaxSDU;
+}
+
+/* 通道当前 TC TEDS 的 UpdateT，没有则 SPeriod（秒），都没有返回 0 */
+static float TEDS_TC_period_s_decode(uint8_t TC)
+{
+    struct TEDS_decoded_struct decoded;
+    struct TEDS_TLV_view_struct tlv;
+    uint8_t* load_ptr = NULL;
+    uint32_t* ref = NULL;
+    uint32_t whole_length = 0;
+    float UpdateT = 0, SPeriod = 0;
+
+    load_ptr = TEDS_image_acquire(TC_TEDS_ACCESS_CODE, TC, &whole_length, &ref);
+    if(load_ptr == NULL)
+    {
+        return 0;
+    }
+
+    if(TEDS_decode(&decoded, load_ptr, whole_length) == TEDS_DECODE_OK && decoded.TC_TEDS != NULL)
+    {
+        UpdateT = decoded.TC_TEDS->UpdateT.Value;
+        SPeriod = decoded.TC_TEDS->SPeriod.Value;
+    }else if(decoded.cursor.load != NULL)
+    {
+        while(TEDS_cursor_next(&decoded.cursor, &tlv))
+        {
+            if(tlv.Type == 20 && tlv.Length == sizeof(UpdateT))
+            {
+                memcpy(&UpdateT, tlv.Value, sizeof(UpdateT));
+            }
+            if(tlv.Type == 23 && tlv.Length == sizeof(SPeriod))
+            {
+                memcpy(&SPeriod, tlv.Value, sizeof(SPeriod));
+            }
         }
-        default:
-            break;
     }
 
-    ReplyMessage_send(Message_temp.Command_class, Message_temp.Command_function);
+    TEDS_image_release(ref);
+
+    return UpdateT > 0 ? UpdateT : (SPeriod > 0 ? SPeriod : 0);
 }
 
+static float TEDS_TC_period_s(uint8_t TC)
+{
+    uint32_t generation = __atomic_load_n(&TEDS_generation, __ATOMIC_ACQUIRE);
+    uint32_t bits = 0;
+    float period_s = 0;
+
+    if(TC >= TC_MAX)
+    {
+        return TEDS_TC_period_s_decode(TC);
+    }
+    if(TEDS_memo_get(&TEDS_TC_period_memo[TC], generation, &bits))
+    {
+        memcpy(&period_s, &bits, sizeof(period_s));
+        return period_s;
+    }
+
+    period_s = TEDS_TC_period_s_decode(TC);
+    memcpy(&bits, &period_s, sizeof(bits));
+    TEDS_memo_set(&TEDS_TC_period_memo[TC], generation, bits);
+
+    return period_s;
+}
+
+/* 各 TEDS 结构体里 ID 之后的 TLV 头（Type, Length）依次排开，和 IEEE1451_5_lib.h 里的结构体一一对应 */
+static const uint8_t TEDS_M_layout[] = { 4,10, 10,4, 11,4, 12,4, 13,2 };
+static const uint8_t TEDS_TC_layout[] = 
+{
+    10,1, 11,1, 12,11, 13,4, 14,4, 15,4, 16,1, 17,1, 18,1, 19,1, 20,4, 21,4, 22,4, 23,4, 24,4, 25,4, 26,4, 
+    27,1, 28,4, 29,4, 30,4, 31,1, 32,1, 33,1, 34,1, 35,1, 36,1, 37,4, 38,8, 39,1,
+};
+static const uint8_t TEDS_UTN_layout[] = { 4,1, 5,25 };
+static const uint8_t TEDS_PHY_layout[] = { 10,1, 11,4, 12,2, 13,2, 14,2, 15,1, 16,2, 17,2, 18,2, 19,4, 20,4, 21,1, 22,1, 23,2, 24,2 };
+
+/* 从游标位置起 TLV 头的序列和 layout 完全一样、且正好到 Checksum 前结束返回 1 */
+static uint8_t TEDS_layout_match(const struct TEDS_cursor_struct* cursor, const uint8_t* layout, uint32_t layout_size)
+{
+    uint32_t pos = cursor->pos;
+    uint32_t i = 0;
+
+    for(i = 0; i + 1 < layout_size; i += 2)
+    {
+        if(pos + 2 > cursor->end || cursor->load[pos] != layout[i] || cursor->load[pos + 1] != layout[i + 1])
+        {
+            return 0;
+        }
+        pos += 2 + layout[i + 1];
+    }
+
+    return pos == cursor->end;
+}
+
+/* TEDS 解析，
+    先看 Length（4 byte）、再看 Checksum、再看第一个 TLV 是不是 TEDS ID（Type 3，Length 4），
+    都对了再看布局：总长度和对应结构体一样大、并且每个 TLV 的 Type 和 Length 都和结构体对得上，
+    才直接把接收缓存当成结构体用（结构体是 1 字节对齐的），否则只给游标；
+    TEDS_load 要是本平台的大小端，对方大小端不同时先用 TEDS_swap() 转好（TEDS_read_pipelined_ctx() 读回来就已经转了） */
+enum TEDS_decode_result_enum TEDS_decode(struct TEDS_decoded_struct* decoded, const uint8_t* TEDS_load, uint32_t received_length)
+{
+    uint32_t Length = 0;
+    uint32_t struct_size = 0;
+    const uint8_t* layout = NULL;
+    uint32_t layout_size = 0;
+    uint16_t Checksum = 0;
+
+    memset(decoded, 0, sizeof(struct TEDS_decoded_struct));
+
+    if(received_length < 4)
+    {
+        return TEDS_DECODE_INCOMPLETE;
+    }
+
+    memcpy(&Length, &TEDS_load[0], sizeof(Length));
+
+    /* 至少要有 TEDS ID（6 byte）和 Checksum（2 byte） */
+    if(Length < sizeof(struct TEDS_ID_struct) + 2 || Length > 0xFFFFFFFF - 4)
+    {
+        return TEDS_DECODE_BAD_LENGTH;
+    }
+    if(received_length < Length + 4)
+    {
+        return TEDS_DECODE_INCOMPLETE;
+    }
+    decoded->whole_length = Length + 4;
+
+    memcpy(&Checksum, &TEDS_load[decoded->whole_length - 2], sizeof(Checksum));
+    if((uint16_t)(0xFFFF - TEDS_checksum_sum(TEDS_load, decoded->whole_length - 2)) != Checksum)
+    {
+        return TEDS_DECODE_BAD_CHECKSUM;
+    }
+    decoded->Checksum = Checksum;
+
+    decoded->ID = (const struct TEDS_ID_struct*)(&TEDS_load[4]);
+    if(decoded->ID->Type != 3 || decoded->ID->Length != 4)
+    {
+        return TEDS_DECODE_BAD_ID;
+    }
+    decoded->access_code = decoded->ID->access_code;
+
+    switch (decoded->access_code)
+    {
+        case M_TEDS_ACCESS_CODE:
+            struct_size = sizeof(struct Meta_TEDS_struct);
+            layout = TEDS_M_layout;     layout_size = sizeof(TEDS_M_layout);
+            break;
+        case TC_TEDS_ACCESS_CODE:
+            struct_size = sizeof(struct TransducerChannel_TEDS_struct);
+            layout = TEDS_TC_layout;    layout_size = sizeof(TEDS_TC_layout);
+            break;
+        case UTN_TEDS_ACCESS_CODE:
+            struct_size = sizeof(struct User_Transducer_Name_TEDS_struct);
+            layout = TEDS_UTN_layout;   layout_size = sizeof(TEDS_UTN_layout);
+            break;
+        case PHY_TEDS_ACCESS_CODE:
+            struct_size = sizeof(struct PHY_TEDS_struct);
+            layout = TEDS_PHY_layout;   layout_size = sizeof(TEDS_PHY_layout);
+            break;
+        default:
+            return TEDS_DECODE_BAD_ID;
+    }
+
+    decoded->cursor.load = TEDS_load;
+    decoded->cursor.pos = 4 + sizeof(struct TEDS_ID_struct);
+    decoded->cursor.end = decoded->whole_length - 2;
+    decoded->cursor.Broken = 0;
+
+    /* 快速路径：只比总长度不够，长度一样但 TLV 排法不同的 TEDS 当成结构体读会读错域 */
+    if(decoded->whole_length == struct_size && TEDS_layout_match(&decoded->cursor, layout, layout_size))
+    {
+        switch (decoded->access_code)
+        {
+            case M_TEDS_ACCESS_CODE:    decoded->M_TEDS = (const struct Meta_TEDS_struct*)TEDS_load;                    break;
+            case TC_TEDS_ACCESS_CODE:   decoded->TC_TEDS = (const struct TransducerChannel_TEDS_struct*)TEDS_load;      break;
+            case UTN_TEDS_ACCESS_CODE:  decoded->UTN_TEDS = (const struct User_Transducer_Name_TEDS_struct*)TEDS_load;  break;
+            case PHY_TEDS_ACCESS_CODE:  decoded->PHY_TEDS = (const struct PHY_TEDS_struct*)TEDS_load;                   break;
+            default:
+                break;
+        }
+    }
+
+    return TEDS_DECODE_OK;
+}
+
+/* 取下一个 TLV */
+uint8_t TEDS_cursor_next(struct TEDS_cursor_struct* cursor, struct TEDS_TLV_view_struct* tlv)
+{
+    if(cursor->Broken || cursor->pos + 2 > cursor->end)
+    {
+        return 0;
+    }
+
+    tlv->Type = cursor->load[cursor->pos];
+    tlv->Length = cursor->load[cursor->pos + 1];
+    tlv->Value = &cursor->load[cursor->pos + 2];
+
+    if(cursor->pos + 2 + tlv->Length > cursor->end)
+    {
+        cursor->Broken = 1;
+        return 0;
+    }
+
+    cursor->pos += 2 + tlv->Length;
+
+    return 1;
+}
+
+/* 往后找指定 Type 的 TLV，跳过其他的 */
+uint8_t TEDS_cursor_find(struct TEDS_cursor_struct* cursor, uint8_t Type, struct TEDS_TLV_view_struct* tlv)
+{
+    while(TEDS_cursor_next(cursor, tlv))
+    {
+        if(tlv->Type == Type)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    带大小端区分的 memcpy，若 is_switch 为 真 则 src 大端转小端或者小端转大端 幅值给 dest，连续 size 的内存空间
+    用例：
+    memcpy_with_BitLittle_switch( (uint8_t*)(&(TEDS.M_TEDS.Length)), (uint8_t*)(&M_TEDS_Value.Length), sizeof(TEDS.M_TEDS.Length), LITTLE_BIG_END);  数据拷贝，根据大小端选择是否要转换
+    memcpy_with_BitLittle_switch( (uint8_t*)(&(TEDS.UTN_TEDS.Length)), (uint8_t*)(&UTN_TEDS_Value.Length), sizeof(TEDS.UTN_TEDS.Length), LITTLE_BIG_END);
+*/
+void memcpy_with_BitLittle_switch(uint8_t* dest, uint8_t* src, uint32_t size, uint8_t is_switch)
+{
+    if(is_switch)
+    {
+        Big_Little_End_Switch(dest, src, size);
+    }else
+    {
+        memcpy(dest, src, size);
+    }
+}
+
+/* 大端 小端 转换，src 如果是大端，出来 dest 为小端，否则反之，
+    总之就是 src 数组倒过来给 dest；2、4、8 字节的用 bswap 内建 */
+void Big_Little_End_Switch(uint8_t* dest, uint8_t* src, uint32_t size)
+{
+    uint32_t i = 0;
+    uint16_t v16 = 0;
+    uint32_t v32 = 0;
+    uint64_t v64 = 0;
+
+    switch(size)
+    {
+        case 2: memcpy(&v16, src, 2); v16 = __builtin_bswap16(v16); memcpy(dest, &v16, 2); return;
+        case 4: memcpy(&v32, src, 4); v32 = __builtin_bswap32(v32); memcpy(dest, &v32, 4); return;
+        case 8: memcpy(&v64, src, 8); v64 = __builtin_bswap64(v64); memcpy(dest, &v64, 8); return;
+        default: break;
+    }
+
+    for(i = 0;i < size;i++)
+    {
+        *dest++ = *(src + size - 1 - i);
+    }
+}
+
+
+                                    /*************\
+************************************* Message 部分 *****************************************************
+                                    \*************/
+
+/* 默认 ctx，原来的全局 API 都落在这里 */
+struct MES_ctx_struct MES_ctx_default;
+
+/* 原来的全局变量，默认 ctx 的 Mes、Message_rx、ReplyMessage_rx、Scratch_load 指向它们 */
+struct MES_struct MES;
+struct Message_struct Message_temp = { 0 };
+struct ReplyMessage_struct ReplyMessage_temp = { 0 };
+uint8_t temp_load[MAX_TEDS_LOAD_SIZE];
+uint32_t temp_load_valid_length = 0;
+
+/**************************** Message init，用户使用 ****************************/
+void Message_init(void)
+{
+    uint8_t i = 0;
+
+    /* 默认 ctx 用全局的 mes_1451_send 发送 */
+    MES_ctx_init(&MES_ctx_default, NULL, NULL);
+
+    for(i = 0; i < TC_MAX; i++)
+    {
+        TC_Data_Transmission_mode[i] = OnCommand;
+    }
+
+    /* 给默认 ctx 的 Message_u 和 ReplyMessage_u 填充默认值，和原来全局的一样 */
+    MES_ctx_default.Message_store.Message.Dest_TIM_and_TC_Num[TIM_enum] = TIM_3;
+    MES_ctx_default.Message_store.Message.Dest_TIM_and_TC_Num[TC_enum] = TC_12;
+    MES_ctx_default.Message_store.Message.Command_class = CommonCmd;
+    MES_ctx_default.Message_store.Message.Command_function = Query_TEDS;
+    MES_ctx_default.Message_store.Message.dependent_Length = 1;
+    MES_ctx_default.Message_store.Message.dependent_load[0] = PHY_TEDS_ACCESS_CODE;
+
+    MES_ctx_default.ReplyMessage_store.ReplyMessage.Flag = 0;
+    MES_ctx_default.ReplyMessage_store.ReplyMessage.dependent_Length = 1;
+    MES_ctx_default.ReplyMessage_store.ReplyMessage.dependent_load[0] = 0xAA;
+}
+
+struct MES_struct* MES_default_mes(void)
+{
+    return MES_ctx_default.Mes;
+}
+
+struct Message_struct* MES_default_Message_temp(void)
+{
+    return MES_ctx_default.Message_rx;
+}
+
+struct ReplyMessage_struct* MES_default_ReplyMessage_temp(void)
+{
+    return MES_ctx_default.ReplyMessage_rx;
+}
+
+/* valid_length 可以填 NULL */
+uint8_t* MES_default_temp_load(uint32_t* valid_length)
+{
+    if(valid_length != NULL)
+    {
+        *valid_length = *MES_ctx_default.Scratch_load_valid_length;
+    }
+    return MES_ctx_default.Scratch_load;
+}
+
+/* 新连接的编号，0 留给没连接过的 */
+static uint32_t MES_ctx_new_link_id(void)
+{
+    static uint32_t link_clock = 0;
+    uint32_t link_id = 0;
+
+    do
+    {
+        link_id = __atomic_add_fetch(&link_clock, 1, __ATOMIC_RELAXED);
+    }while(link_id == 0);
+
+    return link_id;
+}
+
+/* 初始化一个 ctx，
+    第二个参数为本 ctx 的发送函数（填 NULL 则用全局的 mes_1451_send），
+    第三个参数为用户私有数据，发送时原样传给 send，比如本连接的 socket 句柄；
+    要用向量发送的在初始化后再填 ctx->sendv，要用发送队列的再调用 MES_ctx_attach_txq() */
+void MES_ctx_init(struct MES_ctx_struct* ctx, 
+    unsigned int (*send)(void* user_data, unsigned char * data, unsigned int len), void* user_data)
+{
+    memset(ctx, 0, sizeof(struct MES_ctx_struct));
+
+    /* 默认 ctx 用原来的全局变量，别的 ctx 用自己的 */
+    if(ctx == &MES_ctx_default)
+    {
+        ctx->Mes = &MES;
+        ctx->Message_rx = &Message_temp;
+        ctx->ReplyMessage_rx = &ReplyMessage_temp;
+        ctx->Scratch_load = temp_load;
+        ctx->Scratch_load_valid_length = &temp_load_valid_length;
+    }else{
+        ctx->Mes = &ctx->Mes_store;
+        ctx->Message_rx = &ctx->Message_rx_store;
+        ctx->ReplyMessage_rx = &ctx->ReplyMessage_rx_store;
+        ctx->Scratch_load = ctx->Scratch_load_store;
+        ctx->Scratch_load_valid_length = &ctx->Scratch_load_valid_length_store;
+    }
+    ctx->Mes->Message_u = &ctx->Message_store;
+    ctx->Mes->ReplyMessage_u = &ctx->ReplyMessage_store;
+
+    /* Mes 的 Message_load_Length 和 ReplyMessage_load_Length 根据不同的情景在打包发送数据的时候再填 */
+
+    ctx->send = send;
+    ctx->user_data = user_data;
+
+    ctx->codec = MES_CODEC_DEFAULT;
+    ctx->link_id = MES_ctx_new_link_id();
+}
+
+/* 用 ctx 的发送函数直接发送数据 */
+static unsigned int MES_ctx_send_direct(struct MES_ctx_struct* ctx, unsigned char * data, unsigned int len)
+{
+    if(ctx->send != NULL)
+    {
+        return ctx->send(ctx->user_data, data, len);
+    }
+    return mes_1451_send(data, len);
+}
+
+/* 用 ctx 的向量发送函数发送多块数据，都没有则退化为一块一块发 */
+static unsigned int MES_ctx_sendv_direct(struct MES_ctx_struct* ctx, const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    unsigned int i = 0;
+    unsigned int sent = 0;
+
+    if(ctx->sendv != NULL)
+    {
+        return ctx->sendv(ctx->user_data, iov, iovcnt);
+    }
+    if(ctx->send == NULL && mes_1451_sendv != NULL)
+    {
+        return mes_1451_sendv(iov, iovcnt);
+    }
+
+    for(i = 0;i < iovcnt;i++)
+    {
+        sent += MES_ctx_send_direct(ctx, iov[i].base, iov[i].len);
+    }
+    return sent;
+}
+
+/**************************** 发送队列，用户使用 ****************************/
+void MES_ctx_attach_txq(struct MES_ctx_struct* ctx, struct MES_txq_struct* txq, 
+    uint32_t flush_threshold, uint32_t flush_deadline_ms, uint32_t (*now_ms)(void))
+{
+    ctx->txq = txq;
+    if(txq == NULL)
+    {
+        return;
+    }
+
+    txq->used = 0;
+    txq->iovcnt = 0;
+    txq->flush_threshold = flush_threshold > MES_TXQ_BUFFER_SIZE ? MES_TXQ_BUFFER_SIZE : flush_threshold;
+    txq->flush_deadline_ms = flush_deadline_ms;
+    txq->now_ms = now_ms;
+    txq->first_enqueue_valid = 0;
+}
+
+/* 把队列里所有帧一次发出去 */
+uint32_t MES_txq_flush_ctx(struct MES_ctx_struct* ctx)
+{
+    struct MES_txq_struct* txq = ctx->txq;
+    struct MES_iovec_struct whole;
+    uint32_t sent = 0;
+
+    if(txq == NULL || txq->iovcnt == 0)
+    {
+        return 0;
+    }
+
+    if(ctx->sendv != NULL || (ctx->send == NULL && mes_1451_sendv != NULL))
+    {
+        sent = MES_ctx_sendv_direct(ctx, txq->iov, txq->iovcnt);
+    }else
+    {
+        /* 没有向量发送，帧在队列缓存里本来就是连续的，一次发整块 */
+        whole.base = txq->buffer;
+        whole.len = txq->used;
+        sent = MES_ctx_send_direct(ctx, whole.base, whole.len);
+    }
+
+    txq->used = 0;
+    txq->iovcnt = 0;
+    txq->first_enqueue_valid = 0;
+
+    return sent;
+}
+
+uint32_t MES_txq_poll_ctx(struct MES_ctx_struct* ctx, uint32_t now_ms)
+{
+    struct MES_txq_struct* txq = ctx->txq;
+
+    if(txq == NULL || txq->iovcnt == 0 || txq->flush_deadline_ms == 0)
+    {
+        return 0;
+    }
+
+    if(!txq->first_enqueue_valid)
+    {
+        txq->first_enqueue_ms = now_ms;
+        txq->first_enqueue_valid = 1;
+    }
+
+    if((uint32_t)(now_ms - txq->first_enqueue_ms) >= txq->flush_deadline_ms)
+    {
+        return MES_txq_flush_ctx(ctx);
+    }
+    return 0;
+}
+
+/* 一帧入队，放不下则先冲刷，一帧比整个队列还大则冲刷后直接发 */
+static unsigned int MES_txq_enqueue(struct MES_ctx_struct* ctx, unsigned char * data, unsigned int len)
+{
+    struct MES_txq_struct* txq = ctx->txq;
+
+    if(txq->used + len > MES_TXQ_BUFFER_SIZE || txq->iovcnt >= MES_TXQ_IOV_MAX)
+    {
+        MES_txq_flush_ctx(ctx);
+    }
+    if(len > MES_TXQ_BUFFER_SIZE)
+    {
+        return MES_ctx_send_direct(ctx, data, len);
+    }
+
+    memcpy(&txq->buffer[txq->used], data, len);
+    txq->iov[txq->iovcnt].base = &txq->buffer[txq->used];
+    txq->iov[txq->iovcnt].len = len;
+    txq->iovcnt++;
+    txq->used += len;
+
+    if(!txq->first_enqueue_valid && txq->now_ms != NULL)
+    {
+        txq->first_enqueue_ms = txq->now_ms();
+        txq->first_enqueue_valid = 1;
+    }
+
+    if(txq->flush_threshold != 0 && txq->used >= txq->flush_threshold)
+    {
+        MES_txq_flush_ctx(ctx);
+    }
+
+    return len;
+}
+
+/* 用 ctx 发送数据，挂了发送队列则入队 */
+static unsigned int MES_ctx_send(struct MES_ctx_struct* ctx, unsigned char * data, unsigned int len)
+{
+    if(ctx->txq != NULL)
+    {
+        return MES_txq_enqueue(ctx, data, len);
+    }
+    return MES_ctx_send_direct(ctx, data, len);
+}
+
+/* 用 ctx 发送多块数据（同一帧的几段），挂了发送队列则逐块入队，否则一次向量发送 */
+static unsigned int MES_ctx_send_iov(struct MES_ctx_struct* ctx, const struct MES_iovec_struct* iov, unsigned int iovcnt)
+{
+    unsigned int i = 0;
+    unsigned int sent = 0;
+
+    if(ctx->txq != NULL)
+    {
+        for(i = 0;i < iovcnt;i++)
+        {
+            sent += MES_txq_enqueue(ctx, iov[i].base, iov[i].len);
+        }
+        return sent;
+    }
+    return MES_ctx_sendv_direct(ctx, iov, iovcnt);
+}
+
+/* 用 ctx 接收数据 */
+static unsigned int MES_ctx_recv(struct MES_ctx_struct* ctx, unsigned char * data, unsigned int len)
+{
+    if(ctx->recv != NULL)
+    {
+        return ctx->recv(ctx->user_data, data, len);
+    }
+    if(mes_1451_recv != NULL)
+    {
+        return mes_1451_recv(data, len);
+    }
+    return 0;
+}
+
+/**************************** 根据不同命令 填充 Message 结构体 的 API，用户使用 ****************************/
+/* 打包好的消息数据在 ctx->Mes->Message_u->Message_load 里面，有效数据长度为 ctx->Mes->Message_load_Length */
+
+/* 发送 Message API，CommonCmd 的 Query_TEDS 命令*/
+void Message_CommonCmd_Query_TEDS_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = CommonCmd;
+    message->Command_function = Query_TEDS;
+    message->dependent_Length = 1;    /* 本命令的附带参数固定长度 */
+    
+    message->dependent_load[0] = which_TEDS;
+
+    /* 固定信息长度 + 附带参数长度 */
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_CommonCmd_Read_TEDS_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = CommonCmd;
+    message->Command_function = Read_TEDS_segment;
+    message->dependent_Length = 5;
+    
+    message->dependent_load[0] = which_TEDS;
+    memcpy(&(message->dependent_load[1]), &TEDSOffset, sizeof(TEDSOffset));
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+/* 写 TEDS 段：dependent 为 which_TEDS（1 byte） + TEDSOffset（4 byte） + 数据，一次装不下的截断，调用者按截断后的长度推进 TEDSOffset */
+void Message_CommonCmd_Write_TEDS_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset, const uint8_t* data, uint16_t length)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    length = length > MAX_Message_dependent_SIZE - 5 ? MAX_Message_dependent_SIZE - 5 : length;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = CommonCmd;
+    message->Command_function = Write_TEDS_segment;
+    message->dependent_Length = 5 + length;
+    
+    message->dependent_load[0] = which_TEDS;
+    memcpy(&(message->dependent_load[1]), &TEDSOffset, sizeof(TEDSOffset));
+    memcpy(&(message->dependent_load[5]), data, length);
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_CommonCmd_Update_TEDS_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = CommonCmd;
+    message->Command_function = Update_TEDS;
+    message->dependent_Length = 1;
+    
+    message->dependent_load[0] = which_TEDS;
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+/* 询问 TIM 所有通道的 TC TEDS 摘要，没有附带参数，回复用 TC_TEDS_digest_decode() 解 */
+void Message_CommonCmd_Query_TC_TEDS_digest_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = TC_MAX;
+    message->Command_class = CommonCmd;
+    message->Command_function = Query_TC_TEDS_digest;
+    message->dependent_Length = 0;
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+/* 开关 TIM 的数据报上传，对整个 TIM（连接），不分通道 */
+void Message_CommonCmd_Datagram_mode_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t enable, uint16_t session, uint16_t port, uint16_t payload_max)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = TC_MAX;
+    message->Command_class = CommonCmd;
+    message->Command_function = Datagram_mode;
+    message->dependent_Length = 7;
+
+    message->dependent_load[0] = enable;
+    memcpy(&(message->dependent_load[1]), &session, sizeof(session));
+    memcpy(&(message->dependent_load[3]), &port, sizeof(port));
+    memcpy(&(message->dependent_load[5]), &payload_max, sizeof(payload_max));
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_CommonCmd_Datagram_NACK_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, const struct MES_dgram_range_struct* range, uint8_t range_count)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+    uint8_t i = 0;
+
+    range_count = range_count > MES_DGRAM_NACK_MAX ? MES_DGRAM_NACK_MAX : range_count;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = TC_MAX;
+    message->Command_class = CommonCmd;
+    message->Command_function = Datagram_NACK;
+    message->dependent_Length = 1 + 6 * range_count;
+
+    message->dependent_load[0] = range_count;
+    for(i = 0; i < range_count; i++)
+    {
+        memcpy(&(message->dependent_load[1 + 6 * i]), &range[i].seq, sizeof(range[i].seq));
+        memcpy(&(message->dependent_load[5 + 6 * i]), &range[i].count, sizeof(range[i].count));
+    }
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_CommonCmd_Session_resume_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, const struct MES_session_struct* session)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+    uint8_t count = 0;
+    uint8_t TC = 0;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = TC_MAX;
+    message->Command_class = CommonCmd;
+    message->Command_function = Session_resume;
+
+    memcpy(&(message->dependent_load[0]), &session->token, sizeof(session->token));
+    for(TC = 0; TC < TC_MAX; TC++)
+    {
+        if(session->acked_valid[TC])
+        {
+            message->dependent_load[5 + 5 * count] = TC;
+            memcpy(&(message->dependent_load[6 + 5 * count]), &session->acked_Offset[TC], sizeof(session->acked_Offset[TC]));
+            count++;
+        }
+    }
+    message->dependent_load[4] = count;
+    message->dependent_Length = 5 + 5 * count;
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_XdcrIdle_Set_Data_Transmission_mode_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC,enum Data_Transmission_mode_enum mode)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = XdcrIdle;
+    message->Command_function = Data_Transmission_mode;
+    message->dependent_Length = 1;
+    
+    message->dependent_load[0] = mode;
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_XdcrOperate_Read_TC_data_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = XdcrOperate;
+    message->Command_function = Read_TransducerChannel_data_set_segment;
+    message->dependent_Length = 4;
+    
+    memcpy(&(message->dependent_load[0]), &Offset, sizeof(Offset));
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_XdcrOperate_Read_TC_data_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset, uint16_t max_segment_size)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    Message_XdcrOperate_Read_TC_data_pack_up_ctx(ctx, Dest_TIM, Dest_TC, Offset);
+
+    /* Offset 后面再加两个字节的最大数据段大小 */
+    message->dependent_Length = 6;
+    memcpy(&(message->dependent_load[4]), &max_segment_size, sizeof(max_segment_size));
+
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_XdcrOperate_Trigger_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = XdcrOperate;
+    message->Command_function = Trigger_command;
+    message->dependent_Length = 0;
+    
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_XdcrOperate_Abort_Trigger_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Dest_TIM;
+    message->Dest_TIM_and_TC_Num[TC_enum] = Dest_TC;
+    message->Command_class = XdcrOperate;
+    message->Command_function = Abort_Trigger;
+    message->dependent_Length = 0;
+    
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+void Message_TIM_initiated_pack_up_ctx(struct MES_ctx_struct* ctx)
+{
+    struct Message_struct* message = &ctx->Mes->Message_u->Message;
+
+    uint16_t mark = MES_BYTE_ORDER_MARK;
+    uint32_t caps = MES_CAP_SEGMENTED_READ | MES_CAP_TEDS_WRITE | MES_CAP_TC_TEDS_DIGEST | MES_CAP_SESSION_RESUME;
+    uint32_t max_segment_size = TC_data_segment_size_limit;
+    uint32_t MaxSDU = TEDS_PHY_MaxSDU();
+
+    if(ctx->txq != NULL)
+    {
+        caps |= MES_CAP_BATCHING;
+    }
+    if(ctx->dgram_tx != NULL)
+    {
+        caps |= MES_CAP_DATAGRAM;
+    }
+    if(MaxSDU != 0 && MaxSDU < max_segment_size)
+    {
+        max_segment_size = MaxSDU;
+    }
+    max_segment_size = max_segment_size > MAX_TC_data_segment_SIZE ? MAX_TC_data_segment_SIZE : max_segment_size;
+
+    message->Dest_TIM_and_TC_Num[TIM_enum] = Self_TIM; /* 我是谁 */
+    message->Dest_TIM_and_TC_Num[TC_enum] = TC_MAX; /* 表示 ALL */
+    message->Command_class = XdcrIdle;
+    message->Command_function = TIM_ALL_TC_initiated;
+    message->dependent_Length = MES_HANDSHAKE_SESSION_SIZE;
+
+    /* 握手：字节序标记、能力位图、最大数据段、会话号，都按本平台大小端 */
+    memcpy(&(message->dependent_load[0]), &mark, sizeof(mark));
+    memcpy(&(message->dependent_load[2]), &caps, sizeof(caps));
+    memcpy(&(message->dependent_load[6]), &max_segment_size, sizeof(max_segment_size));
+    memcpy(&(message->dependent_load[10]), &ctx->session_token, sizeof(ctx->session_token));
+
+    /* 带会话号重连的等 NCAP 说从哪里接着发 */
+    ctx->session_pending = ctx->session_token != 0;
+    /* 发 TIM_initiated 就是新连接了，上一个连接写了一半的 TEDS 影子不再算数 */
+    ctx->link_id = MES_ctx_new_link_id();
+    
+    ctx->Mes->Message_load_Length = 6 + message->dependent_Length;
+}
+
+/* 剩余其他 Message 在这里 挨个实现 ... 相当繁琐了 */
+
+/* 以下为对默认 ctx 的封装，打包好的消息数据在 MES_ctx_default.Mes->Message_u->Message_load 里面，有效数据长度为 MES_ctx_default.Mes->Message_load_Length */
+void Message_CommonCmd_Query_TEDS_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS)
+{
+    Message_CommonCmd_Query_TEDS_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, which_TEDS);
+}
+
+void Message_CommonCmd_Read_TEDS_segment_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset)
+{
+    Message_CommonCmd_Read_TEDS_segment_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, which_TEDS, TEDSOffset);
+}
+
+void Message_CommonCmd_Write_TEDS_segment_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset, const uint8_t* data, uint16_t length)
+{
+    Message_CommonCmd_Write_TEDS_segment_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, which_TEDS, TEDSOffset, data, length);
+}
+
+void Message_CommonCmd_Update_TEDS_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS)
+{
+    Message_CommonCmd_Update_TEDS_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, which_TEDS);
+}
+
+void Message_CommonCmd_Query_TC_TEDS_digest_pack_up(uint8_t Dest_TIM)
+{
+    Message_CommonCmd_Query_TC_TEDS_digest_pack_up_ctx(&MES_ctx_default, Dest_TIM);
+}
+
+void Message_CommonCmd_Datagram_mode_pack_up(uint8_t Dest_TIM, uint8_t enable, uint16_t session, uint16_t port, uint16_t payload_max)
+{
+    Message_CommonCmd_Datagram_mode_pack_up_ctx(&MES_ctx_default, Dest_TIM, enable, session, port, payload_max);
+}
+
+void Message_XdcrIdle_Set_Data_Transmission_mode_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC,enum Data_Transmission_mode_enum mode)
+{
+    Message_XdcrIdle_Set_Data_Transmission_mode_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, mode);
+}
+
+void Message_XdcrOperate_Read_TC_data_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset)
+{
+    Message_XdcrOperate_Read_TC_data_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC, Offset);
+}
+
+void Message_XdcrOperate_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC)
+{
+    Message_XdcrOperate_Trigger_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC);
+}
+
+void Message_XdcrOperate_Abort_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC)
+{
+    Message_XdcrOperate_Abort_Trigger_pack_up_ctx(&MES_ctx_default, Dest_TIM, Dest_TC);
+}
+
+void Message_TIM_initiated_pack_up(void)
+{
+    Message_TIM_initiated_pack_up_ctx(&MES_ctx_default);
+}
+
+/**************************** 消息的 发送，用户使用 ****************************/
+/* 发送 Message，一般是 NCAP 用 */
+void Message_pack_up_And_send_ctx(struct MES_ctx_struct* ctx)
+{
+    /* 进行发送 */
+    /*
+        目标 TIM 的 IP 地址：   TIM_IP[ ctx->Mes->Message_u->Message.Dest_TIM_and_TC_Num[TIM_enum] ][0 ~ 3]; 
+        调用 Message_xxx_pack_up_ctx() 即填充 ctx->Mes 结构体：
+            待发送数组：        ctx->Mes->Message_u->Message_load
+            有效数据长度为：    ctx->Mes->Message_load_Length
+        然后在 这里 发送数据。
+    */
+
+    /* 对方大小端不同的话转过去发，发完转回来，Message 缓存里一直是本平台的 */
+    ctx->codec->Message_encode(ctx->Mes->Message_u->Message_load, 1);
+    MES_ctx_send(ctx, ctx->Mes->Message_u->Message_load, ctx->Mes->Message_load_Length);
+    ctx->codec->Message_encode(ctx->Mes->Message_u->Message_load, 0);
+}
+
+void Message_pack_up_And_send(void)
+{
+    Message_pack_up_And_send_ctx(&MES_ctx_default);
+}
+
+/**************************** 解析接收到的 Message 的 API ****************************/
+/* 接收 信息 字节数组 received_mes_load 并 解析 然后 将 结果放在 messageReceived 地址的结构体里 */
+void Message_decode(struct Message_struct* messageReceived,uint8_t* received_mes_load)
+{
+    uint16_t i = 0;
+
+    memset(messageReceived, 0, sizeof(struct Message_struct));
+    
+    messageReceived->Dest_TIM_and_TC_Num[TIM_enum] = received_mes_load[0];
+    messageReceived->Dest_TIM_and_TC_Num[TC_enum] = received_mes_load[1];
+
+    messageReceived->Command_class = received_mes_load[2];
+    messageReceived->Command_function = received_mes_load[3];
+
+    /* 这一步填充 dependent_Length */
+    /* 根据 NEED_SWITCH_LITTLE_BIG_END 来判断本平台与 发送数据的 平台的 大小端是否一致，若一致则进行大小端转换，否则不转换 */
+    memcpy_with_BitLittle_switch((uint8_t*)(&(messageReceived->dependent_Length)),   \
+            (uint8_t*)(&(received_mes_load[4])), sizeof((messageReceived->dependent_Length)), NEED_SWITCH_LITTLE_BIG_END);
+    
+    /* 长度限幅 */
+    messageReceived->dependent_Length = messageReceived->dependent_Length > MAX_Message_dependent_SIZE ? \
+        messageReceived->dependent_Length = MAX_Message_dependent_SIZE : messageReceived->dependent_Length;
+
+    for(i = 0;i < messageReceived->dependent_Length;i++)
+    {
+        messageReceived->dependent_load[i] = received_mes_load[6 + i];
+    }
+
+    if(NEED_SWITCH_LITTLE_BIG_END)
+    {
+        MES_swap_fields(messageReceived->dependent_load, messageReceived->dependent_Length, 
+            MES_schema_of(messageReceived->Command_class, messageReceived->Command_function, 0));
+    }
+}
+
+/* 解析结果放在 ctx->Message_rx 里面，并返回其地址 */
+struct Message_struct* Message_decode_ctx(struct MES_ctx_struct* ctx, uint8_t* received_mes_load)
+{
+    Message_decode(ctx->Message_rx, received_mes_load);
+    return ctx->Message_rx;
+}
+
+/* 零拷贝解析 Message：
+    只检查头部和 dependent_Length 是否合法、数据是否够一整帧，然后把头部各域填进 view，
+    view->dependent_load 直接指向 received_mes_load 里面的 dependent，不 memset 也不拷贝，
+    received_length 为 received_mes_load 里有效字节数；
+    swap 为常数，编解码里两个版本各调一次，编译器各展开一份，没有按帧的判断 */
+static inline enum MES_decode_result_enum MES_decode_Message_view(struct Message_view_struct* view, 
+    const uint8_t* received_mes_load, uint32_t received_length, uint8_t swap)
+{
+    if(received_length < MESSAGE_HEADER_SIZE)
+    {
+        return MES_DECODE_INCOMPLETE;
+    }
+
+    view->Dest_TIM_and_TC_Num[TIM_enum] = received_mes_load[0];
+    view->Dest_TIM_and_TC_Num[TC_enum] = received_mes_load[1];
+
+    view->Command_class = received_mes_load[2];
+    view->Command_function = received_mes_load[3];
+
+    memcpy(&(view->dependent_Length), &(received_mes_load[4]), sizeof(view->dependent_Length));
+    if(swap)
+    {
+        view->dependent_Length = __builtin_bswap16(view->dependent_Length);
+    }
+
+    /* 这里不做限幅，超长就是坏帧 */
+    if(view->dependent_Length > MAX_Message_dependent_SIZE)
+    {
+        return MES_DECODE_TOO_LONG;
+    }
+
+    view->frame_Length = MESSAGE_HEADER_SIZE + view->dependent_Length;
+    if(received_length < view->frame_Length)
+    {
+        return MES_DECODE_INCOMPLETE;
+    }
+
+    view->dependent_load = &received_mes_load[MESSAGE_HEADER_SIZE];
+
+    return MES_DECODE_OK;
+}
+
+/* 根据 NEED_SWITCH_LITTLE_BIG_END 判断是否要大小端转换 */
+enum MES_decode_result_enum Message_decode_view(struct Message_view_struct* view, const uint8_t* received_mes_load, uint32_t received_length)
+{
+    return MES_decode_Message_view(view, received_mes_load, received_length, NEED_SWITCH_LITTLE_BIG_END);
+}
+
+/**************************** 根据相应 Message 填充 ReplyMessage 结构体 并打包数据的 API， 的 API ****************************/
+/* 打包好后的回复消息数据在 ctx->Mes->ReplyMessage_u->ReplyMessage_load 里面，有效数据长度为 ctx->Mes->ReplyMessage_load_Length */
+
+/* Query_TEDS 回复里的属性和状态两个字节，TC TEDS 按通道，别的 TEDS 不看 TC，which_TEDS 不认识的填 0 返回 0 */
+static uint8_t TEDS_attr_status_of(uint8_t which_TEDS, uint8_t TC, uint8_t* attr_status)
+{
+    switch (which_TEDS)
+    {
+        case M_TEDS_ACCESS_CODE:
+            
+            attr_status[0] = *((uint8_t*)(TEDS.M_TEDS_attr));
+            attr_status[1] = *((uint8_t*)(TEDS.M_TEDS_status));
+
+            return 1;
+
+        case TC_TEDS_ACCESS_CODE:
+
+            if(TC < TC_MAX)
+            {
+                attr_status[0] = *((uint8_t*)(&TC_TEDS_table[TC].attr));
+                attr_status[1] = *((uint8_t*)(&TC_TEDS_table[TC].status));
+            }else{
+                attr_status[0] = *((uint8_t*)(TEDS.TC_TEDS_attr));
+                attr_status[1] = *((uint8_t*)(TEDS.TC_TEDS_status));
+            }
+            
+            return 1;
+            
+        case UTN_TEDS_ACCESS_CODE:
+
+            attr_status[0] = *((uint8_t*)(TEDS.UTN_TEDS_attr));
+            attr_status[1] = *((uint8_t*)(TEDS.UTN_TEDS_status));
+            
+            return 1;
+
+        case PHY_TEDS_ACCESS_CODE:
+
+            attr_status[0] = *((uint8_t*)(TEDS.PHY_TEDS_attr));
+            attr_status[1] = *((uint8_t*)(TEDS.PHY_TEDS_status));
+
+            return 1;
+        default:
+
+            attr_status[0] = 0;
+            attr_status[1] = 0;
+
+            return 0;
+    }
+}
+
+/* TC 为 Message 里的目标通道，TC TEDS 按通道回复通道自己的属性、状态、长度和 Checksum，别的 TEDS 不看 TC */
+void ReplyMessage_CommonCmd_Query_TEDS_pack_up(struct MES_ctx_struct* ctx, uint8_t which_TEDS, uint8_t TC)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    uint8_t* load_ptr = NULL;
+    uint32_t* ref = NULL;
+    uint32_t whole_length = 0;
+
+    reply->Flag = 1;
+    reply->dependent_Length = 12;
+    
+    TEDS_attr_status_of(which_TEDS, TC, reply->dependent_load);
+
+    /* TEDS 总长度和 Checksum，TEDS 可能是挂的变长 TEDS，Checksum 在最后两个字节 */
+    load_ptr = TEDS_image_acquire(which_TEDS, TC, &whole_length, &ref);
+    if(load_ptr != NULL)
+    {
+        memcpy(&(reply->dependent_load[2]), &whole_length, sizeof(whole_length));
+        memcpy(&(reply->dependent_load[6]), &load_ptr[whole_length - 2], 2);
+        TEDS_image_release(ref);
+    }else{
+        reply->Flag = 0;
+        memset(&(reply->dependent_load[2]), 0, 6);  /* 不留上一个回复的字节 */
+    }
+
+    /* 最后四个字节为 max_TEDS_size */
+    *ctx->Scratch_load_valid_length = (uint32_t)MAX_TEDS_IMAGE_SIZE;
+    memcpy(&(reply->dependent_load[8]), ctx->Scratch_load_valid_length, 4);
+
+    /* 回复消息附带参数的长度 + Flag、dependent_Length 的变量长度 */
+    ctx->Mes->ReplyMessage_load_Length = reply->dependent_Length + 3;
+}
+
+/* 读 TEDS 段：从 TEDSOffset 开始回复一段，数据和读数据集一样挂在 ctx->Reply_payload 上直接从 TEDS 里发，
+    一段多大取 TEDS_segment_size_limit 和 PHY TEDS MaxSDU 的最小值，NCAP 按回复里的 TEDSOffset 和长度拼起来；
+    回复 dependent 为：which_TEDS（1 byte） + TEDSOffset（4 byte） + TEDS 数据，TEDSOffset 超出 TEDS 则回复 Flag 为 0 */
+void ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(struct MES_ctx_struct* ctx, uint8_t which_TEDS, uint8_t TC, uint32_t TEDSOffset)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    uint8_t* load_ptr = NULL;
+    uint32_t whole_length = 0;
+    uint32_t segment_size = TEDS_segment_size_limit;
+    uint32_t MaxSDU = 0;
+    uint32_t* ref = NULL;
+
+    /* 引用一直挂到这段发完（ReplyMessage_send() 里放），期间 Update_TEDS 换了镜像也不会改这块 */
+    load_ptr = TEDS_image_acquire(which_TEDS, TC, &whole_length, &ref);
+    if(load_ptr != NULL && TEDSOffset >= whole_length)
+    {
+        TEDS_image_release(ref);
+        load_ptr = NULL;
+    }
+    if(load_ptr == NULL)
+    {
+        reply->Flag = 0;
+        reply->dependent_Length = 0;
+        ctx->Mes->ReplyMessage_load_Length = reply->dependent_Length + 3;
+        return;
+    }
+
+    MaxSDU = TEDS_PHY_MaxSDU();
+    if(MaxSDU != 0 && MaxSDU < segment_size)
+    {
+        segment_size = MaxSDU;
+    }
+    segment_size = segment_size > MAX_TC_data_segment_SIZE ? MAX_TC_data_segment_SIZE : segment_size;
+    segment_size = segment_size == 0 ? 1 : segment_size;
+    segment_size = segment_size > whole_length - TEDSOffset ? whole_length - TEDSOffset : segment_size;
+
+    /* 填充 回复命令 结构体 */
+    reply->Flag = 1;
+    reply->dependent_Length = (uint16_t)(5 + segment_size); /* which_TEDS 和 TEDSOffset + 本段 TEDS 长度 */
+   
+    reply->dependent_load[0] = which_TEDS;
+    memcpy(&(reply->dependent_load[1]), &TEDSOffset, sizeof(TEDSOffset));
+
+    ctx->Reply_payload = &load_ptr[TEDSOffset];
+    ctx->Reply_payload_Length = segment_size;
+    ctx->Reply_payload_ref = ref;
+
+    /* 缓存里只有头部、which_TEDS 和 TEDSOffset，TEDS 数据在发送时跟在后面 */
+    ctx->Mes->ReplyMessage_load_Length = 3 + 5;
+}
+
+/* 一次回复所有通道的 TC TEDS 摘要，NCAP 一个来回就知道每个通道的 TEDS 有没有变；
+    回复 dependent 为：通道个数（1 byte） + 每个通道 TC_TEDS_DIGEST_SIZE 字节：属性（1） + 状态（1） + 总长度（4） + Checksum（2），
+    通道没有自己的 TC TEDS 时填共用的那个的长度和 Checksum */
+void ReplyMessage_CommonCmd_Query_TC_TEDS_digest_pack_up(struct MES_ctx_struct* ctx)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    struct TC_TEDS_entry_struct* entry = NULL;
+    uint8_t* shared_load = NULL;
+    uint32_t shared_length = 0;
+    uint16_t shared_Checksum = 0;
+    uint8_t* digest = NULL;
+    uint8_t TC = 0;
+
+    shared_load = TEDS_image_get(TC_TEDS_ACCESS_CODE, TC_MAX, &shared_length);
+    if(shared_load != NULL)
+    {
+        memcpy(&shared_Checksum, &shared_load[shared_length - 2], sizeof(shared_Checksum));
+    }else{
+        shared_length = 0;
+    }
+
+    reply->Flag = 1;
+    reply->dependent_Length = 1 + TC_MAX * TC_TEDS_DIGEST_SIZE;
+    reply->dependent_load[0] = TC_MAX;
+
+    for(TC = 0; TC < TC_MAX; TC++)
+    {
+        entry = &TC_TEDS_table[TC];
+        digest = &reply->dependent_load[1 + TC * TC_TEDS_DIGEST_SIZE];
+
+        digest[0] = *((uint8_t*)(&entry->attr));
+        digest[1] = *((uint8_t*)(&entry->status));
+        if(__atomic_load_n(&entry->load, __ATOMIC_ACQUIRE) != NULL)
+        {
+            memcpy(&digest[2], &entry->whole_length, sizeof(entry->whole_length));
+            memcpy(&digest[6], &entry->Checksum, sizeof(entry->Checksum));
+        }else{
+            memcpy(&digest[2], &shared_length, sizeof(shared_length));
+            memcpy(&digest[6], &shared_Checksum, sizeof(shared_Checksum));
+        }
+    }
+
+    ctx->Mes->ReplyMessage_load_Length = reply->dependent_Length + 3;
+}
+
+/* 写 TEDS 段和更新 TEDS 的回复只有 Flag，写进影子或发布成功为 1 */
+void ReplyMessage_CommonCmd_Write_TEDS_segment_pack_up(struct MES_ctx_struct* ctx, uint8_t ok)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = ok ? 1 : 0;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+void ReplyMessage_CommonCmd_Update_TEDS_pack_up(struct MES_ctx_struct* ctx, uint8_t ok)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = ok ? 1 : 0;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+void ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up(struct MES_ctx_struct* ctx)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = 1;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+/* 读数据集：数据不拷贝进 ReplyMessage 缓存（为 1s 的数据开静态内存太大），
+    ReplyMessage 里只放 Offset 4 个字节，数据挂在 ctx->Reply_payload 上，发送时直接从数据集里发，
+    一帧带多少数据取 NCAP 请求的 max_segment_size（为 0 即没指定）、TC_data_segment_size_limit 和 PHY TEDS MaxSDU 的最小值；
+    回复 dependent 为：Offset（4 byte） + 数据，Offset 超出数据集则回复 Flag 为 0 */
+void ReplyMessage_XdcrOperate_Read_TC_data_pack_up(struct MES_ctx_struct* ctx, uint8_t TC, uint32_t Offset, uint32_t max_segment_size)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    uint32_t segment_size = TC_data_segment_size_limit;
+    uint32_t MaxSDU = 0;
+
+    if(TC >= TC_MAX || TC_data_set[TC].load == NULL || Offset >= TC_data_set[TC].length)
+    {
+        reply->Flag = 0;
+        reply->dependent_Length = 0;
+        ctx->Mes->ReplyMessage_load_Length = reply->dependent_Length + 3;
+        return;
+    }
+
+    if(max_segment_size != 0 && max_segment_size < segment_size)
+    {
+        segment_size = max_segment_size;
+    }
+    MaxSDU = TEDS_PHY_MaxSDU();
+    if(MaxSDU != 0 && MaxSDU < segment_size)
+    {
+        segment_size = MaxSDU;
+    }
+    segment_size = segment_size > MAX_TC_data_segment_SIZE ? MAX_TC_data_segment_SIZE : segment_size;
+    segment_size = segment_size > TC_data_set[TC].length - Offset ? TC_data_set[TC].length - Offset : segment_size;
+
+    reply->Flag = 1;
+    reply->dependent_Length = (uint16_t)(4 + segment_size);
+    memcpy(&(reply->dependent_load[0]), &Offset, sizeof(Offset));
+
+    ctx->Reply_payload = &TC_data_set[TC].load[Offset];
+    ctx->Reply_payload_Length = segment_size;
+
+    /* 缓存里只有头部和 Offset，数据在发送时跟在后面 */
+    ctx->Mes->ReplyMessage_load_Length = 3 + 4;
+}
+
+void ReplyMessage_XdcrOperate_Trigger_pack_up(struct MES_ctx_struct* ctx)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = 1;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+void ReplyMessage_XdcrOperate_Abort_Trigger_pack_up(struct MES_ctx_struct* ctx)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = 1;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+void ReplyMessage_TIM_initiated_pack_up(struct MES_ctx_struct* ctx)
+{
+    ctx->Mes->ReplyMessage_u->ReplyMessage.Flag = 1;
+    ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length = 0;
+
+    ctx->Mes->ReplyMessage_load_Length = ctx->Mes->ReplyMessage_u->ReplyMessage.dependent_Length + 3;
+}
+
+/* 通用回复消息打包，自定义命令处理函数里用 */
+void ReplyMessage_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Flag, const uint8_t* dependent, uint16_t dependent_Length)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+
+    /* 长度限幅，尾部还要留两个字节给 class 和 command */
+    dependent_Length = dependent_Length > MAX_Message_dependent_SIZE - 2 ? \
+        MAX_Message_dependent_SIZE - 2 : dependent_Length;
+
+    reply->Flag = Flag;
+    reply->dependent_Length = dependent == NULL ? 0 : dependent_Length;
+    if(dependent != NULL)
+    {
+        memcpy(reply->dependent_load, dependent, dependent_Length);
+    }
+
+    ctx->Mes->ReplyMessage_load_Length = reply->dependent_Length + REPLYMESSAGE_HEADER_SIZE;
+}
+
+/**************************** 回复消息的 发送 ****************************/
+    /* 发送 ReplyMessage，一般是 TIM 用 */
+uint8_t ReplyMessage_send(struct MES_ctx_struct* ctx, uint8_t class, uint8_t command)
+{
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    struct MES_iovec_struct iov[2];
+    unsigned int sent = 0;
+
+    /* 这里我自己再定义，回复消息的 dependent 的尾部再添加两个字节，
+        标识回复消息所对应命令名校的 class 和 command （但是 ReplyMessage.dependent_Length 就不再动了）*/
+    if(reply->dependent_Length + 2 <= MAX_Message_dependent_SIZE)
+    {
+        reply->dependent_load[reply->dependent_Length] = class;
+        reply->dependent_load[reply->dependent_Length + 1] = command;
+    }
+
+    /* 进行发送 */
+    /*
+        目标 NCAP 的 IP 地址：  NCAP_IP[0 ~ 3]
+        调用 ReplyMessage_xxx_pack_up() 即填充 ctx->Mes 结构体
+            待发送数组：        ctx->Mes->ReplyMessage_u->ReplyMessage_load
+            有效数据长度为：    ctx->Mes->ReplyMessage_load_Length
+        然后在这里 发送数据。
+    */
+
+    if(ctx->Reply_payload_Length == 0)
+    {
+        return MES_ctx_send(ctx, ctx->Mes->ReplyMessage_u->ReplyMessage_load, ctx->Mes->ReplyMessage_load_Length) > 0;
+    }
+
+    /* 有外挂数据，头部和数据两块一次发出去，数据不拷贝 */
+    iov[0].base = ctx->Mes->ReplyMessage_u->ReplyMessage_load;
+    iov[0].len = ctx->Mes->ReplyMessage_load_Length;
+    iov[1].base = (uint8_t*)ctx->Reply_payload;
+    iov[1].len = ctx->Reply_payload_Length;
+    if(ctx->Reply_payload_direct)
+    {
+        /* 队列里的先发，顺序不乱 */
+        MES_txq_flush_ctx(ctx);
+        sent = MES_ctx_sendv_direct(ctx, iov, 2);
+    }else{
+        sent = MES_ctx_send_iov(ctx, iov, 2);
+    }
+
+    ctx->Reply_payload = NULL;
+    ctx->Reply_payload_Length = 0;
+    ctx->Reply_payload_direct = 0;
+    if(ctx->Reply_payload_ref != NULL)
+    {
+        __atomic_sub_fetch(ctx->Reply_payload_ref, 1, __ATOMIC_RELEASE);
+        ctx->Reply_payload_ref = NULL;
+    }
+
+    return sent > 0;
+}
+
+/**************************** 解析接收到的 回复消息 的 API ****************************/
+/* 填入接收到的回复消息字符串，接收回复消息解析，并讲结果存在 replyMessageReceived 结构体地址里 */
+void ReplyMessage_decode(struct ReplyMessage_struct* replyMessageReceived,uint8_t* received_rep_mes_load)
+{
+    uint16_t i = 0;
+
+    memset(replyMessageReceived, 0, sizeof(struct ReplyMessage_struct));
+
+    replyMessageReceived->Flag = received_rep_mes_load[0];
+    
+    /* 根据 NEED_SWITCH_LITTLE_BIG_END 来判断本平台与 发送数据的 平台的 大小端是否一致，若一致则进行大小端转换，否则不转换 */
+    memcpy_with_BitLittle_switch((uint8_t*)(&(replyMessageReceived->dependent_Length)),   \
+            (uint8_t*)(&(received_rep_mes_load[1])), sizeof((replyMessageReceived->dependent_Length)), NEED_SWITCH_LITTLE_BIG_END);
+    
+    /* 长度限幅 */
+    replyMessageReceived->dependent_Length = replyMessageReceived->dependent_Length > MAX_Message_dependent_SIZE ? \
+        replyMessageReceived->dependent_Length = MAX_Message_dependent_SIZE : replyMessageReceived->dependent_Length;
+
+    for(i = 0;i < replyMessageReceived->dependent_Length;i++)
+    {
+        replyMessageReceived->dependent_load[i] = received_rep_mes_load[3 + i];
+    }
+}
+
+/* 解析结果放在 ctx->ReplyMessage_rx 里面，并返回其地址 */
+struct ReplyMessage_struct* ReplyMessage_decode_ctx(struct MES_ctx_struct* ctx, uint8_t* received_rep_mes_load)
+{
+    ReplyMessage_decode(ctx->ReplyMessage_rx, received_rep_mes_load);
+    return ctx->ReplyMessage_rx;
+}
+
+/* 零拷贝解析 ReplyMessage，同 MES_decode_Message_view() */
+static inline enum MES_decode_result_enum MES_decode_ReplyMessage_view(struct ReplyMessage_view_struct* view, 
+    const uint8_t* received_rep_mes_load, uint32_t received_length, uint8_t swap)
+{
+    if(received_length < REPLYMESSAGE_HEADER_SIZE)
+    {
+        return MES_DECODE_INCOMPLETE;
+    }
+
+    view->Flag = received_rep_mes_load[0];
+
+    memcpy(&(view->dependent_Length), &(received_rep_mes_load[1]), sizeof(view->dependent_Length));
+    if(swap)
+    {
+        view->dependent_Length = __builtin_bswap16(view->dependent_Length);
+    }
+
+    if(view->dependent_Length > MAX_ReplyMessage_view_dependent_SIZE)
+    {
+        return MES_DECODE_TOO_LONG;
+    }
+
+    view->frame_Length = REPLYMESSAGE_HEADER_SIZE + view->dependent_Length;
+    if(received_length < view->frame_Length)
+    {
+        return MES_DECODE_INCOMPLETE;
+    }
+
+    view->dependent_load = &received_rep_mes_load[REPLYMESSAGE_HEADER_SIZE];
+
+    return MES_DECODE_OK;
+}
+
+enum MES_decode_result_enum ReplyMessage_decode_view(struct ReplyMessage_view_struct* view, const uint8_t* received_rep_mes_load, uint32_t received_length)
+{
+    return MES_decode_ReplyMessage_view(view, received_rep_mes_load, received_length, NEED_SWITCH_LITTLE_BIG_END);
+}
+
+/**************************** 命令处理函数表 ****************************/
+/* 库内置的命令处理函数，把 Message 视图转成上面各个 ReplyMessage_xxx_pack_up() 的参数 */
+/* dependent_load 指在接收缓存里，短帧后面是下一帧的数据，参数不够的回 Flag 为 0 */
+static void MES_handler_Query_TEDS(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    if(message->dependent_Length < 1)
+    {
+        ReplyMessage_pack_up_ctx(ctx, 0, NULL, 0);
+        return;
+    }
+    ReplyMessage_CommonCmd_Query_TEDS_pack_up(ctx, message->dependent_load[0], message->Dest_TIM_and_TC_Num[TC_enum]);
+}
+
+static void MES_handler_Read_TEDS_segment(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint32_t TEDSOffset = 0;
+
+    if(message->dependent_Length < 5)
+    {
+        ReplyMessage_pack_up_ctx(ctx, 0, NULL, 0);
+        return;
+    }
+    memcpy(&TEDSOffset, &message->dependent_load[1], sizeof(TEDSOffset));
+    ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(ctx, message->dependent_load[0], message->Dest_TIM_and_TC_Num[TC_enum], TEDSOffset);
+}
+
+/* 只读的 TEDS 不让写，TC TEDS 看目标通道自己的属性 */
+static uint8_t MES_TEDS_writable(uint8_t which_TEDS, uint8_t TC)
+{
+    struct TEDS_attributes_struct* attr = NULL;
+
+    switch(which_TEDS)
+    {
+        case M_TEDS_ACCESS_CODE:    attr = TEDS.M_TEDS_attr;    break;
+        case TC_TEDS_ACCESS_CODE:   attr = TC < TC_MAX ? &TC_TEDS_table[TC].attr : TEDS.TC_TEDS_attr;   break;
+        case UTN_TEDS_ACCESS_CODE:  attr = TEDS.UTN_TEDS_attr;  break;
+        case PHY_TEDS_ACCESS_CODE:  attr = TEDS.PHY_TEDS_attr;  break;
+        default:
+            return 0;
+    }
+
+    return attr == NULL || !attr->ReadOnly;
+}
+
+static void MES_handler_Write_TEDS_segment(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint8_t TC = message->Dest_TIM_and_TC_Num[TC_enum];
+    uint32_t TEDSOffset = 0;
+    uint8_t ok = 0;
+
+    if(message->dependent_Length >= 5 && MES_TEDS_writable(message->dependent_load[0], TC))
+    {
+        memcpy(&TEDSOffset, &message->dependent_load[1], sizeof(TEDSOffset));
+        ok = TEDS_write_segment_slot(TEDS_slot_of(message->dependent_load[0], TC), ctx->link_id, TEDSOffset, 
+            &message->dependent_load[5], message->dependent_Length - 5);
+    }
+
+    ReplyMessage_CommonCmd_Write_TEDS_segment_pack_up(ctx, ok);
+}
+
+static void MES_handler_Update_TEDS(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint8_t TC = message->Dest_TIM_and_TC_Num[TC_enum];
+    uint8_t ok = 0;
+
+    if(message->dependent_Length >= 1 && MES_TEDS_writable(message->dependent_load[0], TC))
+    {
+        ok = TEDS_update_slot(TEDS_slot_of(message->dependent_load[0], TC), message->dependent_load[0], NEED_SWITCH_LITTLE_BIG_END);
+    }
+
+    ReplyMessage_CommonCmd_Update_TEDS_pack_up(ctx, ok);
+}
+
+static void MES_handler_Query_TC_TEDS_digest(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    (void)message;
+    ReplyMessage_CommonCmd_Query_TC_TEDS_digest_pack_up(ctx);
+}
+
+/* 在数据报上传部分 */
+static uint8_t MES_dgram_resend(struct MES_ctx_struct* ctx, uint32_t seq);
+
+/* 没挂数据报发送的回 Flag 为 0，NCAP 就知道这个连接还是走 TCP */
+static void MES_handler_Datagram_mode(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    struct MES_dgram_tx_struct* tx = ctx->dgram_tx;
+    uint16_t payload_max = 0;
+    uint8_t ok = 0;
+
+    if(tx != NULL && message->dependent_Length >= 7)
+    {
+        tx->enabled = message->dependent_load[0] != 0;
+        if(tx->enabled)
+        {
+            memcpy(&tx->session, &message->dependent_load[1], sizeof(tx->session));
+            memcpy(&tx->port, &message->dependent_load[3], sizeof(tx->port));
+            memcpy(&payload_max, &message->dependent_load[5], sizeof(payload_max));
+            tx->payload_max = payload_max == 0 || payload_max > MES_DGRAM_PAYLOAD_MAX ? MES_DGRAM_PAYLOAD_MAX : payload_max;
+
+            /* 新会话序号从 0 开始，旧会话的历史不再补 */
+            tx->next_seq = 0;
+            memset(tx->history_entry, 0, sizeof(tx->history_entry));
+        }
+        ok = 1;
+    }
+
+    ReplyMessage_pack_up_ctx(ctx, ok, NULL, 0);
+}
+
+static void MES_handler_Datagram_NACK(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    struct MES_dgram_tx_struct* tx = ctx->dgram_tx;
+    uint32_t seq = 0;
+    uint16_t count = 0;
+    uint16_t resent = 0, gone = 0;
+    uint8_t reply[4];
+    uint8_t i = 0;
+
+    /* NCAP 没在等这个回复，带上 MES_REPLY_FLAG_INTERNAL 让它挑出来 */
+    if(tx == NULL || !tx->enabled || message->dependent_Length < 1)
+    {
+        ReplyMessage_pack_up_ctx(ctx, MES_REPLY_FLAG_INTERNAL, NULL, 0);
+        return;
+    }
+
+    for(i = 0; i < message->dependent_load[0] && 1 + 6 * (i + 1) <= message->dependent_Length; i++)
+    {
+        memcpy(&seq, &message->dependent_load[1 + 6 * i], sizeof(seq));
+        memcpy(&count, &message->dependent_load[5 + 6 * i], sizeof(count));
+
+        /* 比历史还长的段后面肯定不在了 */
+        count = count > MES_DGRAM_HISTORY_MAX ? MES_DGRAM_HISTORY_MAX : count;
+        while(count-- > 0)
+        {
+            if(MES_dgram_resend(ctx, seq++))
+            {
+                resent++;
+            }else{
+                gone++;
+            }
+        }
+    }
+    tx->resent_count += resent;
+    tx->gone_count += gone;
+
+    memcpy(&reply[0], &resent, sizeof(resent));
+    memcpy(&reply[2], &gone, sizeof(gone));
+    ReplyMessage_pack_up_ctx(ctx, 1 | MES_REPLY_FLAG_INTERNAL, reply, sizeof(reply));
+}
+
+/* 记下会话号，采样环从 NCAP 收到的位置接着发；上传模式和触发状态一直没动，不用恢复 */
+static void MES_handler_Session_resume(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint8_t reply[1 + 5 * TC_MAX];
+    uint8_t resumed[TC_MAX] = { 0 };
+    uint32_t Offset = 0;
+    uint8_t count = 0;
+    uint8_t TC = 0;
+    uint8_t i = 0;
+
+    if(message->dependent_Length < 5)
+    {
+        ReplyMessage_pack_up_ctx(ctx, 0, NULL, 0);
+        return;
+    }
+    memcpy(&ctx->session_token, &message->dependent_load[0], sizeof(ctx->session_token));
+
+    /* NCAP 说了从哪里接着发，采样环可以发了 */
+    ctx->session_pending = 0;
+
+    /* 通道数是对方填的，回复最多装 TC_MAX 个通道，重复的通道只认第一个 */
+    for(i = 0; i < message->dependent_load[4] && 5 + 5 * (i + 1) <= message->dependent_Length && count < TC_MAX; i++)
+    {
+        TC = message->dependent_load[5 + 5 * i];
+        memcpy(&Offset, &message->dependent_load[6 + 5 * i], sizeof(Offset));
+        if(TC >= TC_MAX || TC_sample_ring[TC].load == NULL || resumed[TC])
+        {
+            continue;
+        }
+        resumed[TC] = 1;
+
+        Offset = TC_sample_ring_resume(TC, Offset);
+        reply[1 + 5 * count] = TC;
+        memcpy(&reply[2 + 5 * count], &Offset, sizeof(Offset));
+        count++;
+    }
+    reply[0] = count;
+
+    ReplyMessage_pack_up_ctx(ctx, 1, reply, 1 + 5 * count);
+}
+
+static void MES_handler_Data_Transmission_mode(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint8_t TC = message->Dest_TIM_and_TC_Num[TC_enum];
+    uint8_t i = 0;
+
+    /* NCAP 没认出会话号，重新走上线流程了，不会再有 Session_resume */
+    ctx->session_pending = 0;
+
+    /* 记下通道的上传模式，TC_MAX 表示所有通道 */
+    if(message->dependent_Length >= 1)
+    {
+        for(i = 0; i < TC_MAX; i++)
+        {
+            if(TC == TC_MAX || TC == i)
+            {
+                TC_Data_Transmission_mode[i] = (enum Data_Transmission_mode_enum)message->dependent_load[0];
+
+                /* 调度器初始化了的话，定时上传模式的通道启动定时器，其他模式停掉 */
+                if(TC_upload_sched.upload != NULL)
+                {
+                    if(TC_Data_Transmission_mode[i] == Interval || TC_Data_Transmission_mode[i] == Interval_1s)
+                    {
+                        TC_upload_sched_start(i, 0);
+                    }else{
+                        TC_upload_sched_stop(i);
+                    }
+                }
+            }
+        }
+    }
+
+    ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up(ctx);
+}
+
+static void MES_handler_TIM_initiated(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    (void)message;
+    ReplyMessage_TIM_initiated_pack_up(ctx);
+}
+
+static void MES_handler_Read_TC_data(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    uint32_t Offset = 0;
+    uint16_t max_segment_size = 0;
+
+    if(message->dependent_Length >= 4)
+    {
+        memcpy(&Offset, &message->dependent_load[0], sizeof(Offset));
+    }
+    if(message->dependent_Length >= 6)
+    {
+        memcpy(&max_segment_size, &message->dependent_load[4], sizeof(max_segment_size));
+    }
+
+    ReplyMessage_XdcrOperate_Read_TC_data_pack_up(ctx, message->Dest_TIM_and_TC_Num[TC_enum], Offset, max_segment_size);
+}
+
+static void MES_handler_Trigger(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    (void)message;
+    ctx->session_pending = 0;       /* 同 Data_Transmission_mode，重新走上线流程了 */
+    ReplyMessage_XdcrOperate_Trigger_pack_up(ctx);
+}
+
+static void MES_handler_Abort_Trigger(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    (void)message;
+    ReplyMessage_XdcrOperate_Abort_Trigger_pack_up(ctx);
+}
+
+/* 第二级表的静态池，前 3 块给库内置的 Command_class，在定义时候就填好，不用初始化 */
+static ReplyMessage_handler_t MES_handler_blocks[MES_HANDLER_CLASS_BLOCK_MAX][256] = 
+{
+    [0] = 
+    {
+        [Query_TEDS]            = MES_handler_Query_TEDS,
+        [Read_TEDS_segment]     = MES_handler_Read_TEDS_segment,
+        [Write_TEDS_segment]    = MES_handler_Write_TEDS_segment,
+        [Update_TEDS]           = MES_handler_Update_TEDS,
+        [Query_TC_TEDS_digest]  = MES_handler_Query_TC_TEDS_digest,
+        [Datagram_mode]         = MES_handler_Datagram_mode,
+        [Datagram_NACK]         = MES_handler_Datagram_NACK,
+        [Session_resume]        = MES_handler_Session_resume,
+    },
+    [1] = 
+    {
+        [Data_Transmission_mode]    = MES_handler_Data_Transmission_mode,
+        [TIM_ALL_TC_initiated]      = MES_handler_TIM_initiated,
+    },
+    [2] = 
+    {
+        [Read_TransducerChannel_data_set_segment]   = MES_handler_Read_TC_data,
+        [Trigger_command]                           = MES_handler_Trigger,
+        [Abort_Trigger]                             = MES_handler_Abort_Trigger,
+    },
+};
+static uint32_t MES_handler_blocks_used = 3;
+
+/* 第一级表，按 Command_class 索引，为 NULL 表示该 Command_class 下没有任何处理函数 */
+static ReplyMessage_handler_t* MES_handler_class_table[256] = 
+{
+    [CommonCmd]     = MES_handler_blocks[0],
+    [XdcrIdle]      = MES_handler_blocks[1],
+    [XdcrOperate]   = MES_handler_blocks[2],
+};
+
+/**************************** 命令处理函数注册，用户使用 ****************************/
+/* 注册某个 Command_class 下某个 Command_function 的处理函数，handler 填 NULL 即注销，
+    返回 1 成功，0 表示 MES_HANDLER_CLASS_BLOCK_MAX 个第二级表已经用完 */
+uint8_t ReplyMessage_Server_register_handler(uint8_t Command_class, uint8_t Command_function, ReplyMessage_handler_t handler)
+{
+    if(MES_handler_class_table[Command_class] == NULL)
+    {
+        if(handler == NULL)
+        {
+            return 1;   /* 本来就没有 */
+        }
+        if(MES_handler_blocks_used >= MES_HANDLER_CLASS_BLOCK_MAX)
+        {
+            return 0;
+        }
+        MES_handler_class_table[Command_class] = MES_handler_blocks[MES_handler_blocks_used++];
+    }
+
+    MES_handler_class_table[Command_class][Command_function] = handler;
+
+    return 1;
+}
+
+/**************************** 回复缓存，TIM 用 ****************************/
+/* 挂上时清空，之前存的帧一律不用 */
+void MES_ctx_attach_reply_cache(struct MES_ctx_struct* ctx, struct MES_reply_cache_struct* cache)
+{
+    ctx->reply_cache = cache;
+    if(cache == NULL)
+    {
+        return;
+    }
+
+    memset(cache->entry, 0, sizeof(cache->entry));
+    cache->use_clock = 0;
+    cache->hit_count = 0;
+    cache->miss_count = 0;
+}
+
+void MES_reply_cache_invalidate(void)
+{
+    __atomic_add_fetch(&TEDS_generation, 1, __ATOMIC_RELEASE);
+}
+
+/* 算请求的键填进 key，返回键映射到的那一组的第一项（组里 MES_REPLY_CACHE_WAYS 项）；
+    只缓存库自带的这两个处理函数，用户注册了自己的就不缓存，返回 NULL */
+static struct MES_reply_cache_entry_struct* MES_reply_cache_set(struct MES_reply_cache_struct* cache, 
+    const struct Message_view_struct* message, ReplyMessage_handler_t handler, struct MES_reply_cache_entry_struct* key)
+{
+    uint8_t TC = message->Dest_TIM_and_TC_Num[TC_enum];
+    uint32_t hash = 0;
+
+    key->TEDSOffset = 0;
+    if(handler == MES_handler_Read_TEDS_segment && message->dependent_Length >= 5)
+    {
+        memcpy(&key->TEDSOffset, &message->dependent_load[1], sizeof(key->TEDSOffset));
+    }else if(handler != MES_handler_Query_TEDS || message->dependent_Length < 1)
+    {
+        return NULL;
+    }
+
+    key->Command_function = message->Command_function;
+    key->which_TEDS = message->dependent_load[0];
+    key->TC = key->which_TEDS == TC_TEDS_ACCESS_CODE && TC < TC_MAX ? TC : TC_MAX;
+
+    /* 乘法只往高位进，乘完再把高位折回低位，取低位做下标 */
+    hash = key->TEDSOffset * 0x9E3779B1u + (((uint32_t)key->Command_function << 16) | ((uint32_t)key->TC << 8) | key->which_TEDS);
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+
+    return &cache->entry[(hash & (MES_REPLY_CACHE_ENTRIES / MES_REPLY_CACHE_WAYS - 1)) * MES_REPLY_CACHE_WAYS];
+}
+
+static uint8_t MES_reply_cache_same_key(const struct MES_reply_cache_entry_struct* entry, const struct MES_reply_cache_entry_struct* key)
+{
+    return entry->valid && entry->TEDSOffset == key->TEDSOffset && entry->Command_function == key->Command_function
+        && entry->which_TEDS == key->which_TEDS && entry->TC == key->TC;
+}
+
+/* 组里找这个键，找到了还要没过时才算命中 */
+static struct MES_reply_cache_entry_struct* MES_reply_cache_lookup(struct MES_reply_cache_entry_struct* set, 
+    const struct MES_reply_cache_entry_struct* key, uint32_t generation)
+{
+    struct MES_reply_cache_entry_struct* entry = NULL;
+    uint8_t attr_status[2];
+    uint32_t i = 0;
+
+    for(i = 0; i < MES_REPLY_CACHE_WAYS; i++)
+    {
+        if(MES_reply_cache_same_key(&set[i], key))
+        {
+            entry = &set[i];
+            break;
+        }
+    }
+    if(entry == NULL || entry->generation != generation || entry->segment_size_limit != TEDS_segment_size_limit)
+    {
+        return NULL;
+    }
+
+    /* 属性和状态不走发布，Query_TEDS 的帧里带着它们，对一下当前的 */
+    if(entry->Command_function == Query_TEDS && (!TEDS_attr_status_of(entry->which_TEDS, entry->TC, attr_status)
+        || entry->frame[REPLYMESSAGE_HEADER_SIZE] != attr_status[0] || entry->frame[REPLYMESSAGE_HEADER_SIZE + 1] != attr_status[1]))
+    {
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* 处理函数打包完、发送之前存，这时外挂的 TEDS 数据的引用还没放；Flag 为 0 的和整帧放不下的不存，
+    组里有这个键的旧帧就覆盖它，没有就用空的或最久没用的那项 */
+static void MES_reply_cache_fill(struct MES_ctx_struct* ctx, struct MES_reply_cache_entry_struct* set, 
+    const struct MES_reply_cache_entry_struct* key, uint32_t generation)
+{
+    struct MES_reply_cache_entry_struct* entry = &set[0];
+    uint32_t header_Length = ctx->Mes->ReplyMessage_load_Length;
+    uint32_t i = 0;
+
+    if(ctx->Mes->ReplyMessage_u->ReplyMessage.Flag != 1 || header_Length + ctx->Reply_payload_Length > MES_REPLY_CACHE_FRAME_SIZE)
+    {
+        return;
+    }
+
+    for(i = 0; i < MES_REPLY_CACHE_WAYS; i++)
+    {
+        if(MES_reply_cache_same_key(&set[i], key))
+        {
+            entry = &set[i];
+            break;
+        }
+        if(!set[i].valid || (entry->valid && set[i].last_use < entry->last_use))
+        {
+            entry = &set[i];
+        }
+    }
+
+    memcpy(entry->frame, ctx->Mes->ReplyMessage_u->ReplyMessage_load, header_Length);
+    if(ctx->Reply_payload_Length != 0)
+    {
+        memcpy(&entry->frame[header_Length], ctx->Reply_payload, ctx->Reply_payload_Length);
+    }
+    entry->frame_Length = (uint16_t)(header_Length + ctx->Reply_payload_Length);
+
+    entry->Command_function = key->Command_function;
+    entry->which_TEDS = key->which_TEDS;
+    entry->TC = key->TC;
+    entry->TEDSOffset = key->TEDSOffset;
+    entry->generation = generation;
+    entry->segment_size_limit = TEDS_segment_size_limit;
+    entry->last_use = ++ctx->reply_cache->use_clock;
+    entry->valid = 1;
+}
+
+/**************************** ReplyMessage 服务程序，自动解析 Message 并回复，用户使用  ****************************/
+/* 根据已经解析好的 Message 视图自动回应，用的都是 ctx 自己的缓存，
+    两次查表即找到处理函数，没有注册的命令回复 Flag 为 0；挂了回复缓存的读 TEDS 类命令先查缓存 */
+void ReplyMessage_Server_view_ctx(struct MES_ctx_struct* ctx, const struct Message_view_struct* message)
+{
+    ReplyMessage_handler_t* handlers = MES_handler_class_table[message->Command_class];
+    ReplyMessage_handler_t handler = handlers == NULL ? NULL : handlers[message->Command_function];
+    struct MES_reply_cache_entry_struct key;
+    struct MES_reply_cache_entry_struct* set = NULL;
+    struct MES_reply_cache_entry_struct* entry = NULL;
+    uint32_t generation = 0;
+
+    /* 挂了回复缓存的先查，命中直接把存的整帧发出去；代数要在打包之前取，打包期间 TEDS 变了存的就作废 */
+    if(ctx->reply_cache != NULL && handler != NULL)
+    {
+        generation = __atomic_load_n(&TEDS_generation, __ATOMIC_ACQUIRE);
+        set = MES_reply_cache_set(ctx->reply_cache, message, handler, &key);
+        entry = set == NULL ? NULL : MES_reply_cache_lookup(set, &key, generation);
+        if(entry != NULL)
+        {
+            entry->last_use = ++ctx->reply_cache->use_clock;
+            ctx->reply_cache->hit_count++;
+            MES_ctx_send(ctx, entry->frame, entry->frame_Length);
+            return;
+        }
+    }
+
+    if(handler != NULL)
+    {
+        handler(ctx, message);
+    }else
+    {
+        ReplyMessage_pack_up_ctx(ctx, 0, NULL, 0);
+    }
+
+    if(set != NULL)
+    {
+        ctx->reply_cache->miss_count++;
+        MES_reply_cache_fill(ctx, set, &key, generation);
+    }
+
+    ReplyMessage_send(ctx, message->Command_class, message->Command_function);
+}
+
+/* 填入接收到的消息字符串，会根据已经实现的消息解码字符串和自动回应，
+    这里用零拷贝的视图解析，不再把 Message 拷贝一遍 */
+void ReplyMessage_Server_ctx(struct MES_ctx_struct* ctx, uint8_t* received_mes_load)
+{
+    struct Message_view_struct message;
+
+    /* 本接口不带接收长度，认为 received_mes_load 至少为一个 Message_load 那么大 */
+    if(Message_decode_view(&message, received_mes_load, sizeof(ctx->Mes->Message_u->Message_load)) != MES_DECODE_OK)
+    {
+        return;
+    }
+
+    if(NEED_SWITCH_LITTLE_BIG_END)
+    {
+        MES_swap_fields(&received_mes_load[MESSAGE_HEADER_SIZE], message.dependent_Length, 
+            MES_schema_of(message.Command_class, message.Command_function, 0));
+    }
+
+    ReplyMessage_Server_view_ctx(ctx, &message);
+}
+
+void ReplyMessage_Server(uint8_t* received_mes_load)
+{
+    ReplyMessage_Server_ctx(&MES_ctx_default, received_mes_load);
+}
+
+
+                                    /*************\
+*************************************  字节流分帧  *****************************************************
+                                    \*************/
+
+void MES_stream_init(struct MES_stream_struct* stream)
+{
+    stream->head = 0;
+    stream->tail = 0;
+    stream->need = 0;
+    stream->Broken = 0;
+    stream->codec = &MES_codec_detect;
+}
+
+/* 取得可写的空间，缓存后面放不下 head 处那半帧（或者一点空间都没了）时才把它挪到缓存开头，
+    一轮缓存最多挪一次，不按最大帧算，不然后半个缓存几乎每收一次都要挪 */
+uint8_t* MES_stream_write_ptr(struct MES_stream_struct* stream, uint32_t* space)
+{
+    uint32_t need = stream->need > MESSAGE_HEADER_SIZE ? stream->need : MESSAGE_HEADER_SIZE;
+
+    if(stream->head == stream->tail)
+    {
+        stream->head = 0;
+        stream->tail = 0;
+    }else if(stream->head > 0 && (MES_STREAM_BUFFER_SIZE - stream->head < need || stream->tail == MES_STREAM_BUFFER_SIZE))
+    {
+        memmove(stream->buffer, &stream->buffer[stream->head], stream->tail - stream->head);
+        stream->tail -= stream->head;
+        stream->head = 0;
+    }
+
+    *space = MES_STREAM_BUFFER_SIZE - stream->tail;
+    return &stream->buffer[stream->tail];
+}
+
+void MES_stream_commit(struct MES_stream_struct* stream, uint32_t received_length)
+{
+    /* 限幅 */
+    received_length = received_length > MES_STREAM_BUFFER_SIZE - stream->tail ? \
+        MES_STREAM_BUFFER_SIZE - stream->tail : received_length;
+
+    stream->tail += received_length;
+}
+
+uint32_t MES_stream_feed(struct MES_stream_struct* stream, const uint8_t* data, uint32_t length)
+{
+    uint32_t space = 0;
+    uint8_t* write_ptr = MES_stream_write_ptr(stream, &space);
+
+    length = length > space ? space : length;
+    memcpy(write_ptr, data, length);
+    MES_stream_commit(stream, length);
+
+    return length;
+}
+
+enum MES_decode_result_enum MES_stream_next_Message(struct MES_stream_struct* stream, struct Message_view_struct* view)
+{
+    enum MES_decode_result_enum result;
+
+    if(stream->Broken)
+    {
+        return MES_DECODE_TOO_LONG;
+    }
+
+    /* 头里有命令，编解码把 dependent 在流的缓存里就地转好再给处理函数 */
+    view->frame_Length = 0;
+    result = stream->codec->Message_view(stream, view);
+    if(result == MES_DECODE_OK)
+    {
+        stream->head += view->frame_Length;
+        stream->need = 0;
+    }else if(result == MES_DECODE_INCOMPLETE)
+    {
+        stream->need = view->frame_Length;
+    }else if(result == MES_DECODE_TOO_LONG)
+    {
+        stream->Broken = 1;
+    }
+
+    return result;
+}
+
+enum MES_decode_result_enum MES_stream_next_ReplyMessage(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view)
+{
+    enum MES_decode_result_enum result;
+
+    if(stream->Broken)
+    {
+        return MES_DECODE_TOO_LONG;
+    }
+
+    view->frame_Length = 0;
+    result = stream->codec->ReplyMessage_view(stream, view);
+    if(result == MES_DECODE_OK)
+    {
+        stream->head += view->frame_Length;
+        stream->need = 0;
+    }else if(result == MES_DECODE_INCOMPLETE)
+    {
+        stream->need = view->frame_Length;
+    }else if(result == MES_DECODE_TOO_LONG)
+    {
+        stream->Broken = 1;
+    }
+
+    return result;
+}
+
+uint32_t MES_stream_serve_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream)
+{
+    struct Message_view_struct message;
+    uint32_t frame_cnt = 0;
+
+    while(MES_stream_next_Message(stream, &message) == MES_DECODE_OK)
+    {
+        ReplyMessage_Server_view_ctx(ctx, &message);
+        frame_cnt++;
+    }
+
+    return frame_cnt;
+}
+
+uint32_t MES_stream_dispatch_ReplyMessage(struct MES_stream_struct* stream, 
+    void (*on_reply)(void* user_data, const struct ReplyMessage_view_struct* reply), void* user_data)
+{
+    struct ReplyMessage_view_struct reply;
+    uint32_t frame_cnt = 0;
+
+    while(MES_stream_next_ReplyMessage(stream, &reply) == MES_DECODE_OK)
+    {
+        on_reply(user_data, &reply);
+        frame_cnt++;
+    }
+
+    return frame_cnt;
+}
+
+/* 等下一个完整的 ReplyMessage，流里没有就用 ctx 的 recv 接着收 */
+uint8_t MES_stream_wait_ReplyMessage_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    struct ReplyMessage_view_struct* reply)
+{
+    uint8_t* write_ptr = NULL;
+    uint32_t space = 0;
+    unsigned int recv_num = 0;
+
+    while(1)
+    {
+        switch(MES_stream_next_ReplyMessage(stream, reply))
+        {
+            case MES_DECODE_OK:
+                if(!MES_ctx_take_push(ctx, reply))
+                {
+                    return 1;
+                }
+                break;
+
+            case MES_DECODE_INCOMPLETE:
+                write_ptr = MES_stream_write_ptr(stream, &space);
+                recv_num = MES_ctx_recv(ctx, write_ptr, space);
+                if(recv_num == 0 || recv_num > space)
+                {
+                    return 0;
+                }
+                MES_stream_commit(stream, recv_num);
+                break;
+
+            default:
+                return 0;
+        }
+    }
+}
+
+void MES_ctx_attach_push(struct MES_ctx_struct* ctx, 
+    void (*on_push)(void* user_data, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length), void* user_data)
+{
+    ctx->on_push = on_push;
+    ctx->on_push_user_data = user_data;
+}
+
+uint8_t MES_ctx_take_push(struct MES_ctx_struct* ctx, const struct ReplyMessage_view_struct* reply)
+{
+    uint32_t Offset = 0;
+
+    /* Datagram_NACK 之类库自己发的命令的回复，没人等，丢掉 */
+    if(reply->Flag & MES_REPLY_FLAG_INTERNAL)
+    {
+        return 1;
+    }
+    if(!(reply->Flag & MES_REPLY_FLAG_PUSH))
+    {
+        return 0;
+    }
+
+    /* Offset 已经被编解码转好了 */
+    if(ctx->on_push != NULL && reply->dependent_Length >= 5)
+    {
+        memcpy(&Offset, &reply->dependent_load[1], sizeof(Offset));
+        ctx->on_push(ctx->on_push_user_data, reply->dependent_load[0], Offset, &reply->dependent_load[5], reply->dependent_Length - 5u);
+    }
+    return 1;
+}
+
+
+                                    /*************\
+*************************************  大小端转换  *****************************************************
+                                    \*************/
+
+/* 就地翻转 count 个 size 宽的元素，memcpy 进出不怕不对齐，编译器会把它和 bswap 合成一条指令 */
+static void MES_bswap_run(uint8_t* p, uint8_t size, uint32_t count)
+{
+    uint16_t v16 = 0;
+    uint32_t v32 = 0;
+    uint64_t v64 = 0;
+    uint32_t i = 0;
+
+    switch(size)
+    {
+        case 2:
+            for(i = 0; i < count; i++, p += 2)
+            {
+                memcpy(&v16, p, 2);
+                v16 = __builtin_bswap16(v16);
+                memcpy(p, &v16, 2);
+            }
+            break;
+        case 4:
+            for(i = 0; i < count; i++, p += 4)
+            {
+                memcpy(&v32, p, 4);
+                v32 = __builtin_bswap32(v32);
+                memcpy(p, &v32, 4);
+            }
+            break;
+        case 8:
+            for(i = 0; i < count; i++, p += 8)
+            {
+                memcpy(&v64, p, 8);
+                v64 = __builtin_bswap64(v64);
+                memcpy(p, &v64, 8);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void MES_swap_field_list(uint8_t* load, uint32_t length, const struct MES_field_struct* field, uint8_t field_count)
+{
+    uint8_t i = 0;
+
+    for(i = 0; i < field_count; i++)
+    {
+        if((uint32_t)field[i].offset + (uint32_t)field[i].size * field[i].count <= length)
+        {
+            MES_bswap_run(&load[field[i].offset], field[i].size, field[i].count);
+        }
+    }
+}
+
+void MES_swap_fields(uint8_t* load, uint32_t length, const struct MES_schema_struct* schema)
+{
+    uint32_t record = 0;
+
+    if(schema == NULL)
+    {
+        return;
+    }
+
+    MES_swap_field_list(load, length, schema->field, schema->field_count);
+
+    if(schema->repeat_stride != 0)
+    {
+        for(record = schema->repeat_offset; record + schema->repeat_stride <= length; record += schema->repeat_stride)
+        {
+            MES_swap_field_list(&load[record], schema->repeat_stride, schema->repeat_field, schema->repeat_field_count);
+        }
+    }
+}
+
+/* 库内置命令的字段表，和上面各个 pack_up 里 memcpy 的位置一一对应，改了 dependent 布局要一起改 */
+static const struct MES_field_struct MES_fields_TEDSOffset[] =        { {1, 4, 1} };                          /* which_TEDS（1）、TEDSOffset（4） */
+static const struct MES_field_struct MES_fields_Read_TC_data[] =      { {0, 4, 1}, {4, 2, 1} };               /* Offset（4）、max_segment_size（2） */
+static const struct MES_field_struct MES_fields_Query_TEDS_reply[] =  { {2, 4, 1}, {6, 2, 1}, {8, 4, 1} };    /* 总长度、Checksum、max_TEDS_size */
+static const struct MES_field_struct MES_fields_TC_TEDS_digest[] =    { {2, 4, 1}, {6, 2, 1} };               /* 每通道：总长度、Checksum */
+static const struct MES_field_struct MES_fields_Offset[] =            { {0, 4, 1} };                          /* 数据集 Offset（4） */
+static const struct MES_field_struct MES_fields_handshake[] =         { {0, 2, 1}, {2, 4, 1}, {6, 4, 1}, {10, 4, 1} };    /* 字节序标记、能力位图、最大数据段、会话号 */
+static const struct MES_field_struct MES_fields_Session_resume[] =    { {0, 4, 1} };                          /* 会话号 */
+static const struct MES_field_struct MES_fields_resume_TC[] =         { {1, 4, 1} };                          /* 每通道：通道号、位置 */
+static const struct MES_field_struct MES_fields_Datagram_mode[] =     { {1, 2, 3} };                          /* 会话号、端口、payload_max */
+static const struct MES_field_struct MES_fields_Datagram_NACK[] =     { {0, 4, 1}, {4, 2, 1} };               /* 每段：起始序号、个数 */
+static const struct MES_field_struct MES_fields_Datagram_NACK_reply[] = { {0, 2, 2} };                        /* 重发的、补不了的 */
+static const struct MES_field_struct MES_fields_dgram_header[] =      { {4, 2, 2}, {8, 4, 3} };               /* 数据报头：session、length，seq、Offset、timestamp_ms */
+
+static const struct MES_schema_struct MES_schema_TEDSOffset =         { MES_fields_TEDSOffset, 1, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_Read_TC_data =       { MES_fields_Read_TC_data, 2, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_Query_TEDS_reply =   { MES_fields_Query_TEDS_reply, 3, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_TC_TEDS_digest =     { NULL, 0, 1, TC_TEDS_DIGEST_SIZE, MES_fields_TC_TEDS_digest, 2 };
+static const struct MES_schema_struct MES_schema_Offset =             { MES_fields_Offset, 1, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_handshake =          { MES_fields_handshake, 4, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_Session_resume =      { MES_fields_Session_resume, 1, 5, 5, MES_fields_resume_TC, 1 };
+static const struct MES_schema_struct MES_schema_Session_resume_reply = { NULL, 0, 1, 5, MES_fields_resume_TC, 1 };
+static const struct MES_schema_struct MES_schema_Datagram_mode =      { MES_fields_Datagram_mode, 1, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_Datagram_NACK =      { NULL, 0, 1, 6, MES_fields_Datagram_NACK, 2 };
+static const struct MES_schema_struct MES_schema_Datagram_NACK_reply = { MES_fields_Datagram_NACK_reply, 1, 0, 0, NULL, 0 };
+static const struct MES_schema_struct MES_schema_dgram_header =       { MES_fields_dgram_header, 2, 0, 0, NULL, 0 };
+
+const struct MES_schema_struct* MES_schema_of(uint8_t Command_class, uint8_t Command_function, uint8_t is_reply)
+{
+    switch(Command_class)
+    {
+        case CommonCmd:
+            switch(Command_function)
+            {
+                case Query_TEDS:            return is_reply ? &MES_schema_Query_TEDS_reply : NULL;
+                case Read_TEDS_segment:     return &MES_schema_TEDSOffset;
+                case Write_TEDS_segment:    return is_reply ? NULL : &MES_schema_TEDSOffset;
+                case Query_TC_TEDS_digest:  return is_reply ? &MES_schema_TC_TEDS_digest : NULL;
+                case Datagram_mode:         return is_reply ? NULL : &MES_schema_Datagram_mode;
+                case Datagram_NACK:         return is_reply ? &MES_schema_Datagram_NACK_reply : &MES_schema_Datagram_NACK;
+                case Session_resume:        return is_reply ? &MES_schema_Session_resume_reply : &MES_schema_Session_resume;
+                default:                    return NULL;
+            }
+        case XdcrIdle:
+            switch(Command_function)
+            {
+                case TIM_ALL_TC_initiated:  return is_reply ? NULL : &MES_schema_handshake;
+                default:                    return NULL;
+            }
+        case XdcrOperate:
+            switch(Command_function)
+            {
+                case Read_TransducerChannel_data_set_segment:   return is_reply ? &MES_schema_Offset : &MES_schema_Read_TC_data;
+                default:                                        return NULL;
+            }
+        default:
+            return NULL;
+    }
+}
+
+/* TEDS 的字段表：按 TLV 的 Type 查值里一个元素的宽度，0 为单字节或字节串不用转，
+    和 IEEE1451_5_lib.h 里各个 TEDS 结构体的域一一对应 */
+static const uint8_t TEDS_M_width[16] = 
+{
+    [10] = 4, [11] = 4, [12] = 4,   /* OholdOff、SHoldOff、TestTime */
+    [13] = 2,                       /* MaxChan */
+};
+static const uint8_t TEDS_TC_width[40] = 
+{
+    [13] = 4, [14] = 4, [15] = 4,   /* LowLimit、HiLimit、OError */
+    [20] = 4, [21] = 4, [22] = 4, [23] = 4, [24] = 4, [25] = 4, [26] = 4,   /* UpdateT ~ TestTime */
+    [28] = 4, [29] = 4, [30] = 4,   /* InPropDl、OutPropD、TSError */
+    [37] = 4, [38] = 4,             /* Directon、DAngles（两个 float） */
+};
+static const uint8_t TEDS_PHY_width[32] = 
+{
+    [11] = 4,                       /* MaxBPS */
+    [12] = 2, [13] = 2,             /* MaxCDev、MaxRDev */
+    [16] = 2, [17] = 2, [18] = 2,   /* MinKeyL、MaxKeyL、MaxSDU */
+    [19] = 4, [20] = 4,             /* MinALat、MinTLat */
+    [23] = 2, [24] = 2,             /* RadioVer、MaxRetry */
+};
+
+uint8_t TEDS_swap(uint8_t* TEDS_load, uint32_t whole_length)
+{
+    const uint8_t* width = NULL;
+    uint32_t width_count = 0;
+    uint32_t pos = 4 + sizeof(struct TEDS_ID_struct);
+    uint32_t end = 0;
+    uint8_t Type = 0, Length = 0, size = 0;
+
+    if(whole_length < 4 + sizeof(struct TEDS_ID_struct) + 2)
+    {
+        return 0;
+    }
+    end = whole_length - 2;
+
+    switch(((const struct TEDS_ID_struct*)&TEDS_load[4])->access_code)
+    {
+        case M_TEDS_ACCESS_CODE:    width = TEDS_M_width;    width_count = sizeof(TEDS_M_width);     break;
+        case TC_TEDS_ACCESS_CODE:   width = TEDS_TC_width;   width_count = sizeof(TEDS_TC_width);    break;
+        case PHY_TEDS_ACCESS_CODE:  width = TEDS_PHY_width;  width_count = sizeof(TEDS_PHY_width);   break;
+        default:                    break;  /* UTN TEDS 和不认识的只转 Length 和 Checksum */
+    }
+
+    MES_bswap_run(TEDS_load, 4, 1);
+
+    while(width != NULL && pos + 2 <= end)
+    {
+        Type = TEDS_load[pos];
+        Length = TEDS_load[pos + 1];
+        if(pos + 2 + Length > end)
+        {
+            MES_bswap_run(&TEDS_load[end], 2, 1);
+            return 0;
+        }
+
+        size = Type < width_count ? width[Type] : 0;
+        if(size != 0 && Length % size == 0)
+        {
+            MES_bswap_run(&TEDS_load[pos + 2], size, Length / size);
+        }
+        pos += 2 + Length;
+    }
+
+    MES_bswap_run(&TEDS_load[end], 2, 1);
+
+    return 1;
+}
+
+uint8_t MES_stream_wait_ReplyMessage_as_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    struct ReplyMessage_view_struct* reply, uint8_t Command_class, uint8_t Command_function)
+{
+    if(!MES_stream_wait_ReplyMessage_ctx(ctx, stream, reply))
+    {
+        return 0;
+    }
+
+    /* 视图指向流自己的接收缓存，就地转 */
+    stream->codec->ReplyMessage_dependent(&stream->buffer[reply->dependent_load - stream->buffer], reply->dependent_Length, 
+        Command_class, Command_function);
+
+    return 1;
+}
+
+/**************************** 每连接的编解码 ****************************/
+/* 不转 */
+static enum MES_decode_result_enum MES_codec_native_Message_view(struct MES_stream_struct* stream, struct Message_view_struct* view)
+{
+    return MES_decode_Message_view(view, &stream->buffer[stream->head], stream->tail - stream->head, 0);
+}
+
+static enum MES_decode_result_enum MES_codec_native_ReplyMessage_view(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view)
+{
+    return MES_decode_ReplyMessage_view(view, &stream->buffer[stream->head], stream->tail - stream->head, 0);
+}
+
+static void MES_codec_native_ReplyMessage_dependent(uint8_t* load, uint32_t length, uint8_t Command_class, uint8_t Command_function)
+{
+    (void)load;
+    (void)length;
+    (void)Command_class;
+    (void)Command_function;
+}
+
+static void MES_codec_native_Message_encode(uint8_t* Message_load, uint8_t to_peer)
+{
+    (void)Message_load;
+    (void)to_peer;
+}
+
+static uint8_t MES_codec_native_TEDS(uint8_t* TEDS_load, uint32_t whole_length)
+{
+    (void)TEDS_load;
+    (void)whole_length;
+    return 1;
+}
+
+/* 都转 */
+static enum MES_decode_result_enum MES_codec_swap_Message_view(struct MES_stream_struct* stream, struct Message_view_struct* view)
+{
+    enum MES_decode_result_enum result = MES_decode_Message_view(view, &stream->buffer[stream->head], stream->tail - stream->head, 1);
+
+    if(result == MES_DECODE_OK)
+    {
+        MES_swap_fields(&stream->buffer[stream->head + MESSAGE_HEADER_SIZE], view->dependent_Length, 
+            MES_schema_of(view->Command_class, view->Command_function, 0));
+    }
+
+    return result;
+}
+
+static enum MES_decode_result_enum MES_codec_swap_ReplyMessage_view(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view)
+{
+    enum MES_decode_result_enum result = MES_decode_ReplyMessage_view(view, &stream->buffer[stream->head], stream->tail - stream->head, 1);
+
+    /* 推的采样自己带格式，不用等调用者告诉命令，这里就把 Offset 转好 */
+    if(result == MES_DECODE_OK && (view->Flag & MES_REPLY_FLAG_PUSH) && view->dependent_Length >= 5)
+    {
+        MES_bswap_run(&stream->buffer[stream->head + REPLYMESSAGE_HEADER_SIZE + 1], 4, 1);
+    }
+
+    return result;
+}
+
+static void MES_codec_swap_ReplyMessage_dependent(uint8_t* load, uint32_t length, uint8_t Command_class, uint8_t Command_function)
+{
+    MES_swap_fields(load, length, MES_schema_of(Command_class, Command_function, 1));
+}
+
+/* 转过去时 dependent_Length 还是本平台的，转回来时已经是对方的 */
+static void MES_codec_swap_Message_encode(uint8_t* Message_load, uint8_t to_peer)
+{
+    uint16_t dependent_Length = 0;
+
+    memcpy(&dependent_Length, &Message_load[4], sizeof(dependent_Length));
+    if(!to_peer)
+    {
+        dependent_Length = __builtin_bswap16(dependent_Length);
+    }
+    dependent_Length = dependent_Length > MAX_Message_dependent_SIZE ? MAX_Message_dependent_SIZE : dependent_Length;
+
+    MES_swap_fields(&Message_load[MESSAGE_HEADER_SIZE], dependent_Length, MES_schema_of(Message_load[2], Message_load[3], 0));
+    MES_bswap_run(&Message_load[4], 2, 1);
+}
+
+/* 看第一帧：带握手的 TIM_initiated 按字节序标记选，别的帧（包括老 TIM 不带握手的 TIM_initiated）用 MES_CODEC_DEFAULT，
+    选好就把流的编解码换掉，之后的帧不再经过这里；
+    NEED_SWITCH_LITTLE_BIG_END 为 1 时对方也是收的时候转，不按握手选，不然会转两次 */
+static enum MES_decode_result_enum MES_codec_detect_Message_view(struct MES_stream_struct* stream, struct Message_view_struct* view)
+{
+    const uint8_t* load = &stream->buffer[stream->head];
+    uint32_t length = stream->tail - stream->head;
+    uint16_t dependent_Length = 0;
+    uint16_t mark = 0;
+
+    if(length < MESSAGE_HEADER_SIZE)
+    {
+        return MES_DECODE_INCOMPLETE;
+    }
+
+    if(!NEED_SWITCH_LITTLE_BIG_END && load[2] == XdcrIdle && load[3] == TIM_ALL_TC_initiated && (load[4] != 0 || load[5] != 0))
+    {
+        if(length < MESSAGE_HEADER_SIZE + sizeof(mark))
+        {
+            return MES_DECODE_INCOMPLETE;
+        }
+        memcpy(&dependent_Length, &load[4], sizeof(dependent_Length));
+        memcpy(&mark, &load[MESSAGE_HEADER_SIZE], sizeof(mark));
+
+        if(mark == MES_BYTE_ORDER_MARK && dependent_Length >= MES_HANDSHAKE_SIZE)
+        {
+            stream->codec = &MES_codec_native;
+        }else if(mark == __builtin_bswap16(MES_BYTE_ORDER_MARK) && __builtin_bswap16(dependent_Length) >= MES_HANDSHAKE_SIZE)
+        {
+            stream->codec = &MES_codec_swap;
+        }else{
+            stream->codec = MES_CODEC_DEFAULT;
+        }
+    }else{
+        stream->codec = MES_CODEC_DEFAULT;
+    }
+
+    return stream->codec->Message_view(stream, view);
+}
+
+static enum MES_decode_result_enum MES_codec_detect_ReplyMessage_view(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view)
+{
+    stream->codec = MES_CODEC_DEFAULT;
+    return stream->codec->ReplyMessage_view(stream, view);
+}
+
+const struct MES_codec_struct MES_codec_native = 
+{
+    .swap                   = 0,
+    .Message_view           = MES_codec_native_Message_view,
+    .ReplyMessage_view      = MES_codec_native_ReplyMessage_view,
+    .ReplyMessage_dependent = MES_codec_native_ReplyMessage_dependent,
+    .Message_encode         = MES_codec_native_Message_encode,
+    .TEDS                   = MES_codec_native_TEDS,
+};
+
+const struct MES_codec_struct MES_codec_swap = 
+{
+    .swap                   = 1,
+    .Message_view           = MES_codec_swap_Message_view,
+    .ReplyMessage_view      = MES_codec_swap_ReplyMessage_view,
+    .ReplyMessage_dependent = MES_codec_swap_ReplyMessage_dependent,
+    .Message_encode         = MES_codec_swap_Message_encode,
+    .TEDS                   = TEDS_swap,
+};
+
+/* NEED_SWITCH_LITTLE_BIG_END 的老做法：两边都只在收的时候转，发的不转 */
+const struct MES_codec_struct MES_codec_swap_rx = 
+{
+    .swap                   = 1,
+    .Message_view           = MES_codec_swap_Message_view,
+    .ReplyMessage_view      = MES_codec_swap_ReplyMessage_view,
+    .ReplyMessage_dependent = MES_codec_swap_ReplyMessage_dependent,
+    .Message_encode         = MES_codec_native_Message_encode,
+    .TEDS                   = TEDS_swap,
+};
+
+/* 还没收到第一帧时别的操作按 MES_CODEC_DEFAULT 来 */
+const struct MES_codec_struct MES_codec_detect = 
+{
+    .swap                   = NEED_SWITCH_LITTLE_BIG_END,
+    .Message_view           = MES_codec_detect_Message_view,
+    .ReplyMessage_view      = MES_codec_detect_ReplyMessage_view,
+#if NEED_SWITCH_LITTLE_BIG_END
+    .ReplyMessage_dependent = MES_codec_swap_ReplyMessage_dependent,
+    .Message_encode         = MES_codec_native_Message_encode,
+    .TEDS                   = TEDS_swap,
+#else
+    .ReplyMessage_dependent = MES_codec_native_ReplyMessage_dependent,
+    .Message_encode         = MES_codec_native_Message_encode,
+    .TEDS                   = MES_codec_native_TEDS,
+#endif
+};
+
+uint8_t MES_ctx_negotiate(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, const struct Message_view_struct* message)
+{
+    uint16_t mark = 0;
+
+    ctx->codec = stream->codec == &MES_codec_detect ? MES_CODEC_DEFAULT : stream->codec;
+    ctx->link_id = MES_ctx_new_link_id();   /* 收到 TIM_initiated 就是新连接，ctx 复用也不沿用上次的 TIM 身份 */
+    ctx->peer_caps = 0;
+    ctx->peer_max_segment_size = 0;
+    ctx->peer_session_token = 0;
+
+    if(message->Command_class != XdcrIdle || message->Command_function != TIM_ALL_TC_initiated 
+        || message->dependent_Length < MES_HANDSHAKE_SIZE)
+    {
+        return 0;
+    }
+
+    /* 流的编解码已经转成本平台的了 */
+    memcpy(&mark, &message->dependent_load[0], sizeof(mark));
+    if(mark != MES_BYTE_ORDER_MARK)
+    {
+        return 0;
+    }
+    memcpy(&ctx->peer_caps, &message->dependent_load[2], sizeof(ctx->peer_caps));
+    memcpy(&ctx->peer_max_segment_size, &message->dependent_load[6], sizeof(ctx->peer_max_segment_size));
+    if(message->dependent_Length >= MES_HANDSHAKE_SESSION_SIZE)
+    {
+        memcpy(&ctx->peer_session_token, &message->dependent_load[10], sizeof(ctx->peer_session_token));
+    }
+
+    return 1;
+}
+
+                                    /*************\
+*************************************   数据集部分  *****************************************************
+                                    \*************/
+
+struct TC_data_set_struct TC_data_set[TC_MAX];
+
+uint32_t TC_data_segment_size_limit = MAX_TC_data_segment_SIZE;
+
+/* TIM 用：绑定 / 更新某个传感器通道的数据集 */
+void TC_data_set_bind(uint8_t TC, const uint8_t* load, uint32_t length)
+{
+    if(TC >= TC_MAX)
+    {
+        return;
+    }
+
+    TC_data_set[TC].load = load;
+    TC_data_set[TC].length = load == NULL ? 0 : length;
+}
+
+/* 把一个数据集回复拷进 dest，返回本帧数据字节数，坏帧或 Flag 为 0 返回 0 */
+static uint32_t TC_data_set_take_reply(const struct ReplyMessage_view_struct* reply, uint8_t* dest, uint32_t length)
+{
+    uint32_t Offset = 0;
+    uint32_t data_length = 0;
+
+    if(!reply->Flag || reply->dependent_Length < 4)
+    {
+        return 0;
+    }
+
+    memcpy(&Offset, reply->dependent_load, sizeof(Offset));
+    data_length = reply->dependent_Length - 4;
+    if(Offset >= length)
+    {
+        return 0;
+    }
+    data_length = data_length > length - Offset ? length - Offset : data_length;
+
+    memcpy(&dest[Offset], &reply->dependent_load[4], data_length);
+
+    return data_length;
+}
+
+/* NCAP 用：流水线拉取一个传感器通道的整个数据集，
+    TIM 按顺序处理命令，TCP 保证回复按顺序到，回复对应的是最早那个在途请求，用 Offset 核对；
+    TIM 推的采样在等回复时已经挑走了，Offset 对不上的不是这次拉取的回复，不算 */
+uint32_t TC_data_set_pull_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t* dest, uint32_t length, uint16_t segment_size, uint32_t window)
+{
+    struct ReplyMessage_view_struct reply;
+    uint32_t received = 0;
+    uint32_t next_Offset = 0;
+    uint32_t expect_Offset = 0;
+    uint32_t reply_Offset = 0;
+    uint32_t in_flight = 0;
+    uint32_t data_length = 0;
+    uint8_t end_of_set = 0;
+
+    if(length == 0)
+    {
+        return 0;
+    }
+    window = window == 0 ? 1 : window;
+
+    /* 第一个请求单独发，TIM 回复的长度就是实际的段大小 */
+    Message_XdcrOperate_Read_TC_data_segment_pack_up_ctx(ctx, Dest_TIM, Dest_TC, 0, segment_size);
+    Message_pack_up_And_send_ctx(ctx);
+    MES_txq_flush_ctx(ctx);
+    if(!MES_stream_wait_ReplyMessage_as_ctx(ctx, stream, &reply, XdcrOperate, Read_TransducerChannel_data_set_segment))
+    {
+        return 0;
+    }
+    if(reply.Flag && reply.dependent_Length >= 4)
+    {
+        memcpy(&reply_Offset, reply.dependent_load, sizeof(reply_Offset));
+    }
+    data_length = reply_Offset == 0 ? TC_data_set_take_reply(&reply, dest, length) : 0;
+    if(data_length == 0)
+    {
+        return 0;
+    }
+    received = data_length;
+    next_Offset = data_length;
+    segment_size = (uint16_t)data_length;
+
+    while(received < length && !(end_of_set && in_flight == 0))
+    {
+        /* 补满窗口，一批请求一起冲刷 */
+        while(!end_of_set && in_flight < window && next_Offset < length)
+        {
+            Message_XdcrOperate_Read_TC_data_segment_pack_up_ctx(ctx, Dest_TIM, Dest_TC, next_Offset, segment_size);
+            Message_pack_up_And_send_ctx(ctx);
+            next_Offset += segment_size;
+            in_flight++;
+        }
+        MES_txq_flush_ctx(ctx);
+
+        if(in_flight == 0)
+        {
+            break;
+        }
+        if(!MES_stream_wait_ReplyMessage_as_ctx(ctx, stream, &reply, XdcrOperate, Read_TransducerChannel_data_set_segment))
+        {
+            break;
+        }
+
+        /* Flag 为 0 的没有 Offset，按顺序就是最早那个请求失败了 */
+        expect_Offset = next_Offset - in_flight * segment_size;
+        if(reply.Flag)
+        {
+            if(reply.dependent_Length < 4)
+            {
+                continue;
+            }
+            memcpy(&reply_Offset, reply.dependent_load, sizeof(reply_Offset));
+            if(reply_Offset != expect_Offset)
+            {
+                continue;
+            }
+        }
+        in_flight--;
+
+        data_length = TC_data_set_take_reply(&reply, dest, length);
+        if(data_length < segment_size)
+        {
+            end_of_set = 1; /* 数据集比 length 短，后面的请求都会失败，不再发新的 */
+        }
+        if(expect_Offset == received)
+        {
+            received += data_length;
+        }
+    }
+
+    /* 提前结束的话把剩下在途的回复收掉，别留在流里 */
+    while(in_flight > 0 && MES_stream_wait_ReplyMessage_ctx(ctx, stream, &reply))
+    {
+        in_flight--;
+    }
+
+    return received;
+}
+
+                                    /*************\
+*************************************  采样环形缓存部分  *****************************************************
+                                    \*************/
+
+struct TC_sample_ring_struct TC_sample_ring[TC_MAX];
+
+enum Data_Transmission_mode_enum TC_Data_Transmission_mode[TC_MAX];     /* Message_init() 里填 OnCommand */
+
+/* TIM 用：给传感器通道挂上环形缓存，应在采集和发送线程开始之前调用 */
+uint8_t TC_sample_ring_init(uint8_t TC, uint8_t* load, uint32_t half_size, 
+    void (*wake)(void* user_data, uint8_t TC), void* wake_user_data)
+{
+    struct TC_sample_ring_struct* ring = NULL;
+
+    if(TC >= TC_MAX)
+    {
+        return 0;
+    }
+    ring = &TC_sample_ring[TC];
+
+    /* 位置是 uint32_t 累计值，缓存大小为 2 的幂时回绕后取模仍然连续 */
+    if(load != NULL && (half_size == 0 || (half_size & (half_size - 1)) != 0 || half_size > MAX_TC_data_segment_SIZE))
+    {
+        return 0;
+    }
+
+    ring->load = load;
+    ring->half_size = load == NULL ? 0 : half_size;
+    ring->write_pos = 0;
+    ring->read_pos = 0;
+    ring->ship_pos = 0;
+    ring->overrun_bytes = 0;
+    ring->wake = wake;
+    ring->wake_user_data = wake_user_data;
+
+    return 1;
+}
+
+/* 生产者用：推入采样 */
+uint32_t TC_sample_ring_push(uint8_t TC, const uint8_t* samples, uint32_t length)
+{
+    struct TC_sample_ring_struct* ring = NULL;
+    uint32_t size = 0, write_pos = 0, read_pos = 0, free_size = 0, index = 0, first = 0;
+
+    if(TC >= TC_MAX || TC_sample_ring[TC].load == NULL)
+    {
+        return 0;
+    }
+    ring = &TC_sample_ring[TC];
+    size = ring->half_size * 2;
+
+    /* write_pos 只有自己写，不用原子；read_pos 要 acquire，保证消费者发完之后才覆盖 */
+    write_pos = ring->write_pos;
+    read_pos = __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE);
+    free_size = size - (write_pos - read_pos);
+
+    if(length > free_size)
+    {
+        __atomic_fetch_add(&ring->overrun_bytes, length - free_size, __ATOMIC_RELAXED);
+        length = free_size;
+    }
+    if(length == 0)
+    {
+        return 0;
+    }
+
+    /* 到缓存尾部的部分和回绕到头部的部分 */
+    index = write_pos & (size - 1);
+    first = length > size - index ? size - index : length;
+    memcpy(&ring->load[index], samples, first);
+    memcpy(&ring->load[0], &samples[first], length - first);
+
+    /* release：消费者看到新位置时数据一定已经写进去了 */
+    __atomic_store_n(&ring->write_pos, write_pos + length, __ATOMIC_RELEASE);
+
+    /* 越过半个缓存的边界，即又写满了一半 */
+    if(TC_Data_Transmission_mode[TC] == BufferHalfFull && ring->wake != NULL 
+        && write_pos / ring->half_size != (write_pos + length) / ring->half_size)
+    {
+        ring->wake(ring->wake_user_data, TC);
+    }
+
+    return length;
+}
+
+/* 发出一半后还给生产者；有会话号的连接最近发的这一半留着，断线重连后可以补发 */
+static void TC_sample_ring_release(struct MES_ctx_struct* ctx, struct TC_sample_ring_struct* ring)
+{
+    uint32_t read_pos = ctx->session_token != 0 ? ring->ship_pos - ring->half_size : ring->ship_pos;
+
+    /* release：消费者发完之后生产者才覆盖 */
+    if((int32_t)(read_pos - ring->read_pos) > 0)
+    {
+        __atomic_store_n(&ring->read_pos, read_pos, __ATOMIC_RELEASE);
+    }
+}
+
+/* 消费者用：发出写满的半个缓存 */
+uint32_t TC_sample_ring_ship_ctx(struct MES_ctx_struct* ctx, uint8_t TC)
+{
+    struct TC_sample_ring_struct* ring = NULL;
+    struct ReplyMessage_struct* reply = &ctx->Mes->ReplyMessage_u->ReplyMessage;
+    uint32_t ship_pos = 0, write_pos = 0, shipped = 0;
+
+    /* 带会话号重连后 NCAP 还没说从哪里接着发 */
+    if(TC >= TC_MAX || TC_sample_ring[TC].load == NULL || ctx->session_pending)
+    {
+        return 0;
+    }
+    ring = &TC_sample_ring[TC];
+
+    write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+    while(write_pos - ring->ship_pos >= ring->half_size)
+    {
+        ship_pos = ring->ship_pos;
+
+        /* 这个连接开了数据报就走 UDP，发不出去的在发送历史里，NCAP 会请重发，所以不等 */
+        if(MES_dgram_send_ctx(ctx, TC, ship_pos, &ring->load[ship_pos & (ring->half_size * 2 - 1)], ring->half_size) != 0)
+        {
+            ring->ship_pos += ring->half_size;
+            TC_sample_ring_release(ctx, ring);
+            shipped++;
+            continue;
+        }
+
+        /* 推的采样：通道号（1 byte） + Offset（4 byte） + 数据，ship_pos 总是半个缓存对齐，这一半在内存里是连续的 */
+        reply->Flag = 1 | MES_REPLY_FLAG_PUSH;
+        reply->dependent_Length = (uint16_t)(5 + ring->half_size);
+        reply->dependent_load[0] = TC;
+        memcpy(&(reply->dependent_load[1]), &ship_pos, sizeof(ship_pos));
+
+        ctx->Reply_payload = &ring->load[ship_pos & (ring->half_size * 2 - 1)];
+        ctx->Reply_payload_Length = ring->half_size;
+        ctx->Reply_payload_direct = 1;
+        ctx->Mes->ReplyMessage_load_Length = REPLYMESSAGE_HEADER_SIZE + 5;
+
+        if(!ReplyMessage_send(ctx, XdcrOperate, Read_TransducerChannel_data_set_segment))
+        {
+            break;
+        }
+
+        /* 发完了才把这一半还给生产者 */
+        ring->ship_pos += ring->half_size;
+        TC_sample_ring_release(ctx, ring);
+        shipped++;
+    }
+
+    return shipped;
+}
+
+uint32_t TC_sample_ring_ship(uint8_t TC)
+{
+    return TC_sample_ring_ship_ctx(&MES_ctx_default, TC);
+}
+
+uint32_t TC_sample_ring_resume(uint8_t TC, uint32_t Offset)
+{
+    struct TC_sample_ring_struct* ring = NULL;
+
+    if(TC >= TC_MAX || TC_sample_ring[TC].load == NULL)
+    {
+        return 0;
+    }
+    ring = &TC_sample_ring[TC];
+
+    /* 只能退回还留着的 [read_pos, ship_pos]，生产者写不到这段；NCAP 说收到的比发的还多就不动 */
+    Offset &= ~(ring->half_size - 1);
+    if((int32_t)(Offset - ring->read_pos) < 0)
+    {
+        Offset = ring->read_pos;
+    }
+    if((int32_t)(Offset - ring->ship_pos) > 0)
+    {
+        Offset = ring->ship_pos;
+    }
+    ring->ship_pos = Offset;
+
+    return Offset;
+}
+
+                                    /*************\
+*************************************   定时上传部分  *****************************************************
+                                    \*************/
+
+struct TC_upload_sched_struct TC_upload_sched;
+
+static void TC_upload_timer_unlink(struct TC_upload_timer_struct* timer)
+{
+    if(timer->pprev == NULL)
+    {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if(timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* 按离到期还有多久放进对应层的槽，太远的先放三层最远的槽，下落时再重新放 */
+static void TC_upload_timer_insert(struct TC_upload_timer_struct* timer)
+{
+    struct TC_upload_timer_struct** slot = NULL;
+    uint32_t delta = timer->expire_ms - TC_upload_sched.now_ms;
+    uint32_t target = timer->expire_ms;
+
+    if((int32_t)delta < 0)
+    {
+        delta = 0;
+        target = TC_upload_sched.now_ms;
+    }
+
+    if(delta < TC_UPLOAD_WHEEL_0_SIZE)
+    {
+        slot = &TC_upload_sched.wheel_0[target & (TC_UPLOAD_WHEEL_0_SIZE - 1)];
+    }else if(delta < (1UL << (TC_UPLOAD_WHEEL_0_BITS + TC_UPLOAD_WHEEL_N_BITS)))
+    {
+        slot = &TC_upload_sched.wheel_1[(target >> TC_UPLOAD_WHEEL_0_BITS) & (TC_UPLOAD_WHEEL_N_SIZE - 1)];
+    }else{
+        if(delta >= (1UL << (TC_UPLOAD_WHEEL_0_BITS + 2 * TC_UPLOAD_WHEEL_N_BITS)))
+        {
+            target = TC_upload_sched.now_ms + (1UL << (TC_UPLOAD_WHEEL_0_BITS + 2 * TC_UPLOAD_WHEEL_N_BITS)) - 1;
+        }
+        slot = &TC_upload_sched.wheel_2[(target >> (TC_UPLOAD_WHEEL_0_BITS + TC_UPLOAD_WHEEL_N_BITS)) & (TC_UPLOAD_WHEEL_N_SIZE - 1)];
+    }
+
+    timer->next = *slot;
+    if(timer->next != NULL)
+    {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/* 高层的一个槽到点了，里面的定时器按剩余时间重新放，落到低层 */
+static void TC_upload_sched_cascade(struct TC_upload_timer_struct** slot)
+{
+    struct TC_upload_timer_struct* timer = NULL;
+
+    while(*slot != NULL)
+    {
+        timer = *slot;
+        TC_upload_timer_unlink(timer);
+        TC_upload_timer_insert(timer);
+    }
+}
+
+void TC_upload_sched_init(uint32_t now_ms, void (*upload)(void* user_data, uint8_t TC, uint32_t late_ms), void* user_data)
+{
+    uint8_t i = 0;
+
+    memset(&TC_upload_sched, 0, sizeof(TC_upload_sched));
+    TC_upload_sched.now_ms = now_ms;
+    TC_upload_sched.upload = upload;
+    TC_upload_sched.user_data = user_data;
+
+    for(i = 0; i < TC_MAX; i++)
+    {
+        TC_upload_sched.timer[i].TC = i;
+    }
+}
+
+/* TEDS 里的时间是秒（Float32），转成毫秒，至少 1ms */
+uint32_t TC_upload_period_from_TEDS(uint8_t TC, enum Data_Transmission_mode_enum mode)
+{
+    float period_s = 0;
+
+    if(mode == Interval_1s)
+    {
+        return 1000;
+    }
+
+    /* 通道有自己的 TC TEDS 就用自己的，没有用共用的 */
+    period_s = TEDS_TC_period_s(TC);
+    if(!(period_s > 0))
+    {
+        return TC_UPLOAD_DEFAULT_PERIOD_MS;
+    }
+
+    return period_s * 1000 < 1 ? 1 : (uint32_t)(period_s * 1000 + 0.5f);
+}
+
+void TC_upload_sched_start(uint8_t TC, uint32_t period_ms)
+{
+    struct TC_upload_timer_struct* timer = NULL;
+
+    if(TC >= TC_MAX)
+    {
+        return;
+    }
+    timer = &TC_upload_sched.timer[TC];
+
+    TC_upload_timer_unlink(timer);
+
+    if(period_ms == 0)
+    {
+        period_ms = TC_upload_period_from_TEDS(TC, TC_Data_Transmission_mode[TC]);
+    }
+
+    timer->period_ms = period_ms;
+    timer->expire_ms = TC_upload_sched.now_ms + period_ms;
+    timer->active = 1;
+    TC_upload_timer_insert(timer);
+}
+
+void TC_upload_sched_stop(uint8_t TC)
+{
+    if(TC >= TC_MAX)
+    {
+        return;
+    }
+
+    TC_upload_timer_unlink(&TC_upload_sched.timer[TC]);
+    TC_upload_sched.timer[TC].active = 0;
+}
+
+/* 推进时间轮，每 1ms 一步：一层转完一圈先把上层对应槽落下来，再触发一层当前槽里的所有定时器 */
+uint32_t TC_upload_sched_tick(uint32_t now_ms)
+{
+    struct TC_upload_timer_struct** slot = NULL;
+    struct TC_upload_timer_struct* timer = NULL;
+    uint32_t tick = 0, late_ms = 0, fired = 0;
+
+    while((int32_t)(now_ms - TC_upload_sched.now_ms) > 0)
+    {
+        tick = ++TC_upload_sched.now_ms;
+
+        if((tick & (TC_UPLOAD_WHEEL_0_SIZE - 1)) == 0)
+        {
+            if(((tick >> TC_UPLOAD_WHEEL_0_BITS) & (TC_UPLOAD_WHEEL_N_SIZE - 1)) == 0)
+            {
+                TC_upload_sched_cascade(&TC_upload_sched.wheel_2[(tick >> (TC_UPLOAD_WHEEL_0_BITS + TC_UPLOAD_WHEEL_N_BITS)) & (TC_UPLOAD_WHEEL_N_SIZE - 1)]);
+            }
+            TC_upload_sched_cascade(&TC_upload_sched.wheel_1[(tick >> TC_UPLOAD_WHEEL_0_BITS) & (TC_UPLOAD_WHEEL_N_SIZE - 1)]);
+        }
+
+        /* 重新放回去的至少在 1ms 之后，不会落回当前槽 */
+        slot = &TC_upload_sched.wheel_0[tick & (TC_UPLOAD_WHEEL_0_SIZE - 1)];
+        while(*slot != NULL)
+        {
+            timer = *slot;
+            TC_upload_timer_unlink(timer);
+
+            late_ms = now_ms - timer->expire_ms;
+            timer->last_late_ms = late_ms;
+            timer->max_late_ms = late_ms > timer->max_late_ms ? late_ms : timer->max_late_ms;
+            timer->fire_count++;
+
+            /* 按原来的相位排下一次，不累积漂移；tick 间隔超过周期错过的直接跳过 */
+            timer->expire_ms += timer->period_ms;
+            while((int32_t)(timer->expire_ms - now_ms) <= 0)
+            {
+                timer->expire_ms += timer->period_ms;
+                timer->missed_count++;
+            }
+            TC_upload_timer_insert(timer);
+            fired++;
+
+            if(TC_upload_sched.upload != NULL)
+            {
+                TC_upload_sched.upload(TC_upload_sched.user_data, timer->TC, late_ms);
+            }
+        }
+    }
+
+    return fired;
+}
+
+                                    /*************\
+*************************************  数据报上传部分  *****************************************************
+                                    \*************/
+
+#define MES_DGRAM_SLOT_EMPTY        0
+#define MES_DGRAM_SLOT_MISSING      1
+#define MES_DGRAM_SLOT_ARRIVED      2
+
+void MES_ctx_attach_dgram_tx(struct MES_ctx_struct* ctx, struct MES_dgram_tx_struct* tx, 
+    unsigned int (*sendv)(void* user_data, uint16_t port, const struct MES_iovec_struct* iov, unsigned int iovcnt), 
+    void* user_data, uint32_t (*now_ms)(void))
+{
+    if(tx != NULL)
+    {
+        memset(tx, 0, sizeof(*tx));
+        tx->sendv = sendv;
+        tx->user_data = user_data;
+        tx->now_ms = now_ms;
+        tx->payload_max = MES_DGRAM_PAYLOAD_MAX;
+    }
+    ctx->dgram_tx = tx;
+}
+
+/* 发送历史里从累计位置 pos 开始的 length 字节，回绕的分两段 */
+static uint32_t MES_dgram_history_span(struct MES_dgram_tx_struct* tx, uint32_t pos, uint32_t length, struct MES_iovec_struct* iov)
+{
+    uint32_t index = pos & (MES_DGRAM_HISTORY_SIZE - 1);
+    uint32_t first = length > MES_DGRAM_HISTORY_SIZE - index ? MES_DGRAM_HISTORY_SIZE - index : length;
+
+    iov[0].base = &tx->history[index];
+    iov[0].len = first;
+    if(first == length)
+    {
+        return 1;
+    }
+    iov[1].base = &tx->history[0];
+    iov[1].len = length - first;
+    return 2;
+}
+
+static void MES_dgram_history_write(struct MES_dgram_tx_struct* tx, uint32_t pos, const uint8_t* data, uint32_t length)
+{
+    struct MES_iovec_struct span[2];
+    uint32_t count = MES_dgram_history_span(tx, pos, length, span);
+
+    memcpy(span[0].base, data, span[0].len);
+    if(count == 2)
+    {
+        memcpy(span[1].base, &data[span[0].len], span[1].len);
+    }
+}
+
+static void MES_dgram_history_read(struct MES_dgram_tx_struct* tx, uint32_t pos, uint8_t* data, uint32_t length)
+{
+    struct MES_iovec_struct span[2];
+    uint32_t count = MES_dgram_history_span(tx, pos, length, span);
+
+    memcpy(data, span[0].base, span[0].len);
+    if(count == 2)
+    {
+        memcpy(&data[span[0].len], span[1].base, span[1].len);
+    }
+}
+
+/* 头放在 iov[0]，数据在发送历史里，一共最多 3 段 */
+static uint8_t MES_dgram_sendv(struct MES_dgram_tx_struct* tx, struct MES_dgram_header_struct* header, uint32_t data_pos)
+{
+    struct MES_iovec_struct iov[3];
+    uint32_t iovcnt = 0;
+
+    iov[0].base = (uint8_t*)header;
+    iov[0].len = MES_DGRAM_HEADER_SIZE;
+    iovcnt = 1 + MES_dgram_history_span(tx, data_pos, header->length, &iov[1]);
+
+    if(tx->sendv(tx->user_data, tx->port, iov, iovcnt) != MES_DGRAM_HEADER_SIZE + (uint32_t)header->length)
+    {
+        tx->send_fail_count++;
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t MES_dgram_send_ctx(struct MES_ctx_struct* ctx, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length)
+{
+    struct MES_dgram_tx_struct* tx = ctx->dgram_tx;
+    struct MES_dgram_header_struct header;
+    struct MES_dgram_history_entry_struct* entry = NULL;
+    uint32_t timestamp_ms = 0, done = 0, chunk = 0;
+
+    if(tx == NULL || !tx->enabled || tx->sendv == NULL || length == 0)
+    {
+        return 0;
+    }
+    timestamp_ms = tx->now_ms != NULL ? tx->now_ms() : 0;
+
+    while(done < length)
+    {
+        chunk = length - done > tx->payload_max ? tx->payload_max : length - done;
+
+        header.magic = MES_DGRAM_MAGIC;
+        header.flags = 0;
+        header.TIM = Self_TIM;
+        header.TC = TC;
+        header.session = tx->session;
+        header.length = (uint16_t)chunk;
+        header.seq = tx->next_seq++;
+        header.Offset = Offset + done;
+        header.timestamp_ms = timestamp_ms;
+
+        /* 先整个存进发送历史，发的时候数据从历史里取，不多拷一次 */
+        entry = &tx->history_entry[header.seq & (MES_DGRAM_HISTORY_MAX - 1)];
+        entry->seq = header.seq;
+        entry->pos = tx->history_tail;
+        entry->length = (uint16_t)(MES_DGRAM_HEADER_SIZE + chunk);
+        MES_dgram_history_write(tx, entry->pos, (const uint8_t*)&header, MES_DGRAM_HEADER_SIZE);
+        MES_dgram_history_write(tx, entry->pos + MES_DGRAM_HEADER_SIZE, &data[done], chunk);
+        tx->history_tail += entry->length;
+
+        if(MES_dgram_sendv(tx, &header, entry->pos + MES_DGRAM_HEADER_SIZE))
+        {
+            tx->sent_count++;
+        }
+        done += chunk;
+    }
+
+    return length;
+}
+
+/* 还在发送历史里（没被后来的覆盖）的重发，头上打重发标记，序号和时间戳不变 */
+static uint8_t MES_dgram_resend(struct MES_ctx_struct* ctx, uint32_t seq)
+{
+    struct MES_dgram_tx_struct* tx = ctx->dgram_tx;
+    struct MES_dgram_history_entry_struct* entry = &tx->history_entry[seq & (MES_DGRAM_HISTORY_MAX - 1)];
+    struct MES_dgram_header_struct header;
+
+    if(entry->length == 0 || entry->seq != seq || (int32_t)(seq - tx->next_seq) >= 0
+        || tx->history_tail - entry->pos > MES_DGRAM_HISTORY_SIZE)
+    {
+        return 0;
+    }
+
+    MES_dgram_history_read(tx, entry->pos, (uint8_t*)&header, MES_DGRAM_HEADER_SIZE);
+    header.flags |= MES_DGRAM_FLAG_RETRANS;
+
+    return MES_dgram_sendv(tx, &header, entry->pos + MES_DGRAM_HEADER_SIZE);
+}
+
+void MES_dgram_rx_init(struct MES_dgram_rx_struct* rx, struct MES_ctx_struct* ctx, uint8_t TIM, uint16_t session, 
+    void (*deliver)(void* user_data, uint8_t TC, uint32_t Offset, uint32_t timestamp_ms, const uint8_t* data, uint16_t length), 
+    void* user_data)
+{
+    memset(rx, 0, sizeof(*rx));
+
+    rx->ctx = ctx;
+    rx->TIM = TIM;
+    rx->swap = ctx->codec->swap;
+    rx->session = session;
+    rx->deliver = deliver;
+    rx->user_data = user_data;
+
+    rx->nack_delay_ms = MES_DGRAM_NACK_DELAY_MS;
+    rx->give_up_ms = MES_DGRAM_GIVE_UP_MS;
+    rx->nack_retry_max = MES_DGRAM_NACK_RETRY_MAX;
+}
+
+static void MES_dgram_rx_deliver(struct MES_dgram_rx_struct* rx, uint8_t TC, uint32_t Offset, uint32_t timestamp_ms, const uint8_t* data, uint16_t length)
+{
+    rx->delivered_count++;
+    if(rx->deliver != NULL)
+    {
+        rx->deliver(rx->user_data, TC, Offset, timestamp_ms, data, length);
+    }
+}
+
+/* 队头往后连续到了的依次交付 */
+static void MES_dgram_rx_drain(struct MES_dgram_rx_struct* rx)
+{
+    struct MES_dgram_rx_slot_struct* slot = NULL;
+
+    while(rx->next_seq != rx->end_seq)
+    {
+        slot = &rx->slot[rx->next_seq & (MES_DGRAM_WINDOW - 1)];
+        if(slot->state != MES_DGRAM_SLOT_ARRIVED)
+        {
+            break;
+        }
+        MES_dgram_rx_deliver(rx, slot->TC, slot->Offset, slot->timestamp_ms, slot->data, slot->length);
+        slot->state = MES_DGRAM_SLOT_EMPTY;
+        rx->next_seq++;
+    }
+}
+
+uint8_t MES_dgram_rx_input(struct MES_dgram_rx_struct* rx, const uint8_t* datagram, uint32_t length, uint32_t now_ms)
+{
+    struct MES_dgram_header_struct header;
+    struct MES_dgram_rx_slot_struct* slot = NULL;
+    struct MES_dgram_rx_slot_struct* gap = NULL;
+    const uint8_t* data = &datagram[MES_DGRAM_HEADER_SIZE];
+    uint32_t seq = 0, diff = 0;
+
+    rx->received_count++;
+
+    if(length < MES_DGRAM_HEADER_SIZE || datagram[0] != MES_DGRAM_MAGIC)
+    {
+        rx->bad_count++;
+        return 0;
+    }
+    memcpy(&header, datagram, MES_DGRAM_HEADER_SIZE);
+    if(rx->swap)
+    {
+        MES_swap_fields((uint8_t*)&header, MES_DGRAM_HEADER_SIZE, &MES_schema_dgram_header);
+    }
+
+    /* 旧会话的或者序号跳得离谱的（比如 TIM 重启了还没重新协商）不收 */
+    seq = header.seq;
+    diff = seq - rx->next_seq;
+    if(header.TIM != rx->TIM || header.session != rx->session || header.length > MES_DGRAM_PAYLOAD_MAX
+        || MES_DGRAM_HEADER_SIZE + (uint32_t)header.length != length || (diff > 0x10000 && (int32_t)diff >= 0))
+    {
+        rx->bad_count++;
+        return 0;
+    }
+
+    /* 已经交付过或放弃了的 */
+    if((int32_t)diff < 0)
+    {
+        rx->duplicate_count++;
+        return 0;
+    }
+
+    /* 超出窗口：队头让位，到了的交付，没到的算丢 */
+    while(seq - rx->next_seq >= MES_DGRAM_WINDOW)
+    {
+        slot = &rx->slot[rx->next_seq & (MES_DGRAM_WINDOW - 1)];
+        if(slot->state == MES_DGRAM_SLOT_ARRIVED)
+        {
+            MES_dgram_rx_deliver(rx, slot->TC, slot->Offset, slot->timestamp_ms, slot->data, slot->length);
+        }else{
+            rx->lost_count++;
+        }
+        slot->state = MES_DGRAM_SLOT_EMPTY;
+        rx->next_seq++;
+        if((int32_t)(rx->end_seq - rx->next_seq) < 0)
+        {
+            rx->end_seq = rx->next_seq;
+        }
+    }
+
+    slot = &rx->slot[seq & (MES_DGRAM_WINDOW - 1)];
+    if((int32_t)(seq - rx->end_seq) < 0 && slot->state == MES_DGRAM_SLOT_ARRIVED)
+    {
+        rx->duplicate_count++;
+        return 0;
+    }
+    if((header.flags & MES_DGRAM_FLAG_RETRANS) && (int32_t)(seq - rx->end_seq) < 0 && slot->state == MES_DGRAM_SLOT_MISSING)
+    {
+        rx->repaired_count++;
+    }
+
+    /* 中间跳过的记成缺着，从现在开始算时间 */
+    while((int32_t)(rx->end_seq - seq) < 0)
+    {
+        gap = &rx->slot[rx->end_seq & (MES_DGRAM_WINDOW - 1)];
+        gap->state = MES_DGRAM_SLOT_MISSING;
+        gap->nack_count = 0;
+        gap->missing_ms = now_ms;
+        rx->end_seq++;
+    }
+    if(rx->end_seq == seq)
+    {
+        rx->end_seq++;
+    }
+
+    if(seq == rx->next_seq)
+    {
+        /* 按序的：直接从数据报交付，不拷贝 */
+        MES_dgram_rx_deliver(rx, header.TC, header.Offset, header.timestamp_ms, data, header.length);
+        slot->state = MES_DGRAM_SLOT_EMPTY;
+        rx->next_seq++;
+        MES_dgram_rx_drain(rx);
+    }else{
+        if(!(header.flags & MES_DGRAM_FLAG_RETRANS))
+        {
+            rx->reordered_count++;
+        }
+        slot->state = MES_DGRAM_SLOT_ARRIVED;
+        slot->TC = header.TC;
+        slot->length = header.length;
+        slot->Offset = header.Offset;
+        slot->timestamp_ms = header.timestamp_ms;
+        memcpy(slot->data, data, header.length);
+    }
+
+    return 1;
+}
+
+uint32_t MES_dgram_rx_poll(struct MES_dgram_rx_struct* rx, uint32_t now_ms)
+{
+    struct MES_dgram_range_struct range[MES_DGRAM_NACK_MAX];
+    struct MES_dgram_rx_slot_struct* slot = NULL;
+    uint8_t range_count = 0;
+    uint32_t seq = 0, requested = 0;
+
+    /* 队头缺了太久的放弃，后面到了的接着交付 */
+    while(rx->next_seq != rx->end_seq)
+    {
+        slot = &rx->slot[rx->next_seq & (MES_DGRAM_WINDOW - 1)];
+        if(slot->state != MES_DGRAM_SLOT_MISSING || now_ms - slot->missing_ms < rx->give_up_ms)
+        {
+            break;
+        }
+        slot->state = MES_DGRAM_SLOT_EMPTY;
+        rx->next_seq++;
+        rx->lost_count++;
+        MES_dgram_rx_drain(rx);
+    }
+
+    if(rx->nack_delay_ms == 0)
+    {
+        return 0;
+    }
+
+    /* 缺了够久的（请过的再隔 nack_delay_ms）连续的并成一段，一个 Datagram_NACK 装不下的下次再请 */
+    for(seq = rx->next_seq; seq != rx->end_seq; seq++)
+    {
+        slot = &rx->slot[seq & (MES_DGRAM_WINDOW - 1)];
+        if(slot->state != MES_DGRAM_SLOT_MISSING || slot->nack_count >= rx->nack_retry_max
+            || now_ms - (slot->nack_count == 0 ? slot->missing_ms : slot->nack_ms) < rx->nack_delay_ms)
+        {
+            continue;
+        }
+
+        if(range_count > 0 && range[range_count - 1].seq + range[range_count - 1].count == seq)
+        {
+            range[range_count - 1].count++;
+        }else if(range_count < MES_DGRAM_NACK_MAX){
+            range[range_count].seq = seq;
+            range[range_count].count = 1;
+            range_count++;
+        }else{
+            break;
+        }
+        slot->nack_count++;
+        slot->nack_ms = now_ms;
+        requested++;
+    }
+
+    if(range_count > 0)
+    {
+        Message_CommonCmd_Datagram_NACK_pack_up_ctx(rx->ctx, rx->TIM, range, range_count);
+        Message_pack_up_And_send_ctx(rx->ctx);
+        rx->nack_count += requested;
+    }
+
+    return requested;
+}
+
+                                    /*************\
+*************************************  会话恢复部分  *****************************************************
+                                    \*************/
+
+void MES_session_new(struct MES_session_struct* session, uint8_t TIM, uint32_t token)
+{
+    memset(session, 0, sizeof(*session));
+    session->token = token;
+    session->TIM = TIM;
+}
+
+uint8_t MES_session_match(const struct MES_session_struct* session, const struct MES_ctx_struct* ctx, uint8_t TIM)
+{
+    return session->token != 0 && session->token == ctx->peer_session_token && session->TIM == TIM
+        && (ctx->peer_caps & MES_CAP_SESSION_RESUME) != 0;
+}
+
+void MES_session_ack(struct MES_session_struct* session, uint8_t TC, uint32_t Offset_end)
+{
+    if(TC >= TC_MAX)
+    {
+        return;
+    }
+
+    /* 补发的和重复的比已经收到的靠前，不往回退 */
+    if(!session->acked_valid[TC] || (int32_t)(Offset_end - session->acked_Offset[TC]) > 0)
+    {
+        session->acked_Offset[TC] = Offset_end;
+        session->acked_valid[TC] = 1;
+    }
+}
+
+                                    /*************\
+*************************************  TEDS 缓存部分  *****************************************************
+                                    \*************/
+
+/* Query_TEDS 回复 dependent：属性（1）、状态（1）、TEDS 总长度（4）、Checksum（2）、max_TEDS_size（4） */
+uint8_t TEDS_query_reply_decode(const struct ReplyMessage_view_struct* reply, uint32_t* whole_length, uint16_t* Checksum)
+{
+    if(!reply->Flag || reply->dependent_Length < 8)
+    {
+        return 0;
+    }
+
+    memcpy(whole_length, &reply->dependent_load[2], sizeof(*whole_length));
+    memcpy(Checksum, &reply->dependent_load[6], sizeof(*Checksum));
+
+    return 1;
+}
+
+/* Query_TC_TEDS_digest 回复：通道个数（1），再每通道属性（1）、状态（1）、总长度（4）、Checksum（2），返回解出的通道数 */
+uint8_t TC_TEDS_digest_decode(const struct ReplyMessage_view_struct* reply, struct TC_TEDS_digest_struct* digest, uint8_t max_count)
+{
+    const uint8_t* item = NULL;
+    uint8_t count = 0;
+    uint8_t i = 0;
+
+    if(!reply->Flag || reply->dependent_Length < 1)
+    {
+        return 0;
+    }
+
+    count = reply->dependent_load[0];
+    if(reply->dependent_Length < 1 + (uint32_t)count * TC_TEDS_DIGEST_SIZE)
+    {
+        return 0;
+    }
+    count = count > max_count ? max_count : count;
+
+    for(i = 0; i < count; i++)
+    {
+        item = &reply->dependent_load[1 + i * TC_TEDS_DIGEST_SIZE];
+        digest[i].attr = item[0];
+        digest[i].status = item[1];
+        memcpy(&digest[i].whole_length, &item[2], sizeof(digest[i].whole_length));
+        memcpy(&digest[i].Checksum, &item[6], sizeof(digest[i].Checksum));
+    }
+
+    return count;
+}
+
+/* 把一个 Read_TEDS_segment 回复拷进 dest，TEDSOffset 填本段的偏移，返回本段字节数，坏帧、Flag 为 0 或不是要的 TEDS 返回 0 */
+static uint32_t TEDS_take_segment_reply(const struct ReplyMessage_view_struct* reply, uint8_t access_code, 
+    uint8_t* dest, uint32_t whole_length, uint32_t* TEDSOffset_out)
+{
+    uint32_t TEDSOffset = 0;
+    uint32_t segment_length = 0;
+
+    /* 回复 dependent：access code（1）、TEDSOffset（4）、TEDS 数据 */
+    if(!reply->Flag || reply->dependent_Length <= 5 || reply->dependent_load[0] != access_code)
+    {
+        return 0;
+    }
+
+    memcpy(&TEDSOffset, &reply->dependent_load[1], sizeof(TEDSOffset));
+    if(TEDSOffset >= whole_length)
+    {
+        return 0;
+    }
+    segment_length = reply->dependent_Length - 5;
+    segment_length = segment_length > whole_length - TEDSOffset ? whole_length - TEDSOffset : segment_length;
+
+    memcpy(&dest[TEDSOffset], &reply->dependent_load[5], segment_length);
+    *TEDSOffset_out = TEDSOffset;
+
+    return segment_length;
+}
+
+/* NCAP 用：流水线读一个 TEDS，和 TC_data_set_pull_ctx() 一样只数在途请求的个数；
+    TCP 上回复按请求的顺序回来，偏移不是接着已收到的就是中间缺了一段，停下只报前面连续的 */
+uint32_t TEDS_read_pipelined_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t access_code, uint8_t* dest, uint32_t whole_length, uint32_t window)
+{
+    struct ReplyMessage_view_struct reply;
+    uint32_t received = 0;
+    uint32_t next_Offset = 0;
+    uint32_t in_flight = 0;
+    uint32_t segment_length = 0;
+    uint32_t segment_size = 0;
+    uint32_t TEDSOffset = 0;
+    uint8_t failed = 0;
+
+    if(whole_length == 0)
+    {
+        return 0;
+    }
+    window = window == 0 ? 1 : window;
+
+    /* 第一个请求单独发，TIM 回复的长度就是它的段大小 */
+    Message_CommonCmd_Read_TEDS_segment_pack_up_ctx(ctx, Dest_TIM, Dest_TC, access_code, 0);
+    Message_pack_up_And_send_ctx(ctx);
+    MES_txq_flush_ctx(ctx);
+    if(!MES_stream_wait_ReplyMessage_as_ctx(ctx, stream, &reply, CommonCmd, Read_TEDS_segment))
+    {
+        return 0;
+    }
+    segment_size = TEDS_take_segment_reply(&reply, access_code, dest, whole_length, &TEDSOffset);
+    if(segment_size == 0 || TEDSOffset != 0)
+    {
+        return 0;
+    }
+    received = segment_size;
+    next_Offset = segment_size;
+
+    while(received < whole_length && !failed)
+    {
+        while(in_flight < window && next_Offset < whole_length)
+        {
+            Message_CommonCmd_Read_TEDS_segment_pack_up_ctx(ctx, Dest_TIM, Dest_TC, access_code, next_Offset);
+            Message_pack_up_And_send_ctx(ctx);
+            next_Offset += segment_size;
+            in_flight++;
+        }
+        MES_txq_flush_ctx(ctx);
+
+        if(in_flight == 0 || !MES_stream_wait_ReplyMessage_as_ctx(ctx, stream, &reply, CommonCmd, Read_TEDS_segment))
+        {
+            break;
+        }
+        in_flight--;
+
+        segment_length = TEDS_take_segment_reply(&reply, access_code, dest, whole_length, &TEDSOffset);
+        if(segment_length == 0 || TEDSOffset != received)
+        {
+            failed = 1;
+        }else{
+            received += segment_length;
+        }
+    }
+
+    /* 提前结束的话把剩下在途的回复收掉 */
+    while(in_flight > 0 && MES_stream_wait_ReplyMessage_ctx(ctx, stream, &reply))
+    {
+        in_flight--;
+    }
+
+    /* TEDS 是按 TIM 的大小端发的，读全了整个转一遍 */
+    if(received == whole_length && !stream->codec->TEDS(dest, whole_length))
+    {
+        return 0;
+    }
+
+    return received;
+}
+
+#if TEDS_CACHE_USE
+
+struct TEDS_cache_struct TEDS_cache;
+
+/* 找同一个键的条目，没有则找空的，都没有则找最久没用的 */
+static struct TEDS_cache_entry_struct* TEDS_cache_slot(const uint8_t* UUID, uint8_t TC, uint8_t access_code)
+{
+    struct TEDS_cache_entry_struct* victim = NULL;
+    uint32_t i = 0;
+
+    for(i = 0; i < TEDS_CACHE_ENTRY_MAX; i++)
+    {
+        struct TEDS_cache_entry_struct* entry = &TEDS_cache.entry[i];
+
+        if(entry->valid && entry->TC == TC && entry->access_code == access_code && memcmp(entry->UUID, UUID, 10) == 0)
+        {
+            return entry;
+        }
+        if(victim == NULL || (victim->valid && (!entry->valid || entry->last_use < victim->last_use)))
+        {
+            victim = entry;
+        }
+    }
+
+    return victim;
+}
+
+const uint8_t* TEDS_cache_lookup(const uint8_t* UUID, uint8_t TC, uint8_t access_code, uint32_t whole_length, uint16_t Checksum)
+{
+    struct TEDS_cache_entry_struct* entry = TEDS_cache_slot(UUID, TC, access_code);
+
+    if(!entry->valid || entry->TC != TC || entry->access_code != access_code || memcmp(entry->UUID, UUID, 10) != 0
+        || entry->whole_length != whole_length || entry->Checksum != Checksum)
+    {
+        TEDS_cache.miss_count++;
+        return NULL;
+    }
+
+    entry->last_use = ++TEDS_cache.use_clock;
+    TEDS_cache.hit_count++;
+
+    return entry->load;
+}
+
+/* 存进某个条目，load 可以就是该条目自己的缓存（fetch 直接读到里面） */
+static uint8_t TEDS_cache_fill(struct TEDS_cache_entry_struct* entry, const uint8_t* UUID, uint8_t TC, 
+    const uint8_t* TEDS_load, uint32_t whole_length)
+{
+    struct TEDS_decoded_struct decoded;
+
+    entry->valid = 0;
+    if(whole_length > TEDS_CACHE_LOAD_SIZE || TEDS_decode(&decoded, TEDS_load, whole_length) != TEDS_DECODE_OK
+        || decoded.whole_length != whole_length)
+    {
+        return 0;
+    }
+
+    if(TEDS_load != entry->load)
+    {
+        memcpy(entry->load, TEDS_load, whole_length);
+    }
+    memcpy(entry->UUID, UUID, 10);
+    entry->TC = TC;
+    entry->access_code = decoded.access_code;
+    entry->Checksum = decoded.Checksum;
+    entry->whole_length = whole_length;
+    entry->last_use = ++TEDS_cache.use_clock;
+    entry->valid = 1;
+
+    /* 顺便更新 TEDS 目录的索引 */
+    TEDS_dir_update(UUID, TC, entry->load, whole_length);
+
+    return 1;
+}
+
+uint8_t TEDS_cache_store(const uint8_t* UUID, uint8_t TC, const uint8_t* TEDS_load, uint32_t whole_length)
+{
+    struct TEDS_decoded_struct decoded;
+
+    if(TEDS_decode(&decoded, TEDS_load, whole_length) != TEDS_DECODE_OK)
+    {
+        return 0;
+    }
+
+    return TEDS_cache_fill(TEDS_cache_slot(UUID, TC, decoded.access_code), UUID, TC, TEDS_load, whole_length);
+}
+
+/* 从 Meta-TEDS 里取 UUID（Type 4，Length 10） */
+static uint8_t TEDS_cache_Meta_UUID(const uint8_t* TEDS_load, uint32_t whole_length, uint8_t* UUID)
+{
+    struct TEDS_decoded_struct decoded;
+    struct TEDS_TLV_view_struct tlv;
+
+    if(TEDS_decode(&decoded, TEDS_load, whole_length) != TEDS_DECODE_OK || decoded.access_code != M_TEDS_ACCESS_CODE)
+    {
+        return 0;
+    }
+
+    if(decoded.M_TEDS != NULL)
+    {
+        memcpy(UUID, decoded.M_TEDS->UUID.Value, 10);
+        return 1;
+    }
+    if(TEDS_cursor_find(&decoded.cursor, 4, &tlv) && tlv.Length == 10)
+    {
+        memcpy(UUID, tlv.Value, 10);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* 读整个 TEDS 到 dest */
+static uint8_t TEDS_cache_read(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t access_code, uint8_t* dest, uint32_t whole_length)
+{
+    return TEDS_read_pipelined_ctx(ctx, stream, Dest_TIM, Dest_TC, access_code, dest, whole_length, TEDS_READ_WINDOW) == whole_length;
+}
+
+const uint8_t* TEDS_cache_fetch_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t access_code, uint32_t* whole_length)
+{
+    struct ReplyMessage_view_struct reply;
+    struct TEDS_cache_entry_struct* entry = NULL;
+    struct TEDS_cache_entry_struct* old_entry = NULL;
+    const uint8_t* cached = NULL;
+    uint8_t UUID[10];
+    uint32_t length = 0, Meta_length = 0;
+    uint16_t Checksum = 0;
+    uint8_t confirmed = 0;
+    /* Meta-TEDS 和 PHY TEDS 是整个 TIM 一份，不按通道分 */
+    uint8_t key_TC = (access_code == M_TEDS_ACCESS_CODE || access_code == PHY_TEDS_ACCESS_CODE) ? 0 : Dest_TC;
+
+    if(Dest_TIM >= TIM_MAX)
+    {
+        return NULL;
+    }
+
+    /* UUID 不是本连接读的话先取它的 Meta-TEDS，里面有 UUID */
+    confirmed = TEDS_cache.TIM_UUID_valid[Dest_TIM] && TEDS_cache.TIM_UUID_link[Dest_TIM] == ctx->link_id;
+    if(access_code != M_TEDS_ACCESS_CODE && !confirmed)
+    {
+        if(TEDS_cache_fetch_ctx(ctx, stream, Dest_TIM, Dest_TC, M_TEDS_ACCESS_CODE, &Meta_length) == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    Message_CommonCmd_Query_TEDS_pack_up_ctx(ctx, Dest_TIM, Dest_TC, access_code);
+    Message_pack_up_And_send_ctx(ctx);
+    MES_txq_flush_ctx(ctx);
+    if(!MES_stream_wait_ReplyMessage_as_ctx(ctx, stream, &reply, CommonCmd, Query_TEDS) || !TEDS_query_reply_decode(&reply, &length, &Checksum))
+    {
+        return NULL;
+    }
+
+    /* 本连接已经读过 Meta-TEDS 确认了 UUID 才查缓存；Checksum 只用来判断同一个 TIM 的 TEDS 变没变，
+        不用来认 TIM，换了连接的 Meta-TEDS 总是重新读 */
+    if(confirmed || access_code != M_TEDS_ACCESS_CODE)
+    {
+        cached = TEDS_cache_lookup(TEDS_cache.TIM_UUID[Dest_TIM], key_TC, access_code, length, Checksum);
+        if(cached != NULL)
+        {
+            *whole_length = length;
+            return cached;
+        }
+    }
+
+    if(access_code == M_TEDS_ACCESS_CODE)
+    {
+        /* 换了 TIM 或者 Meta-TEDS 变了，UUID 先作废，读回来再定 */
+        TEDS_cache.TIM_UUID_valid[Dest_TIM] = 0;
+        memset(UUID, 0, sizeof(UUID));
+    }else{
+        memcpy(UUID, TEDS_cache.TIM_UUID[Dest_TIM], sizeof(UUID));
+    }
+
+    if(length > TEDS_CACHE_LOAD_SIZE)
+    {
+        return NULL;
+    }
+
+    /* 直接读到要替换的条目里，读的过程中它先标为无效 */
+    entry = TEDS_cache_slot(UUID, key_TC, access_code);
+    entry->valid = 0;
+    if(!TEDS_cache_read(ctx, stream, Dest_TIM, Dest_TC, access_code, entry->load, length))
+    {
+        return NULL;
+    }
+
+    if(access_code == M_TEDS_ACCESS_CODE)
+    {
+        if(!TEDS_cache_Meta_UUID(entry->load, length, UUID))
+        {
+            return NULL;
+        }
+        memcpy(TEDS_cache.TIM_UUID[Dest_TIM], UUID, sizeof(UUID));
+        TEDS_cache.TIM_UUID_valid[Dest_TIM] = 1;
+        TEDS_cache.TIM_UUID_link[Dest_TIM] = ctx->link_id;
+
+        /* 同一个 UUID 的旧 Meta-TEDS（内容变了）作废，免得一个键两条 */
+        old_entry = TEDS_cache_slot(UUID, key_TC, access_code);
+        if(old_entry != entry && old_entry->valid && old_entry->TC == key_TC && old_entry->access_code == access_code 
+            && memcmp(old_entry->UUID, UUID, 10) == 0)
+        {
+            old_entry->valid = 0;
+        }
+    }
+
+    if(!TEDS_cache_fill(entry, UUID, key_TC, entry->load, length))
+    {
+        return NULL;
+    }
+
+    *whole_length = length;
+    return entry->load;
+}
+
+#if TEDS_CACHE_USE_FILE
+
+#include <stdio.h>
+
+/* 文件格式：魔数（4）、TIM UUID 表、条目个数（4）、每个条目的 UUID（10）、TC（1）、总长度（4）、TEDS；
+    Checksum 和 access code 读回来时从 TEDS 里重新取 */
+#define TEDS_CACHE_FILE_MAGIC   0x31435445  /* "ETC1" */
+
+/* 读文件用的一个 TEDS 的缓存，TEDS_CACHE_LOAD_SIZE 放栈上小平台吃不消 */
+static uint8_t TEDS_cache_file_load[TEDS_CACHE_LOAD_SIZE];
+
+uint8_t TEDS_cache_save(const char* path)
+{
+    FILE* file = NULL;
+    uint32_t magic = TEDS_CACHE_FILE_MAGIC;
+    uint32_t count = 0;
+    uint32_t i = 0;
+    uint8_t ok = 1;
+
+    file = fopen(path, "wb");
+    if(file == NULL)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < TEDS_CACHE_ENTRY_MAX; i++)
+    {
+        count += TEDS_cache.entry[i].valid;
+    }
+
+    ok &= fwrite(&magic, sizeof(magic), 1, file) == 1;
+    ok &= fwrite(TEDS_cache.TIM_UUID_valid, sizeof(TEDS_cache.TIM_UUID_valid), 1, file) == 1;
+    ok &= fwrite(TEDS_cache.TIM_UUID, sizeof(TEDS_cache.TIM_UUID), 1, file) == 1;
+    ok &= fwrite(&count, sizeof(count), 1, file) == 1;
+
+    for(i = 0; i < TEDS_CACHE_ENTRY_MAX && ok; i++)
+    {
+        struct TEDS_cache_entry_struct* entry = &TEDS_cache.entry[i];
+
+        if(!entry->valid)
+        {
+            continue;
+        }
+        ok &= fwrite(entry->UUID, sizeof(entry->UUID), 1, file) == 1;
+        ok &= fwrite(&entry->TC, sizeof(entry->TC), 1, file) == 1;
+        ok &= fwrite(&entry->whole_length, sizeof(entry->whole_length), 1, file) == 1;
+        ok &= fwrite(entry->load, entry->whole_length, 1, file) == 1;
+    }
+
+    ok &= fclose(file) == 0;
+
+    return ok;
+}
+
+/* 读回来的条目逐条过 TEDS_cache_store()，坏的丢掉；文件不对返回 0，缓存不动 */
+uint8_t TEDS_cache_load(const char* path)
+{
+    FILE* file = NULL;
+    uint32_t magic = 0;
+    uint32_t count = 0;
+    uint32_t i = 0;
+    uint8_t UUID[10];
+    uint8_t TC = 0;
+    uint32_t whole_length = 0;
+    uint8_t TIM_UUID_valid[TIM_MAX];
+    uint8_t TIM_UUID[TIM_MAX][10];
+
+    file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        return 0;
+    }
+
+    if(fread(&magic, sizeof(magic), 1, file) != 1 || magic != TEDS_CACHE_FILE_MAGIC
+        || fread(TIM_UUID_valid, sizeof(TIM_UUID_valid), 1, file) != 1
+        || fread(TIM_UUID, sizeof(TIM_UUID), 1, file) != 1
+        || fread(&count, sizeof(count), 1, file) != 1)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    memcpy(TEDS_cache.TIM_UUID_valid, TIM_UUID_valid, sizeof(TIM_UUID_valid));
+    memcpy(TEDS_cache.TIM_UUID, TIM_UUID, sizeof(TIM_UUID));
+    /* 文件里的 UUID 不是任何一个当前连接读的，用之前都要重新读 Meta-TEDS 确认 */
+    memset(TEDS_cache.TIM_UUID_link, 0, sizeof(TEDS_cache.TIM_UUID_link));
+
+    for(i = 0; i < count; i++)
+    {
+        if(fread(UUID, sizeof(UUID), 1, file) != 1 || fread(&TC, sizeof(TC), 1, file) != 1
+            || fread(&whole_length, sizeof(whole_length), 1, file) != 1 || whole_length > TEDS_CACHE_LOAD_SIZE
+            || fread(TEDS_cache_file_load, whole_length, 1, file) != 1)
+        {
+            break;
+        }
+        TEDS_cache_store(UUID, TC, TEDS_cache_file_load, whole_length);
+    }
+
+    fclose(file);
+
+    return 1;
+}
+
+#endif
+
+                                    /*************\
+*************************************  TEDS 目录部分  *****************************************************
+                                    \*************/
+
+struct TEDS_dir_struct TEDS_dir;
+
+#define TEDS_DIR_BIT_SET(map, i)    ((map)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define TEDS_DIR_BIT_CLEAR(map, i)  ((map)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+static struct TEDS_dir_TIM_struct* TEDS_dir_TIM_of(const uint8_t* UUID, uint8_t create)
+{
+    struct TEDS_dir_TIM_struct* empty = NULL;
+    uint32_t i = 0;
+
+    for(i = 0; i < TEDS_DIR_TIM_MAX; i++)
+    {
+        if(TEDS_dir.TIM[i].valid && memcmp(TEDS_dir.TIM[i].UUID, UUID, 10) == 0)
+        {
+            return &TEDS_dir.TIM[i];
+        }
+        if(empty == NULL && !TEDS_dir.TIM[i].valid)
+        {
+            empty = &TEDS_dir.TIM[i];
+        }
+    }
+
+    if(!create || empty == NULL)
+    {
+        return NULL;
+    }
+
+    memset(empty, 0, sizeof(*empty));
+    memcpy(empty->UUID, UUID, 10);
+    empty->valid = 1;
+
+    return empty;
+}
+
+/* 找 TIM 下的某个通道，没有则新建（挂到 TIM 的通道链上），满了返回 TEDS_DIR_CHANNEL_MAX */
+static uint32_t TEDS_dir_channel_of(struct TEDS_dir_TIM_struct* TIM, uint8_t TC)
+{
+    struct TEDS_dir_channel_struct* channel = NULL;
+    uint32_t link = TIM->first_channel;
+    uint32_t i = 0;
+
+    for(; link != 0; link = TEDS_dir.channel[link - 1].next)
+    {
+        if(TEDS_dir.channel[link - 1].TC == TC)
+        {
+            return link - 1;
+        }
+    }
+
+    if(TEDS_dir.channel_free != 0)
+    {
+        i = TEDS_dir.channel_free - 1;
+        TEDS_dir.channel_free = TEDS_dir.channel[i].next;
+    }else if(TEDS_dir.channel_used < TEDS_DIR_CHANNEL_MAX)
+    {
+        i = TEDS_dir.channel_used++;
+    }else{
+        return TEDS_DIR_CHANNEL_MAX;
+    }
+
+    channel = &TEDS_dir.channel[i];
+    memset(channel, 0, sizeof(*channel));
+    channel->valid = 1;
+    channel->TC = TC;
+    channel->TIM = (uint16_t)(TIM - TEDS_dir.TIM);
+    channel->units_index = TEDS_DIR_UNITS_MAX;
+    channel->next = TIM->first_channel;
+    TIM->first_channel = (uint16_t)(i + 1);
+    TEDS_dir.channel_count++;
+
+    return i;
+}
+
+static uint32_t TEDS_dir_name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+
+    while(*name != '\0')
+    {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+
+    return hash & (TEDS_DIR_NAME_HASH_SIZE - 1);
+}
+
+/* SPeriod_order 里第一个 SPeriod 不小于 value 的位置 */
+static uint32_t TEDS_dir_SPeriod_lower_bound(float value)
+{
+    uint32_t low = 0, high = TEDS_dir.SPeriod_count, middle = 0;
+
+    while(low < high)
+    {
+        middle = (low + high) / 2;
+        if(TEDS_dir.channel[TEDS_dir.SPeriod_order[middle]].SPeriod < value)
+        {
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/* 一个通道所属 TIM 的域的位图，PHY TEDS 变了时单独重做 */
+static void TEDS_dir_unindex_TIM_bits(uint32_t i)
+{
+    uint32_t k = 0;
+
+    for(k = 0; k <= Reserved_for_future_expansion_RadioType; k++)
+    {
+        TEDS_DIR_BIT_CLEAR(TEDS_dir.RadioType_map[k], i);
+    }
+    TEDS_DIR_BIT_CLEAR(TEDS_dir.Battery_map, i);
+}
+
+static void TEDS_dir_index_TIM_bits(uint32_t i)
+{
+    const struct TEDS_dir_TIM_struct* TIM = &TEDS_dir.TIM[TEDS_dir.channel[i].TIM];
+
+    if(TIM->has & TEDS_DIR_HAS_RadioType)
+    {
+        TEDS_DIR_BIT_SET(TEDS_dir.RadioType_map[TIM->RadioType < Reserved_for_future_expansion_RadioType ? 
+            TIM->RadioType : Reserved_for_future_expansion_RadioType], i);
+    }
+    if((TIM->has & TEDS_DIR_HAS_Battery) && TIM->Battery != 0)
+    {
+        TEDS_DIR_BIT_SET(TEDS_dir.Battery_map, i);
+    }
+}
+
+/* 把通道从所有索引里拿掉，改它的域之前调 */
+static void TEDS_dir_unindex(uint32_t i)
+{
+    struct TEDS_dir_channel_struct* channel = &TEDS_dir.channel[i];
+    uint16_t* link = NULL;
+    uint32_t k = 0;
+
+    TEDS_DIR_BIT_CLEAR(TEDS_dir.valid_map, i);
+    for(k = 0; k <= Reserved_for_ChanType; k++)
+    {
+        TEDS_DIR_BIT_CLEAR(TEDS_dir.ChanType_map[k], i);
+    }
+    TEDS_dir_unindex_TIM_bits(i);
+
+    if(channel->units_index < TEDS_DIR_UNITS_MAX)
+    {
+        TEDS_DIR_BIT_CLEAR(TEDS_dir.units_map[channel->units_index], i);
+    }else if(channel->has & TEDS_DIR_HAS_PhyUnits)
+    {
+        TEDS_dir.units_overflow--;
+    }
+    channel->units_index = TEDS_DIR_UNITS_MAX;
+
+    if(channel->has & TEDS_DIR_HAS_SPeriod)
+    {
+        for(k = 0; k < TEDS_dir.SPeriod_count && TEDS_dir.SPeriod_order[k] != i; k++);
+        if(k < TEDS_dir.SPeriod_count)
+        {
+            memmove(&TEDS_dir.SPeriod_order[k], &TEDS_dir.SPeriod_order[k + 1], 
+                (TEDS_dir.SPeriod_count - k - 1) * sizeof(TEDS_dir.SPeriod_order[0]));
+            TEDS_dir.SPeriod_count--;
+        }
+    }
+
+    if(channel->has & TEDS_DIR_HAS_TCName)
+    {
+        for(link = &TEDS_dir.name_head[TEDS_dir_name_hash(channel->TCName)]; *link != 0; link = &TEDS_dir.channel[*link - 1].name_next)
+        {
+            if(*link == i + 1)
+            {
+                *link = channel->name_next;
+                break;
+            }
+        }
+        channel->name_next = 0;
+    }
+}
+
+/* 按通道当前的域建索引 */
+static void TEDS_dir_index(uint32_t i)
+{
+    struct TEDS_dir_channel_struct* channel = &TEDS_dir.channel[i];
+    uint32_t position = 0;
+    uint32_t k = 0;
+
+    TEDS_DIR_BIT_SET(TEDS_dir.valid_map, i);
+    if(channel->has & TEDS_DIR_HAS_ChanType)
+    {
+        TEDS_DIR_BIT_SET(TEDS_dir.ChanType_map[channel->ChanType < Reserved_for_ChanType ? channel->ChanType : Reserved_for_ChanType], i);
+    }
+    TEDS_dir_index_TIM_bits(i);
+
+    /* 单位字典：有就用，没有且还有空位就加，满了记在 units_overflow 里 */
+    if(channel->has & TEDS_DIR_HAS_PhyUnits)
+    {
+        for(k = 0; k < TEDS_dir.units_count && memcmp(&TEDS_dir.units[k], &channel->PhyUnits, sizeof(channel->PhyUnits)) != 0; k++);
+        if(k == TEDS_dir.units_count && k < TEDS_DIR_UNITS_MAX)
+        {
+            memcpy(&TEDS_dir.units[k], &channel->PhyUnits, sizeof(channel->PhyUnits));
+            TEDS_dir.units_count++;
+        }
+        if(k < TEDS_DIR_UNITS_MAX)
+        {
+            channel->units_index = (uint8_t)k;
+            TEDS_DIR_BIT_SET(TEDS_dir.units_map[k], i);
+        }else{
+            TEDS_dir.units_overflow++;
+        }
+    }
+
+    if(channel->has & TEDS_DIR_HAS_SPeriod)
+    {
+        position = TEDS_dir_SPeriod_lower_bound(channel->SPeriod);
+        memmove(&TEDS_dir.SPeriod_order[position + 1], &TEDS_dir.SPeriod_order[position], 
+            (TEDS_dir.SPeriod_count - position) * sizeof(TEDS_dir.SPeriod_order[0]));
+        TEDS_dir.SPeriod_order[position] = (uint16_t)i;
+        TEDS_dir.SPeriod_count++;
+    }
+
+    if(channel->has & TEDS_DIR_HAS_TCName)
+    {
+        k = TEDS_dir_name_hash(channel->TCName);
+        channel->name_next = TEDS_dir.name_head[k];
+        TEDS_dir.name_head[k] = (uint16_t)(i + 1);
+    }
+}
+
+/* TC TEDS 的域全部重新取，TEDS 里去掉了的域也跟着去掉；NaN 的不算有值 */
+static void TEDS_dir_take_TC_TEDS(struct TEDS_dir_channel_struct* channel, struct TEDS_cursor_struct* cursor)
+{
+    struct TEDS_TLV_view_struct tlv;
+
+    channel->has &= TEDS_DIR_HAS_TCName;
+    while(TEDS_cursor_next(cursor, &tlv))
+    {
+        switch(tlv.Type)
+        {
+            case 11:    /* ChanType */
+                if(tlv.Length == 1)
+                {
+                    channel->ChanType = tlv.Value[0];
+                    channel->has |= TEDS_DIR_HAS_ChanType;
+                }
+                break;
+            case 12:    /* PhyUnits */
+                if(tlv.Length == sizeof(channel->PhyUnits))
+                {
+                    memcpy(&channel->PhyUnits, tlv.Value, sizeof(channel->PhyUnits));
+                    channel->has |= TEDS_DIR_HAS_PhyUnits;
+                }
+                break;
+            case 13:    /* LowLimit */
+                if(tlv.Length == sizeof(float))
+                {
+                    memcpy(&channel->LowLimit, tlv.Value, sizeof(float));
+                    channel->has |= channel->LowLimit == channel->LowLimit ? TEDS_DIR_HAS_LowLimit : 0;
+                }
+                break;
+            case 14:    /* HiLimit */
+                if(tlv.Length == sizeof(float))
+                {
+                    memcpy(&channel->HiLimit, tlv.Value, sizeof(float));
+                    channel->has |= channel->HiLimit == channel->HiLimit ? TEDS_DIR_HAS_HiLimit : 0;
+                }
+                break;
+            case 23:    /* SPeriod */
+                if(tlv.Length == sizeof(float))
+                {
+                    memcpy(&channel->SPeriod, tlv.Value, sizeof(float));
+                    channel->has |= channel->SPeriod == channel->SPeriod ? TEDS_DIR_HAS_SPeriod : 0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void TEDS_dir_take_UTN_TEDS(struct TEDS_dir_channel_struct* channel, struct TEDS_cursor_struct* cursor)
+{
+    struct TEDS_TLV_view_struct tlv;
+    uint32_t length = 0;
+
+    channel->has &= ~TEDS_DIR_HAS_TCName;
+    if(TEDS_cursor_find(cursor, 5, &tlv))     /* TCName */
+    {
+        length = tlv.Length < sizeof(channel->TCName) - 1 ? tlv.Length : sizeof(channel->TCName) - 1;
+        memcpy(channel->TCName, tlv.Value, length);
+        channel->TCName[length] = '\0';     /* TEDS 里的名字可能补了 0，按 C 字符串截 */
+        channel->has |= TEDS_DIR_HAS_TCName;
+    }
+}
+
+uint8_t TEDS_dir_update(const uint8_t* UUID, uint8_t TC, const uint8_t* TEDS_load, uint32_t whole_length)
+{
+    struct TEDS_decoded_struct decoded;
+    struct TEDS_TLV_view_struct tlv;
+    struct TEDS_dir_TIM_struct* TIM = NULL;
+    uint32_t link = 0;
+    uint32_t i = 0;
+
+    if(TEDS_decode(&decoded, TEDS_load, whole_length) != TEDS_DECODE_OK)
+    {
+        return 0;
+    }
+    TIM = TEDS_dir_TIM_of(UUID, 1);
+    if(TIM == NULL)
+    {
+        return 0;
+    }
+
+    switch(decoded.access_code)
+    {
+        case M_TEDS_ACCESS_CODE:
+            return 1;
+
+        case PHY_TEDS_ACCESS_CODE:
+            TIM->has = 0;
+            while(TEDS_cursor_next(&decoded.cursor, &tlv))
+            {
+                if(tlv.Type == 10 && tlv.Length == 1)       /* RadioType */
+                {
+                    TIM->RadioType = tlv.Value[0];
+                    TIM->has |= TEDS_DIR_HAS_RadioType;
+                }
+                if(tlv.Type == 22 && tlv.Length == 1)       /* Battery */
+                {
+                    TIM->Battery = tlv.Value[0];
+                    TIM->has |= TEDS_DIR_HAS_Battery;
+                }
+            }
+
+            /* 只重做这个 TIM 的通道的 TIM 位图 */
+            for(link = TIM->first_channel; link != 0; link = TEDS_dir.channel[link - 1].next)
+            {
+                TEDS_dir_unindex_TIM_bits(link - 1);
+                TEDS_dir_index_TIM_bits(link - 1);
+            }
+            return 1;
+
+        case TC_TEDS_ACCESS_CODE:
+        case UTN_TEDS_ACCESS_CODE:
+            i = TEDS_dir_channel_of(TIM, TC);
+            if(i >= TEDS_DIR_CHANNEL_MAX)
+            {
+                return 0;
+            }
+            TEDS_dir_unindex(i);
+            if(decoded.access_code == TC_TEDS_ACCESS_CODE)
+            {
+                TEDS_dir_take_TC_TEDS(&TEDS_dir.channel[i], &decoded.cursor);
+            }else{
+                TEDS_dir_take_UTN_TEDS(&TEDS_dir.channel[i], &decoded.cursor);
+            }
+            TEDS_dir_index(i);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+void TEDS_dir_remove_TIM(const uint8_t* UUID)
+{
+    struct TEDS_dir_TIM_struct* TIM = TEDS_dir_TIM_of(UUID, 0);
+    uint32_t link = 0, next = 0;
+
+    if(TIM == NULL)
+    {
+        return;
+    }
+
+    for(link = TIM->first_channel; link != 0; link = next)
+    {
+        next = TEDS_dir.channel[link - 1].next;
+        TEDS_dir_unindex(link - 1);
+        TEDS_dir.channel[link - 1].valid = 0;
+        TEDS_dir.channel[link - 1].next = TEDS_dir.channel_free;
+        TEDS_dir.channel_free = (uint16_t)link;
+        TEDS_dir.channel_count--;
+    }
+
+    TIM->valid = 0;
+    TIM->first_channel = 0;
+}
+
+static uint8_t TEDS_dir_match_TIM(const struct TEDS_dir_TIM_struct* TIM, const struct TEDS_dir_query_struct* query)
+{
+    if((query->match & TEDS_DIR_MATCH_RadioType) && (!(TIM->has & TEDS_DIR_HAS_RadioType) || TIM->RadioType != query->RadioType))
+    {
+        return 0;
+    }
+    if((query->match & TEDS_DIR_MATCH_Battery) && (!(TIM->has & TEDS_DIR_HAS_Battery) || (TIM->Battery != 0) != (query->Battery != 0)))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* 逐条比全部条件，位图只是先筛一遍，最后都以这里为准 */
+static uint8_t TEDS_dir_match(uint32_t i, const struct TEDS_dir_query_struct* query)
+{
+    const struct TEDS_dir_channel_struct* channel = &TEDS_dir.channel[i];
+    uint32_t match = query->match;
+
+    if((match & TEDS_DIR_MATCH_ChanType) && (!(channel->has & TEDS_DIR_HAS_ChanType) || channel->ChanType != query->ChanType))
+    {
+        return 0;
+    }
+    if((match & TEDS_DIR_MATCH_PhyUnits) && (!(channel->has & TEDS_DIR_HAS_PhyUnits) 
+        || memcmp(&channel->PhyUnits, &query->PhyUnits, sizeof(channel->PhyUnits)) != 0))
+    {
+        return 0;
+    }
+    if((match & TEDS_DIR_MATCH_SPeriod) && (!(channel->has & TEDS_DIR_HAS_SPeriod) 
+        || !(channel->SPeriod >= query->SPeriod_min && channel->SPeriod < query->SPeriod_max)))
+    {
+        return 0;
+    }
+    if((match & TEDS_DIR_MATCH_Limits) && ((channel->has & (TEDS_DIR_HAS_LowLimit | TEDS_DIR_HAS_HiLimit)) != (TEDS_DIR_HAS_LowLimit | TEDS_DIR_HAS_HiLimit)
+        || !(channel->LowLimit <= query->LowLimit && channel->HiLimit >= query->HiLimit)))
+    {
+        return 0;
+    }
+    if((match & TEDS_DIR_MATCH_TCName) && (!(channel->has & TEDS_DIR_HAS_TCName) || strcmp(channel->TCName, query->TCName) != 0))
+    {
+        return 0;
+    }
+
+    return TEDS_dir_match_TIM(&TEDS_dir.TIM[channel->TIM], query);
+}
+
+static uint32_t TEDS_dir_emit(uint32_t count, uint32_t i, uint16_t* result, uint32_t max_count)
+{
+    if(result != NULL && count < max_count)
+    {
+        result[count] = (uint16_t)i;
+    }
+
+    return count + 1;
+}
+
+uint32_t TEDS_dir_query(const struct TEDS_dir_query_struct* query, uint16_t* result, uint32_t max_count)
+{
+    uint64_t candidate[TEDS_DIR_WORDS];
+    uint64_t range[TEDS_DIR_WORDS];
+    uint32_t words = (TEDS_dir.channel_used + 63) / 64;
+    uint32_t count = 0;
+    uint32_t link = 0;
+    uint32_t i = 0, k = 0, w = 0;
+    uint64_t bits = 0;
+
+    /* 按名字查的先走散列，链上只有几个 */
+    if(query->match & TEDS_DIR_MATCH_TCName)
+    {
+        for(link = TEDS_dir.name_head[TEDS_dir_name_hash(query->TCName)]; link != 0; link = TEDS_dir.channel[link - 1].name_next)
+        {
+            if(TEDS_dir_match(link - 1, query))
+            {
+                count = TEDS_dir_emit(count, link - 1, result, max_count);
+            }
+        }
+        return count;
+    }
+
+    memcpy(candidate, TEDS_dir.valid_map, words * sizeof(uint64_t));
+
+    if(query->match & TEDS_DIR_MATCH_ChanType)
+    {
+        k = query->ChanType < Reserved_for_ChanType ? query->ChanType : Reserved_for_ChanType;
+        for(w = 0; w < words; w++)
+        {
+            candidate[w] &= TEDS_dir.ChanType_map[k][w];
+        }
+    }
+    if(query->match & TEDS_DIR_MATCH_RadioType)
+    {
+        k = query->RadioType < Reserved_for_future_expansion_RadioType ? query->RadioType : Reserved_for_future_expansion_RadioType;
+        for(w = 0; w < words; w++)
+        {
+            candidate[w] &= TEDS_dir.RadioType_map[k][w];
+        }
+    }
+    if(query->match & TEDS_DIR_MATCH_Battery)
+    {
+        for(w = 0; w < words; w++)
+        {
+            candidate[w] &= query->Battery != 0 ? TEDS_dir.Battery_map[w] : ~TEDS_dir.Battery_map[w];
+        }
+    }
+
+    /* 单位在字典里就用它的位图；不在字典里又没有溢出的通道就一个也没有；有溢出的不筛，逐条比 */
+    if((query->match & TEDS_DIR_MATCH_PhyUnits) && TEDS_dir.units_overflow == 0)
+    {
+        for(k = 0; k < TEDS_dir.units_count && memcmp(&TEDS_dir.units[k], &query->PhyUnits, sizeof(query->PhyUnits)) != 0; k++);
+        if(k == TEDS_dir.units_count)
+        {
+            return 0;
+        }
+        for(w = 0; w < words; w++)
+        {
+            candidate[w] &= TEDS_dir.units_map[k][w];
+        }
+    }
+
+    /* SPeriod 范围：二分找到起点，顺着排好的下标走到 SPeriod_max */
+    if(query->match & TEDS_DIR_MATCH_SPeriod)
+    {
+        memset(range, 0, words * sizeof(uint64_t));
+        for(k = TEDS_dir_SPeriod_lower_bound(query->SPeriod_min); 
+            k < TEDS_dir.SPeriod_count && TEDS_dir.channel[TEDS_dir.SPeriod_order[k]].SPeriod < query->SPeriod_max; k++)
+        {
+            TEDS_DIR_BIT_SET(range, TEDS_dir.SPeriod_order[k]);
+        }
+        for(w = 0; w < words; w++)
+        {
+            candidate[w] &= range[w];
+        }
+    }
+
+    for(w = 0; w < words; w++)
+    {
+        for(bits = candidate[w]; bits != 0; bits &= bits - 1)
+        {
+            i = w * 64 + __builtin_ctzll(bits);
+            if(TEDS_dir_match(i, query))
+            {
+                count = TEDS_dir_emit(count, i, result, max_count);
+            }
+        }
+    }
+
+    return count;
+}
+
+uint32_t TEDS_dir_query_TIM(const struct TEDS_dir_query_struct* query, uint16_t* result, uint32_t max_count)
+{
+    uint32_t count = 0;
+    uint32_t i = 0;
+
+    for(i = 0; i < TEDS_DIR_TIM_MAX; i++)
+    {
+        if(TEDS_dir.TIM[i].valid && TEDS_dir_match_TIM(&TEDS_dir.TIM[i], query))
+        {
+            count = TEDS_dir_emit(count, i, result, max_count);
+        }
+    }
+
+    return count;
+}
 
+#endif
@@ -21,10 +21,12 @@
             程序中只、已经做限幅，但是没有加报错返回
         
         四个 TEDS 就 四个 200 byte，
-        Message 和 ReplyMessage 共两个 200 byte 
-        另外再加 Message_temp 和 ReplyMessage_temp 共两个 200 byte
+        每个 Message 上下文（struct MES_ctx_struct）里面
+            Message 和 ReplyMessage 共两个 200 byte 
+            另外再加 Message_temp 和 ReplyMessage_temp 共两个 200 byte
+            再加 temp_load 一个 200 byte
         
-        就是至少 1600 Byte
+        只用默认 ctx 就是至少 1800 Byte，每多例化一个 ctx 多 1000 Byte 左右
 */
 
 /* 宏 NEED_SWITCH_LITTLE_BIG_END
@@ -33,7 +35,9 @@
     但对于两个不同大小端之间的数据传输，接收时候需要大小端转换，
     如果 NEED_SWITCH_LITTLE_BIG_END 宏 为 真，则表示需要在 接收的时候进行大小端转换， 0 为不需要。
     
-    本库内部根据 NEED_SWITCH_LITTLE_BIG_END 的值自动做处理，用户只需 按需修改 NEED_SWITCH_LITTLE_BIG_END 即可。
+    本库内部根据 NEED_SWITCH_LITTLE_BIG_END 的值自动做处理，用户只需按需修改 NEED_SWITCH_LITTLE_BIG_END 即可：
+        帧头的 dependent_Length、库内置命令和回复 dependent 里的多字节域、读回来的 TEDS 镜像都按字段表转，见 “大小端转换” 部分；
+        数据集的采样数据格式只有用户知道，库原样给出，用户自己转。
 
     注：小端存储为以字节为最小单位按照 MSB 顺序排列，即变量的高字节放在寄存器的高位，低字节放在地位，大端与之相反。
 */
@@ -43,6 +47,21 @@
 /* 定义发送数据 函数指针，初始化时候应该填入 */
 extern unsigned int (*mes_1451_send)(unsigned char * data, unsigned int len);
 
+/* 分散-聚集发送用的一块内存的描述，对应 linux 的 struct iovec 和 win 的 WSABUF */
+struct MES_iovec_struct
+{
+    uint8_t* base;
+    uint32_t len;
+};
+
+/* 定义向量发送数据函数指针，可选，填了则发送队列批量发送时一次把所有帧交给它（比如 writev / sendmsg / WSASend），
+    不填则发送队列用 mes_1451_send 一次发送整个连续的队列缓存 */
+extern unsigned int (*mes_1451_sendv)(const struct MES_iovec_struct* iov, unsigned int iovcnt);
+
+/* 定义接收数据函数指针，可选，只有 NCAP 用 TC_data_set_pull_ctx() 这类要等回复的 API 时才需要，
+    阻塞接收，返回收到的字节数，0 表示连接断开或出错 */
+extern unsigned int (*mes_1451_recv)(unsigned char * data, unsigned int len);
+
 
 enum TIM_status_enum
 {
@@ -103,9 +122,6 @@ enum TransducerChannel_enum
 };
 
 
-extern uint8_t temp_load[200];
-extern uint32_t temp_load_valid_length;
-
                                     /*************\
 *************************************     TEDS    *****************************************************
                                     *   格式定义  *
@@ -119,6 +135,10 @@ extern uint32_t temp_load_valid_length;
 /* 这个数要大于下面 TEDS 结构体整体的大小，不要太小 */
 #define MAX_TEDS_LOAD_SIZE 200
 
+/* 一个 TEDS 整体最大多少字节：用 TEDS_image_bind() 挂的变长 TEDS（带 Group、校准、文本等段）和 NCAP 收 TEDS 都以此为上限，
+    TEDS 按段传，每段数据直接从 TEDS 里发，不受 MAX_TEDS_LOAD_SIZE 和 MAX_Message_dependent_SIZE 限制 */
+#define MAX_TEDS_IMAGE_SIZE (4 * 1024)
+
 /*************************** TEDS 属性 结构体 定义 ***************************/
 struct TEDS_attributes_struct
 {
@@ -770,11 +790,145 @@ extern struct TEDS_struct   TEDS;
 
 /* API 具体注释看 .c 文件 函数定义处 */
 
+/* 是否用 TEDS_gen 预先生成的 TEDS 镜像（TEDS_images.c / TEDS_images.h，由 TEDS_desc.txt 生成）：
+    为 1 时 TEDS_init() 不再算 Length 和 Checksum，直接挂 const 镜像，镜像在 flash / rodata 里直接发，.c 里的静态 TEDS 结构体不编译；
+    生成的 TC TEDS 只有描述里写了的域，和本库结构体布局不一样，读域要用 TEDS_decode()，改 TEDS 照常走影子（TEDS_update_field() 的 offset 按镜像算） */
+#define TEDS_PREBUILT   0
+
 void TEDS_init(void);
 
 void TEDS_pack_up(uint8_t* dest_loader,uint32_t* length,uint8_t access_code);
 
-void TEDS_decode(uint8_t* TEDS_load);   /* TODO ，暂不实现 */
+/* TEDS 解析：NCAP 用，就地解析收到的 TEDS，不分配不拷贝，结果里的指针都指向接收缓存 */
+enum TEDS_decode_result_enum
+{
+    TEDS_DECODE_OK = 0,
+    TEDS_DECODE_INCOMPLETE,     /* 收到的字节比 TEDS 头部 Length 说的少 */
+    TEDS_DECODE_BAD_LENGTH,     /* Length 太小，或 TLV 长度越界 */
+    TEDS_DECODE_BAD_ID,         /* 第一个 TLV 不是 TEDS ID，或 access code 不认识 */
+    TEDS_DECODE_BAD_CHECKSUM,
+};
+
+/* 一个 TLV，Value 指向接收缓存，多字节值用 memcpy 取（不一定对齐） */
+struct TEDS_TLV_view_struct
+{
+    uint8_t Type;
+    uint8_t Length;
+    const uint8_t* Value;
+};
+
+/* TLV 游标：从 DATA BLOCK 开头往后一个一个取，不认识的 Type 直接跳过就行 */
+struct TEDS_cursor_struct
+{
+    const uint8_t* load;
+    uint32_t pos;       /* 下一个 TLV 的偏移 */
+    uint32_t end;       /* DATA BLOCK 结束的偏移，即 Checksum 的位置 */
+    uint8_t Broken;     /* 遇到越界的 TLV 后置 1，之后不再返回 */
+};
+
+struct TEDS_decoded_struct
+{
+    const struct TEDS_ID_struct* ID;
+    uint8_t access_code;
+    uint32_t whole_length;      /* 含 Length 和 Checksum 的总长度 */
+    uint16_t Checksum;
+
+    /* 快速路径：总长度和每个 TLV 的 Type、Length 都和本库的结构体一模一样时（本库 TIM 发来的都是），对应的指针直接指向接收缓存，其他为 NULL */
+    const struct Meta_TEDS_struct* M_TEDS;
+    const struct TransducerChannel_TEDS_struct* TC_TEDS;
+    const struct User_Transducer_Name_TEDS_struct* UTN_TEDS;
+    const struct PHY_TEDS_struct* PHY_TEDS;
+
+    /* 通用路径：停在 ID 之后的第一个 TLV 上 */
+    struct TEDS_cursor_struct cursor;
+};
+
+/* 解析一个 TEDS（从最开头的 Length 开始），检查 Length、ID 和 Checksum */
+enum TEDS_decode_result_enum TEDS_decode(struct TEDS_decoded_struct* decoded, const uint8_t* TEDS_load, uint32_t received_length);
+
+/* 取下一个 TLV，到结尾或 TLV 越界返回 0 */
+uint8_t TEDS_cursor_next(struct TEDS_cursor_struct* cursor, struct TEDS_TLV_view_struct* tlv);
+
+/* 从游标当前位置往后找指定 Type 的 TLV，找到返回 1，游标停在它后面 */
+uint8_t TEDS_cursor_find(struct TEDS_cursor_struct* cursor, uint8_t Type, struct TEDS_TLV_view_struct* tlv);
+
+/* TEDS 校验内核：返回任意一段字节的加和（调用者取低 16 位），
+    编译时按目标平台选 AVX2 / SSE2 / NEON 实现，都没有则用标量，大数据集的帧完整性校验也可以用 */
+uint32_t TEDS_checksum_sum(const uint8_t* load, uint32_t length);
+
+/* 增量更新校验：一段 old_bytes 改成 new_bytes 后，从旧 Checksum 直接算新的，不用重新扫整个 TEDS */
+uint16_t TEDS_checksum_update(uint16_t Checksum, const uint8_t* old_bytes, const uint8_t* new_bytes, uint32_t length);
+
+/* 改 TEDS 里某个域的值（offset 为在 TEDS_load 里的字节偏移），同时增量更新该 TEDS 的 Checksum，成功返回 1 */
+uint8_t TEDS_update_field(uint8_t access_code, uint32_t offset, const void* value, uint32_t length);
+
+/* TIM 用：把某个 TEDS 换成用户提供的一整块 TEDS 字节（从 Length 开始，Checksum 已经算好），
+    可以比 MAX_TEDS_LOAD_SIZE 大（不超过 MAX_TEDS_IMAGE_SIZE），布局也可以和本库结构体不同，内存由用户保持有效，可以是只读的；
+    检查通过返回 1。之后读这个 TEDS 的域要用 TEDS_decode()，不能再直接用 TEDS.xxx_TEDS_u 的结构体成员 */
+uint8_t TEDS_image_bind(uint8_t access_code, const uint8_t* load, uint32_t whole_length);
+
+/* TIM 回复 Read_TEDS_segment 时一段最多带多少字节，实际还要和 PHY TEDS 的 MaxSDU 取最小 */
+extern uint32_t TEDS_segment_size_limit;
+
+/* 
+    TIM 用：改 TEDS 分两步，和 NCAP 发来的 Write_TEDS_segment / Update_TEDS 对应：
+    TEDS_write_segment() 写到这个 TEDS 的影子里（每个 TEDS 两块 MAX_TEDS_IMAGE_SIZE 的缓冲轮换），第一次写时先拷一份当前镜像，
+    TEDS_update() 检查影子的 Length、ID、Checksum，通过则一次原子地换上去，不通过丢掉影子旧镜像照常用；
+    正在从旧镜像发的 Read_TEDS_segment 回复持有引用，发完才放，不会读到写了一半的 TEDS；
+    同一个 TEDS 同时只能一个写的，别人正在写时直接返回 0 不等；TEDS_update_field() 也走影子，改完立即发布；
+    NCAP 写了一半断线的：换了连接（TIM 发 TIM_initiated 时 ctx 换新的 link_id）后第一个 Write_TEDS_segment 自动丢掉旧影子，
+    也可以断线时自己调 TEDS_write_abort() 丢掉；影子那块还有回复在发时写返回 0，不等；
+    NCAP 和 TIM 大小端不同（NEED_SWITCH_LITTLE_BIG_END 为 1）时 Update 要转整个影子，NCAP 要从 0 开始连续写满整个 TEDS，只写一部分的 Update 失败 
+*/
+uint8_t TEDS_write_segment(uint8_t access_code, uint32_t TEDSOffset, const uint8_t* data, uint32_t length);
+uint8_t TEDS_update(uint8_t access_code);
+uint8_t TEDS_write_abort(uint8_t access_code);
+
+/* 每个通道的 TC TEDS 影子缓存大小，通道的 TC TEDS 超过这个就只能 TC_TEDS_bind() 整个换，不能分段写 */
+#define TC_TEDS_SHADOW_SIZE     512
+
+/* Query_TC_TEDS_digest 回复里每个通道占的字节：属性（1） + 状态（1） + 总长度（4） + Checksum（2），
+    1 + TC_MAX * TC_TEDS_DIGEST_SIZE 要不大于 MAX_Message_dependent_SIZE */
+#define TC_TEDS_DIGEST_SIZE     8
+
+/* 通道表：每个通道一项，按通道号直接索引，Query / Read / Write / Update TEDS 按 Message 里的目标通道找这里；
+    load 为 NULL 的通道用共用的 TEDS.TC_TEDS_u，whole_length 和 Checksum 是发布时记下的，只给看 */
+struct TC_TEDS_entry_struct
+{
+    uint8_t* load;
+    uint32_t whole_length;
+    uint16_t Checksum;
+    struct TEDS_attributes_struct attr;
+    struct TEDS_status_struct status;
+};
+
+extern struct TC_TEDS_entry_struct TC_TEDS_table[TC_MAX];
+
+/* TIM 用：给通道挂自己的 TC TEDS（检查同 TEDS_image_bind()），load 为 NULL 则回到共用的；
+    其余同上面 TEDS_xxx()，只是改的是通道自己的，还没挂过的通道第一次写时从共用的拷一份再改 */
+uint8_t TC_TEDS_bind(uint8_t TC, const uint8_t* load, uint32_t whole_length);
+uint8_t TC_TEDS_update_field(uint8_t TC, uint32_t offset, const void* value, uint32_t length);
+uint8_t TC_TEDS_write_segment(uint8_t TC, uint32_t TEDSOffset, const uint8_t* data, uint32_t length);
+uint8_t TC_TEDS_update(uint8_t TC);
+uint8_t TC_TEDS_write_abort(uint8_t TC);
+
+/* 是否编译 TEDS 持久存储（需要 POSIX 的 mmap / msync，Linux 上的 TIM 用），MinGW 和裸机保持 0 */
+#define TEDS_STORE_USE_MMAP     0
+
+#if TEDS_STORE_USE_MMAP
+/*
+    TIM 用：把 TEDS 的影子缓存换成一个文件的内存映射，TEDS_init() 之后、开始服务之前调一次，成功返回 1；
+    文件里每个槽（四个 TEDS 和每个通道的 TC TEDS）两块，就是原来的两块影子，Write_TEDS_segment 直接写进映射，
+    Update_TEDS / TEDS_update_field() 检查通过后先 msync 数据再写这块的提交头，之后才发布；
+    启动时只 mmap 一次，每个槽取提交头里序号大的那块直接挂上，不解析不拷贝，通道再多也一样；
+    写到一半断电的那块头已经作废，重启后用的还是上次提交的；文件不存在或布局对不上时重新建，TEDS 用编译进来的；
+    TEDS_image_bind() / TC_TEDS_bind() 挂的是用户的内存，不存；
+    TEDS_update_field() / TC_TEDS_update_field()（Adaptive 的域，改得勤）先只在内存里发布，不落盘，
+    TIM 隔一段时间（比如每秒）和退出前调 TEDS_store_flush() 一起存，NCAP 的 Update_TEDS 照旧马上存
+*/
+uint8_t TEDS_store_open(const char* path);
+uint8_t TEDS_store_flush(void);
+#endif
 
                                     /*************\
 *************************************   Message    *****************************************************
@@ -828,6 +982,16 @@ enum CommonCmd_commands_enum
 
     /* 这里自定 TIM 初始化完毕标志 */
     TIM_ALL_TC_initiated = 130,
+
+    /* 自定：一次询问 TIM 所有通道的 TC TEDS 摘要 */
+    Query_TC_TEDS_digest = 131,
+
+    /* 自定：开关本连接的数据报（UDP）上传，见数据报上传部分 */
+    Datagram_mode = 132,
+    /* 自定：请 TIM 重发丢了的数据报 */
+    Datagram_NACK = 133,
+    /* 自定：给 TIM 会话号，重连认出来的 TIM 从 NCAP 收到的位置接着上传，见会话恢复部分 */
+    Session_resume = 134,
 };
 
 /* 传感器 空闲状态命令枚举（XdcrIdle，Transducer idle state commands）  */
@@ -942,6 +1106,57 @@ struct ReplyMessage_struct
 
 #pragma pack() /* 取消 1 字节对齐，恢复为默认对齐 */
 
+/* 读传感器通道数据集时，一个回复帧最多带多少字节的数据（实际大小由 NCAP 请求、TIM 限制和 PHY TEDS 的 MaxSDU 共同决定），
+    数据不经过 200 字节的 ReplyMessage 缓存，而是从数据集里直接发送，所以可以远大于 MAX_Message_dependent_SIZE；
+    dependent_Length 只有两个字节，所以不能超过 65535 - 4 */
+#define MAX_TC_data_segment_SIZE    (32 * 1024)
+
+/* 零拷贝解析 ReplyMessage 时允许的最大 dependent 长度，数据集回复 = Offset 4 字节 + 数据，TIM 推的数据再多一个通道号 */
+#define MAX_ReplyMessage_view_dependent_SIZE    (MAX_TC_data_segment_SIZE + 5)
+
+/* ReplyMessage 的 Flag 最高位为 1 的不是哪个命令的回复，是 TIM 主动推的采样（BufferHalfFull 的采样环），
+    dependent 为通道号（1） + Offset（4） + 数据；NCAP 等命令回复时先把它们挑出来（MES_ctx_take_push()） */
+#define MES_REPLY_FLAG_PUSH         0x80
+
+/* ReplyMessage 的 Flag 次高位为 1 的是库自己发的命令（NCAP 的 Datagram_NACK）的回复，调用者没在等它，
+    NCAP 等命令回复时和推的采样一起挑出来丢掉（MES_ctx_take_push()），不会被当成别的命令的回复 */
+#define MES_REPLY_FLAG_INTERNAL     0x40
+
+/* Message 和 ReplyMessage 在 dependent 前面的固定头部字节数 */
+#define MESSAGE_HEADER_SIZE         6   /* Dest_TIM_and_TC_Num[2] + Command_class + Command_function + dependent_Length[2] */
+#define REPLYMESSAGE_HEADER_SIZE    3   /* Flag + dependent_Length[2] */
+
+/*************************** Message 和 ReplyMessage 视图结构体定义 ***************************/
+    /* 零拷贝解析用：只解析并检查头部和长度，dependent 不拷贝，只记下其在接收缓存里的地址，
+        所以视图只在接收缓存没被覆盖前有效 */
+
+struct Message_view_struct
+{
+    uint8_t Dest_TIM_and_TC_Num[2];
+    uint8_t Command_class;
+    uint8_t Command_function;
+    uint16_t dependent_Length;
+    const uint8_t* dependent_load;  /* 指向接收缓存里面的 dependent，有效长度为 dependent_Length */
+    uint32_t frame_Length;          /* 本帧总长度，即 MESSAGE_HEADER_SIZE + dependent_Length */
+};
+
+struct ReplyMessage_view_struct
+{
+    uint8_t Flag;
+    uint16_t dependent_Length;
+    const uint8_t* dependent_load;  /* 指向接收缓存里面的 dependent，有效长度为 dependent_Length */
+    uint32_t frame_Length;          /* 本帧总长度，即 REPLYMESSAGE_HEADER_SIZE + dependent_Length */
+};
+
+/* 视图解析的返回值 */
+enum MES_decode_result_enum
+{
+    MES_DECODE_OK = 0,
+    MES_DECODE_INCOMPLETE,  /* 接收的数据不够一整帧（头部或 dependent 不全） */
+    MES_DECODE_TOO_LONG,    /* dependent_Length 超过上限（Message 为 MAX_Message_dependent_SIZE，
+                                ReplyMessage 为 MAX_ReplyMessage_view_dependent_SIZE），视为坏帧 */
+};
+
 
 /*************************** Message 和 ReplyMessage 联合体定义 ***************************/
     /* 这么做 让 Message 和 ReplyMessage 结构体可以 逐字节 处理 */
@@ -967,10 +1182,186 @@ struct MES_struct
     union ReplyMessage_union*   ReplyMessage_u; uint32_t ReplyMessage_load_Length;
 };
 
+/*************************** 发送队列结构体 ***************************/
+    /* 打包好的 Message / ReplyMessage 先攒在队列里，
+        到了字节数门限、到了时限或者用户主动冲刷时用一次向量发送（每帧一个 iovec）全部发出去，
+        省掉一帧一次 send() 的系统调用 */
+
+#define MES_TXQ_BUFFER_SIZE     (16 * 1024)     /* 队列缓存字节数 */
+#define MES_TXQ_IOV_MAX         64              /* 队列最多攒多少帧，linux 的 IOV_MAX 一般为 1024 */
+
+struct MES_txq_struct
+{
+    uint8_t  buffer[MES_TXQ_BUFFER_SIZE];       /* 帧依次拷贝进来，连续存放 */
+    uint32_t used;
+    struct MES_iovec_struct iov[MES_TXQ_IOV_MAX];
+    uint32_t iovcnt;
+
+    uint32_t flush_threshold;       /* 攒够这么多字节就发，0 表示只按时限和主动冲刷 */
+    uint32_t flush_deadline_ms;     /* 第一帧入队后最多等这么多毫秒就发，0 表示不按时限 */
+    uint32_t (*now_ms)(void);       /* 可选，毫秒时基，填了则入队时记下时间，不填则从入队后第一次 MES_txq_poll_ctx() 开始算 */
+    uint32_t first_enqueue_ms;
+    uint8_t  first_enqueue_valid;
+};
+
+/*************************** 回复缓存结构体 ***************************/
+    /* TIM 用：Query_TEDS 和 Read_TEDS_segment 的回复只有 TEDS 变了才会变，
+        第一次回复时把整帧（头部 + TEDS 数据）存下来，之后同样的请求（命令、TEDS、通道、TEDSOffset）直接把存的字节发出去，
+        不用再取镜像、解 PHY TEDS 算段大小、填回复；
+    任何 TEDS 发布（Update_TEDS、TEDS_update_field()、bind 等）都让所有缓存失效，TEDS_segment_size_limit 改了也失效，
+        Query_TEDS 命中时还对一下属性和状态，变了就重新编 */
+
+#define MES_REPLY_CACHE_ENTRIES     64      /* 须为 2 的幂 */
+#define MES_REPLY_CACHE_WAYS        4       /* 组相联，一组这么多项，组里满了按最久没用的替换 */
+#define MES_REPLY_CACHE_FRAME_SIZE  256     /* 整帧超过这么多字节的回复不缓存，照常回复 */
+
+struct MES_reply_cache_entry_struct
+{
+    uint8_t  valid;
+    uint8_t  Command_function;
+    uint8_t  which_TEDS;
+    uint8_t  TC;                    /* 只有 TC TEDS 看通道，别的 TEDS 都记 TC_MAX */
+    uint32_t TEDSOffset;            /* Query_TEDS 为 0 */
+    uint32_t generation;            /* 存的时候的 TEDS 代数，和当前的不同就是 TEDS 变了 */
+    uint32_t segment_size_limit;    /* 存的时候的 TEDS_segment_size_limit */
+    uint32_t last_use;
+    uint16_t frame_Length;
+    uint8_t  frame[MES_REPLY_CACHE_FRAME_SIZE];
+};
+
+struct MES_reply_cache_struct
+{
+    struct MES_reply_cache_entry_struct entry[MES_REPLY_CACHE_ENTRIES];
+    uint32_t use_clock;
+
+    uint32_t hit_count;
+    uint32_t miss_count;
+};
+
+/*************************** 握手和每连接的编解码 ***************************/
+    /* TIM 上线发的 TIM_initiated 带握手信息，dependent 按 TIM 自己的大小端：
+        字节序标记（2） + 能力位图（4） + 最大数据段大小（4） + 会话号（4，之前没连过为 0），老的 TIM 不带（dependent_Length 为 0）；
+    NCAP 从字节序标记看出 TIM 和自己大小端是否相同，给这个连接选一套编解码：
+        相同的不转，不同的收的时候转进来、发的时候转出去，TIM 一直按自己的大小端收发，什么都不做；
+    选好后每帧只是通过函数指针调对应的那套，没有按帧的判断，一个 NCAP 可以同时连大端和小端的 TIM；
+    这样协商时两边的 NEED_SWITCH_LITTLE_BIG_END 都要为 0，它只决定没握手的连接用哪套 */
+
+#define MES_BYTE_ORDER_MARK         0xFEFF      /* 按本平台大小端写，对方读出来是 0xFFFE 就是大小端不同 */
+#define MES_HANDSHAKE_SIZE          10          /* TIM_initiated 的 dependent 最短长度，不带会话号的老 TIM */
+#define MES_HANDSHAKE_SESSION_SIZE  14          /* 带会话号的长度 */
+
+/* 能力位图 */
+#define MES_CAP_SEGMENTED_READ      (1u << 0)   /* Read_TEDS_segment 和按 Offset 分段读数据集 */
+#define MES_CAP_TEDS_WRITE          (1u << 1)   /* Write_TEDS_segment / Update_TEDS */
+#define MES_CAP_TC_TEDS_DIGEST      (1u << 2)   /* Query_TC_TEDS_digest 和每通道的 TC TEDS */
+#define MES_CAP_BATCHING            (1u << 3)   /* TIM 挂了发送队列，回复攒起来一次发 */
+#define MES_CAP_COMPRESSION         (1u << 4)   /* 保留：数据压缩，本库还没有 */
+#define MES_CAP_TRANSACTION_ID      (1u << 5)   /* 保留：帧带事务号，本库还没有，现在按 TCP 的顺序对回复 */
+#define MES_CAP_DATAGRAM            (1u << 6)   /* TIM 挂了数据报发送，采样上传可以走 UDP（Datagram_mode / Datagram_NACK） */
+#define MES_CAP_SESSION_RESUME      (1u << 7)   /* TIM 认 Session_resume，重连后不用重新走一遍上线流程 */
+
+struct MES_stream_struct;
+struct MES_ctx_struct;
+struct MES_dgram_tx_struct;
+struct MES_dgram_range_struct;
+struct MES_session_struct;
+
+struct MES_codec_struct
+{
+    uint8_t swap;   /* 对方和本平台大小端不同 */
+    /* 从流的 head 切一个帧的视图，Message 的 dependent 顺便就地转好 */
+    enum MES_decode_result_enum (*Message_view)(struct MES_stream_struct* stream, struct Message_view_struct* view);
+    enum MES_decode_result_enum (*ReplyMessage_view)(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view);
+    /* 就地转回复的 dependent，回复头里没有命令，由调用者给 */
+    void (*ReplyMessage_dependent)(uint8_t* load, uint32_t length, uint8_t Command_class, uint8_t Command_function);
+    /* 发之前把打包好的 Message 就地转成对方的大小端，to_peer 为 0 时转回来 */
+    void (*Message_encode)(uint8_t* Message_load, uint8_t to_peer);
+    /* 就地转读回来的整个 TEDS，返回 0 为 TEDS 坏了 */
+    uint8_t (*TEDS)(uint8_t* TEDS_load, uint32_t whole_length);
+};
+
+extern const struct MES_codec_struct MES_codec_native;     /* 不转 */
+extern const struct MES_codec_struct MES_codec_swap;       /* 都转：收的转进来，发的 Message 转出去 */
+extern const struct MES_codec_struct MES_codec_swap_rx;    /* 只收的时候转，NEED_SWITCH_LITTLE_BIG_END 为 1 的老做法，两边各转各收的 */
+extern const struct MES_codec_struct MES_codec_detect;     /* 流刚初始化时用：看第一帧是不是带握手的 TIM_initiated，选好就换成上面两个之一 */
+/* 没握手的连接用的 */
+#define MES_CODEC_DEFAULT           (NEED_SWITCH_LITTLE_BIG_END ? &MES_codec_swap_rx : &MES_codec_native)
+
+/*************************** Message 上下文（ctx）结构体 ***************************/
+    /* 一个 ctx 拥有自己的一套 Message、ReplyMessage 和临时缓存，ctx 之间互不干扰，
+        NCAP 可以给每一个 TIM 连接例化一个 ctx，N 个线程各自服务一个连接，不用加锁；
+        ctx 可以是静态变量，也可以在栈上，用之前调用 MES_ctx_init() 初始化 */
+struct MES_ctx_struct
+{
+    /* 下面几个指针指向本 ctx 自己的 xxx_store；默认 ctx 的指向原来的全局变量，和全局变量是同一块存储 */
+    struct MES_struct*          Mes;                /* 与原全局 MES 一样，里面两个联合指针指向本 ctx 下面的两个联合体 */
+    struct Message_struct*      Message_rx;         /* 与原全局 Message_temp 一样 */
+    struct ReplyMessage_struct* ReplyMessage_rx;    /* 与原全局 ReplyMessage_temp 一样 */
+    uint8_t*                    Scratch_load;       /* 与原全局 temp_load 一样 */
+    uint32_t*                   Scratch_load_valid_length;
+
+    struct MES_struct           Mes_store;
+    union Message_union         Message_store;
+    union ReplyMessage_union    ReplyMessage_store;
+    struct Message_struct       Message_rx_store;
+    struct ReplyMessage_struct  ReplyMessage_rx_store;
+    uint8_t  Scratch_load_store[MAX_TEDS_LOAD_SIZE];
+    uint32_t Scratch_load_valid_length_store;
+
+    /* 本 ctx 的发送数据函数指针，为 NULL 则用全局的 mes_1451_send */
+    unsigned int (*send)(void* user_data, unsigned char * data, unsigned int len);
+    /* 本 ctx 的向量发送数据函数指针，可选，为 NULL 则用全局的 mes_1451_sendv（ctx 的 send 也为 NULL 时） */
+    unsigned int (*sendv)(void* user_data, const struct MES_iovec_struct* iov, unsigned int iovcnt);
+    /* 本 ctx 的接收数据函数指针，可选，为 NULL 则用全局的 mes_1451_recv */
+    unsigned int (*recv)(void* user_data, unsigned char * data, unsigned int len);
+    void* user_data;    /* 用户私有数据，原样传给 send、sendv 和 recv，比如本连接的 socket 句柄 */
+
+    /* 回复的外挂数据，不拷贝进 ReplyMessage 缓存，发送时直接跟在 ReplyMessage_load 后面发，
+        长度已经算在 ReplyMessage.dependent_Length 里，发完即清零；读数据集这种大回复用 */
+    const uint8_t* Reply_payload;
+    uint32_t Reply_payload_Length;
+    uint32_t* Reply_payload_ref;    /* 外挂数据的引用计数，非 NULL 时发完减一，读 TEDS 段时用它保住旧镜像 */
+    uint8_t  Reply_payload_direct;  /* 为 1 时外挂数据不进发送队列：先冲刷队列再直接向量发送，发完即清零；
+                                        采样环用，发完就还给生产者，拷贝进队列就不是零拷贝了 */
+
+    struct MES_txq_struct* txq; /* 发送队列，可选，为 NULL 则每帧直接发送，用 MES_ctx_attach_txq() 挂上 */
+    struct MES_reply_cache_struct* reply_cache; /* 回复缓存，可选，TIM 用，用 MES_ctx_attach_reply_cache() 挂上 */
+    struct MES_dgram_tx_struct* dgram_tx;       /* 数据报上传，可选，TIM 用，用 MES_ctx_attach_dgram_tx() 挂上 */
+
+    /* 本连接发 Message 用的编解码，MES_ctx_init() 填 MES_CODEC_DEFAULT，NCAP 收到 TIM_initiated 后 MES_ctx_negotiate() 改 */
+    const struct MES_codec_struct* codec;
+    uint32_t peer_caps;                 /* 对方 TIM 的能力位图，没握手为 0 */
+    uint32_t peer_max_segment_size;     /* 对方 TIM 一帧最多回多少数据，没握手为 0 */
+    uint32_t peer_session_token;        /* 对方 TIM 握手带的会话号，没有为 0 */
+
+    /* TIM 用：NCAP 用 Session_resume 给的会话号，ctx 跨重连留着，TIM_initiated 带上 */
+    uint32_t session_token;
+    uint8_t  session_pending;           /* 带会话号的 TIM_initiated 发出后还没收到 Session_resume（或者重新上线的设模式、Trigger），采样环先不发 */
+
+    /* NCAP 用：TIM 主动推的采样（Flag 带 MES_REPLY_FLAG_PUSH），MES_ctx_take_push() 交给它，用 MES_ctx_attach_push() 挂上 */
+    void (*on_push)(void* user_data, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length);
+    void* on_push_user_data;
+
+    /* 本连接的编号，MES_ctx_init() 时分配，NCAP 在 MES_ctx_negotiate()、TIM 在打包 TIM_initiated 时换新的；
+        NCAP 的 TEDS 缓存用它认 UUID 是不是本连接读的，TIM 用它认影子是不是本连接写的 */
+    uint32_t link_id;
+};
+
+/* 默认 ctx，原来的全局 API 都是对它的薄封装 */
+extern struct MES_ctx_struct MES_ctx_default;
+
+/* 原来的全局变量照旧可用，用户程序不用改；默认 ctx 的指针指向它们，两边是同一块存储 */
 extern struct MES_struct MES;
-
 extern struct Message_struct Message_temp;
 extern struct ReplyMessage_struct ReplyMessage_temp;
+extern uint8_t temp_load[MAX_TEDS_LOAD_SIZE];
+extern uint32_t temp_load_valid_length;
+
+/* 同上，取默认 ctx 的对应成员 */
+struct MES_struct* MES_default_mes(void);
+struct Message_struct* MES_default_Message_temp(void);
+struct ReplyMessage_struct* MES_default_ReplyMessage_temp(void);
+uint8_t* MES_default_temp_load(uint32_t* valid_length);
 
                                     /*************\
 *************************************   Message   *****************************************************
@@ -979,43 +1370,772 @@ extern struct ReplyMessage_struct ReplyMessage_temp;
 
 /* API 具体注释看 .c 文件 函数定义处，具体使用实例看 .c 最上面 注释 */
 
+/* 下面每个 API 都有一个 _ctx 后缀的版本，第一个参数为 ctx，操作的是该 ctx 自己的缓存，可重入；
+    不带 _ctx 的原版 API 即是对默认 ctx（MES_ctx_default）的封装 */
+
 /**************************** Message init，用户使用 ****************************/
 void Message_init(void);
+void MES_ctx_init(struct MES_ctx_struct* ctx, 
+    unsigned int (*send)(void* user_data, unsigned char * data, unsigned int len), void* user_data);
 
 /**************************** 根据不同命令 填充 Message 结构体 并打包数据的 API，用户使用 ****************************/
-/* 打包好的消息数据在 MES.Message_u->Message_load 里面，有效数据长度为 MES.Message_load_Length */
+/* 打包好的消息数据在 ctx->Mes->Message_u->Message_load 里面，有效数据长度为 ctx->Mes->Message_load_Length */
 void Message_CommonCmd_Query_TEDS_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS);
 void Message_CommonCmd_Read_TEDS_segment_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset);
+void Message_CommonCmd_Write_TEDS_segment_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset, const uint8_t* data, uint16_t length);
+void Message_CommonCmd_Update_TEDS_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS);
+void Message_CommonCmd_Query_TC_TEDS_digest_pack_up(uint8_t Dest_TIM);
+void Message_CommonCmd_Datagram_mode_pack_up(uint8_t Dest_TIM, uint8_t enable, uint16_t session, uint16_t port, uint16_t payload_max);
 void Message_XdcrIdle_Set_Data_Transmission_mode_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC,enum Data_Transmission_mode_enum mode);
 void Message_XdcrOperate_Read_TC_data_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset);
 void Message_XdcrOperate_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC);
 void Message_XdcrOperate_Abort_Trigger_pack_up(uint8_t Dest_TIM, uint8_t Dest_TC);
 void Message_TIM_initiated_pack_up(void);
 
+/* 打包好的消息数据在 ctx->Mes->Message_u->Message_load 里面，有效数据长度为 ctx->Mes->Message_load_Length */
+void Message_CommonCmd_Query_TEDS_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS);
+void Message_CommonCmd_Read_TEDS_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset);
+/* 一次最多写 MAX_Message_dependent_SIZE - 5 字节，长的 TEDS 按 TEDSOffset 分几次写，写完再发 Update_TEDS；
+    NEED_SWITCH_LITTLE_BIG_END 为 1 时 TIM 在 Update_TEDS 时把影子整个转一遍，所以要按 NCAP 自己的大小端写整个 TEDS，不能只写一段；
+    握手得知大小端不同的连接 TIM 什么都不转，NCAP 先用 TEDS_swap() 把 TEDS 转成 TIM 的大小端再写 */
+void Message_CommonCmd_Write_TEDS_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS, uint32_t TEDSOffset, const uint8_t* data, uint16_t length);
+void Message_CommonCmd_Update_TEDS_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t which_TEDS);
+void Message_CommonCmd_Query_TC_TEDS_digest_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM);
+/* 开关 TIM 的数据报上传：开关（1）、会话号（2）、NCAP 收数据报的 UDP 端口（2）、一个数据报最多带多少数据（2），
+    TIM 挂了数据报发送才回 Flag 为 1 */
+void Message_CommonCmd_Datagram_mode_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t enable, uint16_t session, uint16_t port, uint16_t payload_max);
+/* 请 TIM 重发：段数（1） + 每段起始序号（4）、个数（2），最多 MES_DGRAM_NACK_MAX 段；
+    回复 Flag 为 1 | MES_REPLY_FLAG_INTERNAL，dependent 为重发了的个数（2） + 已经不在发送历史里补不了的个数（2）；
+    MES_dgram_rx_poll() 自己发，回复不用等，MES_ctx_take_push() 会挑出来丢掉 */
+void Message_CommonCmd_Datagram_NACK_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, const struct MES_dgram_range_struct* range, uint8_t range_count);
+/* 给 TIM 会话号并让它接着上传：会话号（4） + 通道数（1） + 每个通道号（1）、NCAP 收到的末尾位置（4）；
+    回复 Flag 为 1，dependent 为通道数（1） + 每个通道号（1）、TIM 实际从哪里接着发（4） */
+void Message_CommonCmd_Session_resume_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, const struct MES_session_struct* session);
+void Message_XdcrIdle_Set_Data_Transmission_mode_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC,enum Data_Transmission_mode_enum mode);
+void Message_XdcrOperate_Read_TC_data_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset);
+/* 同上，多带两个字节的本次想要的最大数据段大小，TIM 回复的数据不超过它 */
+void Message_XdcrOperate_Read_TC_data_segment_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC, uint32_t Offset, uint16_t max_segment_size);
+void Message_XdcrOperate_Trigger_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC);
+void Message_XdcrOperate_Abort_Trigger_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Dest_TIM, uint8_t Dest_TC);
+/* dependent 为握手信息：字节序标记、本 TIM 的能力位图、一帧最多回多少数据和 ctx 的会话号 */
+void Message_TIM_initiated_pack_up_ctx(struct MES_ctx_struct* ctx);
+
 /**************************** 消息的 发送，用户使用 ****************************/
 void Message_pack_up_And_send(void);
+void Message_pack_up_And_send_ctx(struct MES_ctx_struct* ctx);
+
+/**************************** 发送队列，用户使用 ****************************/
+/* 给 ctx 挂上发送队列，之后该 ctx 的 Message_pack_up_And_send_ctx() 和回复都先入队，
+    flush_threshold 和 flush_deadline_ms 见 struct MES_txq_struct，txq 填 NULL 即摘掉（摘之前要先冲刷） */
+void MES_ctx_attach_txq(struct MES_ctx_struct* ctx, struct MES_txq_struct* txq, 
+    uint32_t flush_threshold, uint32_t flush_deadline_ms, uint32_t (*now_ms)(void));
+/* 主动冲刷，把队列里所有帧一次发出去，返回发送的字节数 */
+uint32_t MES_txq_flush_ctx(struct MES_ctx_struct* ctx);
+/* 在主循环里定期调用，到了时限就冲刷，返回发送的字节数 */
+uint32_t MES_txq_poll_ctx(struct MES_ctx_struct* ctx, uint32_t now_ms);
+
+/**************************** 回复缓存，TIM 用 ****************************/
+/* 给 ctx 挂上回复缓存，之后 ReplyMessage_Server_view_ctx() 回 Query_TEDS 和 Read_TEDS_segment 先查缓存，
+    一个连接（ctx）一个，不加锁；cache 填 NULL 即摘掉 */
+void MES_ctx_attach_reply_cache(struct MES_ctx_struct* ctx, struct MES_reply_cache_struct* cache);
+/**************************** TIM 推的采样，NCAP 用 ****************************/
+/* 挂上推的采样的处理函数，on_push 填 NULL 则推的采样收到就丢掉 */
+void MES_ctx_attach_push(struct MES_ctx_struct* ctx, 
+    void (*on_push)(void* user_data, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length), void* user_data);
+/* reply 是 TIM 推的采样就交给 on_push 并返回 1，是库自己发的命令的回复（MES_REPLY_FLAG_INTERNAL）丢掉并返回 1，
+    是调用者的命令的回复返回 0；
+    MES_stream_wait_ReplyMessage_ctx() 自己会调，自己用 MES_stream_next_ReplyMessage() 收回复的要先调它 */
+uint8_t MES_ctx_take_push(struct MES_ctx_struct* ctx, const struct ReplyMessage_view_struct* reply);
+
+/* 让所有 ctx 的回复缓存失效，库的 API 改 TEDS 时自己会做，
+    用户绕过库直接改了 TEDS 的内容（比如 TEDS_PREBUILT 为 0 时直接改 M_TEDS_u 里的域）后调 */
+void MES_reply_cache_invalidate(void);
 
 /**************************** 解析接收到的 Message 的 API ****************************/
 void Message_decode(struct Message_struct* messageReceived,uint8_t* received_mes_load);
+struct Message_struct* Message_decode_ctx(struct MES_ctx_struct* ctx, uint8_t* received_mes_load); /* 结果放在 *ctx->Message_rx */
+/* 零拷贝解析，不 memset 不拷贝，view 里的 dependent_load 指向 received_mes_load 里面，received_length 为接收到的有效字节数 */
+enum MES_decode_result_enum Message_decode_view(struct Message_view_struct* view, const uint8_t* received_mes_load, uint32_t received_length);
 
 /**************************** 根据相应 Message 填充 ReplyMessage 结构体 并打包数据的 API， 的 API ****************************/
-/* 打包好后的回复消息数据在 MES.ReplyMessage_u->ReplyMessage_load 里面，有效数据长度为 MES.ReplyMessage_load_Length */
-// void ReplyMessage_CommonCmd_Query_TEDS_pack_up(uint8_t which_TEDS);
-// void ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(uint8_t which_TEDS, uint32_t TEDSOffset);
-// void ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up(void);
-// void ReplyMessage_XdcrOperate_Read_TC_data_pack_up(void);
-// void ReplyMessage_XdcrOperate_Trigger_pack_up(void);
-// void ReplyMessage_XdcrOperate_Abort_Trigger_pack_up(void);
-// void ReplyMessage_TIM_initiated_pack_up(void);
+/* 打包好后的回复消息数据在 ctx->Mes->ReplyMessage_u->ReplyMessage_load 里面，有效数据长度为 ctx->Mes->ReplyMessage_load_Length */
+// void ReplyMessage_CommonCmd_Query_TEDS_pack_up(struct MES_ctx_struct* ctx, uint8_t which_TEDS, uint8_t TC);
+// void ReplyMessage_CommonCmd_Read_TEDS_segment_pack_up(struct MES_ctx_struct* ctx, uint8_t which_TEDS, uint8_t TC, uint32_t TEDSOffset);
+// void ReplyMessage_CommonCmd_Query_TC_TEDS_digest_pack_up(struct MES_ctx_struct* ctx);
+// void ReplyMessage_CommonCmd_Write_TEDS_segment_pack_up(struct MES_ctx_struct* ctx, uint8_t ok);
+// void ReplyMessage_CommonCmd_Update_TEDS_pack_up(struct MES_ctx_struct* ctx, uint8_t ok);
+// void ReplyMessage_XdcrIdle_Data_Transmission_mode_pack_up(struct MES_ctx_struct* ctx);
+// void ReplyMessage_XdcrOperate_Read_TC_data_pack_up(struct MES_ctx_struct* ctx, uint8_t TC, uint32_t Offset, uint32_t max_segment_size);
+// void ReplyMessage_XdcrOperate_Trigger_pack_up(struct MES_ctx_struct* ctx);
+// void ReplyMessage_XdcrOperate_Abort_Trigger_pack_up(struct MES_ctx_struct* ctx);
+// void ReplyMessage_TIM_initiated_pack_up(struct MES_ctx_struct* ctx);
 
 /**************************** 回复消息的 发送 ****************************/
-// uint8_t ReplyMessage_send(uint8_t class, uint8_t command); 由 ReplyMessage_Server() 调用
+// uint8_t ReplyMessage_send(struct MES_ctx_struct* ctx, uint8_t class, uint8_t command); 由 ReplyMessage_Server() 调用
 
 /**************************** 解析接收到的 消息 的 API ****************************/
 void ReplyMessage_decode(struct ReplyMessage_struct* replyMessageReceived,uint8_t* received_rep_mes_load);
+struct ReplyMessage_struct* ReplyMessage_decode_ctx(struct MES_ctx_struct* ctx, uint8_t* received_rep_mes_load); /* 结果放在 *ctx->ReplyMessage_rx */
+enum MES_decode_result_enum ReplyMessage_decode_view(struct ReplyMessage_view_struct* view, const uint8_t* received_rep_mes_load, uint32_t received_length);
+
+/**************************** 通用回复消息打包，自定义命令处理函数里用 ****************************/
+/* 把 dependent 拷贝进 ctx 的 ReplyMessage 并填好长度，dependent 为 NULL 则只填 Flag 和长度 0 */
+void ReplyMessage_pack_up_ctx(struct MES_ctx_struct* ctx, uint8_t Flag, const uint8_t* dependent, uint16_t dependent_Length);
+
+/**************************** 命令处理函数注册，用户使用 ****************************/
+/* 命令处理函数：根据 message 打包好 ctx 的 ReplyMessage（用 ReplyMessage_pack_up_ctx() 等），
+    返回后由 ReplyMessage_Server 统一发送 */
+typedef void (*ReplyMessage_handler_t)(struct MES_ctx_struct* ctx, const struct Message_view_struct* message);
+
+/* 处理函数表为两级稀疏表：第一级按 Command_class 256 个指针，第二级每个 Command_class 一块 256 个处理函数，
+    第二级的块从静态池里取，这个数为最多能有多少个 Command_class 注册了处理函数（库内置的占 3 个） */
+#define MES_HANDLER_CLASS_BLOCK_MAX     8
+
+/* 注册某个 Command_class 下某个 Command_function 的处理函数，handler 填 NULL 即注销，
+    可以覆盖库内置的处理函数，也可以添加厂商自定义（ClassN，128 ~ 255）等命令；
+    返回 1 成功，0 表示静态池用完；
+    注册要在开始服务之前做完，服务中不要再改 */
+uint8_t ReplyMessage_Server_register_handler(uint8_t Command_class, uint8_t Command_function, ReplyMessage_handler_t handler);
 
 /**************************** ReplyMessage 服务程序，自动解析 Message 并回复，用户使用  ****************************/
+/* 查表分发，没有注册处理函数的命令回复 Flag 为 0 */
 void ReplyMessage_Server(uint8_t* received_mes_load);
+void ReplyMessage_Server_ctx(struct MES_ctx_struct* ctx, uint8_t* received_mes_load);
+void ReplyMessage_Server_view_ctx(struct MES_ctx_struct* ctx, const struct Message_view_struct* message); /* 直接用视图，不再解析 */
+
+                                    /*************\
+*************************************  字节流分帧  *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* TCP 是字节流，一次 recv() 可能收到好几帧粘在一起，也可能一帧被拆成好几次收到，
+    这里用 Message 的 6 字节头和 ReplyMessage 的 3 字节头里的 dependent_Length 从接收缓存里切出完整的帧，
+    一次 recv() 收 64KB 就可以一次处理几百个命令 */
+
+/* 每个连接的接收缓存大小，至少要大于一个最大帧 */
+#define MES_STREAM_BUFFER_SIZE      (64 * 1024)
+
+struct MES_stream_struct
+{
+    uint8_t  buffer[MES_STREAM_BUFFER_SIZE];
+    uint32_t head;      /* 还没处理的第一个字节 */
+    uint32_t tail;      /* 有效数据的末尾 */
+    uint32_t need;      /* head 处那半帧的总长度，头还没收全为 0；放得下它就不挪缓存 */
+    uint8_t  Broken;    /* 收到坏帧（长度超限）后置 1，流已经失去同步，应该断开重连或者 MES_stream_init() */
+    const struct MES_codec_struct* codec;   /* 本连接收的编解码，MES_stream_init() 填 MES_codec_detect */
+};
+
+void MES_stream_init(struct MES_stream_struct* stream);
+
+/* 写入数据方式一：取得可写的空间，recv() 直接写到返回的地址，再用 MES_stream_commit() 提交收到的字节数，不用多拷贝一次 */
+uint8_t* MES_stream_write_ptr(struct MES_stream_struct* stream, uint32_t* space);
+void MES_stream_commit(struct MES_stream_struct* stream, uint32_t received_length);
+/* 写入数据方式二：拷贝进来，返回实际拷贝的字节数 */
+uint32_t MES_stream_feed(struct MES_stream_struct* stream, const uint8_t* data, uint32_t length);
+
+/* 取出下一个完整帧的视图，返回 MES_DECODE_OK 才有效，
+    视图里的指针指向流的接收缓存，在下一次写入数据之前有效 */
+enum MES_decode_result_enum MES_stream_next_Message(struct MES_stream_struct* stream, struct Message_view_struct* view);
+enum MES_decode_result_enum MES_stream_next_ReplyMessage(struct MES_stream_struct* stream, struct ReplyMessage_view_struct* view);
+
+/* 批量处理：TIM 用，把流里所有完整的 Message 依次交给 ReplyMessage_Server_view_ctx() 处理并回复，返回处理的帧数 */
+uint32_t MES_stream_serve_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream);
+/* 批量处理：NCAP 用，把流里所有完整的 ReplyMessage 依次交给回调函数，返回处理的帧数 */
+uint32_t MES_stream_dispatch_ReplyMessage(struct MES_stream_struct* stream, 
+    void (*on_reply)(void* user_data, const struct ReplyMessage_view_struct* reply), void* user_data);
+
+/* 阻塞等下一个完整的 ReplyMessage：流里没有就用 ctx 的 recv（没填则 mes_1451_recv）接着收，
+    TIM 推的采样交给 ctx 的 on_push，不算回复；连接断开或流坏了返回 0；NCAP 发完命令等回复用 */
+uint8_t MES_stream_wait_ReplyMessage_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    struct ReplyMessage_view_struct* reply);
+
+                                    /*************\
+*************************************  大小端转换  *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* 连接的编解码是 MES_codec_swap（握手得知大小端不同）或 MES_codec_swap_rx（NEED_SWITCH_LITTLE_BIG_END 为 1）时
+    收到的帧和 TEDS 按字段表一遍转完，MES_codec_swap 发的 Message 也一样转出去，
+    每个多字节域用编译器的 bswap 内建（x86 上是一条 bswap / movbe），同宽度连续的域编译器会合成 SIMD 的字节重排；
+    MES_codec_native 的那些函数什么都不做 */
+
+/* 一个域：从 offset 开始 count 个 size 字节宽的元素，size 为 2、4、8 */
+struct MES_field_struct
+{
+    uint16_t offset;
+    uint8_t  size;
+    uint8_t  count;
+};
+
+/* 一个 dependent 的字段表：先是固定位置的域，
+    repeat_stride 不为 0 的话从 repeat_offset 开始每 repeat_stride 字节一条记录，记录里的域在 repeat_field 里（offset 相对记录开头） */
+struct MES_schema_struct
+{
+    const struct MES_field_struct* field;
+    uint8_t  field_count;
+    uint16_t repeat_offset;
+    uint16_t repeat_stride;
+    const struct MES_field_struct* repeat_field;
+    uint8_t  repeat_field_count;
+};
+
+/* 按字段表把 load（length 字节）里的多字节域就地翻转，超出 length 的域跳过；schema 为 NULL 则什么都不做 */
+void MES_swap_fields(uint8_t* load, uint32_t length, const struct MES_schema_struct* schema);
+
+/* 库内置命令的字段表，is_reply 为 1 取回复的，没有多字节域或不认识的命令返回 NULL，
+    厂商自定义命令自己写字段表调 MES_swap_fields() */
+const struct MES_schema_struct* MES_schema_of(uint8_t Command_class, uint8_t Command_function, uint8_t is_reply);
+
+/* 整个 TEDS 镜像就地转：开头的 Length、按 access code 的字段表转每个 TLV 的值、最后的 Checksum，
+    TLV 的 Length 只占 1 个字节不用转，所以 whole_length 给对了两个方向都是这一个函数；
+    Checksum 是逐字节加的，转前转后一样；返回 0 表示 TLV 越界，镜像已经转了的部分不恢复 */
+uint8_t TEDS_swap(uint8_t* TEDS_load, uint32_t whole_length);
+
+/* 同 MES_stream_wait_ReplyMessage_ctx()，回复是哪个命令的由调用者给，
+    用流的编解码在流的接收缓存里就地转好再给出视图；
+    库里 NCAP 的流程（读 TEDS、拉数据集、TEDS 缓存）都用这个等回复；
+    Message 不用这样：TIM 收到的 Message 头里有命令，MES_stream_next_Message() 自己就转了 */
+uint8_t MES_stream_wait_ReplyMessage_as_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    struct ReplyMessage_view_struct* reply, uint8_t Command_class, uint8_t Command_function);
+
+/* NCAP 用：收到 TIM_initiated 后调，ctx 发 Message 用流选好的编解码，记下 TIM 的能力位图和最大数据段，
+    老 TIM 不带握手信息返回 0，ctx 照样跟流一致（MES_CODEC_DEFAULT） */
+uint8_t MES_ctx_negotiate(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, const struct Message_view_struct* message);
+
+                                    /*************\
+*************************************   数据集    *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* TIM 上每个传感器通道的数据集，读数据集命令（Read_TransducerChannel_data_set_segment）按 Offset 从这里取数据，
+    数据集的内存由用户采集程序提供（比如 1s 的 24 位 20KHz 音频 60000 字节），库只记地址和长度，不拷贝 */
+struct TC_data_set_struct
+{
+    const uint8_t* load;
+    uint32_t length;
+};
+
+extern struct TC_data_set_struct TC_data_set[TC_MAX];
+
+/* TIM 一个回复帧最多带多少字节数据，默认 MAX_TC_data_segment_SIZE，
+    实际还要再和 NCAP 请求的大小以及 PHY TEDS 的 MaxSDU 取最小 */
+extern uint32_t TC_data_segment_size_limit;
+
+/* TIM 用：绑定 / 更新某个传感器通道的数据集，load 填 NULL 即解绑 */
+void TC_data_set_bind(uint8_t TC, const uint8_t* load, uint32_t length);
+
+/* NCAP 用：流水线拉取一个传感器通道的整个数据集到 dest，
+    同时有 window 个请求在途（第一个请求单独发，用它的回复确定 TIM 实际的段大小），
+    数据集回复从 stream 里收，接收用 ctx 的 recv，Offset 对不上最早那个在途请求的回复不算；
+    返回从 0 开始连续收到的字节数，中间缺了一段的后面收到的不算 */
+uint32_t TC_data_set_pull_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t* dest, uint32_t length, uint16_t segment_size, uint32_t window);
+
+                                    /*************\
+*************************************  采样环形缓存  *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* 每个传感器通道一个单生产者 / 单消费者的无锁环形缓存，给 BufferHalfFull（130）上传模式用：
+    采集线程（生产者，比如 FPGA / 麦克风阵列读取）只管往里推采样，不加锁不分配内存；
+    每写满半个缓存就调 wake 回调通知网络线程（消费者），网络线程把写满的那一半作为一个回复直接从环里发出去，
+    即双缓冲：采集写这一半的同时发另一半，中间没有拷贝，采样路径上也没有互斥锁；
+    读写位置是累计字节数，只用编译器的 __atomic 内建函数做 acquire / release，各自只有一方写 */
+struct TC_sample_ring_struct
+{
+    uint8_t* load;          /* 用户提供，大小为 2 * half_size */
+    uint32_t half_size;     /* 半个缓存的字节数，须为 2 的幂，且不大于 MAX_TC_data_segment_SIZE，大小和命令回复无关，NCAP 靠 Flag 认 */
+    uint32_t write_pos;     /* 生产者写，累计写入字节数 */
+    uint32_t read_pos;      /* 消费者写，生产者可以覆盖到这里，总是 half_size 的整数倍 */
+    uint32_t ship_pos;      /* 消费者自己用，累计发出字节数，总是 half_size 的整数倍；
+                                连接有会话号时最近发的半个留着（read_pos 落后半个），断线重连可以补发，否则和 read_pos 一样 */
+    uint32_t overrun_bytes; /* 生产者写，网络来不及发而丢掉的字节数 */
+
+    /* 写满半个缓存时在采集线程里调用，里面只应做唤醒（置事件 / 信号量等），不要直接发送 */
+    void (*wake)(void* user_data, uint8_t TC);
+    void* wake_user_data;
+};
+
+extern struct TC_sample_ring_struct TC_sample_ring[TC_MAX];
+
+/* 各传感器通道当前的上传模式，收到 Data_Transmission_mode 命令时更新，Message_init() 都填 OnCommand */
+extern enum Data_Transmission_mode_enum TC_Data_Transmission_mode[TC_MAX];
+
+/* TIM 用：给传感器通道挂上环形缓存，load 大小为 2 * half_size，load 填 NULL 即解绑；
+    成功返回 1，half_size 不合法返回 0 */
+uint8_t TC_sample_ring_init(uint8_t TC, uint8_t* load, uint32_t half_size, 
+    void (*wake)(void* user_data, uint8_t TC), void* wake_user_data);
+
+/* 生产者用：推入采样，空间不够的部分丢掉并计入 overrun_bytes，返回实际写入的字节数；
+    通道处于 BufferHalfFull 模式时，每写满半个缓存调一次 wake */
+uint32_t TC_sample_ring_push(uint8_t TC, const uint8_t* samples, uint32_t length);
+
+/* 消费者用：把写满的半个缓存逐个作为推的采样（Flag 带 MES_REPLY_FLAG_PUSH，通道号 + Offset 为该半的累计起始字节数 + 数据）发出去，
+    数据直接从环里发，挂了发送队列的也不进队列（先冲刷队列保顺序），发完才还给生产者；返回发出的半个缓存的个数；
+    ctx 有会话号时最近发的半个要留着断线补发，生产者只剩半个余量，采集快的把 half_size 加大 */
+uint32_t TC_sample_ring_ship_ctx(struct MES_ctx_struct* ctx, uint8_t TC);
+uint32_t TC_sample_ring_ship(uint8_t TC);
+
+/* TIM 用：重连后从 NCAP 收到的位置 Offset 接着发（Session_resume 自动调）；
+    Offset 对不上半个缓存的往前取整，已经被覆盖的从还留着的最早位置发；返回实际接着发的位置 */
+uint32_t TC_sample_ring_resume(uint8_t TC, uint32_t Offset);
+
+                                    /*************\
+*************************************   定时上传   *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* Interval / Interval_1s 上传模式的调度：TIM 上一个分层时间轮，单位 1ms，
+    三层 256 + 64 + 64 个槽，一层覆盖 256ms，二层约 16s，三层约 17min，更远的在三层最后一个槽里等着再下落；
+    每个传感器通道一个定时器，插入 / 删除 / 到期都是 O(1)，24 个通道各不同周期也一样便宜；
+    时间轮只在一个线程里用：TC_upload_sched_tick() 和 start / stop（以及 ReplyMessage_Server()）要在同一个线程调用 */
+#define TC_UPLOAD_WHEEL_0_BITS  8
+#define TC_UPLOAD_WHEEL_N_BITS  6
+#define TC_UPLOAD_WHEEL_0_SIZE  (1 << TC_UPLOAD_WHEEL_0_BITS)
+#define TC_UPLOAD_WHEEL_N_SIZE  (1 << TC_UPLOAD_WHEEL_N_BITS)
+
+/* TEDS 里没填 UpdateT 和 SPeriod 时 Interval 模式的默认周期 */
+#define TC_UPLOAD_DEFAULT_PERIOD_MS 1000
+
+struct TC_upload_timer_struct
+{
+    struct TC_upload_timer_struct* next;
+    struct TC_upload_timer_struct** pprev;  /* 指向前一个的 next 或槽本身，删除 O(1) */
+    uint32_t period_ms;
+    uint32_t expire_ms;     /* 下次应该触发的时刻 */
+    uint8_t TC;
+    uint8_t active;
+
+    /* 迟到统计：实际触发时刻减应该触发的时刻 */
+    uint32_t last_late_ms;
+    uint32_t max_late_ms;
+    uint32_t fire_count;
+    uint32_t missed_count;  /* tick 间隔太长整个周期都错过的次数，错过的不补 */
+};
+
+struct TC_upload_sched_struct
+{
+    struct TC_upload_timer_struct* wheel_0[TC_UPLOAD_WHEEL_0_SIZE];
+    struct TC_upload_timer_struct* wheel_1[TC_UPLOAD_WHEEL_N_SIZE];
+    struct TC_upload_timer_struct* wheel_2[TC_UPLOAD_WHEEL_N_SIZE];
+    uint32_t now_ms;        /* 时间轮已经走到的时刻 */
+
+    struct TC_upload_timer_struct timer[TC_MAX];
+
+    /* 到期回调，在 tick 里调，里面发该通道的数据，late_ms 为这次迟到的毫秒数 */
+    void (*upload)(void* user_data, uint8_t TC, uint32_t late_ms);
+    void* user_data;
+};
+
+extern struct TC_upload_sched_struct TC_upload_sched;
+
+/* TIM 用：初始化调度器，now_ms 为当前的单调毫秒时间；
+    初始化之后收到 Data_Transmission_mode 命令会自动按模式启停对应通道的定时器 */
+void TC_upload_sched_init(uint32_t now_ms, void (*upload)(void* user_data, uint8_t TC, uint32_t late_ms), void* user_data);
+
+/* 通道的上传周期：Interval_1s 为 1000ms，Interval 取 TC TEDS 的 UpdateT，没有则取 SPeriod，都没有则默认周期 */
+uint32_t TC_upload_period_from_TEDS(uint8_t TC, enum Data_Transmission_mode_enum mode);
+
+/* 启动 / 重设通道的定时器，period_ms 填 0 即按当前上传模式从 TEDS 取 */
+void TC_upload_sched_start(uint8_t TC, uint32_t period_ms);
+void TC_upload_sched_stop(uint8_t TC);
+
+/* 推进时间轮到 now_ms，触发所有到期的通道，返回触发的次数；
+    调用间隔越均匀迟到越小，一般放在网络线程的超时循环里 */
+uint32_t TC_upload_sched_tick(uint32_t now_ms);
+
+                                    /*************\
+*************************************  数据报上传  *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* Interval / BufferHalfFull 上传的采样量大又讲时效，走 TCP 时 WiFi 上丢一个包，后面的都得等它重传完（队头阻塞）；
+    可以让采样走数据报（UDP），命令和回复还是走 TCP：
+    TIM 给连接的 ctx 挂上数据报发送（MES_ctx_attach_dgram_tx()），握手时就带 MES_CAP_DATAGRAM；
+    NCAP 看到这个能力并且自己也要时发 Datagram_mode 打开，带本连接的会话号和 NCAP 收数据报的 UDP 端口，TIM 回 Flag 为 1 就开了，
+        每个连接各自协商，没开的照旧走 TCP；
+    开了之后 TC_sample_ring_ship_ctx() 和 MES_dgram_send_ctx() 发的数据按 payload_max 切成数据报，每个带一个头（MES_dgram_header_struct），
+        TIM 把发过的存在发送历史里；
+    NCAP 每个连接一个接收结构体，按序号重排，窗口里先到的存着，缺的过 nack_delay_ms 还没到就用 Datagram_NACK（走 TCP）请 TIM 重发，
+        过 give_up_ms 还没补上的算丢，跳过去接着交付，收到、乱序、重复、补上、丢的都有计数 */
+
+#define MES_DGRAM_MAGIC             0xD5
+#define MES_DGRAM_HEADER_SIZE       20
+#define MES_DGRAM_PAYLOAD_MAX       1400            /* 一个数据报最多带多少字节数据，加上头和 IP、UDP 头不超过以太网的 1500 */
+#define MES_DGRAM_FLAG_RETRANS      0x01            /* 重发的 */
+#define MES_DGRAM_HISTORY_SIZE      (16 * 1024)     /* TIM 发送历史字节数，须为 2 的幂，NACK 来时还在里面的才补得了；
+                                                        按单片机（ESP32 之类）定的，约十来个满的数据报，Linux 上流量大的 TIM 可以改大 */
+#define MES_DGRAM_HISTORY_MAX       64              /* 发送历史最多记多少个数据报，须为 2 的幂 */
+#define MES_DGRAM_WINDOW            256             /* NCAP 重排窗口，须为 2 的幂，要装得下一个 NACK 来回期间发的数据报 */
+#define MES_DGRAM_NACK_MAX          32              /* 一个 Datagram_NACK 最多带多少段，6 * 32 + 1 不超过 MAX_Message_dependent_SIZE */
+#define MES_DGRAM_NACK_DELAY_MS     10              /* 默认：缺了多久请重发，之后每隔这么久再请 */
+#define MES_DGRAM_GIVE_UP_MS        200             /* 默认：缺了多久算丢 */
+#define MES_DGRAM_NACK_RETRY_MAX    3               /* 默认：一个序号最多请几次 */
+
+#pragma pack(1)
+/* 数据报头，多字节域按 TIM 的大小端，NCAP 按握手的结果转 */
+struct MES_dgram_header_struct
+{
+    uint8_t  magic;             /* MES_DGRAM_MAGIC */
+    uint8_t  flags;             /* MES_DGRAM_FLAG_xxx */
+    uint8_t  TIM;               /* NCAP 按它找连接 */
+    uint8_t  TC;
+    uint16_t session;           /* Datagram_mode 给的，和当前的不同的是旧连接的，丢掉 */
+    uint16_t length;            /* 数据字节数 */
+    uint32_t seq;               /* 本连接的序号，每个数据报加一，重发的不变 */
+    uint32_t Offset;            /* 数据在通道数据集里的偏移，同数据集回复的 Offset */
+    uint32_t timestamp_ms;      /* TIM 第一次发的时刻 */
+};
+#pragma pack()
+
+struct MES_dgram_range_struct
+{
+    uint32_t seq;
+    uint16_t count;
+};
+
+/* TIM 用，一个连接一个 */
+struct MES_dgram_history_entry_struct
+{
+    uint32_t seq;
+    uint32_t pos;               /* 在 history 里的累计位置 */
+    uint16_t length;            /* 头 + 数据，0 为空 */
+};
+
+struct MES_dgram_tx_struct
+{
+    /* 发一个数据报给 NCAP，IP 就是 TCP 连接对端的，port 为 Datagram_mode 里给的；返回发出的字节数 */
+    unsigned int (*sendv)(void* user_data, uint16_t port, const struct MES_iovec_struct* iov, unsigned int iovcnt);
+    void* user_data;
+    uint32_t (*now_ms)(void);   /* 可选，时间戳用，不填则时间戳为 0 */
+
+    uint8_t  enabled;
+    uint16_t session;
+    uint16_t port;
+    uint16_t payload_max;
+    uint32_t next_seq;
+
+    /* 发送历史：发过的数据报整个依次存着，满了覆盖最旧的 */
+    uint8_t  history[MES_DGRAM_HISTORY_SIZE];
+    uint32_t history_tail;      /* 累计写入字节数 */
+    struct MES_dgram_history_entry_struct history_entry[MES_DGRAM_HISTORY_MAX];    /* 按 seq % MES_DGRAM_HISTORY_MAX 放 */
+
+    uint32_t sent_count;
+    uint32_t send_fail_count;   /* sendv 没发出去的，还在历史里，NCAP 请了可以补 */
+    uint32_t resent_count;
+    uint32_t gone_count;        /* 请重发时已经不在历史里的 */
+};
+
+/* NCAP 用，一个连接一个 */
+struct MES_dgram_rx_slot_struct
+{
+    uint8_t  state;             /* 0 空，1 缺着，2 到了 */
+    uint8_t  TC;
+    uint8_t  nack_count;        /* 请过几次重发 */
+    uint16_t length;
+    uint32_t Offset;
+    uint32_t timestamp_ms;
+    uint32_t missing_ms;        /* 发现缺的时刻 */
+    uint32_t nack_ms;           /* 上次请重发的时刻 */
+    uint8_t  data[MES_DGRAM_PAYLOAD_MAX];
+};
+
+struct MES_dgram_rx_struct
+{
+    struct MES_ctx_struct* ctx; /* 这个连接的 ctx，发 Datagram_NACK 用 */
+    uint8_t  TIM;
+    uint8_t  swap;              /* TIM 和本平台大小端不同，头要转 */
+    uint16_t session;
+    uint32_t next_seq;          /* 下一个要交付的序号 */
+    uint32_t end_seq;           /* 收到过的最大序号 + 1 */
+    struct MES_dgram_rx_slot_struct slot[MES_DGRAM_WINDOW];    /* 按 seq % MES_DGRAM_WINDOW 放 */
+
+    /* 按序号交付给上层，丢了的不交付，上层从 Offset 的跳变看得出缺了哪段 */
+    void (*deliver)(void* user_data, uint8_t TC, uint32_t Offset, uint32_t timestamp_ms, const uint8_t* data, uint16_t length);
+    void* user_data;
+
+    uint32_t nack_delay_ms;     /* 0 为不请重发，只等和统计 */
+    uint32_t give_up_ms;
+    uint8_t  nack_retry_max;
+
+    uint32_t received_count;    /* 收到的数据报，含重复的 */
+    uint32_t delivered_count;
+    uint32_t reordered_count;   /* 前面的还没到，先存着的 */
+    uint32_t duplicate_count;   /* 已经交付、已经存着或者已经放弃了的序号 */
+    uint32_t repaired_count;    /* 重发补上的 */
+    uint32_t lost_count;        /* 放弃的 */
+    uint32_t nack_count;        /* 请重发的序号个数 */
+    uint32_t bad_count;         /* 头不对、不是这个 TIM 或会话的、序号跳得太远的 */
+};
+
+/* TIM 用：给 ctx 挂上数据报发送，握手时就会带 MES_CAP_DATAGRAM，NCAP 发 Datagram_mode 打开后才用；tx 填 NULL 即摘掉 */
+void MES_ctx_attach_dgram_tx(struct MES_ctx_struct* ctx, struct MES_dgram_tx_struct* tx, 
+    unsigned int (*sendv)(void* user_data, uint16_t port, const struct MES_iovec_struct* iov, unsigned int iovcnt), 
+    void* user_data, uint32_t (*now_ms)(void));
+
+/* TIM 用：把通道的一段数据（Offset 同数据集回复）切成数据报发出去，Interval 上传的回调里用；
+    这个连接没开数据报返回 0（调用者照旧走 TCP），开了返回 length */
+uint32_t MES_dgram_send_ctx(struct MES_ctx_struct* ctx, uint8_t TC, uint32_t Offset, const uint8_t* data, uint32_t length);
+
+/* NCAP 用：TIM 回 Datagram_mode 的 Flag 为 1 之后初始化这个连接的接收，大小端按 ctx 握手的结果；
+    nack_delay_ms、give_up_ms、nack_retry_max 填默认值，要改的初始化后直接改 */
+void MES_dgram_rx_init(struct MES_dgram_rx_struct* rx, struct MES_ctx_struct* ctx, uint8_t TIM, uint16_t session, 
+    void (*deliver)(void* user_data, uint8_t TC, uint32_t Offset, uint32_t timestamp_ms, const uint8_t* data, uint16_t length), 
+    void* user_data);
+
+/* NCAP 用：收到一个数据报（先按头里的 TIM 找到连接），按序能交付的直接交付，不拷贝，乱序的存进窗口；收下返回 1 */
+uint8_t MES_dgram_rx_input(struct MES_dgram_rx_struct* rx, const uint8_t* datagram, uint32_t length, uint32_t now_ms);
+
+/* NCAP 用：定期调（比如每 10ms），缺了够久的发 Datagram_NACK，缺了太久的算丢跳过；返回这次请重发的序号个数；
+    Datagram_NACK 的回复带 MES_REPLY_FLAG_INTERNAL，收回复时 MES_ctx_take_push() 会挑出来，不会混进调用者等的回复里 */
+uint32_t MES_dgram_rx_poll(struct MES_dgram_rx_struct* rx, uint32_t now_ms);
+
+                                    /*************\
+*************************************  会话恢复  *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* TIM 断线重连后不用再走一遍上线流程（TIM_initiated、Query_TEDS、Read_TEDS、设模式、Trigger），一个来回就接着上传：
+    NCAP 第一次见到 TIM 走完上线流程后用 Session_resume 给它一个会话号，TIM 存在 ctx 里；
+    TIM 断线后 ctx 和 TIM 的状态（上传模式、触发、采样环）都不动，重连后 TIM_initiated 带上会话号；
+    NCAP 认出来（会话号和 TIM 号都对）就不走上线流程，直接发 Session_resume 带上每个通道收到的末尾位置，
+        TIM 的采样环从那里接着发，断线时在路上丢的那段补上；认不出来的（NCAP 重启过、TIM 重启过）照旧走上线流程；
+    TIM 带会话号重连后等到 Session_resume 才接着发采样，免得先发的和补发的顺序乱了，
+        之前的 Datagram_mode、读 TEDS 之类的命令不算；NCAP 没认出来重新上线的，收到 Data_Transmission_mode 或 Trigger 就接着发 */
+
+/* NCAP 用，一个 TIM 一个，ctx 跟连接走，这个跨重连留着 */
+struct MES_session_struct
+{
+    uint32_t token;                     /* 0 为没有会话 */
+    uint8_t  TIM;
+    uint8_t  acked_valid[TC_MAX];
+    uint32_t acked_Offset[TC_MAX];      /* 每个通道收到的数据末尾位置（Offset + 长度） */
+};
+
+/* NCAP 用：TIM 走完上线流程后新开一个会话，token 由调用者给（随机的非 0 数，别和上次的一样） */
+void MES_session_new(struct MES_session_struct* session, uint8_t TIM, uint32_t token);
+
+/* NCAP 用：MES_ctx_negotiate() 之后看重连的 TIM 是不是这个会话的，是返回 1 */
+uint8_t MES_session_match(const struct MES_session_struct* session, const struct MES_ctx_struct* ctx, uint8_t TIM);
+
+/* NCAP 用：收到一段数据后记下末尾位置，只往前走；TCP 上推的数据回复不带通道号，调用者自己知道是哪个通道的 */
+void MES_session_ack(struct MES_session_struct* session, uint8_t TC, uint32_t Offset_end);
+
+                                    /*************\
+*************************************  TEDS 缓存   *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* NCAP 上的 TEDS 缓存：按 Meta-TEDS 的 UUID + 通道 + access code 存 TIM 的 TEDS，
+    TIM 重连后只发 Query_TEDS 拿长度和 Checksum，和缓存的一样就不用再 Read_TEDS_segment 读了；
+    缓存可以存到本地文件，NCAP 重启后再读回来（读回来的每一条都重新校验） */
+
+/* NCAP 流水线读 TEDS 时同时在途的 Read_TEDS_segment 请求个数 */
+#define TEDS_READ_WINDOW        8
+
+/* NCAP 用：流水线读 TIM 的一个 TEDS 到 dest（至少 whole_length 字节，whole_length 从 Query_TEDS 的回复拿），
+    第一个请求单独发，用它的回复确定 TIM 的段大小，之后 window 个请求同时在途；返回收到的连续字节数 */
+uint32_t TEDS_read_pipelined_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t access_code, uint8_t* dest, uint32_t whole_length, uint32_t window);
+
+/* 解 Query_TEDS 的回复：TEDS 总长度和 Checksum，Flag 为 0 或长度不对返回 0 */
+uint8_t TEDS_query_reply_decode(const struct ReplyMessage_view_struct* reply, uint32_t* whole_length, uint16_t* Checksum);
+
+/* 一个通道的 TC TEDS 摘要，属性和状态是原样的一个字节 */
+struct TC_TEDS_digest_struct
+{
+    uint8_t attr;
+    uint8_t status;
+    uint32_t whole_length;
+    uint16_t Checksum;
+};
+
+/* 解 Query_TC_TEDS_digest 的回复，最多解 max_count 个通道，返回解出的个数；
+    NCAP 拿每个通道的长度和 Checksum 去 TEDS_cache_lookup()，命中的通道不用再 Query / Read */
+uint8_t TC_TEDS_digest_decode(const struct ReplyMessage_view_struct* reply, struct TC_TEDS_digest_struct* digest, uint8_t max_count);
+
+/* 是否编译 TEDS 缓存和后面的 TEDS 目录（NCAP 用）：两个都是静态数组，加起来六百多 KB，
+    默认不编译，只做 TIM 的和 MCU 上的 NCAP 保持 0，要用 TEDS_cache_xxx() / TEDS_dir_xxx() 的 NCAP 改为 1 */
+#define TEDS_CACHE_USE          0
+
+#if TEDS_CACHE_USE
+
+/* 是否编译文件存取（需要 stdio），只做 TIM 的平台可以改为 0 */
+#define TEDS_CACHE_USE_FILE     1
+
+/* 12 个 TIM，每个 Meta、UTN、PHY 各一个，再留一些给 TC TEDS，满了按最久没用的替换 */
+#define TEDS_CACHE_ENTRY_MAX    64
+#define TEDS_CACHE_LOAD_SIZE    MAX_TEDS_IMAGE_SIZE
+
+struct TEDS_cache_entry_struct
+{
+    uint8_t valid;
+    uint8_t UUID[10];
+    uint8_t TC;
+    uint8_t access_code;
+    uint16_t Checksum;
+    uint32_t whole_length;
+    uint32_t last_use;
+    uint8_t load[TEDS_CACHE_LOAD_SIZE];
+};
+
+struct TEDS_cache_struct
+{
+    struct TEDS_cache_entry_struct entry[TEDS_CACHE_ENTRY_MAX];
+    uint32_t use_clock;
+
+    /* 每个 TIM 上次见到的 UUID，和读它的连接编号（ctx 的 link_id）；
+        换了连接的话先重新读一遍 Meta-TEDS 拿 UUID，不拿旧 UUID 和 Checksum 认 TIM */
+    uint8_t TIM_UUID_valid[TIM_MAX];
+    uint8_t TIM_UUID[TIM_MAX][10];
+    uint32_t TIM_UUID_link[TIM_MAX];
+
+    uint32_t hit_count;
+    uint32_t miss_count;
+};
+
+extern struct TEDS_cache_struct TEDS_cache;
+
+/* 查缓存，长度和 Checksum 都对上才算命中，返回缓存里的 TEDS（从 Length 开始），没有返回 NULL */
+const uint8_t* TEDS_cache_lookup(const uint8_t* UUID, uint8_t TC, uint8_t access_code, uint32_t whole_length, uint16_t Checksum);
+
+/* 存一个 TEDS，先用 TEDS_decode() 校验，不对或太大返回 0；同一个键的旧条目直接覆盖 */
+uint8_t TEDS_cache_store(const uint8_t* UUID, uint8_t TC, const uint8_t* TEDS_load, uint32_t whole_length);
+
+/* NCAP 用：取 TIM 的一个 TEDS，返回缓存里的地址，失败返回 NULL；
+    先 Query_TEDS，缓存里有一样的直接返回，没有才 Read_TEDS_segment 读，校验后存进缓存；
+    每个连接上第一次取时先把 Meta-TEDS 整个读一遍拿 UUID，确认是哪个 TIM 之后才用缓存 */
+const uint8_t* TEDS_cache_fetch_ctx(struct MES_ctx_struct* ctx, struct MES_stream_struct* stream, 
+    uint8_t Dest_TIM, uint8_t Dest_TC, uint8_t access_code, uint32_t* whole_length);
+
+#if TEDS_CACHE_USE_FILE
+/* 存到文件 / 从文件读，成功返回 1 */
+uint8_t TEDS_cache_save(const char* path);
+uint8_t TEDS_cache_load(const char* path);
+#endif
+
+                                    /*************\
+*************************************  TEDS 目录   *****************************************************
+                                    *   定义及API  *
+                                    \*************/
+
+/* NCAP 上的 TEDS 目录：TEDS 存进缓存时顺便把几个常用的域解出来建索引，
+    上层问 "单位为开尔文、SPeriod 小于 1ms 的 Sensor 通道"、"电池供电的 TIM" 这种不用再把缓存里的 TEDS 一个一个解一遍；
+    通道的域来自它的 TC TEDS（ChanType、PhyUnits、LowLimit、HiLimit、SPeriod）和 UTN TEDS（TCName），
+    TIM 的域来自 PHY TEDS（RadioType、Battery），查通道时也可以按所属 TIM 的域筛；
+    分类的域用位图（每通道一位），SPeriod 用排好序的下标二分，TCName 用散列，剩下的条件只在筛出来的通道上逐条比；
+    某个 TEDS 变了重新存进缓存时只更新这一个通道（或这个 TIM）的索引；和 TEDS 缓存一样不加锁 */
+
+#define TEDS_DIR_CHANNEL_MAX    4096    /* 最多多少个通道，须为 64 的倍数 */
+#define TEDS_DIR_TIM_MAX        256     /* 最多多少个 TIM，按 UUID 算 */
+#define TEDS_DIR_UNITS_MAX      32      /* 单位字典大小，不同的 PhyUnits 超过这么多后新的不进位图，查时逐条比 */
+#define TEDS_DIR_NAME_HASH_SIZE 1024    /* TCName 散列桶数，须为 2 的幂 */
+#define TEDS_DIR_WORDS          (TEDS_DIR_CHANNEL_MAX / 64)
+
+/* 通道记录里哪些域有值（TEDS 里有这个 TLV） */
+#define TEDS_DIR_HAS_ChanType   0x01
+#define TEDS_DIR_HAS_PhyUnits   0x02
+#define TEDS_DIR_HAS_LowLimit   0x04
+#define TEDS_DIR_HAS_HiLimit    0x08
+#define TEDS_DIR_HAS_SPeriod    0x10
+#define TEDS_DIR_HAS_TCName     0x20
+/* TIM 记录里的 */
+#define TEDS_DIR_HAS_RadioType  0x01
+#define TEDS_DIR_HAS_Battery    0x02
+
+/* 下面的链都存下标 + 1，0 表示没有 */
+struct TEDS_dir_channel_struct
+{
+    uint8_t  valid;
+    uint8_t  TC;
+    uint16_t TIM;               /* TEDS_dir.TIM[] 的下标 */
+    uint16_t next;              /* 同一个 TIM 的下一个通道，空闲时为空闲链 */
+    uint16_t name_next;         /* TCName 散列链 */
+    uint8_t  has;               /* TEDS_DIR_HAS_xxx */
+    uint8_t  ChanType;
+    uint8_t  units_index;       /* 单位字典下标，TEDS_DIR_UNITS_MAX 表示没进字典 */
+    struct Units_struct PhyUnits;
+    float    LowLimit;
+    float    HiLimit;
+    float    SPeriod;
+    char     TCName[26];        /* 以 0 结尾 */
+};
+
+struct TEDS_dir_TIM_struct
+{
+    uint8_t  valid;
+    uint8_t  UUID[10];
+    uint8_t  has;               /* TEDS_DIR_HAS_RadioType、TEDS_DIR_HAS_Battery */
+    uint8_t  RadioType;
+    uint8_t  Battery;
+    uint16_t first_channel;
+};
+
+struct TEDS_dir_struct
+{
+    struct TEDS_dir_channel_struct channel[TEDS_DIR_CHANNEL_MAX];
+    struct TEDS_dir_TIM_struct TIM[TEDS_DIR_TIM_MAX];
+    uint16_t channel_used;      /* 用到过的最大下标 + 1，新通道先从空闲链拿 */
+    uint16_t channel_free;
+    uint16_t channel_count;
+
+    /* 位图索引 */
+    uint64_t valid_map[TEDS_DIR_WORDS];
+    uint64_t ChanType_map[Reserved_for_ChanType + 1][TEDS_DIR_WORDS];                 /* 最后一个为其他值 */
+    uint64_t RadioType_map[Reserved_for_future_expansion_RadioType + 1][TEDS_DIR_WORDS]; /* 通道所属 TIM 的，最后一个为其他值 */
+    uint64_t Battery_map[TEDS_DIR_WORDS];                                               /* 所属 TIM 电池供电 */
+    struct Units_struct units[TEDS_DIR_UNITS_MAX];
+    uint64_t units_map[TEDS_DIR_UNITS_MAX][TEDS_DIR_WORDS];
+    uint8_t  units_count;
+    uint32_t units_overflow;    /* 没进字典的通道个数 */
+
+    /* 有 SPeriod 的通道下标，按 SPeriod 从小到大排 */
+    uint16_t SPeriod_order[TEDS_DIR_CHANNEL_MAX];
+    uint16_t SPeriod_count;
+
+    uint16_t name_head[TEDS_DIR_NAME_HASH_SIZE];
+};
+
+extern struct TEDS_dir_struct TEDS_dir;
+
+/* 查询条件，match 里没置的条件不看，TEDS 里没有该域的通道 / TIM 不匹配 */
+#define TEDS_DIR_MATCH_ChanType     0x01
+#define TEDS_DIR_MATCH_PhyUnits     0x02    /* 11 个字节全一样 */
+#define TEDS_DIR_MATCH_SPeriod      0x04    /* SPeriod_min <= SPeriod < SPeriod_max，单位秒 */
+#define TEDS_DIR_MATCH_Limits       0x08    /* 量程盖住 [LowLimit, HiLimit]：通道的 LowLimit 不大于、HiLimit 不小于查询的 */
+#define TEDS_DIR_MATCH_TCName       0x10    /* 名字完全一样 */
+#define TEDS_DIR_MATCH_RadioType    0x20
+#define TEDS_DIR_MATCH_Battery      0x40    /* 是否电池供电（Battery 非 0）和查询的一样 */
+
+struct TEDS_dir_query_struct
+{
+    uint32_t match;
+    uint8_t  ChanType;
+    struct Units_struct PhyUnits;
+    float    SPeriod_min;
+    float    SPeriod_max;
+    float    LowLimit;
+    float    HiLimit;
+    const char* TCName;
+    uint8_t  RadioType;
+    uint8_t  Battery;
+};
+
+/* 把一个 TEDS 的域更新进目录，TEDS_cache 存 TEDS 时自动调，UUID 和 TC 同 TEDS 缓存的键；
+    Meta-TEDS 只登记 TIM，PHY TEDS 更新 TIM 和它所有通道的位图，TC TEDS 和 UTN TEDS 更新一个通道；进了目录返回 1 */
+uint8_t TEDS_dir_update(const uint8_t* UUID, uint8_t TC, const uint8_t* TEDS_load, uint32_t whole_length);
+
+/* TIM 下线不再用时把它和它的通道从目录里去掉 */
+void TEDS_dir_remove_TIM(const uint8_t* UUID);
+
+/* 查通道，匹配的通道下标（TEDS_dir.channel[] 的）按下标顺序写进 result，最多 max_count 个；
+    返回匹配的总数，可能比 max_count 大，result 填 NULL 只计数 */
+uint32_t TEDS_dir_query(const struct TEDS_dir_query_struct* query, uint16_t* result, uint32_t max_count);
+
+/* 查 TIM，只看 RadioType 和 Battery 两个条件，结果为 TEDS_dir.TIM[] 的下标 */
+uint32_t TEDS_dir_query_TIM(const struct TEDS_dir_query_struct* query, uint16_t* result, uint32_t max_count);
+
+#endif
 
 #ifdef __cplusplus
 	}
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+/* 编译命令：在编译的电脑上跑，不进 TIM 固件
+    gcc TEDS_gen.c -o TEDS_gen.exe
+   使用：
+    TEDS_gen.exe TEDS_desc.txt TEDS_images         生成 TEDS_images.c 和 TEDS_images.h
+    TEDS_gen.exe TEDS_desc.txt TEDS_images -be     TIM 是大端的时候加 -be
+*/
+
+/* 我是 TEDS 编译器：把 TEDS 描述文件编译成可以直接发送的 const TEDS 镜像，
+    每个 TLV 的 Length、TEDS 的 Length 和 Checksum 都在这里算好，TIM 上不用再算，镜像可以放在 flash / rodata 里；
+    TIM 编译库时把 IEEE1451_5_lib.h 里的 TEDS_PREBUILT 改为 1，再把生成的 .c 一起编译，TEDS_init() 直接挂这些镜像 */
+
+/*
+描述文件格式：一行一条，# 后面是注释
+    TEDS <名字> <access code> <Family> <Version>    开始一个 TEDS，TEDS 头（ID）自动生成，
+                                                   名字用 M_TEDS、TC_TEDS、UTN_TEDS、PHY_TEDS 的才会被 TEDS_init() 挂上
+    <Type> <值类型> <值 ...>                        一个 TLV 域，Length 按值自动算
+        值类型：u8 u16 u32 f32，后面可以跟多个值，组成数组
+                bytes 后面跟若干个字节
+                str "文本" [定长]，给了定长则后面补 0 到定长，文本里可以用 \0 \n \" \\
+                整数可以写十进制或 0x 十六进制
+    END                                            结束当前 TEDS，算 Length 和 Checksum
+*/
+
+#define TEDS_GEN_MAX_TEDS       16
+#define TEDS_GEN_MAX_IMAGE      (4 * 1024)      /* 和库里的 MAX_TEDS_IMAGE_SIZE 一致 */
+#define TEDS_GEN_MAX_NAME       32
+#define TEDS_GEN_MAX_LINE       1024
+
+struct TEDS_gen_image_struct
+{
+    char name[TEDS_GEN_MAX_NAME];
+    uint8_t access_code;
+    uint8_t load[TEDS_GEN_MAX_IMAGE];
+    uint32_t length;        /* 已经填了多少字节 */
+    uint16_t Checksum;
+};
+
+static struct TEDS_gen_image_struct images[TEDS_GEN_MAX_TEDS];
+static uint32_t image_count = 0;
+static int big_end = 0;
+
+static const char* desc_path = NULL;
+static uint32_t line_num = 0;
+
+static void gen_error(const char* what)
+{
+    fprintf(stderr, "%s:%u: %s\n", desc_path, line_num, what);
+    exit(1);
+}
+
+/* 按目标大小端放一个整数 */
+static void put_uint(struct TEDS_gen_image_struct* image, uint32_t value, uint32_t size)
+{
+    uint32_t i = 0;
+
+    if(image->length + size > TEDS_GEN_MAX_IMAGE - 2)
+    {
+        gen_error("TEDS too large");
+    }
+    for(i = 0; i < size; i++)
+    {
+        image->load[image->length + (big_end ? size - 1 - i : i)] = (uint8_t)(value >> (8 * i));
+    }
+    image->length += size;
+}
+
+/* 取下一个词，str 的引号里的算一个词，返回 NULL 表示这行没了 */
+static char* next_token(char** cursor, int* quoted)
+{
+    char* p = *cursor;
+    char* start = NULL;
+    char* out = NULL;
+
+    while(*p != '\0' && isspace((unsigned char)*p))
+    {
+        p++;
+    }
+    if(*p == '\0' || *p == '#')
+    {
+        *cursor = p;
+        return NULL;
+    }
+
+    *quoted = (*p == '"');
+    if(!*quoted)
+    {
+        start = p;
+        while(*p != '\0' && !isspace((unsigned char)*p) && *p != '#')
+        {
+            p++;
+        }
+        if(*p != '\0' && *p != '#')
+        {
+            *p++ = '\0';
+        }else if(*p == '#'){
+            *p = '\0';
+        }
+        *cursor = p;
+        return start;
+    }
+
+    /* 引号里的转义就地展开，\0 先记成 0x01（文本里用不到），放字节时再换回 0，不然会被当成词的结尾 */
+    start = out = ++p;
+    while(*p != '\0' && *p != '"')
+    {
+        if(*p == '\\' && p[1] != '\0')
+        {
+            p++;
+            switch(*p)
+            {
+                case '0':   *out++ = '\x01';    break;
+                case 'n':   *out++ = '\n';      break;
+                case 't':   *out++ = '\t';      break;
+                default:    *out++ = *p;        break;
+            }
+            p++;
+        }else{
+            *out++ = *p++;
+        }
+    }
+    if(*p != '"')
+    {
+        gen_error("missing closing quote");
+    }
+    *cursor = p + 1;
+    *out = '\0';
+
+    return start;
+}
+
+static uint32_t parse_uint(const char* token, uint32_t max)
+{
+    char* end = NULL;
+    unsigned long value = strtoul(token, &end, 0);
+
+    if(end == token || *end != '\0' || value > max)
+    {
+        gen_error("bad integer");
+    }
+    return (uint32_t)value;
+}
+
+static void parse_field(struct TEDS_gen_image_struct* image, char* cursor, uint32_t Type)
+{
+    char* kind = NULL;
+    char* token = NULL;
+    int quoted = 0;
+    uint32_t Length_pos = 0;
+    uint32_t value_start = 0;
+    uint32_t fixed = 0;
+    uint32_t i = 0;
+    char* end = NULL;
+    float f = 0;
+    uint32_t f_bits = 0;
+
+    kind = next_token(&cursor, &quoted);
+    if(kind == NULL)
+    {
+        gen_error("missing value type");
+    }
+
+    put_uint(image, Type, 1);
+    Length_pos = image->length;
+    put_uint(image, 0, 1);          /* Length 最后回填 */
+    value_start = image->length;
+
+    if(strcmp(kind, "str") == 0)
+    {
+        token = next_token(&cursor, &quoted);
+        if(token == NULL || !quoted)
+        {
+            gen_error("str needs a quoted text");
+        }
+        for(i = 0; token[i] != '\0'; i++)
+        {
+            put_uint(image, token[i] == '\x01' ? 0 : (uint8_t)token[i], 1);
+        }
+        token = next_token(&cursor, &quoted);
+        if(token != NULL)
+        {
+            fixed = parse_uint(token, 255);
+            if(image->length - value_start > fixed)
+            {
+                gen_error("text longer than its fixed length");
+            }
+            while(image->length - value_start < fixed)
+            {
+                put_uint(image, 0, 1);
+            }
+        }
+    }else{
+        while((token = next_token(&cursor, &quoted)) != NULL)
+        {
+            if(strcmp(kind, "u8") == 0 || strcmp(kind, "bytes") == 0)
+            {
+                put_uint(image, parse_uint(token, 0xFF), 1);
+            }else if(strcmp(kind, "u16") == 0){
+                put_uint(image, parse_uint(token, 0xFFFF), 2);
+            }else if(strcmp(kind, "u32") == 0){
+                put_uint(image, parse_uint(token, 0xFFFFFFFF), 4);
+            }else if(strcmp(kind, "f32") == 0){
+                f = strtof(token, &end);
+                if(end == token || *end != '\0')
+                {
+                    gen_error("bad float");
+                }
+                memcpy(&f_bits, &f, sizeof(f_bits));
+                put_uint(image, f_bits, 4);
+            }else{
+                gen_error("unknown value type");
+            }
+        }
+    }
+
+    if(image->length - value_start > 255)
+    {
+        gen_error("TLV value longer than 255 bytes");
+    }
+    image->load[Length_pos] = (uint8_t)(image->length - value_start);
+}
+
+/* Length 为 DATA BLOCK 加 Checksum 的长度，Checksum = 0xFFFF - 从 Length 开始到 DATA BLOCK 最后一个字节的加和 */
+static void finish_image(struct TEDS_gen_image_struct* image)
+{
+    uint32_t sum = 0;
+    uint32_t i = 0;
+    uint32_t data_end = image->length;
+
+    image->length = 0;
+    put_uint(image, data_end + 2 - 4, 4);
+    image->length = data_end;
+
+    for(i = 0; i < data_end; i++)
+    {
+        sum += image->load[i];
+    }
+    image->Checksum = (uint16_t)(0xFFFF - sum);
+    put_uint(image, image->Checksum, 2);
+}
+
+static void parse_desc(FILE* in)
+{
+    char line[TEDS_GEN_MAX_LINE];
+    char* cursor = NULL;
+    char* token = NULL;
+    int quoted = 0;
+    struct TEDS_gen_image_struct* image = NULL;
+
+    while(fgets(line, sizeof(line), in) != NULL)
+    {
+        line_num++;
+        cursor = line;
+        token = next_token(&cursor, &quoted);
+        if(token == NULL)
+        {
+            continue;
+        }
+
+        if(strcmp(token, "TEDS") == 0)
+        {
+            if(image != NULL)
+            {
+                gen_error("TEDS inside TEDS, missing END");
+            }
+            if(image_count >= TEDS_GEN_MAX_TEDS)
+            {
+                gen_error("too many TEDS");
+            }
+            image = &images[image_count++];
+
+            token = next_token(&cursor, &quoted);
+            if(token == NULL || strlen(token) >= TEDS_GEN_MAX_NAME)
+            {
+                gen_error("bad TEDS name");
+            }
+            strcpy(image->name, token);
+
+            image->length = 4;          /* Length 在 END 时填 */
+
+            /* TEDS 头：Type 3，Length 4，Family，access code，Version，Tuple_Length 1 */
+            put_uint(image, 3, 1);
+            put_uint(image, 4, 1);
+            token = next_token(&cursor, &quoted);
+            image->access_code = (uint8_t)parse_uint(token == NULL ? "" : token, 0xFF);
+            token = next_token(&cursor, &quoted);
+            put_uint(image, parse_uint(token == NULL ? "" : token, 0xFF), 1);
+            put_uint(image, image->access_code, 1);
+            token = next_token(&cursor, &quoted);
+            put_uint(image, parse_uint(token == NULL ? "" : token, 0xFF), 1);
+            put_uint(image, 1, 1);
+        }else if(strcmp(token, "END") == 0){
+            if(image == NULL)
+            {
+                gen_error("END without TEDS");
+            }
+            finish_image(image);
+            image = NULL;
+        }else{
+            if(image == NULL)
+            {
+                gen_error("field outside TEDS");
+            }
+            parse_field(image, cursor, parse_uint(token, 0xFF));
+        }
+    }
+
+    if(image != NULL)
+    {
+        gen_error("missing END at end of file");
+    }
+}
+
+static void write_outputs(const char* prefix)
+{
+    char path[512];
+    char guard[256];
+    const char* base = NULL;
+    FILE* out = NULL;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    /* 头文件保护宏和 #include 用不带目录的名字 */
+    base = strrchr(prefix, '/');
+    base = base == NULL ? strrchr(prefix, '\\') : base;
+    base = base == NULL ? prefix : base + 1;
+    for(i = 0; base[i] != '\0' && i < sizeof(guard) - 3; i++)
+    {
+        guard[i] = isalnum((unsigned char)base[i]) ? (char)toupper((unsigned char)base[i]) : '_';
+    }
+    strcpy(&guard[i], "_H");
+
+    snprintf(path, sizeof(path), "%s.h", prefix);
+    out = fopen(path, "w");
+    if(out == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fprintf(out, "/* 由 TEDS_gen 从 %s 生成，不要手改，改描述文件后重新生成 */\n", desc_path);
+    fprintf(out, "#ifndef %s\n#define %s\n\n#include <stdint.h>\n\n", guard, guard);
+    for(i = 0; i < image_count; i++)
+    {
+        fprintf(out, "#define TEDS_IMAGE_%s_LENGTH %u\n", images[i].name, images[i].length);
+        fprintf(out, "extern const uint8_t TEDS_image_%s[TEDS_IMAGE_%s_LENGTH];\n\n", images[i].name, images[i].name);
+    }
+    fprintf(out, "#endif\n");
+    fclose(out);
+
+    snprintf(path, sizeof(path), "%s.c", prefix);
+    out = fopen(path, "w");
+    if(out == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fprintf(out, "/* 由 TEDS_gen 从 %s 生成，不要手改，改描述文件后重新生成 */\n", desc_path);
+    fprintf(out, "#include \"%s.h\"\n", base);
+    for(i = 0; i < image_count; i++)
+    {
+        fprintf(out, "\n/* %s：access code %u，%u 字节，Checksum 0x%04X */\n",
+            images[i].name, images[i].access_code, images[i].length, images[i].Checksum);
+        fprintf(out, "const uint8_t TEDS_image_%s[TEDS_IMAGE_%s_LENGTH] = \n{", images[i].name, images[i].name);
+        for(j = 0; j < images[i].length; j++)
+        {
+            fprintf(out, "%s0x%02X%s", j % 16 == 0 ? "\n    " : "", images[i].load[j], j + 1 < images[i].length ? "," : "");
+        }
+        fprintf(out, "\n};\n");
+    }
+    fclose(out);
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* in = NULL;
+
+    if(argc < 3)
+    {
+        fprintf(stderr, "usage: %s <TEDS description> <output prefix> [-be]\n", argv[0]);
+        return 1;
+    }
+    big_end = (argc > 3 && strcmp(argv[3], "-be") == 0);
+
+    desc_path = argv[1];
+    in = fopen(desc_path, "r");
+    if(in == NULL)
+    {
+        perror(desc_path);
+        return 1;
+    }
+    parse_desc(in);
+    fclose(in);
+
+    write_outputs(argv[2]);
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/* 由 TEDS_gen 从 TEDS_desc.txt 生成，不要手改，改描述文件后重新生成 */
+#include "TEDS_images.h"
+
+/* M_TEDS：access code 1，46 字节，Checksum 0xFB7B */
+const uint8_t TEDS_image_M_TEDS[TEDS_IMAGE_M_TEDS_LENGTH] = 
+{
+    0x2A,0x00,0x00,0x00,0x03,0x04,0x05,0x01,0x01,0x01,0x04,0x0A,0x8D,0x4D,0x9D,0xA6,
+    0x52,0x81,0xF7,0x00,0x00,0x00,0x0A,0x04,0x05,0x00,0x00,0x00,0x0B,0x04,0x0A,0x00,
+    0x00,0x00,0x0C,0x04,0x0A,0x00,0x00,0x00,0x0D,0x02,0x01,0x00,0x7B,0xFB
+};
+
+/* TC_TEDS：access code 3，55 字节，Checksum 0xF77C */
+const uint8_t TEDS_image_TC_TEDS[TEDS_IMAGE_TC_TEDS_LENGTH] = 
+{
+    0x33,0x00,0x00,0x00,0x03,0x04,0x05,0x03,0x01,0x01,0x0A,0x01,0x00,0x0B,0x01,0x00,
+    0x0C,0x0B,0x00,0x80,0x80,0x7E,0x82,0x7C,0x80,0x82,0x7C,0x80,0x03,0x0D,0x04,0x00,
+    0x00,0x38,0xC2,0x0E,0x04,0x00,0x00,0xCD,0x42,0x0F,0x04,0x00,0x00,0xF0,0x42,0x10,
+    0x01,0x00,0x11,0x01,0x00,0x7C,0xF7
+};
+
+/* UTN_TEDS：access code 12，42 字节，Checksum 0xF853 */
+const uint8_t TEDS_image_UTN_TEDS[TEDS_IMAGE_UTN_TEDS_LENGTH] = 
+{
+    0x26,0x00,0x00,0x00,0x03,0x04,0x05,0x0C,0x01,0x01,0x04,0x01,0x01,0x05,0x19,0x6D,
+    0x69,0x63,0x72,0x6F,0x70,0x68,0x6F,0x6E,0x65,0x20,0x61,0x72,0x72,0x61,0x79,0x20,
+    0x2F,0x20,0x32,0x34,0x00,0x00,0x00,0x00,0x53,0xF8
+};
+
+/* PHY_TEDS：access code 13，74 字节，Checksum 0xF931 */
+const uint8_t TEDS_image_PHY_TEDS[TEDS_IMAGE_PHY_TEDS_LENGTH] = 
+{
+    0x46,0x00,0x00,0x00,0x03,0x04,0x05,0x0D,0x01,0x01,0x0A,0x01,0x00,0x0B,0x04,0x00,
+    0x00,0x80,0x01,0x0C,0x02,0x01,0x00,0x0D,0x02,0x01,0x00,0x0E,0x02,0x00,0xAA,0x0F,
+    0x01,0x00,0x10,0x02,0x00,0x00,0x11,0x02,0x20,0x00,0x12,0x02,0x00,0x28,0x13,0x04,
+    0x00,0xCA,0x9A,0x3B,0x14,0x04,0x00,0xCA,0x9A,0x3B,0x15,0x01,0x18,0x16,0x01,0x7B,
+    0x17,0x02,0x02,0x01,0x18,0x02,0x05,0x00,0x31,0xF9
+};
@@ -0,0 +1,19 @@
+/* 由 TEDS_gen 从 TEDS_desc.txt 生成，不要手改，改描述文件后重新生成 */
+#ifndef TEDS_IMAGES_H
+#define TEDS_IMAGES_H
+
+#include <stdint.h>
+
+#define TEDS_IMAGE_M_TEDS_LENGTH 46
+extern const uint8_t TEDS_image_M_TEDS[TEDS_IMAGE_M_TEDS_LENGTH];
+
+#define TEDS_IMAGE_TC_TEDS_LENGTH 55
+extern const uint8_t TEDS_image_TC_TEDS[TEDS_IMAGE_TC_TEDS_LENGTH];
+
+#define TEDS_IMAGE_UTN_TEDS_LENGTH 42
+extern const uint8_t TEDS_image_UTN_TEDS[TEDS_IMAGE_UTN_TEDS_LENGTH];
+
+#define TEDS_IMAGE_PHY_TEDS_LENGTH 74
+extern const uint8_t TEDS_image_PHY_TEDS[TEDS_IMAGE_PHY_TEDS_LENGTH];
+
+#endif
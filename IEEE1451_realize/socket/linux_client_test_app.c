@@ -11,11 +11,14 @@
 */
 int main(void)
 {
-    linux_socket_TCP_client_loop_handle(linux_socket_TCP_client_init(
+    if(linux_socket_TCP_client_loop_handle(linux_socket_TCP_client_init(
         0,
         TEST_CLIENT_AIM_WIN_ADDR_STR,
         TEST_CLIENT_AIM_PORT
-    ));
+    )) < 0)
+    {
+        return -1;
+    }
     
     return 0;
 }
\ No newline at end of file
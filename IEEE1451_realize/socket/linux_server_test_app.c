@@ -11,12 +11,15 @@
 */
 int main(void)
 {
-    linux_socket_TCP_server_loop_handle(linux_socket_TCP_server_init(
+    if(linux_socket_TCP_server_loop_handle(linux_socket_TCP_server_init(
         1,
         TEST_SERVER_ADDR_STR,
         TEST_SERVER_PORT,
-        1
-    ));
+        TEST_SERVER_LISTEN_CNT_MAX
+    )) < 0)
+    {
+        return -1;
+    }
 
     return 0;
 }
\ No newline at end of file
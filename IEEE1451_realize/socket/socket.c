@@ -233,8 +233,35 @@ void win_socket_TCP_client_loop_handle(SOCKET socket_client)
 	return ;
 }
 
+/* 分散-聚集发送，阻塞 socket 下 WSASend 会把所有数据发完才返回；出错返回 SOCKET_ERROR，接到 1451 的 unsigned 发送接口上时要转成 0 */
+int win_socket_TCP_sendv(SOCKET socket_fd, WSABUF* bufs, DWORD buf_cnt)
+{
+    DWORD sent = 0;
+
+    if(WSASend(socket_fd, bufs, buf_cnt, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+        {
+            perror("sendv error");
+            return SOCKET_ERROR;
+        }
+
+    return (int)sent;
+}
+
 #else
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>         // unix socket，交共享内存的 fd 用
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/memfd.h>    // MFD_CLOEXEC
+
 /* 记录 server 和 client 的 socket 句柄 的 全局变量 */
 int socket_server_g;
 int socket_client_g[TEST_SERVER_LISTEN_CNT_MAX];
@@ -249,10 +276,14 @@ int linux_socket_TCP_server_init(unsigned char autoaddr,
     if( (socket_server = socket(AF_INET, SOCK_STREAM, 0)) < 0)
         {
             perror("server socket error");
-            exit(-1);
+            return -1;
         }
 
     socket_server_g = socket_server;
+
+    /* server 重启时之前的连接还在 TIME_WAIT，不设这个 bind 会失败 */
+    int reuse = 1;
+    setsockopt(socket_server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     
     saddr.sin_family = AF_INET;
     saddr.sin_port = htons(port);
@@ -261,7 +292,8 @@ int linux_socket_TCP_server_init(unsigned char autoaddr,
         if(inet_pton(AF_INET,ip_str,&(saddr.sin_addr)) < 0)    // inet_pton() 支持 ipv4 或 ipv6 地址
         {
             perror("server inet_pton error");
-            exit(-1);
+            close(socket_server);
+            return -1;
         }
     }else
     {
@@ -271,13 +303,15 @@ int linux_socket_TCP_server_init(unsigned char autoaddr,
     if (bind(socket_server, (struct sockaddr*)&saddr, sizeof(struct sockaddr)) < 0)
         {
             perror("server bind error\n");
-            exit(-1);
+            close(socket_server);
+            return -1;
         }
  
 	if (listen(socket_server, listen_cnt_max) < 0)
         {
             perror("server listen error\n");
-            exit(-1);
+            close(socket_server);
+            return -1;
         }
 
     // inet_ntop() 支持 ipv4 或 ipv6 地址
@@ -285,7 +319,8 @@ int linux_socket_TCP_server_init(unsigned char autoaddr,
     if(inet_ntop(AF_INET, &(saddr.sin_addr), server_ip_addr_str, sizeof(server_ip_addr_str)) < 0)
         {
             perror("server inet_ntop 1 error");
-            exit(-1);
+            close(socket_server);
+            return -1;
         }
     
     printf("server ip:%s port:%d listening...\n",
@@ -295,173 +330,1787 @@ int linux_socket_TCP_server_init(unsigned char autoaddr,
     return socket_server;
 }
 
-/* tcp server 接受连接和接收数据 并原样回传 的处理函数，目前只能接受一个连接 */
-    /* 日后加上 epoll 就更加完善 支持多连接了 */
-void linux_socket_TCP_server_loop_handle(int socket_server)
+/**************************** epoll 事件循环 ****************************/
+
+static int linux_socket_set_nonblock(int fd)
 {
-    int socket_client = 0;
-    struct sockaddr_in caddr = { 0 };
-    int csize = sizeof(caddr);
-    char buf[32] = { 0 };
-    unsigned int recv_num = 0;
+    int flags = fcntl(fd, F_GETFL, 0);
 
-	while(1)
-	{
-		socket_client = accept(socket_server, (struct sockaddr*)&caddr, &csize);
-            if (socket_client < 0)
-            {
-                perror("server accept error\n");
-                exit(-1);
-            }
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-        socket_client_g[0] = socket_client;
- 
-		printf("socket_client = %#X\n", socket_client);
+/* 排到就绪队列，下一轮先处理它，一个连接最多排一次 */
+static void linux_socket_conn_queue(struct linux_socket_conn_struct* conn)
+{
+    struct linux_socket_epoll_struct* loop = conn->loop;
 
-        // inet_ntop() 支持 ipv4 或 ipv6 地址
-        char client_ip_addr_str[20] = {'\0'};
-        if(inet_ntop(AF_INET, &(caddr.sin_addr), client_ip_addr_str, sizeof(client_ip_addr_str)) < 0)
-            {
-                perror("server inet_ntop 2 error");
-                exit(-1);
-            }
-        
-        printf("client ip:%s port:%d\n",
-            client_ip_addr_str,
-            ntohs(caddr.sin_port));
- 
-		do
-		{
-            memset(buf,'\0',sizeof(buf));
+    if(!conn->queued)
+    {
+        conn->queued = 1;
+        loop->ready[(loop->ready_head + loop->ready_count) % LINUX_SOCKET_CONN_MAX] = conn->index;
+        loop->ready_count++;
+    }
+}
 
-			recv_num = recv(socket_client, buf, sizeof(buf), 0);
-			if (recv_num > 0)
-			{
-                printf("Receive data: %s\n", buf);
-                if(send(socket_client, buf, strlen(buf) + 1, 0) < 0)
-                    {
-                        perror("server send error");
-                        goto quit_server_test;
-                    }
-				
-                if (strcmp("quit", buf) == 0)
-				{
-                    printf("quiting...\n");
-                    close(socket_client);
-					goto quit_server_test;
+void linux_socket_conn_close(struct linux_socket_conn_struct* conn)
+{
+    if(conn->fd >= 0 && !conn->closing)
+    {
+        conn->closing = 1;
+        linux_socket_conn_queue(conn);
+    }
+}
 
-				}else if(strcmp("diss", buf) == 0)
-                {
-                    printf("disconnect...wait for next\n");
-                    break;
-                }
-			}
- 
-		} while (recv_num > 0);
- 
-		close(socket_client);
-	}
+/* 真正关闭，只在一轮事件处理完之后调，这样同一轮里后面的事件不会落到复用的 conn 上 */
+static void linux_socket_conn_release(struct linux_socket_conn_struct* conn)
+{
+    struct linux_socket_epoll_struct* loop = conn->loop;
 
-quit_server_test:
+    loop->handler->on_close(conn->user_data);
+    close(conn->fd);        /* 关闭后 epoll 自动把它摘掉 */
 
-	close(socket_server);
-    
-    printf("quited\n");
+    conn->fd = -1;
+    conn->user_data = NULL;
+    loop->free_list[loop->free_count++] = conn->index;
+    loop->conn_count--;
+}
 
-	return ;
+#if LINUX_SOCKET_USE_IO_URING
+static void linux_socket_uring_send(struct linux_socket_conn_struct* conn);
+static int linux_socket_uring_poll(struct linux_socket_epoll_struct* loop, int timeout_ms);
+#endif
+
+/* 把发送缓存里的往外发，环绕回时两段一次 sendmsg() 发；发完或 socket 满返回 0，出错返回 -1 */
+static int linux_socket_conn_flush(struct linux_socket_conn_struct* conn)
+{
+    struct msghdr msg = { 0 };
+    struct iovec iov[2];
+    unsigned int offset = 0;
+    unsigned int length = 0;
+    ssize_t sent = 0;
+
+    while(conn->tx_head != conn->tx_tail)
+    {
+        offset = conn->tx_head & (LINUX_SOCKET_CONN_TX_SIZE - 1);
+        length = conn->tx_tail - conn->tx_head;
+
+        iov[0].iov_base = &conn->tx_buf[offset];
+        iov[0].iov_len = length < LINUX_SOCKET_CONN_TX_SIZE - offset ? length : LINUX_SOCKET_CONN_TX_SIZE - offset;
+        iov[1].iov_base = conn->tx_buf;
+        iov[1].iov_len = length - iov[0].iov_len;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+        sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(sent > 0)
+        {
+            conn->tx_head += sent;
+        }else if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;       /* 等 EPOLLOUT */
+        }else{
+            return -1;
+        }
+    }
+    return 0;
 }
 
-int linux_socket_TCP_client_init(unsigned char defaultaddr, 
-    const char* ip_str, const unsigned short port)
+int linux_socket_conn_sendv(struct linux_socket_conn_struct* conn, const struct iovec* iov, int iovcnt)
 {
-    int sock = 0;
-	struct sockaddr_in addr = { 0 };
+    struct msghdr msg = { 0 };
+    unsigned int total = 0;
+    unsigned int skip = 0;
+    unsigned int offset = 0;
+    unsigned int chunk = 0;
+    unsigned char direct = conn->loop->uring == NULL;
+    ssize_t sent = 0;
+    int i = 0;
 
-    if( (sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if(conn->fd < 0 || conn->closing)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+#if LINUX_SOCKET_USE_IO_URING
+    /* io_uring 的存进环，本轮处理完一起提交；一轮里攒的超过环的大小时，内核里没有这个连接的发送请求
+        就先把环里的直接发掉，这次的照 epoll 的发，内核的发送缓存也满了才算慢 */
+    if(!direct && conn->tx_inflight == 0 && total > LINUX_SOCKET_CONN_TX_SIZE - (conn->tx_tail - conn->tx_head))
+    {
+        if(linux_socket_conn_flush(conn) < 0)
         {
-            perror("client socket error");
-            exit(-1);
+            linux_socket_conn_close(conn);
+            return -1;
         }
+        direct = 1;
+    }
+#endif
 
-    /* client 要接连的 server 的 ip 和 port */
-    addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-    if(!defaultaddr)
+    /* 缓存里没有排队的才能直接发，不然会插队 */
+    if(direct && conn->tx_head == conn->tx_tail)
     {
-        if(inet_pton(AF_INET, ip_str, &(addr.sin_addr)) < 0)
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = iovcnt;
+        do
         {
-            perror("client inet_pton 1 error");
-            exit(-1);
+            sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while(sent < 0 && errno == EINTR);
+
+        if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            linux_socket_conn_close(conn);
+            return -1;
         }
-    }else
+        skip = sent > 0 ? sent : 0;
+    }
+
+    if(total - skip > LINUX_SOCKET_CONN_TX_SIZE - (conn->tx_tail - conn->tx_head))
     {
-        if(inet_pton(AF_INET, CLIENT_DEFAULT_AIM_ADDR_STR, &(addr.sin_addr)) < 0)
+        conn->loop->slow_count++;
+        linux_socket_conn_close(conn);
+        return -1;
+    }
+
+    /* 剩下的存进环 */
+    for(i = 0; i < iovcnt; i++)
+    {
+        if(skip >= iov[i].iov_len)
         {
-            perror("client inet_pton 2 error");
-            exit(-1);
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        offset = skip;
+        skip = 0;
+        while(offset < iov[i].iov_len)
+        {
+            chunk = LINUX_SOCKET_CONN_TX_SIZE - (conn->tx_tail & (LINUX_SOCKET_CONN_TX_SIZE - 1));
+            chunk = chunk < iov[i].iov_len - offset ? chunk : iov[i].iov_len - offset;
+            memcpy(&conn->tx_buf[conn->tx_tail & (LINUX_SOCKET_CONN_TX_SIZE - 1)], (const char*)iov[i].iov_base + offset, chunk);
+            conn->tx_tail += chunk;
+            offset += chunk;
         }
     }
 
-    /* 这里可以省去 bind() 步骤 */
+#if LINUX_SOCKET_USE_IO_URING
+    if(conn->loop->uring != NULL && conn->tx_head != conn->tx_tail)
+    {
+        linux_socket_conn_queue(conn);      /* 本轮处理完再提交 */
+    }
+#endif
 
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    return total;
+}
+
+int linux_socket_conn_send(struct linux_socket_conn_struct* conn, const void* data, unsigned int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+
+    return linux_socket_conn_sendv(conn, &iov, 1);
+}
+
+/* 读到 socket 空（EAGAIN）或者用完本轮预算，预算用完的排到下一轮（边沿触发不会再通知） */
+static void linux_socket_conn_read(struct linux_socket_conn_struct* conn)
+{
+    const struct linux_socket_epoll_handler_struct* handler = conn->loop->handler;
+    unsigned int budget = LINUX_SOCKET_CONN_RX_BUDGET;
+    unsigned int space = 0;
+    unsigned char* buf = NULL;
+    ssize_t recv_n = 0;
+
+    conn->rx_pending = 0;
+
+    while(!conn->closing)
+    {
+        if(budget == 0)
         {
-            perror("connect error");
-            exit(-1);
+            conn->rx_pending = 1;
+            linux_socket_conn_queue(conn);
+            return;
         }
-    
-    // inet_ntop() 支持 ipv4 或 ipv6 地址
-    char server_ip_addr_str[20] = {'\0'};
-    if(inet_ntop(AF_INET, &(addr.sin_addr), server_ip_addr_str, sizeof(server_ip_addr_str)) < 0)
+
+        buf = handler->rx_space(conn->user_data, &space);
+        if(buf == NULL || space == 0)
         {
-            perror("client inet_ntop error");
-            exit(-1);
+            linux_socket_conn_close(conn);
+            return;
         }
+        space = space < budget ? space : budget;
 
-    printf("connect succeed\n");
-    printf("connect to server ip:%s port:%d\n",
-            server_ip_addr_str,
-            ntohs(addr.sin_port));
+        recv_n = recv(conn->fd, buf, space, 0);
+        if(recv_n > 0)
+        {
+            budget -= recv_n;
+            if(handler->on_recv(conn->user_data, recv_n) < 0)
+            {
+                linux_socket_conn_close(conn);
+            }
+        }else if(recv_n < 0 && errno == EINTR)
+        {
+            continue;
+        }else if(recv_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }else{
+            linux_socket_conn_close(conn);     /* 对方关闭或出错 */
+        }
+    }
+}
 
-    return sock;
+/* 接进来的连接占一个空闲 conn 并通知上层，连接满了或上层拒绝的直接关，返回 NULL */
+static struct linux_socket_conn_struct* linux_socket_conn_open(struct linux_socket_epoll_struct* loop,
+    int fd, const struct sockaddr_in* caddr)
+{
+    struct linux_socket_conn_struct* conn = NULL;
+    int nodelay = 1;
+
+    if(loop->free_count == 0)
+    {
+        loop->refused_count++;
+        close(fd);
+        return NULL;
+    }
+
+    /* 1451 的帧都很小，不要攒 */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    /* queued 不动：复用的 conn 可能还在就绪队列里，出队时才清 */
+    conn = &loop->conn[loop->free_list[--loop->free_count]];
+    conn->fd = fd;
+    conn->tx_head = 0;
+    conn->tx_tail = 0;
+    conn->rx_pending = 0;
+    conn->closing = 0;
+    conn->rx_armed = 0;
+    conn->tx_inflight = 0;
+    conn->shut = 0;
+    loop->conn_count++;
+
+    conn->user_data = loop->handler->on_open(conn, caddr);
+    if(conn->user_data == NULL)
+    {
+        loop->refused_count++;
+        close(fd);
+        conn->fd = -1;
+        loop->free_list[loop->free_count++] = conn->index;
+        loop->conn_count--;
+        return NULL;
+    }
+
+    return conn;
 }
 
-void linux_socket_TCP_client_loop_handle(int socket_client)
+/* fd 用完了（EMFILE / ENFILE）：关掉留着的 fd 腾一个出来，把排队的连接一个个接了直接关，再把 fd 留回来；
+    留的 fd 没了或者腾出来的又被别人占了返回 -1 */
+static int linux_socket_accept_shed(struct linux_socket_epoll_struct* loop)
 {
-    char input[32] = { '\0' };
-	char recv_buf[128] = { '\0' };
-	int recv_n = 0;
+    int fd = -1;
+    int ret = -1;
 
-    while (1)
-	{
-		printf("Input a str to send: ");
- 
-		scanf("%s", input);
- 
-		if( send(socket_client, input, strlen(input) + 1, 0) < 0)
+    if(loop->reserve_fd < 0)
+    {
+        return -1;
+    }
+    close(loop->reserve_fd);
+
+    while(1)
+    {
+        fd = accept(loop->socket_server, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
             {
-                perror("client send error");
-                break;
+                continue;
             }
- 
-		recv_n = recv(socket_client, recv_buf, sizeof(recv_buf), 0);
- 
-		if (recv_n > 0)
-		{
-			printf("Receive data: %s\n", recv_buf);
-		}
-		else
-		{
-            perror("client recv error");
-			break;
-		}
-	}
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                ret = 0;
+            }
+            break;
+        }
+        loop->refused_count++;
+        close(fd);
+    }
 
-	close(socket_client);
-    
-    printf("quited\n");
- 
-	return ;
+    loop->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return ret;
+}
+
+/* 把排队的连接全部接进来，连接满了的接了直接关；
+    accept() 出错没接完的记下来，下一轮再接，fd 用完了的用留着的 fd 接了关掉 */
+static void linux_socket_epoll_accept(struct linux_socket_epoll_struct* loop)
+{
+    struct linux_socket_conn_struct* conn = NULL;
+    struct epoll_event event = { 0 };
+    struct sockaddr_in caddr = { 0 };
+    socklen_t csize = sizeof(caddr);
+    int fd = -1;
+
+    while(1)
+    {
+        csize = sizeof(caddr);
+        fd = accept(loop->socket_server, (struct sockaddr*)&caddr, &csize);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;     /* 接完了 */
+            }
+            if((errno == EMFILE || errno == ENFILE) && linux_socket_accept_shed(loop) == 0)
+            {
+                return;
+            }
+            loop->accept_pending = 1;
+            return;
+        }
+
+        if(linux_socket_set_nonblock(fd) < 0)
+        {
+            loop->refused_count++;
+            close(fd);
+            continue;
+        }
+
+        conn = linux_socket_conn_open(loop, fd, &caddr);
+        if(conn == NULL)
+        {
+            continue;
+        }
+
+        /* 读写都边沿触发，注册一次就不用再改：socket 从满变可写时来一次 EPOLLOUT */
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            linux_socket_conn_close(conn);
+            continue;
+        }
+
+        /* 连接前就发来的数据不会再有边沿，先读一次 */
+        linux_socket_conn_read(conn);
+    }
+}
+
+int linux_socket_epoll_init(struct linux_socket_epoll_struct* loop, int socket_server,
+    const struct linux_socket_epoll_handler_struct* handler)
+{
+    struct epoll_event event = { 0 };
+    unsigned int i = 0;
+
+    memset(loop, 0, sizeof(*loop));
+    loop->socket_server = socket_server;
+    loop->handler = handler;
+    loop->reserve_fd = -1;
+
+    for(i = 0; i < LINUX_SOCKET_CONN_MAX; i++)
+    {
+        loop->conn[i].fd = -1;
+        loop->conn[i].index = i;
+        loop->conn[i].loop = loop;
+        loop->free_list[i] = LINUX_SOCKET_CONN_MAX - 1 - i;     /* 先用小下标的 */
+    }
+    loop->free_count = LINUX_SOCKET_CONN_MAX;
+
+    if(linux_socket_set_nonblock(socket_server) < 0)
+    {
+        perror("server set nonblock error");
+        return -1;
+    }
+
+    if((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("server epoll_create error");
+        return -1;
+    }
+
+    /* 打不开也能跑，只是 fd 用完时排队的连接要等有 fd 了才接 */
+    loop->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* 监听 socket 的 data.ptr 为 NULL */
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, socket_server, &event) < 0)
+    {
+        perror("server epoll_ctl error");
+        close(loop->epoll_fd);
+        if(loop->reserve_fd >= 0)
+        {
+            close(loop->reserve_fd);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int linux_socket_epoll_poll(struct linux_socket_epoll_struct* loop, int timeout_ms)
+{
+    struct epoll_event events[LINUX_SOCKET_EPOLL_EVENTS_MAX];
+    struct linux_socket_conn_struct* conn = NULL;
+    unsigned int ready_n = 0;
+    int event_n = 0;
+    int i = 0;
+
+#if LINUX_SOCKET_USE_IO_URING
+    if(loop->uring != NULL)
+    {
+        return linux_socket_uring_poll(loop, timeout_ms);
+    }
+#endif
+
+    /* 上一轮没接完的不会再有边沿，这里再接一次，还是没接完的最多等 LINUX_SOCKET_ACCEPT_RETRY_MS */
+    if(loop->accept_pending)
+    {
+        loop->accept_pending = 0;
+        linux_socket_epoll_accept(loop);
+    }
+    if(loop->accept_pending && (timeout_ms < 0 || timeout_ms > LINUX_SOCKET_ACCEPT_RETRY_MS))
+    {
+        timeout_ms = LINUX_SOCKET_ACCEPT_RETRY_MS;
+    }
+
+    event_n = epoll_wait(loop->epoll_fd, events, LINUX_SOCKET_EPOLL_EVENTS_MAX, loop->ready_count > 0 ? 0 : timeout_ms);
+    if(event_n < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for(i = 0; i < event_n; i++)
+    {
+        conn = events[i].data.ptr;
+        if(conn == NULL)
+        {
+            linux_socket_epoll_accept(loop);
+            continue;
+        }
+        if(conn->closing)
+        {
+            continue;
+        }
+
+        if(events[i].events & EPOLLOUT)
+        {
+            if(linux_socket_conn_flush(conn) < 0)
+            {
+                linux_socket_conn_close(conn);
+            }
+        }
+        /* 出错和对方关闭也走读，读到 0 或错误再断开，对方关之前发的数据不会丢 */
+        if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        {
+            linux_socket_conn_read(conn);
+        }
+    }
+
+    /* 上一轮和这一轮排队的：接着读的读，要关的关；这时读又排队的留到下一轮 */
+    ready_n = loop->ready_count;
+    while(ready_n-- > 0)
+    {
+        conn = &loop->conn[loop->ready[loop->ready_head]];
+        loop->ready_head = (loop->ready_head + 1) % LINUX_SOCKET_CONN_MAX;
+        loop->ready_count--;
+        conn->queued = 0;
+
+        if(!conn->closing && conn->rx_pending)
+        {
+            linux_socket_conn_read(conn);
+        }
+        if(conn->closing)
+        {
+            if(conn->queued)
+            {
+                continue;   /* 读的时候又排进去了，下一轮关 */
+            }
+            linux_socket_conn_release(conn);
+        }
+    }
+
+    return event_n;
+}
+
+#if LINUX_SOCKET_USE_IO_URING
+/**************************** io_uring 收发 ****************************/
+
+/* 完成事件的 user_data：高 32 位是请求类型，低 32 位是连接下标 */
+#define LINUX_SOCKET_URING_OP_ACCEPT    1ULL
+#define LINUX_SOCKET_URING_OP_RECV      2ULL
+#define LINUX_SOCKET_URING_OP_SEND      3ULL
+#define LINUX_SOCKET_URING_DATA(op, index)  (((op) << 32) | (index))
+
+static int linux_socket_uring_enter(struct linux_socket_uring_struct* uring, unsigned int to_submit,
+    unsigned int min_complete, unsigned int flags, void* arg, size_t arg_size)
+{
+    uring->enter_count++;
+    return syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+/* 提交队列留出 n 个空位，满了先把攒的提交掉，还是不够返回 -1 */
+static int linux_socket_uring_reserve(struct linux_socket_uring_struct* uring, unsigned int n)
+{
+    int ret = 0;
+
+    if(*uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) + n <= uring->sq_entries)
+    {
+        return 0;
+    }
+
+    ret = linux_socket_uring_enter(uring, uring->to_submit, 0, 0, NULL, 0);
+    if(ret > 0)
+    {
+        uring->to_submit -= ret;
+    }
+
+    return *uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) + n <= uring->sq_entries ? 0 : -1;
+}
+
+/* 取下一个请求填，填好了 linux_socket_uring_push()；之前要先 reserve() */
+static struct io_uring_sqe* linux_socket_uring_sqe(struct linux_socket_uring_struct* uring)
+{
+    struct io_uring_sqe* sqe = &uring->sqes[*uring->sq_tail & uring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* sq_array 在 attach 时已经一一对应好，这里只挪尾 */
+static void linux_socket_uring_push(struct linux_socket_uring_struct* uring)
+{
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+}
+
+/* 缓存块还回缓存环，内核下次收数据可以再用 */
+static void linux_socket_uring_buf_put(struct linux_socket_uring_struct* uring, unsigned short bid)
+{
+    struct io_uring_buf* buf = &uring->buf_ring[uring->buf_tail & (LINUX_SOCKET_URING_BUF_COUNT - 1)];
+
+    /* 第 0 块的 resv 就是环的 tail，只写前三个 */
+    buf->addr = (unsigned long)uring->buf[bid];
+    buf->len = LINUX_SOCKET_URING_BUF_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+    __atomic_store_n(&((struct io_uring_buf_ring*)uring->buf_ring)->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void linux_socket_uring_accept(struct linux_socket_epoll_struct* loop)
+{
+    struct linux_socket_uring_struct* uring = loop->uring;
+    struct io_uring_sqe* sqe = NULL;
+
+    if(linux_socket_uring_reserve(uring, 1) < 0)
+    {
+        return;     /* 下一轮再挂 */
+    }
+    sqe = linux_socket_uring_sqe(uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->socket_server;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = LINUX_SOCKET_URING_DATA(LINUX_SOCKET_URING_OP_ACCEPT, 0);
+    linux_socket_uring_push(uring);
+    uring->accept_armed = 1;
+}
+
+/* 挂一个多次接收，缓存由内核从缓存环里挑 */
+static int linux_socket_uring_recv(struct linux_socket_conn_struct* conn)
+{
+    struct linux_socket_uring_struct* uring = conn->loop->uring;
+    struct io_uring_sqe* sqe = NULL;
+
+    if(linux_socket_uring_reserve(uring, 1) < 0)
+    {
+        return -1;
+    }
+    sqe = linux_socket_uring_sqe(uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = LINUX_SOCKET_URING_DATA(LINUX_SOCKET_URING_OP_RECV, conn->index);
+    linux_socket_uring_push(uring);
+    conn->rx_armed = 1;
+
+    return 0;
+}
+
+/* 发送缓存里有的都提交，环绕回的两段链起来，前一段没发完后一段会被取消，回来后接着提交剩下的 */
+static void linux_socket_uring_send(struct linux_socket_conn_struct* conn)
+{
+    struct linux_socket_uring_struct* uring = conn->loop->uring;
+    struct io_uring_sqe* sqe = NULL;
+    unsigned int offset = 0;
+    unsigned int length = 0;
+    unsigned int first = 0;
+
+    if(conn->closing || conn->tx_inflight > 0 || conn->tx_head == conn->tx_tail)
+    {
+        return;
+    }
+
+    offset = conn->tx_head & (LINUX_SOCKET_CONN_TX_SIZE - 1);
+    length = conn->tx_tail - conn->tx_head;
+    first = length < LINUX_SOCKET_CONN_TX_SIZE - offset ? length : LINUX_SOCKET_CONN_TX_SIZE - offset;
+
+    if(linux_socket_uring_reserve(uring, length > first ? 2 : 1) < 0)
+    {
+        linux_socket_conn_close(conn);
+        return;
+    }
+
+    sqe = linux_socket_uring_sqe(uring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long)&conn->tx_buf[offset];
+    sqe->len = first;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->flags = length > first ? IOSQE_IO_LINK : 0;
+    sqe->user_data = LINUX_SOCKET_URING_DATA(LINUX_SOCKET_URING_OP_SEND, conn->index);
+    linux_socket_uring_push(uring);
+    conn->tx_inflight = 1;
+
+    if(length > first)
+    {
+        sqe = linux_socket_uring_sqe(uring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (unsigned long)conn->tx_buf;
+        sqe->len = length - first;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = LINUX_SOCKET_URING_DATA(LINUX_SOCKET_URING_OP_SEND, conn->index);
+        linux_socket_uring_push(uring);
+        conn->tx_inflight = 2;
+    }
+}
+
+/* 内核里的请求都回来了才真正关闭，不然完成事件会落到复用的 conn 上 */
+static void linux_socket_uring_try_release(struct linux_socket_conn_struct* conn)
+{
+    if(conn->fd >= 0 && conn->closing && conn->rx_armed == 0 && conn->tx_inflight == 0)
+    {
+        linux_socket_conn_release(conn);
+    }
+}
+
+/* 收到的拷进上层的接收缓存，上层一次放不下就分几次 */
+static void linux_socket_uring_deliver(struct linux_socket_conn_struct* conn, const unsigned char* data, unsigned int len)
+{
+    const struct linux_socket_epoll_handler_struct* handler = conn->loop->handler;
+    unsigned int space = 0;
+    unsigned char* buf = NULL;
+
+    while(len > 0 && !conn->closing)
+    {
+        buf = handler->rx_space(conn->user_data, &space);
+        if(buf == NULL || space == 0)
+        {
+            linux_socket_conn_close(conn);
+            return;
+        }
+        space = space < len ? space : len;
+        memcpy(buf, data, space);
+        data += space;
+        len -= space;
+
+        if(handler->on_recv(conn->user_data, space) < 0)
+        {
+            linux_socket_conn_close(conn);
+        }
+    }
+}
+
+static void linux_socket_uring_complete(struct linux_socket_epoll_struct* loop, const struct io_uring_cqe* cqe)
+{
+    struct linux_socket_uring_struct* uring = loop->uring;
+    struct linux_socket_conn_struct* conn = &loop->conn[(unsigned int)cqe->user_data % LINUX_SOCKET_CONN_MAX];
+    struct sockaddr_in caddr = { 0 };
+    socklen_t csize = sizeof(caddr);
+
+    switch(cqe->user_data >> 32)
+    {
+    case LINUX_SOCKET_URING_OP_ACCEPT:
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            uring->accept_armed = 0;    /* 出错停了，下一轮重新挂 */
+        }
+        if(cqe->res < 0)
+        {
+            /* fd 用完了：排队的接了关掉，下一轮重新挂 */
+            if(cqe->res == -EMFILE || cqe->res == -ENFILE)
+            {
+                linux_socket_accept_shed(loop);
+            }
+            break;
+        }
+        /* 多次接受连接不带对方地址，自己问一下 */
+        getpeername(cqe->res, (struct sockaddr*)&caddr, &csize);
+        conn = linux_socket_conn_open(loop, cqe->res, &caddr);
+        if(conn != NULL && linux_socket_uring_recv(conn) < 0)
+        {
+            linux_socket_conn_close(conn);
+        }
+        break;
+
+    case LINUX_SOCKET_URING_OP_RECV:
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            if(cqe->res > 0 && !conn->closing)
+            {
+                linux_socket_uring_deliver(conn, uring->buf[cqe->flags >> IORING_CQE_BUFFER_SHIFT], cqe->res);
+            }
+            linux_socket_uring_buf_put(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            conn->rx_armed = 0;
+            /* 缓存环用光（ENOBUFS）或者内核自己停的再挂上，0 是对方关闭，负的是出错 */
+            if(!conn->closing && (cqe->res > 0 || cqe->res == -ENOBUFS))
+            {
+                if(linux_socket_uring_recv(conn) < 0)
+                {
+                    linux_socket_conn_close(conn);
+                }
+            }else{
+                linux_socket_conn_close(conn);
+            }
+        }
+        linux_socket_uring_try_release(conn);
+        break;
+
+    case LINUX_SOCKET_URING_OP_SEND:
+        conn->tx_inflight--;
+        if(cqe->res > 0)
+        {
+            conn->tx_head += cqe->res;
+        }else if(cqe->res < 0 && cqe->res != -ECANCELED)
+        {
+            linux_socket_conn_close(conn);
+        }
+        if(conn->tx_inflight == 0)
+        {
+            linux_socket_uring_send(conn);
+        }
+        linux_socket_uring_try_release(conn);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static int linux_socket_uring_poll(struct linux_socket_epoll_struct* loop, int timeout_ms)
+{
+    struct linux_socket_uring_struct* uring = loop->uring;
+    struct linux_socket_conn_struct* conn = NULL;
+    struct io_uring_getevents_arg arg = { 0 };
+    struct __kernel_timespec ts = { 0 };
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    unsigned int wait = 1;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    unsigned int ready_n = 0;
+    int event_n = 0;
+    int ret = 0;
+
+    if(!uring->accept_armed)
+    {
+        linux_socket_uring_accept(loop);
+    }
+
+    /* 上一轮回调里攒的请求和等待一次 io_uring_enter() 搞定；已经有完成事件的不等 */
+    head = *uring->cq_head;
+    if(timeout_ms == 0 || head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        wait = 0;
+    }
+    if(wait && timeout_ms > 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if(wait || uring->to_submit > 0)
+    {
+        ret = linux_socket_uring_enter(uring, uring->to_submit, wait, flags,
+            flags & IORING_ENTER_EXT_ARG ? &arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+        if(ret > 0)
+        {
+            uring->to_submit -= ret;
+        }else if(ret < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+        {
+            return -1;
+        }
+    }
+
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail)
+    {
+        linux_socket_uring_complete(loop, &uring->cqes[head & uring->cq_mask]);
+        head++;
+        event_n++;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    uring->cqe_count += event_n;
+
+    /* 要发的：本轮存进环的一起提交，下一轮 io_uring_enter() 交给内核；
+        要关的：先 shutdown() 让内核里的接收和发送都结束回来，全回来了再关 */
+    ready_n = loop->ready_count;
+    while(ready_n-- > 0)
+    {
+        conn = &loop->conn[loop->ready[loop->ready_head]];
+        loop->ready_head = (loop->ready_head + 1) % LINUX_SOCKET_CONN_MAX;
+        loop->ready_count--;
+        conn->queued = 0;
+
+        if(conn->fd >= 0 && conn->closing)
+        {
+            if(!conn->shut)
+            {
+                shutdown(conn->fd, SHUT_RDWR);
+                conn->shut = 1;
+            }
+            linux_socket_uring_try_release(conn);
+        }else if(conn->fd >= 0)
+        {
+            linux_socket_uring_send(conn);
+        }
+    }
+
+    return event_n;
+}
+
+static void linux_socket_uring_free(struct linux_socket_uring_struct* uring)
+{
+    if(uring->sqes != NULL)
+    {
+        munmap(uring->sqes, uring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if(uring->ring_ptr != NULL)
+    {
+        munmap(uring->ring_ptr, uring->ring_size);
+    }
+    close(uring->ring_fd);
+}
+
+int linux_socket_uring_attach(struct linux_socket_epoll_struct* loop, struct linux_socket_uring_struct* uring)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    unsigned char* ptr = NULL;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    unsigned int i = 0;
+
+    if(loop->conn_count > 0)
+    {
+        return -1;
+    }
+
+    /* SINGLE_ISSUER 6.0 才有，多次接收也是 6.0，老内核在这里就失败 */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    params.cq_entries = LINUX_SOCKET_URING_ENTRIES * 8;
+    uring->ring_fd = syscall(__NR_io_uring_setup, LINUX_SOCKET_URING_ENTRIES, &params);
+    if(uring->ring_fd < 0)
+    {
+        return -1;
+    }
+    uring->ring_ptr = NULL;
+    uring->sqes = NULL;
+    uring->sq_entries = params.sq_entries;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        linux_socket_uring_free(uring);
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ptr = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        uring->ring_fd, IORING_OFF_SQ_RING);
+    if(ptr == MAP_FAILED)
+    {
+        linux_socket_uring_free(uring);
+        return -1;
+    }
+    uring->ring_ptr = ptr;
+
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if(uring->sqes == MAP_FAILED)
+    {
+        uring->sqes = NULL;
+        linux_socket_uring_free(uring);
+        return -1;
+    }
+
+    uring->sq_head = (unsigned int*)(ptr + params.sq_off.head);
+    uring->sq_tail = (unsigned int*)(ptr + params.sq_off.tail);
+    uring->sq_array = (unsigned int*)(ptr + params.sq_off.array);
+    uring->sq_mask = *(unsigned int*)(ptr + params.sq_off.ring_mask);
+    uring->cq_head = (unsigned int*)(ptr + params.cq_off.head);
+    uring->cq_tail = (unsigned int*)(ptr + params.cq_off.tail);
+    uring->cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+    uring->cq_mask = *(unsigned int*)(ptr + params.cq_off.ring_mask);
+    for(i = 0; i < params.sq_entries; i++)
+    {
+        uring->sq_array[i] = i;
+    }
+
+    /* 缓存环注册给内核，组号 0 */
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)uring->buf_ring;
+    reg.ring_entries = LINUX_SOCKET_URING_BUF_COUNT;
+    reg.bgid = 0;
+    if(syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        linux_socket_uring_free(uring);
+        return -1;
+    }
+    uring->buf_tail = 0;
+    for(i = 0; i < LINUX_SOCKET_URING_BUF_COUNT; i++)
+    {
+        linux_socket_uring_buf_put(uring, i);
+    }
+
+    uring->to_submit = 0;
+    uring->accept_armed = 0;
+    uring->enter_count = 0;
+    uring->cqe_count = 0;
+
+    loop->uring = uring;
+    linux_socket_uring_accept(loop);
+
+    return 0;
+}
+#endif
+
+/* tcp server 接受连接和接收数据并原样回传的处理函数，用上面的 epoll 事件循环，同时接受多个连接 */
+static char echo_buf[LINUX_SOCKET_CONN_MAX][32];
+static unsigned char echo_quit = 0;
+
+static void* echo_on_open(struct linux_socket_conn_struct* conn, const struct sockaddr_in* caddr)
+{
+    // inet_ntop() 支持 ipv4 或 ipv6 地址
+    char client_ip_addr_str[20] = {'\0'};
+
+    if(conn->index < TEST_SERVER_LISTEN_CNT_MAX)
+    {
+        socket_client_g[conn->index] = conn->fd;
+    }
+
+    inet_ntop(AF_INET, &(caddr->sin_addr), client_ip_addr_str, sizeof(client_ip_addr_str));
+    printf("socket_client = %#X\n", conn->fd);
+    printf("client ip:%s port:%d\n",
+        client_ip_addr_str,
+        ntohs(caddr->sin_port));
+
+    return conn;
+}
+
+static unsigned char* echo_rx_space(void* user_data, unsigned int* space)
+{
+    struct linux_socket_conn_struct* conn = user_data;
+
+    *space = sizeof(echo_buf[0]) - 1;   /* 留一个给 '\0' */
+    return (unsigned char*)echo_buf[conn->index];
+}
+
+static int echo_on_recv(void* user_data, unsigned int len)
+{
+    struct linux_socket_conn_struct* conn = user_data;
+    char* buf = echo_buf[conn->index];
+
+    buf[len] = '\0';
+    printf("Receive data: %s\n", buf);
+    if(linux_socket_conn_send(conn, buf, strlen(buf) + 1) < 0)
+    {
+        perror("server send error");
+        return -1;
+    }
+
+    if (strcmp("quit", buf) == 0)
+    {
+        printf("quiting...\n");
+        echo_quit = 1;
+        return -1;
+    }else if(strcmp("diss", buf) == 0)
+    {
+        printf("disconnect...wait for next\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void echo_on_close(void* user_data)
+{
+    struct linux_socket_conn_struct* conn = user_data;
+
+    if(conn->index < TEST_SERVER_LISTEN_CNT_MAX)
+    {
+        socket_client_g[conn->index] = 0;
+    }
+}
+
+static const struct linux_socket_epoll_handler_struct echo_handler = {
+    .on_open = echo_on_open,
+    .rx_space = echo_rx_space,
+    .on_recv = echo_on_recv,
+    .on_close = echo_on_close,
+};
+
+/* 连接表比较大，放静态区 */
+static struct linux_socket_epoll_struct echo_loop;
+
+int linux_socket_TCP_server_loop_handle(int socket_server)
+{
+    unsigned int i = 0;
+
+    if(socket_server < 0)
+    {
+        return -1;
+    }
+
+    if(linux_socket_epoll_init(&echo_loop, socket_server, &echo_handler) < 0)
+    {
+        close(socket_server);
+        return -1;
+    }
+
+    while(!echo_quit)
+    {
+        if(linux_socket_epoll_poll(&echo_loop, -1) < 0)
+        {
+            perror("server epoll_wait error");
+            break;
+        }
+    }
+
+    /* 剩下的连接都关掉 */
+    for(i = 0; i < LINUX_SOCKET_CONN_MAX; i++)
+    {
+        if(echo_loop.conn[i].fd >= 0)
+        {
+            linux_socket_conn_release(&echo_loop.conn[i]);
+        }
+    }
+	close(echo_loop.epoll_fd);
+    if(echo_loop.reserve_fd >= 0)
+    {
+        close(echo_loop.reserve_fd);
+    }
+	close(socket_server);
+    
+    printf("quited\n");
+
+	return 0;
+}
+
+int linux_socket_TCP_client_init(unsigned char defaultaddr, 
+    const char* ip_str, const unsigned short port)
+{
+    int sock = 0;
+	struct sockaddr_in addr = { 0 };
+
+    if( (sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        {
+            perror("client socket error");
+            return -1;
+        }
+
+    /* client 要接连的 server 的 ip 和 port */
+    addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+    if(!defaultaddr)
+    {
+        if(inet_pton(AF_INET, ip_str, &(addr.sin_addr)) < 0)
+        {
+            perror("client inet_pton 1 error");
+            close(sock);
+            return -1;
+        }
+    }else
+    {
+        if(inet_pton(AF_INET, CLIENT_DEFAULT_AIM_ADDR_STR, &(addr.sin_addr)) < 0)
+        {
+            perror("client inet_pton 2 error");
+            close(sock);
+            return -1;
+        }
+    }
+
+    /* 这里可以省去 bind() 步骤 */
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            perror("connect error");
+            close(sock);
+            return -1;
+        }
+    
+    // inet_ntop() 支持 ipv4 或 ipv6 地址
+    char server_ip_addr_str[20] = {'\0'};
+    if(inet_ntop(AF_INET, &(addr.sin_addr), server_ip_addr_str, sizeof(server_ip_addr_str)) < 0)
+        {
+            perror("client inet_ntop error");
+            close(sock);
+            return -1;
+        }
+
+    printf("connect succeed\n");
+    printf("connect to server ip:%s port:%d\n",
+            server_ip_addr_str,
+            ntohs(addr.sin_port));
+
+    return sock;
+}
+
+int linux_socket_TCP_connect(const char* ip_str, const unsigned short port, int timeout_ms)
+{
+    int sock = -1;
+    int flags = 0;
+    int err = 0;
+    int one = 1;
+    socklen_t err_len = sizeof(err);
+    struct sockaddr_in addr = { 0 };
+    struct pollfd pfd;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, ip_str, &(addr.sin_addr)) <= 0)
+    {
+        return -1;
+    }
+
+    if((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("client socket error");
+        return -1;
+    }
+
+    /* 非阻塞发起，对方不在时不会卡在内核的重试上（阻塞 connect 要等一两分钟） */
+    flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        if(errno != EINPROGRESS)
+        {
+            close(sock);
+            return -1;
+        }
+
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, timeout_ms) <= 0
+            || getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+
+    /* 之后按阻塞的用；1451 的帧小，不等凑包 */
+    fcntl(sock, F_SETFL, flags);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return sock;
+}
+
+void linux_socket_backoff_init(struct linux_socket_backoff_struct* backoff, unsigned int base_ms, unsigned int max_ms)
+{
+    backoff->base_ms = base_ms;
+    backoff->max_ms = max_ms;
+    backoff->attempt = 0;
+    backoff->seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+}
+
+unsigned int linux_socket_backoff_next(struct linux_socket_backoff_struct* backoff)
+{
+    unsigned int ceil_ms = backoff->base_ms;
+    unsigned int i = 0;
+
+    for(i = 0; i < backoff->attempt && ceil_ms < backoff->max_ms; i++)
+    {
+        ceil_ms *= 2;
+    }
+    ceil_ms = ceil_ms > backoff->max_ms ? backoff->max_ms : ceil_ms;
+    backoff->attempt++;
+
+    return ceil_ms == 0 ? 0 : (unsigned int)rand_r(&backoff->seed) % ceil_ms;
+}
+
+void linux_socket_backoff_reset(struct linux_socket_backoff_struct* backoff)
+{
+    backoff->attempt = 0;
+}
+
+int linux_socket_TCP_reconnect(const char* ip_str, const unsigned short port, int timeout_ms, 
+    struct linux_socket_backoff_struct* backoff)
+{
+    int sock = -1;
+    unsigned int wait_ms = 0;
+
+    /* 连上也算一次，握手或会话恢复成功了调用者才清零：连上就被断的也照样退避，不会一直猛连 */
+    while(1)
+    {
+        wait_ms = linux_socket_backoff_next(backoff);
+        if(backoff->attempt > 1)
+        {
+            usleep(wait_ms * 1000);     /* 第一次马上试 */
+        }
+        if((sock = linux_socket_TCP_connect(ip_str, port, timeout_ms)) >= 0)
+        {
+            return sock;
+        }
+    }
+}
+
+int linux_socket_TCP_client_loop_handle(int socket_client)
+{
+    char input[32] = { '\0' };
+	char recv_buf[128] = { '\0' };
+	int recv_n = 0;
+
+    if(socket_client < 0)
+    {
+        return -1;
+    }
+
+    while (1)
+	{
+		printf("Input a str to send: ");
+ 
+		scanf("%s", input);
+ 
+		if( send(socket_client, input, strlen(input) + 1, 0) < 0)
+            {
+                perror("client send error");
+                break;
+            }
+ 
+		recv_n = recv(socket_client, recv_buf, sizeof(recv_buf), 0);
+ 
+		if (recv_n > 0)
+		{
+			printf("Receive data: %s\n", recv_buf);
+		}
+		else
+		{
+            perror("client recv error");
+			break;
+		}
+	}
+
+	close(socket_client);
+    
+    printf("quited\n");
+ 
+	return 0;
+}
+
+/* 分散-聚集发送，一次 sendmsg() 发出多块数据，发送不完（被信号打断或缓冲区满）则跳过已发的接着发 */
+int linux_socket_TCP_sendv(int socket_fd, struct iovec* iov, int iovcnt)
+{
+    struct msghdr msg = { 0 };
+    ssize_t sent_once = 0;
+    int sent = 0;
+
+    while(iovcnt > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        sent_once = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if(sent_once < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                perror("sendv error");
+                return -1;
+            }
+        sent += sent_once;
+
+        /* 跳过已经发完的块 */
+        while(iovcnt > 0 && (size_t)sent_once >= iov->iov_len)
+        {
+            sent_once -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + sent_once;
+            iov->iov_len -= sent_once;
+        }
+    }
+
+    return sent;
+}
+
+/* UDP 数据报：非阻塞，port 不为 0 就绑上（NCAP 收的一端），接收缓存给大一些，一轮没来得及收的突发不至于丢 */
+int linux_socket_UDP_init(unsigned char autoaddr, const char* ip_str, const unsigned short port)
+{
+    int socket_udp = 0;
+    int rcvbuf = LINUX_SOCKET_UDP_RCVBUF;
+    struct sockaddr_in saddr = { 0 };
+
+    if( (socket_udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        {
+            perror("udp socket error");
+            return -1;
+        }
+    setsockopt(socket_udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if(port == 0)
+    {
+        return socket_udp;
+    }
+
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    if(!autoaddr)
+    {
+        if(inet_pton(AF_INET,ip_str,&(saddr.sin_addr)) <= 0)
+        {
+            perror("udp inet_pton error");
+            close(socket_udp);
+            return -1;
+        }
+    }else
+    {
+        saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+
+    if (bind(socket_udp, (struct sockaddr*)&saddr, sizeof(struct sockaddr)) < 0)
+        {
+            perror("udp bind error");
+            close(socket_udp);
+            return -1;
+        }
+
+    return socket_udp;
+}
+
+/* 一个数据报不拆，发不出去（缓存满等）整个算丢，由上层的重发管 */
+int linux_socket_UDP_sendv(int socket_fd, const struct sockaddr_in* daddr, const struct iovec* iov, int iovcnt)
+{
+    struct msghdr msg = { 0 };
+
+    msg.msg_name = (void*)daddr;
+    msg.msg_namelen = sizeof(*daddr);
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return (int)sendmsg(socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**************************** 共享内存环 ****************************/
+
+static void linux_shm_link_setup(struct linux_shm_link_struct* link, unsigned char side)
+{
+    link->side = side;
+    link->tx = &link->region->ring[side];
+    link->rx = &link->region->ring[!side];
+    link->doorbell_count = 0;
+    link->wait_count = 0;
+}
+
+static void linux_shm_link_release(struct linux_shm_link_struct* link)
+{
+    if(link->region != NULL)
+    {
+        munmap(link->region, sizeof(struct linux_shm_region_struct));
+        link->region = NULL;
+    }
+    if(link->memfd >= 0)
+    {
+        close(link->memfd);
+    }
+    if(link->doorbell[0] >= 0)
+    {
+        close(link->doorbell[0]);
+    }
+    if(link->doorbell[1] >= 0)
+    {
+        close(link->doorbell[1]);
+    }
+    link->memfd = link->doorbell[0] = link->doorbell[1] = -1;
+}
+
+/* 敲对方的门铃 */
+static void linux_shm_link_ring(struct linux_shm_link_struct* link)
+{
+    eventfd_t one = 1;
+
+    if(write(link->doorbell[!link->side], &one, sizeof(one)) == sizeof(one))
+    {
+        link->doorbell_count++;
+    }
+}
+
+/* 等自己的门铃，门铃响过返回 1；可能是假醒（别的情况敲的），调用者要重新看环 */
+static int linux_shm_link_wait(struct linux_shm_link_struct* link, int timeout_ms)
+{
+    struct pollfd pfd;
+    eventfd_t count = 0;
+
+    pfd.fd = link->doorbell[link->side];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    link->wait_count++;
+    if(poll(&pfd, 1, timeout_ms) <= 0)
+    {
+        return 0;
+    }
+    (void)!read(pfd.fd, &count, sizeof(count));
+    return 1;
+}
+
+static int linux_shm_link_peer_closed(struct linux_shm_link_struct* link)
+{
+    return __atomic_load_n(&link->region->closed[!link->side], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* 写完的交给对方；fence 和对方 “置 rx_waiting 再看 head” 配对，两边不会都没看到对方，就不会睡过去 */
+static void linux_shm_link_publish(struct linux_shm_link_struct* link, unsigned int head)
+{
+    __atomic_store_n(&link->tx->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&link->tx->rx_waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&link->tx->rx_waiting, 0, __ATOMIC_RELAXED))
+    {
+        linux_shm_link_ring(link);
+    }
+}
+
+int linux_shm_link_offer(struct linux_shm_link_struct* link, const char* path)
+{
+    struct sockaddr_un uaddr = { 0 };
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    struct cmsghdr* cmsg = NULL;
+    union
+    {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char tag = 'S';
+    int socket_unix = -1, socket_peer = -1;
+
+    memset(link, 0, sizeof(*link));
+    link->memfd = (int)syscall(SYS_memfd_create, "1451_shm", MFD_CLOEXEC);
+    link->doorbell[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->doorbell[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(link->memfd < 0 || link->doorbell[0] < 0 || link->doorbell[1] < 0
+        || ftruncate(link->memfd, sizeof(struct linux_shm_region_struct)) < 0)
+    {
+        perror("shm memfd / eventfd error");
+        linux_shm_link_release(link);
+        return -1;
+    }
+
+    /* ftruncate 出来的是全 0，读写位置和标记不用再初始化 */
+    link->region = mmap(NULL, sizeof(struct linux_shm_region_struct), PROT_READ | PROT_WRITE, MAP_SHARED, link->memfd, 0);
+    if(link->region == MAP_FAILED)
+    {
+        perror("shm mmap error");
+        link->region = NULL;
+        linux_shm_link_release(link);
+        return -1;
+    }
+    linux_shm_link_setup(link, 0);
+
+    uaddr.sun_family = AF_UNIX;
+    strncpy(uaddr.sun_path, path, sizeof(uaddr.sun_path) - 1);
+    unlink(path);
+
+    if((socket_unix = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+        || bind(socket_unix, (struct sockaddr*)&uaddr, sizeof(uaddr)) < 0
+        || listen(socket_unix, 1) < 0
+        || (socket_peer = accept(socket_unix, NULL, NULL)) < 0)
+    {
+        perror("shm unix socket error");
+        if(socket_unix >= 0)
+        {
+            close(socket_unix);
+        }
+        unlink(path);
+        linux_shm_link_release(link);
+        return -1;
+    }
+
+    /* 一个字节的数据带上三个 fd */
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &link->memfd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg) + sizeof(int), link->doorbell, 2 * sizeof(int));
+
+    if(sendmsg(socket_peer, &msg, MSG_NOSIGNAL) != 1)
+    {
+        perror("shm send fd error");
+        close(socket_peer);
+        close(socket_unix);
+        unlink(path);
+        linux_shm_link_release(link);
+        return -1;
+    }
+
+    close(socket_peer);
+    close(socket_unix);
+    unlink(path);
+    return 0;
+}
+
+int linux_shm_link_join(struct linux_shm_link_struct* link, const char* path)
+{
+    struct sockaddr_un uaddr = { 0 };
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    struct cmsghdr* cmsg = NULL;
+    struct stat st;
+    union
+    {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char tag = 0;
+    int socket_unix = -1;
+
+    memset(link, 0, sizeof(*link));
+    link->memfd = link->doorbell[0] = link->doorbell[1] = -1;
+
+    uaddr.sun_family = AF_UNIX;
+    strncpy(uaddr.sun_path, path, sizeof(uaddr.sun_path) - 1);
+
+    if((socket_unix = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+        || connect(socket_unix, (struct sockaddr*)&uaddr, sizeof(uaddr)) < 0)
+    {
+        perror("shm unix connect error");
+        if(socket_unix >= 0)
+        {
+            close(socket_unix);
+        }
+        return -1;
+    }
+
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if(recvmsg(socket_unix, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    {
+        perror("shm recv fd error");
+        close(socket_unix);
+        return -1;
+    }
+    close(socket_unix);
+    memcpy(&link->memfd, CMSG_DATA(cmsg), sizeof(int));
+    memcpy(link->doorbell, CMSG_DATA(cmsg) + sizeof(int), 2 * sizeof(int));
+
+    /* 两边编译的 LINUX_SHM_RING_SIZE 不一样就对不上 */
+    if(fstat(link->memfd, &st) < 0 || (size_t)st.st_size != sizeof(struct linux_shm_region_struct))
+    {
+        printf("shm size mismatch, check LINUX_SHM_RING_SIZE on both sides\n");
+        linux_shm_link_release(link);
+        return -1;
+    }
+
+    link->region = mmap(NULL, sizeof(struct linux_shm_region_struct), PROT_READ | PROT_WRITE, MAP_SHARED, link->memfd, 0);
+    if(link->region == MAP_FAILED)
+    {
+        perror("shm mmap error");
+        link->region = NULL;
+        linux_shm_link_release(link);
+        return -1;
+    }
+    linux_shm_link_setup(link, 1);
+
+    return 0;
+}
+
+int linux_shm_link_sendv(struct linux_shm_link_struct* link, const struct iovec* iov, int iovcnt)
+{
+    struct linux_shm_ring_struct* ring = link->tx;
+    const unsigned char* src = NULL;
+    unsigned int head = ring->head;
+    unsigned int tail = 0, free_size = 0, index = 0, first = 0, chunk = 0, done = 0;
+    int sent = 0;
+    int i = 0;
+
+    if(linux_shm_link_peer_closed(link))
+    {
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+    {
+        src = iov[i].iov_base;
+        done = 0;
+        while(done < iov[i].iov_len)
+        {
+            /* acquire：对方读完了才覆盖 */
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            free_size = LINUX_SHM_RING_SIZE - (head - tail);
+
+            if(free_size == 0)
+            {
+                /* 满了：写了的先交出去叫对方读，说自己要等空间，再看一次还满才睡 */
+                linux_shm_link_publish(link, head);
+                __atomic_store_n(&ring->tx_waiting, 1, __ATOMIC_SEQ_CST);
+                if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail)
+                {
+                    if(linux_shm_link_peer_closed(link))
+                    {
+                        __atomic_store_n(&ring->tx_waiting, 0, __ATOMIC_RELAXED);
+                        return -1;
+                    }
+                    linux_shm_link_wait(link, LINUX_SHM_WAIT_MS);
+                }
+                __atomic_store_n(&ring->tx_waiting, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            chunk = iov[i].iov_len - done > free_size ? free_size : (unsigned int)(iov[i].iov_len - done);
+            index = head & (LINUX_SHM_RING_SIZE - 1);
+            first = chunk > LINUX_SHM_RING_SIZE - index ? LINUX_SHM_RING_SIZE - index : chunk;
+            memcpy(&ring->data[index], &src[done], first);
+            memcpy(&ring->data[0], &src[done + first], chunk - first);
+            head += chunk;
+            done += chunk;
+        }
+        sent += (int)iov[i].iov_len;
+    }
+
+    /* 所有块写完一起交出去，最多敲一次门铃 */
+    linux_shm_link_publish(link, head);
+    return sent;
+}
+
+int linux_shm_link_send(struct linux_shm_link_struct* link, const void* data, unsigned int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    return linux_shm_link_sendv(link, &iov, 1);
+}
+
+int linux_shm_link_arm(struct linux_shm_link_struct* link)
+{
+    struct linux_shm_ring_struct* ring = link->rx;
+
+    __atomic_store_n(&ring->rx_waiting, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail || linux_shm_link_peer_closed(link))
+    {
+        __atomic_store_n(&ring->rx_waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+int linux_shm_link_recv(struct linux_shm_link_struct* link, void* data, unsigned int len, int timeout_ms)
+{
+    struct linux_shm_ring_struct* ring = link->rx;
+    unsigned char* dst = data;
+    unsigned int tail = ring->tail;
+    unsigned int head = 0, index = 0, first = 0;
+
+    /* acquire：看到新位置时数据一定已经写进去了 */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while(head == tail)
+    {
+        /* 对方关之前写的要先收完 */
+        if(linux_shm_link_peer_closed(link))
+        {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if(head != tail)
+            {
+                break;
+            }
+            return -1;
+        }
+        if(timeout_ms == 0)
+        {
+            return 0;
+        }
+
+        /* 说自己要睡了，再看一次还空才睡 */
+        if(!linux_shm_link_arm(link))
+        {
+            if(!linux_shm_link_wait(link, timeout_ms < 0 || timeout_ms > LINUX_SHM_WAIT_MS ? LINUX_SHM_WAIT_MS : timeout_ms)
+                && timeout_ms > 0)
+            {
+                __atomic_store_n(&ring->rx_waiting, 0, __ATOMIC_RELAXED);
+                return 0;
+            }
+            __atomic_store_n(&ring->rx_waiting, 0, __ATOMIC_RELAXED);
+        }
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    len = head - tail < len ? head - tail : len;
+    index = tail & (LINUX_SHM_RING_SIZE - 1);
+    first = len > LINUX_SHM_RING_SIZE - index ? LINUX_SHM_RING_SIZE - index : len;
+    memcpy(dst, &ring->data[index], first);
+    memcpy(&dst[first], &ring->data[0], len - first);
+
+    /* release：拷完了才还给对方；对方在等空间就敲它 */
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->tx_waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->tx_waiting, 0, __ATOMIC_RELAXED))
+    {
+        linux_shm_link_ring(link);
+    }
+
+    return (int)len;
+}
+
+int linux_shm_link_fd(const struct linux_shm_link_struct* link)
+{
+    return link->doorbell[link->side];
+}
+
+void linux_shm_link_close(struct linux_shm_link_struct* link)
+{
+    if(link->region != NULL)
+    {
+        /* 对方可能正睡着等数据或空间，敲一下让它看到关了 */
+        __atomic_store_n(&link->region->closed[link->side], 1, __ATOMIC_RELEASE);
+        linux_shm_link_ring(link);
+    }
+    linux_shm_link_release(link);
 }
 
 #endif
\ No newline at end of file
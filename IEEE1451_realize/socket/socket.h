@@ -66,6 +66,9 @@ SOCKET win_socket_TCP_client_init(unsigned char defaultaddr,
     const char* ip_str, const unsigned short port);
 void win_socket_TCP_client_loop_handle(SOCKET socket_client);
 
+/* 分散-聚集发送，一次系统调用发出多块数据，返回发送的总字节数，出错返回 SOCKET_ERROR */
+int win_socket_TCP_sendv(SOCKET socket_fd, WSABUF* bufs, DWORD buf_cnt);
+
 
 #else
 
@@ -74,19 +77,249 @@ void win_socket_TCP_client_loop_handle(SOCKET socket_client);
 #include <netinet/in.h> // htons() etc
 #include <arpa/inet.h>  // inet_pton() etc
 #include <netdb.h>      // getaddrinfo() etc
+#include <sys/uio.h>    // struct iovec
 
 /* 记录 server 和 client 的 socket 句柄 的 全局变量 */
 extern int socket_server_g;
 extern int socket_client_g[TEST_SERVER_LISTEN_CNT_MAX];
 
+/* 出错返回 -1，不退出程序；loop_handle 传进来的 socket 小于 0 直接返回 -1，结束时会关掉 socket */
 int linux_socket_TCP_server_init(unsigned char autoaddr, 
     const char* ip_str, const unsigned short port, 
     const unsigned short listen_cnt_max);
-void linux_socket_TCP_server_loop_handle(int socket_server);
+int linux_socket_TCP_server_loop_handle(int socket_server);
 
 int linux_socket_TCP_client_init(unsigned char defaultaddr, 
     const char* ip_str, const unsigned short port);
-void linux_socket_TCP_client_loop_handle(int client_server);
+int linux_socket_TCP_client_loop_handle(int client_server);
+
+/* 上面的 client_init 是阻塞连接，连不上就返回 -1，断线要重连的用下面这些：
+    linux_socket_TCP_connect() 非阻塞发起连接，最多等 timeout_ms，连上返回 socket（阻塞的，关了 Nagle），失败返回 -1；
+    重连退避：第 n 次失败后等 [0, min(max_ms, base_ms * 2^n)) 里随机的时间（full jitter），很多 TIM 同时断的时候不会一起涌上来；
+    linux_socket_TCP_reconnect() 一直试到连上为止，第一次马上试；连上不清零，握手或会话恢复成功后调用者调 linux_socket_backoff_reset()，
+        连上就被断的下次重连还是退避 */
+struct linux_socket_backoff_struct
+{
+    unsigned int base_ms;
+    unsigned int max_ms;
+    unsigned int attempt;       /* 连续试了几次还没连好（连上但握手没成的也算） */
+    unsigned int seed;
+};
+
+int linux_socket_TCP_connect(const char* ip_str, const unsigned short port, int timeout_ms);
+void linux_socket_backoff_init(struct linux_socket_backoff_struct* backoff, unsigned int base_ms, unsigned int max_ms);
+unsigned int linux_socket_backoff_next(struct linux_socket_backoff_struct* backoff);
+void linux_socket_backoff_reset(struct linux_socket_backoff_struct* backoff);
+int linux_socket_TCP_reconnect(const char* ip_str, const unsigned short port, int timeout_ms, 
+    struct linux_socket_backoff_struct* backoff);
+
+/* 分散-聚集发送，一次系统调用发出多块数据（sendmsg），发送不完或被信号打断（EINTR）会接着发剩下的，
+    返回发送的总字节数，出错返回 -1；注意 iov 里的内容会被修改 */
+int linux_socket_TCP_sendv(int socket_fd, struct iovec* iov, int iovcnt);
+
+/* UDP 数据报（1451 的采样上传可以走它，见 IEEE1451_5_lib.h 数据报上传）：
+    linux_socket_UDP_init() 返回非阻塞的 socket，port 为 0 不绑（发的一端），出错返回 -1；
+    linux_socket_UDP_sendv() 一次发一个数据报，返回发出的字节数，出错或缓存满返回 -1 */
+#define LINUX_SOCKET_UDP_RCVBUF         (4 * 1024 * 1024)
+
+int linux_socket_UDP_init(unsigned char autoaddr, const char* ip_str, const unsigned short port);
+int linux_socket_UDP_sendv(int socket_fd, const struct sockaddr_in* daddr, const struct iovec* iov, int iovcnt);
+
+/* epoll 事件循环：一个线程同时服务监听 socket 和所有连接，socket 都设为非阻塞，边沿触发；
+    每个连接一个发送环形缓存，一次发不完的先存着，socket 可写了再接着发，存满说明对方太慢，直接断开它，不会卡住别的连接；
+    接收不多拷贝：连接的接收缓存由上层给（比如 1451 的分帧接收缓存），recv() 直接写进去，收到多少交给上层多少；
+    一个连接一轮最多读 LINUX_SOCKET_CONN_RX_BUDGET 字节，没读完的排到下一轮接着读，发得快的连接也占不住循环 */
+#define LINUX_SOCKET_CONN_MAX           1024            /* 最多同时多少个连接，连接结构体都静态分配 */
+#define LINUX_SOCKET_CONN_TX_SIZE       (8 * 1024)      /* 每个连接的发送环形缓存字节数，须为 2 的幂 */
+#define LINUX_SOCKET_CONN_RX_BUDGET     (16 * 1024)     /* 一个连接一轮最多读的字节数 */
+#define LINUX_SOCKET_EPOLL_EVENTS_MAX   64              /* 一次 epoll_wait() 最多取的事件数 */
+#define LINUX_SOCKET_ACCEPT_RETRY_MS    100             /* 没接完的连接最多等多久再接 */
+
+/* io_uring 收发，见 linux_socket_uring_attach()；工具链的内核头文件太老（没有 IORING_RECV_MULTISHOT）时改为 0 */
+#define LINUX_SOCKET_USE_IO_URING       1
+
+#if LINUX_SOCKET_USE_IO_URING
+#include <linux/io_uring.h>
+
+#define LINUX_SOCKET_URING_ENTRIES      256             /* 提交队列长度，完成队列是它的 8 倍 */
+#define LINUX_SOCKET_URING_BUF_COUNT    256             /* 给内核的接收缓存块数，须为 2 的幂 */
+#define LINUX_SOCKET_URING_BUF_SIZE     4096            /* 每块字节数 */
+#endif
+
+struct linux_socket_epoll_struct;
+struct linux_socket_uring_struct;
+
+struct linux_socket_conn_struct
+{
+    int fd;                         /* -1 为空闲 */
+    unsigned int index;             /* 在连接表里的下标，上层可以拿它索引自己的连接数据 */
+    void* user_data;                /* on_open() 返回的上层连接数据 */
+    struct linux_socket_epoll_struct* loop;
+
+    unsigned int tx_head;           /* 累计发出的字节数 */
+    unsigned int tx_tail;           /* 累计存入的字节数 */
+    unsigned char queued;           /* 在就绪队列里 */
+    unsigned char rx_pending;       /* 上一轮读满预算了，可能还有数据 */
+    unsigned char closing;          /* 要断开，本轮事件处理完再真正关闭，期间不再收发 */
+    unsigned char rx_armed;         /* io_uring：多次接收请求还在内核里 */
+    unsigned char tx_inflight;      /* io_uring：在内核里的发送请求数，为 0 才发下一批 */
+    unsigned char shut;             /* io_uring：已经 shutdown()，等内核里的请求都回来再关闭 */
+
+    unsigned char tx_buf[LINUX_SOCKET_CONN_TX_SIZE];
+};
+
+/* 上层的回调，都在 linux_socket_epoll_poll() 里调用 */
+struct linux_socket_epoll_handler_struct
+{
+    /* 新连接，返回上层的连接数据（之后原样传给下面几个），返回 NULL 则拒绝 */
+    void* (*on_open)(struct linux_socket_conn_struct* conn, const struct sockaddr_in* addr);
+    /* 取接收缓存的可写地址和空间，空间为 0 说明上层消化不了，断开 */
+    unsigned char* (*rx_space)(void* user_data, unsigned int* space);
+    /* 收到 len 字节，已经写在 rx_space() 给的地方，返回 -1 则断开 */
+    int (*on_recv)(void* user_data, unsigned int len);
+    /* 连接断开了（对方关闭、出错、发送缓存满或上层要断），之后这个 conn 会给新连接用 */
+    void (*on_close)(void* user_data);
+};
+
+struct linux_socket_epoll_struct
+{
+    int epoll_fd;
+    int socket_server;
+    const struct linux_socket_epoll_handler_struct* handler;
+
+    struct linux_socket_conn_struct conn[LINUX_SOCKET_CONN_MAX];
+    unsigned int free_list[LINUX_SOCKET_CONN_MAX];  /* 空闲连接的下标，当栈用 */
+    unsigned int free_count;
+    unsigned int ready[LINUX_SOCKET_CONN_MAX];      /* 下一轮要接着读或要关闭的连接，环形 */
+    unsigned int ready_head;
+    unsigned int ready_count;
+
+    unsigned int conn_count;
+    unsigned long refused_count;    /* 连接满了被拒绝的 */
+    unsigned long slow_count;       /* 发送缓存满被断开的 */
+
+    int reserve_fd;                 /* 留一个 fd：fd 用完时关掉它腾出位置，把排队的连接接了直接关，不让它们一直挂着 */
+    unsigned char accept_pending;   /* accept() 出错没接完，监听 socket 是边沿触发不会再来事件，下一轮再接 */
+
+    struct linux_socket_uring_struct* uring;    /* 不为 NULL 时收发走 io_uring，epoll 不再用 */
+};
+
+/* 初始化事件循环，socket_server 为 linux_socket_TCP_server_init() 返回的监听 socket，成功返回 0，失败返回 -1 */
+int linux_socket_epoll_init(struct linux_socket_epoll_struct* loop, int socket_server,
+    const struct linux_socket_epoll_handler_struct* handler);
+
+/* 等一轮事件并处理完，timeout_ms 为 -1 一直等，有没读完的连接时不等；返回处理的事件数，出错返回 -1；
+    attach 了 io_uring 的等的是 io_uring 的完成事件 */
+int linux_socket_epoll_poll(struct linux_socket_epoll_struct* loop, int timeout_ms);
+
+/* 给一个连接发数据，不阻塞：能直接发的直接发，剩下的存进发送缓存（io_uring 时全部存进去，本轮处理完一起提交，
+    一轮里攒的存不下时先直接发）；
+    返回 len，连接已经要断开或者发送缓存存不下返回 -1（连接会被断开） */
+int linux_socket_conn_send(struct linux_socket_conn_struct* conn, const void* data, unsigned int len);
+int linux_socket_conn_sendv(struct linux_socket_conn_struct* conn, const struct iovec* iov, int iovcnt);
+
+/* 上层要断开一个连接，回调里也可以调，本轮处理完再关闭并调 on_close() */
+void linux_socket_conn_close(struct linux_socket_conn_struct* conn);
+
+#if LINUX_SOCKET_USE_IO_URING
+/* io_uring 收发：上层接口和回调都不变，只是底下不再一个连接一次系统调用：
+    接收用多次接收（一个请求一直收，不用每次重新提交），数据由内核写进注册给它的缓存环，拷到 rx_space() 后把缓存还回环；
+    发送从连接的发送环形缓存直接提交，环绕回时两段用链接请求（IOSQE_IO_LINK）保证顺序，一个连接同时只有一批在内核里；
+    接受连接也是多次请求；一轮里攒的所有请求在下一次等完成时一起提交，一次 io_uring_enter() 既提交又等待；
+    不依赖 liburing，直接用系统调用和内核头文件 */
+struct linux_socket_uring_struct
+{
+    struct io_uring_buf buf_ring[LINUX_SOCKET_URING_BUF_COUNT] __attribute__((aligned(4096)));  /* 缓存环，要按页对齐 */
+    unsigned char buf[LINUX_SOCKET_URING_BUF_COUNT][LINUX_SOCKET_URING_BUF_SIZE];
+    unsigned short buf_tail;
+
+    int ring_fd;
+    void* ring_ptr;                 /* 提交和完成队列共用一次 mmap */
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    struct io_uring_cqe* cqes;
+    unsigned int cq_mask;
+    unsigned int to_submit;         /* 准备好还没提交的请求数 */
+    unsigned char accept_armed;     /* 多次接受连接请求还在内核里 */
+
+    unsigned long enter_count;      /* io_uring_enter() 调用次数 */
+    unsigned long cqe_count;        /* 处理的完成事件数 */
+};
+
+/* linux_socket_epoll_init() 之后、开始 poll 之前调，之后 linux_socket_epoll_poll() 收发都走 io_uring；
+    内核不支持（要 6.0 以后，有多次接收和缓存环）返回 -1，loop 还是用 epoll，上层不用改 */
+int linux_socket_uring_attach(struct linux_socket_epoll_struct* loop, struct linux_socket_uring_struct* uring);
+#endif
+
+/**************************** 共享内存环 ****************************/
+
+/* NCAP 和 TIM 在同一个板子上的不同进程时不走 TCP 回环：
+    一块 memfd 共享内存里两个单生产者单消费者的字节环，一个方向一个，收发和 TCP 一样是字节流，1451 的分帧照旧；
+    读写位置用原子的 acquire / release，不加锁，数据不经过内核；
+    每个进程一个 eventfd 门铃，只有对方说自己要睡了（waiting）才敲，一直有数据时一次系统调用都没有；
+    memfd 和两个 eventfd 由 NCAP 建，通过 unix socket 的 SCM_RIGHTS 交给 TIM */
+#define LINUX_SHM_RING_SIZE             (256 * 1024)    /* 每个方向的环字节数，须为 2 的幂 */
+#define LINUX_SHM_WAIT_MS               1000            /* 阻塞等的时候多久看一次对方还在不在 */
+
+/* 在共享内存里，读写位置各占一个缓存行，生产者和消费者不互相抢 */
+struct linux_shm_ring_struct
+{
+    unsigned int head __attribute__((aligned(64)));    /* 生产者写到的累计位置 */
+    unsigned int rx_waiting;                            /* 消费者要睡了，生产者发完要敲门铃 */
+    unsigned int tail __attribute__((aligned(64)));    /* 消费者读到的累计位置 */
+    unsigned int tx_waiting;                            /* 生产者等空间，消费者读完要敲门铃 */
+    unsigned char data[LINUX_SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct linux_shm_region_struct
+{
+    struct linux_shm_ring_struct ring[2];   /* [0] NCAP 发 TIM 收，[1] TIM 发 NCAP 收 */
+    unsigned int closed[2];                 /* [0] NCAP 关了，[1] TIM 关了 */
+};
+
+/* 每个进程一个 */
+struct linux_shm_link_struct
+{
+    int memfd;
+    int doorbell[2];                        /* [0] NCAP 的门铃，[1] TIM 的门铃 */
+    unsigned char side;                     /* 0 NCAP，1 TIM */
+    struct linux_shm_region_struct* region;
+    struct linux_shm_ring_struct* tx;
+    struct linux_shm_ring_struct* rx;
+
+    unsigned long doorbell_count;           /* 敲对方门铃的次数，即这一端的系统调用次数 */
+    unsigned long wait_count;               /* 自己睡下的次数 */
+};
+
+/* NCAP 用：建共享内存和门铃，在 unix socket path 上等一个 TIM 连上来把它们交过去（阻塞）；出错返回 -1 */
+int linux_shm_link_offer(struct linux_shm_link_struct* link, const char* path);
+
+/* TIM 用：连 NCAP 的 unix socket path，收共享内存和门铃并映射；出错返回 -1 */
+int linux_shm_link_join(struct linux_shm_link_struct* link, const char* path);
+
+/* 发数据：环里放得下的直接拷进去，放不下的等对方读，都放进去才返回；返回 len，对方关了返回 -1；
+    sendv 多块拷完只敲一次门铃 */
+int linux_shm_link_send(struct linux_shm_link_struct* link, const void* data, unsigned int len);
+int linux_shm_link_sendv(struct linux_shm_link_struct* link, const struct iovec* iov, int iovcnt);
+
+/* 收数据：有多少拷多少（最多 len），没有的话最多等 timeout_ms（-1 一直等，0 不等）；
+    返回收到的字节数，超时返回 0，对方关了并且收完了返回 -1 */
+int linux_shm_link_recv(struct linux_shm_link_struct* link, void* data, unsigned int len, int timeout_ms);
+
+/* 自己的门铃，可以放进 epoll 等：等之前先调 linux_shm_link_arm()，返回 1 说明已经有数据（或对方关了）不要等；
+    门铃可读后用 timeout_ms 为 0 的 recv 收完 */
+int linux_shm_link_fd(const struct linux_shm_link_struct* link);
+int linux_shm_link_arm(struct linux_shm_link_struct* link);
+
+/* 告诉对方关了，解除映射，关闭 fd */
+void linux_shm_link_close(struct linux_shm_link_struct* link);
 
 #endif
 